@@ -247,8 +247,35 @@ if ( test [ "x$lookforldap" != "xno" ] || test [ "x$lookforauthldap" != "xno" ]
     if test [ "x$LDAPLIB" = "xfailed" ]; then
         AC_MSG_ERROR([Could not find LDAP library.])
     else
+        dnl Threads can only share LDAP connections with a thread-safe
+        dnl libldap: libldap_r before OpenLDAP 2.5, libldap itself since.
+        LDAP_LIBNAME="ldap"
+        LDAP_R=`echo "$LDAPLIB" | sed -e 's/-lldap$/-lldap_r/'`
+        SAVE_CFLAGS=$CFLAGS
+        SAVE_LIBS=$LIBS
+        CFLAGS="$CFLAGS $LDAPINC"
+        LIBS="$LDAP_R $LIBS"
+        AC_MSG_CHECKING([for libldap_r])
+        AC_LINK_IFELSE([AC_LANG_PROGRAM([[#include <ldap.h>]], [[LDAP *ld; return ldap_initialize(&ld, "");]])],
+            [AC_MSG_RESULT([yes])
+            LDAPLIB=$LDAP_R
+            LDAP_LIBNAME="ldap_r"
+            AC_DEFINE([HAVE_LDAP_THREAD_SAFE], 1, [Define if libldap can be used by several threads at once.])],
+            [AC_MSG_RESULT([no])
+            AC_MSG_CHECKING([for OpenLDAP 2.5 or later])
+            AC_COMPILE_IFELSE([AC_LANG_PROGRAM([[#include <ldap.h>]], [[
+#if !defined(LDAP_VENDOR_VERSION) || LDAP_VENDOR_VERSION < 20500
+#error libldap is not thread-safe
+#endif]])],
+                [AC_MSG_RESULT([yes])
+                AC_DEFINE([HAVE_LDAP_THREAD_SAFE], 1, [Define if libldap can be used by several threads at once.])],
+                [AC_MSG_RESULT([no])
+                AC_MSG_WARN([libldap is not thread-safe, each thread will use its own LDAP connection])])])
+        CFLAGS=$SAVE_CFLAGS
+        LIBS=$SAVE_LIBS
+
         AC_DEFINE([AUTHLDAP], 1, [Define if LDAP will be used.])
-        AC_SEARCH_LIBS(ldap_initialize, ldap, AC_DEFINE([HAVE_LDAP_INITIALIZE], 1, [ldap_initialize() can be used instead of ldap_init()]))
+        AC_SEARCH_LIBS(ldap_initialize, $LDAP_LIBNAME, AC_DEFINE([HAVE_LDAP_INITIALIZE], 1, [ldap_initialize() can be used instead of ldap_init()]))
         AC_SUBST(LDAPLIB)
         AC_SUBST(LDAPINC)
         AUTHALIB="modules/.libs/libauth_ldap.a"
@@ -648,4 +675,60 @@ AC_DEFUN([DM_UPGRADE_STEPS], [dnl
 	AC_SUBST(MYSQL_35002)
 	AC_SUBST(SQLITE_35002)
 
+	PGSQL_35003=`sed -e 's/\"/\\\"/g' -e 's/^/\"/' -e 's/$/\\\n\"/' -e '$!s/$/ \\\\/'  sql/postgresql/upgrades/35003.psql`
+	MYSQL_35003=`sed -e 's/\"/\\\"/g' -e 's/^/\"/' -e 's/$/\\\n\"/' -e '$!s/$/ \\\\/'  sql/mysql/upgrades/35003.mysql`
+	SQLITE_35003=`sed -e 's/\"/\\\"/g' -e 's/^/\"/' -e 's/$/\\\n\"/' -e '$!s/$/ \\\\/'  sql/sqlite/upgrades/35003.sqlite`
+
+	AC_SUBST(PGSQL_35003)
+	AC_SUBST(MYSQL_35003)
+	AC_SUBST(SQLITE_35003)
+
+	PGSQL_35004=`sed -e 's/\"/\\\"/g' -e 's/^/\"/' -e 's/$/\\\n\"/' -e '$!s/$/ \\\\/'  sql/postgresql/upgrades/35004.psql`
+	MYSQL_35004=`sed -e 's/\"/\\\"/g' -e 's/^/\"/' -e 's/$/\\\n\"/' -e '$!s/$/ \\\\/'  sql/mysql/upgrades/35004.mysql`
+	SQLITE_35004=`sed -e 's/\"/\\\"/g' -e 's/^/\"/' -e 's/$/\\\n\"/' -e '$!s/$/ \\\\/'  sql/sqlite/upgrades/35004.sqlite`
+
+	AC_SUBST(PGSQL_35004)
+	AC_SUBST(MYSQL_35004)
+	AC_SUBST(SQLITE_35004)
+
+	PGSQL_35005=`sed -e 's/\"/\\\"/g' -e 's/^/\"/' -e 's/$/\\\n\"/' -e '$!s/$/ \\\\/'  sql/postgresql/upgrades/35005.psql`
+	MYSQL_35005=`sed -e 's/\"/\\\"/g' -e 's/^/\"/' -e 's/$/\\\n\"/' -e '$!s/$/ \\\\/'  sql/mysql/upgrades/35005.mysql`
+	SQLITE_35005=`sed -e 's/\"/\\\"/g' -e 's/^/\"/' -e 's/$/\\\n\"/' -e '$!s/$/ \\\\/'  sql/sqlite/upgrades/35005.sqlite`
+
+	AC_SUBST(PGSQL_35005)
+	AC_SUBST(MYSQL_35005)
+	AC_SUBST(SQLITE_35005)
+
+	PGSQL_35006=`sed -e 's/\"/\\\"/g' -e 's/^/\"/' -e 's/$/\\\n\"/' -e '$!s/$/ \\\\/'  sql/postgresql/upgrades/35006.psql`
+	MYSQL_35006=`sed -e 's/\"/\\\"/g' -e 's/^/\"/' -e 's/$/\\\n\"/' -e '$!s/$/ \\\\/'  sql/mysql/upgrades/35006.mysql`
+	SQLITE_35006=`sed -e 's/\"/\\\"/g' -e 's/^/\"/' -e 's/$/\\\n\"/' -e '$!s/$/ \\\\/'  sql/sqlite/upgrades/35006.sqlite`
+
+	AC_SUBST(PGSQL_35006)
+	AC_SUBST(MYSQL_35006)
+	AC_SUBST(SQLITE_35006)
+
+	PGSQL_35007=`sed -e 's/\"/\\\"/g' -e 's/^/\"/' -e 's/$/\\\n\"/' -e '$!s/$/ \\\\/'  sql/postgresql/upgrades/35007.psql`
+	MYSQL_35007=`sed -e 's/\"/\\\"/g' -e 's/^/\"/' -e 's/$/\\\n\"/' -e '$!s/$/ \\\\/'  sql/mysql/upgrades/35007.mysql`
+	SQLITE_35007=`sed -e 's/\"/\\\"/g' -e 's/^/\"/' -e 's/$/\\\n\"/' -e '$!s/$/ \\\\/'  sql/sqlite/upgrades/35007.sqlite`
+
+	AC_SUBST(PGSQL_35007)
+	AC_SUBST(MYSQL_35007)
+	AC_SUBST(SQLITE_35007)
+
+	PGSQL_35008=`sed -e 's/\"/\\\"/g' -e 's/^/\"/' -e 's/$/\\\n\"/' -e '$!s/$/ \\\\/'  sql/postgresql/upgrades/35008.psql`
+	MYSQL_35008=`sed -e 's/\"/\\\"/g' -e 's/^/\"/' -e 's/$/\\\n\"/' -e '$!s/$/ \\\\/'  sql/mysql/upgrades/35008.mysql`
+	SQLITE_35008=`sed -e 's/\"/\\\"/g' -e 's/^/\"/' -e 's/$/\\\n\"/' -e '$!s/$/ \\\\/'  sql/sqlite/upgrades/35008.sqlite`
+
+	AC_SUBST(PGSQL_35008)
+	AC_SUBST(MYSQL_35008)
+	AC_SUBST(SQLITE_35008)
+
+	PGSQL_35009=`sed -e 's/\"/\\\"/g' -e 's/^/\"/' -e 's/$/\\\n\"/' -e '$!s/$/ \\\\/'  sql/postgresql/upgrades/35009.psql`
+	MYSQL_35009=`sed -e 's/\"/\\\"/g' -e 's/^/\"/' -e 's/$/\\\n\"/' -e '$!s/$/ \\\\/'  sql/mysql/upgrades/35009.mysql`
+	SQLITE_35009=`sed -e 's/\"/\\\"/g' -e 's/^/\"/' -e 's/$/\\\n\"/' -e '$!s/$/ \\\\/'  sql/sqlite/upgrades/35009.sqlite`
+
+	AC_SUBST(PGSQL_35009)
+	AC_SUBST(MYSQL_35009)
+	AC_SUBST(SQLITE_35009)
+
 ])
@@ -38,8 +38,10 @@ void socket_write_cb(int fd, short what, void *arg);
  
 int pop3_handle_connection(client_sock *c);
 int imap_handle_connection(client_sock *c);
+void imap_cb_notify(uint64_t mailbox_id, uint64_t seq);
 int tims_handle_connection(client_sock *c);
 int lmtp_handle_connection(client_sock *c);
+void lmtp_cb_notify(uint64_t mailbox_id, uint64_t seq);
 int sieve_handle_connection(client_sock *c);
 
 #endif
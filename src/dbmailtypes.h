@@ -156,7 +156,6 @@ typedef struct {
 	String_T crlf; 
 
 	// Mappings
-	GHashTable *header_dict;
 	GTree *header_name;
 	GTree *header_value;
 	
@@ -164,6 +163,11 @@ typedef struct {
 	int part_key;
 	int part_depth;
 	int part_order;
+	GList *mimeparts;
+
+	// placeholder -> mimepart id for bodies left out by
+	// dbmail_message_retrieve_sparse
+	GHashTable *elided;
 
 } DbmailMessage;
 
@@ -478,11 +482,25 @@ typedef enum {
 	SEARCH_THREAD_REFERENCES
 } search_order;
 
+/* SORT criteria; the sort cache keeps a column for each */
+enum SORT_KEYS {
+	SORT_ARRIVAL = 1,
+	SORT_CC,
+	SORT_DATE,
+	SORT_FROM,
+	SORT_SIZE,
+	SORT_SUBJECT,
+	SORT_TO,
+	SORT_KEY_LAST
+};
+
+#define SORT_REVERSE 0x80
+#define SORT_KEYS_MAX 16
+
 typedef struct {
 	int type;
 	uint64_t size;
-	char table[MAX_SEARCH_LEN];
-	char order[MAX_SEARCH_LEN];
+	unsigned char sort[SORT_KEYS_MAX];	// SORT_KEYS, or'ed with SORT_REVERSE
 	char field[MAX_SEARCH_LEN];
 	char op[MAX_SEARCH_LEN];
 	char search[MAX_SEARCH_LEN];
@@ -561,8 +579,9 @@ typedef struct {
  */
 #define IMAP_NFLAGS 6
 typedef struct { // map dbmail_messages
+	// states holding it; shared ones are copied before a change
+	int refcount;
 	uint64_t mailbox_id;
-	uint64_t msn;
 	uint64_t uid;
 	uint64_t rfcsize;
 	uint64_t seq;
@@ -573,10 +592,11 @@ typedef struct { // map dbmail_messages
         // expunged (pushed to client), can be removed
         int expunged;
 	int status;
+	// system flags, bit (1 << IMAP_FLAG_*) each; see MailboxState_message_hasFlag
+	unsigned flags;
 	char internaldate[IMAP_INTERNALDATE_LEN];
-	int flags[IMAP_NFLAGS];
-	// reference dbmail_keywords
-	GList *keywords;
+	// keyword indices into the table of the mailbox state, ascending
+	GArray *keywords;
 } MessageInfo;
 
 
@@ -162,11 +162,12 @@ void mailbox_match_free(struct mailbox_match *m)
 
 
 /** list of tables used in dbmail */
-#define DB_NTABLES 19
+#define DB_NTABLES 20
 const char *DB_TABLENAMES[DB_NTABLES] = {
 	"acl",
 	"aliases",
 	"envelope",
+	"expunges",
 	"header",
 	"headername",
 	"headervalue",
@@ -1026,6 +1027,13 @@ static int check_upgrade_step(int from_version, int to_version)
 			if (to_version == 32006) query = DM_SQLITE_32006;
 			if (to_version == 35001) query = DM_SQLITE_35001;
 			if (to_version == 35002) query = DM_SQLITE_35002;
+			if (to_version == 35003) query = DM_SQLITE_35003;
+			if (to_version == 35004) query = DM_SQLITE_35004;
+			if (to_version == 35005) query = DM_SQLITE_35005;
+			if (to_version == 35006) query = DM_SQLITE_35006;
+			if (to_version == 35007) query = DM_SQLITE_35007;
+			if (to_version == 35008) query = DM_SQLITE_35008;
+			if (to_version == 35009) query = DM_SQLITE_35009;
 			break;
 		case DM_DRIVER_MYSQL:
 			if (to_version == 32001) query = DM_MYSQL_32001;
@@ -1036,6 +1044,13 @@ static int check_upgrade_step(int from_version, int to_version)
 			if (to_version == 32006) query = DM_MYSQL_32006;
 			if (to_version == 35001) query = DM_MYSQL_35001;
 			if (to_version == 35002) query = DM_MYSQL_35002;
+			if (to_version == 35003) query = DM_MYSQL_35003;
+			if (to_version == 35004) query = DM_MYSQL_35004;
+			if (to_version == 35005) query = DM_MYSQL_35005;
+			if (to_version == 35006) query = DM_MYSQL_35006;
+			if (to_version == 35007) query = DM_MYSQL_35007;
+			if (to_version == 35008) query = DM_MYSQL_35008;
+			if (to_version == 35009) query = DM_MYSQL_35009;
 			break;
 		case DM_DRIVER_POSTGRESQL:
 			if (to_version == 32001) query = DM_PGSQL_32001;
@@ -1046,6 +1061,13 @@ static int check_upgrade_step(int from_version, int to_version)
 			if (to_version == 32006) query = DM_PGSQL_32006;
 			if (to_version == 35001) query = DM_PGSQL_35001;
 			if (to_version == 35002) query = DM_PGSQL_35002;
+			if (to_version == 35003) query = DM_PGSQL_35003;
+			if (to_version == 35004) query = DM_PGSQL_35004;
+			if (to_version == 35005) query = DM_PGSQL_35005;
+			if (to_version == 35006) query = DM_PGSQL_35006;
+			if (to_version == 35007) query = DM_PGSQL_35007;
+			if (to_version == 35008) query = DM_PGSQL_35008;
+			if (to_version == 35009) query = DM_PGSQL_35009;
 			break;
 		default:
 			TRACE(TRACE_WARNING, "Migrations not supported for database driver");
@@ -1305,12 +1327,26 @@ int db_check_version(void)
 			break;
 		if ((ok = check_upgrade_step(35001, 35002)) == DM_EQUERY)
 			break;
+		if ((ok = check_upgrade_step(35002, 35003)) == DM_EQUERY)
+			break;
+		if ((ok = check_upgrade_step(35003, 35004)) == DM_EQUERY)
+			break;
+		if ((ok = check_upgrade_step(35004, 35005)) == DM_EQUERY)
+			break;
+		if ((ok = check_upgrade_step(35005, 35006)) == DM_EQUERY)
+			break;
+		if ((ok = check_upgrade_step(35006, 35007)) == DM_EQUERY)
+			break;
+		if ((ok = check_upgrade_step(35007, 35008)) == DM_EQUERY)
+			break;
+		if ((ok = check_upgrade_step(35008, 35009)) == DM_EQUERY)
+			break;
 		break;
 	} while (true);
 
 	db_con_close(c);
 
-	if (ok == 35002) {
+	if (ok == 35009) {
 		TRACE(TRACE_DEBUG, "Schema check successful");
 	} else {
 		TRACE(TRACE_ERR,"Schema version [%d] incompatible. Bailing out",
@@ -1867,6 +1903,8 @@ int db_icheck_mimeparts(gboolean cleanup)
 				if (! g_list_next(ids)) break;
 				ids = g_list_next(ids);
 			}
+			dm_mimepart_cache_flush();
+			dm_notify_publish_mimeparts();
 		}
 		g_list_destroy(ids);
 	CATCH(SQLException)
@@ -1880,6 +1918,102 @@ int db_icheck_mimeparts(gboolean cleanup)
 	return t;
 }
 
+/* mimeparts kept in the mimepart store whose file is gone or truncated */
+int db_icheck_partstore(GList **lost)
+{
+	Connection_T c; ResultSet_T r; volatile int t = DM_SUCCESS;
+	const char *esc = db_get_sql(SQL_ESCAPE_COLUMN);
+
+	c = db_con_get();
+	TRY
+		r = db_query(c, "SELECT id, hash, %ssize%s FROM %smimeparts WHERE storage = %d",
+				esc, esc, DBPFX, MIMEPART_STORAGE_FILE);
+		while (db_result_next(r)) {
+			uint64_t *id;
+			if (dm_partstore_check(db_result_get(r, 1), db_result_get_u64(r, 2)))
+				continue;
+			id = g_new0(uint64_t, 1);
+			*id = db_result_get_u64(r, 0);
+			TRACE(TRACE_WARNING, "mimepart [%" PRIu64 "] missing from the mimepart store", *id);
+			*(GList **)lost = g_list_prepend(*(GList **)lost, id);
+		}
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		t = DM_EQUERY;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	if (t == DM_EQUERY)
+		return t;
+
+	return g_list_length(*(GList **)lost);
+}
+
+/* files younger than this may belong to a delivery still in progress */
+#define PARTSTORE_GRACE 3600
+
+struct partstore_orphans {
+	GHashTable *paths;
+	gboolean cleanup;
+	time_t before;
+	int count;
+};
+
+static int partstore_orphan(const char *path, const char *UNUSED hash, size_t UNUSED size, time_t mtime, void *data)
+{
+	struct partstore_orphans *o = (struct partstore_orphans *)data;
+
+	if (g_hash_table_lookup(o->paths, path) || (mtime > o->before))
+		return DM_SUCCESS;
+
+	o->count++;
+	TRACE(TRACE_INFO, "unreferenced file [%s]", path);
+	if (o->cleanup && unlink(path) < 0)
+		TRACE(TRACE_ERR, "unable to remove [%s]: %s", path, strerror(errno));
+
+	return DM_SUCCESS;
+}
+
+/* files in the mimepart store without a mimepart referring to them */
+int db_icheck_partstore_orphans(gboolean cleanup)
+{
+	Connection_T c; ResultSet_T r; volatile int t = DM_SUCCESS;
+	const char *esc = db_get_sql(SQL_ESCAPE_COLUMN);
+	struct partstore_orphans o;
+
+	memset(&o, 0, sizeof(o));
+	o.paths = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	o.cleanup = cleanup;
+	o.before = time(NULL) - PARTSTORE_GRACE;
+
+	c = db_con_get();
+	TRY
+		r = db_query(c, "SELECT hash, %ssize%s FROM %smimeparts WHERE storage = %d",
+				esc, esc, DBPFX, MIMEPART_STORAGE_FILE);
+		while (db_result_next(r)) {
+			char *path = dm_partstore_path(db_result_get(r, 0), db_result_get_u64(r, 1));
+			if (path)
+				g_hash_table_replace(o.paths, path, GINT_TO_POINTER(1));
+		}
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		t = DM_EQUERY;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	if (t != DM_EQUERY && dm_partstore_walk(partstore_orphan, &o) != DM_SUCCESS)
+		t = DM_EQUERY;
+
+	g_hash_table_destroy(o.paths);
+
+	if (t == DM_EQUERY)
+		return t;
+
+	return o.count;
+}
+
 int db_icheck_headernames(gboolean cleanup)
 {
 	Connection_T c; ResultSet_T r; volatile int t = DM_SUCCESS;
@@ -2126,6 +2260,65 @@ int db_set_envelope(GList *lost)
 }
 
 		
+int db_set_bodystructure(GList *lost)
+{
+	uint64_t pmsgid;
+	uint64_t *id;
+	DbmailMessage *msg;
+	Mempool_T pool;
+	if (! lost)
+		return DM_SUCCESS;
+
+	pool = mempool_open();
+	lost = g_list_first(lost);
+	while (lost) {
+		id = (uint64_t *)lost->data;
+		pmsgid = *id;
+		
+		msg = dbmail_message_new(pool);
+		if (! msg) {
+			mempool_close(&pool);
+			return DM_EQUERY;
+		}
+
+		if (! (msg = dbmail_message_retrieve(msg, pmsgid))) {
+			TRACE(TRACE_WARNING,"error retrieving physmessage: [%" PRIu64 "]", pmsgid);
+			fprintf(stderr,"E");
+		} else {
+			dbmail_message_cache_bodystructure(msg);
+			fprintf(stderr,".");
+		}
+		dbmail_message_free(msg);
+		if (! g_list_next(lost)) break;
+		lost = g_list_next(lost);
+	}
+
+	mempool_close(&pool);
+	return DM_SUCCESS;
+}
+int db_icheck_bodystructure(GList **lost)
+{
+	Connection_T c; ResultSet_T r; volatile int t = DM_SUCCESS;
+	uint64_t *id;
+
+	c = db_con_get();
+	TRY
+		r = db_query(c, "SELECT physmessage_id FROM %senvelope "
+			"WHERE bodystructure IS NULL OR body IS NULL", DBPFX);
+		while (db_result_next(r)) {
+			id = g_new0(uint64_t,1);
+			*id = db_result_get_u64(r, 0);
+			*(GList **)lost = g_list_prepend(*(GList **)lost,id);
+		}
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		t = DM_EQUERY;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	return t;
+}
 int db_icheck_envelope(GList **lost)
 {
 	Connection_T c; ResultSet_T r; volatile int t = DM_SUCCESS;
@@ -2182,10 +2375,53 @@ int db_icheck_empty_envelope(GList **lost)
 	return t;
 }
 
+/*
+ * record messages about to leave their mailbox in the expunge log,
+ * with the mailbox seq at that time
+ */
+gboolean db_expunge_log(Connection_T c, uint64_t message_idnr)
+{
+	return db_exec(c, "INSERT INTO %sexpunges (mailbox_idnr, message_idnr, seq) "
+			"SELECT m.mailbox_idnr, m.message_idnr, b.seq FROM %smessages m "
+			"JOIN %smailboxes b ON b.mailbox_idnr = m.mailbox_idnr "
+			"WHERE m.message_idnr = %" PRIu64 " AND m.status < %d",
+			DBPFX, DBPFX, DBPFX, message_idnr, MESSAGE_STATUS_DELETE);
+}
+
+gboolean db_expunge_log_mailbox(Connection_T c, uint64_t mailbox_idnr)
+{
+	return db_exec(c, "INSERT INTO %sexpunges (mailbox_idnr, message_idnr, seq) "
+			"SELECT m.mailbox_idnr, m.message_idnr, b.seq FROM %smessages m "
+			"JOIN %smailboxes b ON b.mailbox_idnr = m.mailbox_idnr "
+			"WHERE m.mailbox_idnr = %" PRIu64 " AND m.status < %d",
+			DBPFX, DBPFX, DBPFX, mailbox_idnr, MESSAGE_STATUS_DELETE);
+}
+
 int db_set_message_status(uint64_t message_idnr, MessageStatus_T status)
 {
-	return db_update("UPDATE %smessages SET status = %d WHERE message_idnr = %" PRIu64 "", 
-			DBPFX, status, message_idnr);
+	Connection_T c; volatile gboolean result = FALSE;
+
+	if (status < MESSAGE_STATUS_DELETE)
+		return db_update("UPDATE %smessages SET status = %d WHERE message_idnr = %" PRIu64 "", 
+				DBPFX, status, message_idnr);
+
+	c = db_con_get();
+	TRY
+		db_begin_transaction(c);
+		db_expunge_log(c, message_idnr);
+		if (db_exec(c, "UPDATE %smessages SET status = %d WHERE message_idnr = %" PRIu64 "", 
+					DBPFX, status, message_idnr))
+			result = TRUE;
+		db_commit_transaction(c);
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		db_rollback_transaction(c);
+		result = FALSE;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	return result;
 }
 
 int db_delete_message(uint64_t message_idnr)
@@ -2202,8 +2438,31 @@ static int mailbox_delete(uint64_t mailbox_idnr)
 
 static int mailbox_empty(uint64_t mailbox_idnr)
 {
-	return db_update("DELETE FROM %smessages WHERE mailbox_idnr = %" PRIu64 "", 
-			DBPFX, mailbox_idnr);
+	Connection_T c; volatile gboolean result = FALSE;
+
+	c = db_con_get();
+	TRY
+		db_begin_transaction(c);
+		if (db_expunge_log_mailbox(c, mailbox_idnr) &&
+				db_exec(c, "DELETE FROM %smessages WHERE mailbox_idnr = %" PRIu64 "",
+					DBPFX, mailbox_idnr))
+			result = TRUE;
+		if (result)
+			db_commit_transaction(c);
+		else
+			db_rollback_transaction(c);
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		db_rollback_transaction(c);
+		result = FALSE;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	if (result)
+		db_mailbox_seq_update(mailbox_idnr, 0);
+
+	return result;
 }
 
 /** get the total size of messages in a mailbox. Does not work recursively! */
@@ -2339,6 +2598,8 @@ int db_update_pop(ClientSession_T * session_ptr)
 				if (user_idnr == 0) user_idnr = db_get_useridnr(msg->realmessageid);
 
 				/* yes they need an update, do the query */
+				if (msg->virtual_messagestatus >= MESSAGE_STATUS_DELETE)
+					db_expunge_log(c, msg->realmessageid);
 				db_exec(c, "UPDATE %smessages set status=%d WHERE message_idnr=%" PRIu64 " AND status < %d",
 						DBPFX, msg->virtual_messagestatus, msg->realmessageid, 
 						MESSAGE_STATUS_DELETE);
@@ -2358,6 +2619,13 @@ int db_update_pop(ClientSession_T * session_ptr)
 
 	if (t == DM_EQUERY) return t;
 
+	/* let IMAP sessions on the inbox know */
+	if (user_idnr != 0) {
+		uint64_t mailbox_idnr = 0;
+		if (db_findmailbox("INBOX", user_idnr, &mailbox_idnr) == 1)
+			db_mailbox_seq_update(mailbox_idnr, 0);
+	}
+
 	/* because the status of some messages might have changed (for instance
 	 * to status >= MESSAGE_STATUS_DELETE, the quotum has to be 
 	 * recalculated */
@@ -3153,6 +3421,7 @@ int db_movemsg(uint64_t mailbox_to, uint64_t mailbox_from)
 	c = db_con_get();
 	TRY
 		db_begin_transaction(c);
+		db_expunge_log_mailbox(c, mailbox_from);
 		db_exec(c, "UPDATE %smessages SET mailbox_idnr=%" PRIu64 " WHERE mailbox_idnr=%" PRIu64 "", 
 				DBPFX, mailbox_to, mailbox_from);
 		count = Connection_rowsChanged(c);
@@ -3369,6 +3638,231 @@ int db_copymsg(uint64_t msg_idnr, uint64_t mailbox_to, uint64_t user_idnr,
 	return DM_EGENERAL;
 }
 
+int db_copymsg_many(uint64_t msg_idnr, CopyTarget_T *targets, unsigned n)
+{
+	Connection_T c; ResultSet_T r;
+	uint64_t msgsize;
+	volatile int t = DM_SUCCESS;
+	volatile unsigned copies = 0;
+	unsigned i;
+	int valid;
+	uint64_t physmessage_id = 0;
+	int seen = 0, answered = 0, deleted = 0, flagged = 0, recent = 0, draft = 0, status = 0;
+	GString *values, *mailboxes, *ids;
+	GHashTable *uids, *users;
+	GHashTableIter iter;
+	gpointer key, value;
+
+	for (i = 0; i < n; i++)
+		targets[i].result = DM_EQUERY;
+
+	/* no multi-row inserts */
+	if (db_params.db_driver == DM_DRIVER_ORACLE) {
+		for (i = 0; i < n; i++) {
+			int result = db_copymsg(msg_idnr, targets[i].mailbox_idnr,
+					targets[i].user_idnr, &targets[i].message_idnr);
+			targets[i].result = (result == DM_OVERQUOTA) ? DM_OVERQUOTA :
+				(result == DM_EQUERY) ? DM_EQUERY : DM_SUCCESS;
+			if (targets[i].result == DM_SUCCESS)
+				copies++;
+		}
+		return copies;
+	}
+
+	if (! (msgsize = message_get_size(msg_idnr))) {
+		TRACE(TRACE_ERR, "error getting size for message [%" PRIu64 "]", msg_idnr);
+		return DM_EQUERY;
+	}
+
+	c = db_con_get();
+	TRY
+		r = db_query(c, "SELECT physmessage_id, seen_flag, answered_flag, deleted_flag, "
+				"flagged_flag, recent_flag, draft_flag, status "
+				"FROM %smessages WHERE message_idnr = %" PRIu64 "",
+				DBPFX, msg_idnr);
+		if (db_result_next(r)) {
+			physmessage_id = db_result_get_u64(r, 0);
+			seen = db_result_get_bool(r, 1);
+			answered = db_result_get_int(r, 2);
+			deleted = db_result_get_int(r, 3);
+			flagged = db_result_get_int(r, 4);
+			recent = db_result_get_int(r, 5);
+			draft = db_result_get_int(r, 6);
+			status = db_result_get_int(r, 7);
+		}
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		t = DM_EQUERY;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	if (t == DM_EQUERY || ! physmessage_id)
+		return DM_EQUERY;
+
+	values = g_string_new("");
+	mailboxes = g_string_new("");
+	uids = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	users = g_hash_table_new_full(g_int64_hash, g_int64_equal, NULL, NULL);
+
+	/* the rows of the targets with room for the message; each is
+	 * found back by its unique_id */
+	for (i = 0; i < n; i++) {
+		char unique_id[UID_SIZE];
+		gpointer count;
+
+		if ((valid = dm_quota_user_validate(targets[i].user_idnr, msgsize)) == DM_EQUERY)
+			continue;
+		if (! valid) {
+			TRACE(TRACE_INFO, "user [%" PRIu64 "] would exceed quotum", targets[i].user_idnr);
+			targets[i].result = DM_OVERQUOTA;
+			continue;
+		}
+
+		do {
+			memset(unique_id, 0, sizeof(unique_id));
+			create_unique_id(unique_id, msg_idnr);
+		} while (g_hash_table_contains(uids, unique_id));
+		g_hash_table_insert(uids, g_strdup(unique_id), &targets[i]);
+
+		/* copies per user, for the quota */
+		if (user_idnr_is_delivery_user_idnr(targets[i].user_idnr) == DM_SUCCESS) {
+			count = g_hash_table_lookup(users, &targets[i].user_idnr);
+			g_hash_table_insert(users, &targets[i].user_idnr,
+					GUINT_TO_POINTER(GPOINTER_TO_UINT(count) + 1));
+		}
+
+		g_string_append_printf(values, "%s(%" PRIu64 ",%" PRIu64 ",%d,%d,%d,%d,%d,%d,'%s',%d)",
+				values->len ? "," : "", targets[i].mailbox_idnr, physmessage_id,
+				seen, answered, deleted, flagged, recent, draft, unique_id, status);
+		g_string_append_printf(mailboxes, "%s%" PRIu64 "",
+				mailboxes->len ? "," : "", targets[i].mailbox_idnr);
+	}
+
+	if (! values->len) {
+		g_string_free(values, TRUE);
+		g_string_free(mailboxes, TRUE);
+		g_hash_table_destroy(uids);
+		g_hash_table_destroy(users);
+		return 0;
+	}
+
+	ids = g_string_new("");
+
+	c = db_con_get();
+	TRY
+		db_begin_transaction(c);
+
+		/* any failure rolls back the whole batch, so the targets can
+		 * be delivered one by one from a clean state */
+		if (! db_exec(c, "INSERT INTO %smessages (mailbox_idnr, physmessage_id, seen_flag, "
+				"answered_flag, deleted_flag, flagged_flag, recent_flag, draft_flag, "
+				"unique_id, status) VALUES %s",
+				DBPFX, values->str))
+			t = DM_EQUERY;
+
+		if (t == DM_SUCCESS) {
+			r = db_query(c, "SELECT message_idnr, unique_id FROM %smessages "
+					"WHERE physmessage_id = %" PRIu64 " AND mailbox_idnr IN (%s)",
+					DBPFX, physmessage_id, mailboxes->str);
+			while (db_result_next(r)) {
+				CopyTarget_T *target = g_hash_table_lookup(uids, db_result_get(r, 1));
+				if (! target)
+					continue;
+				target->message_idnr = db_result_get_u64(r, 0);
+				g_string_append_printf(ids, "%s%" PRIu64 "", ids->len ? "," : "", target->message_idnr);
+			}
+			db_con_clear(c);
+
+			if (! ids->len) {
+				TRACE(TRACE_ERR, "copies of message [%" PRIu64 "] not found", msg_idnr);
+				t = DM_EQUERY;
+			}
+		}
+
+		if (t == DM_SUCCESS && ! (
+			db_exec(c, "INSERT INTO %skeywords (message_idnr, keyword) "
+				"SELECT m.message_idnr, k.keyword FROM %smessages m, %skeywords k "
+				"WHERE k.message_idnr = %" PRIu64 " AND m.message_idnr IN (%s)",
+				DBPFX, DBPFX, DBPFX, msg_idnr, ids->str) &&
+			/* one modseq per mailbox for all copies into it */
+			db_exec(c, "UPDATE %s %smailboxes SET seq = seq + 1 WHERE mailbox_idnr IN (%s)",
+				db_get_sql(SQL_IGNORE), DBPFX, mailboxes->str) &&
+			db_exec(c, "UPDATE %s %smessages SET seq = (SELECT s.seq FROM %smailboxes s "
+				"WHERE s.mailbox_idnr = %smessages.mailbox_idnr) WHERE message_idnr IN (%s)",
+				db_get_sql(SQL_IGNORE), DBPFX, DBPFX, DBPFX, ids->str)))
+			t = DM_EQUERY;
+
+		/* users with the same number of copies share an update */
+		while (t == DM_SUCCESS && g_hash_table_size(users)) {
+			GString *same = g_string_new("");
+			guint count = 0;
+
+			g_hash_table_iter_init(&iter, users);
+			while (g_hash_table_iter_next(&iter, &key, &value)) {
+				if (! count)
+					count = GPOINTER_TO_UINT(value);
+				if (GPOINTER_TO_UINT(value) != count)
+					continue;
+				g_string_append_printf(same, "%s%" PRIu64 "", same->len ? "," : "", *(uint64_t *)key);
+				g_hash_table_iter_remove(&iter);
+			}
+			if (! db_exec(c, "UPDATE %susers SET curmail_size = curmail_size + %" PRIu64 " "
+					"WHERE user_idnr IN (%s)", DBPFX, msgsize * count, same->str))
+				t = DM_EQUERY;
+			g_string_free(same, TRUE);
+		}
+
+		if (t == DM_SUCCESS)
+			db_commit_transaction(c);
+		else
+			db_rollback_transaction(c);
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		db_rollback_transaction(c);
+		t = DM_EQUERY;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	if (t == DM_SUCCESS) {
+		g_hash_table_iter_init(&iter, uids);
+		while (g_hash_table_iter_next(&iter, &key, &value)) {
+			CopyTarget_T *target = (CopyTarget_T *)value;
+			if (! target->message_idnr)
+				continue;
+			target->result = DM_SUCCESS;
+			copies++;
+		}
+
+		/* tell the imap sessions */
+		c = db_con_get();
+		TRY
+			r = db_query(c, "SELECT mailbox_idnr, seq FROM %smailboxes WHERE mailbox_idnr IN (%s)",
+					DBPFX, mailboxes->str);
+			while (db_result_next(r))
+				dm_notify_publish(db_result_get_u64(r, 0), db_result_get_u64(r, 1));
+		CATCH(SQLException)
+			LOG_SQLERROR;
+		FINALLY
+			db_con_close(c);
+		END_TRY;
+
+		TRACE(TRACE_INFO, "message [%" PRIu64 "] copied [%u] times", msg_idnr, copies);
+	} else {
+		for (i = 0; i < n; i++)
+			targets[i].message_idnr = 0;
+	}
+
+	g_string_free(values, TRUE);
+	g_string_free(mailboxes, TRUE);
+	g_string_free(ids, TRUE);
+	g_hash_table_destroy(uids);
+	g_hash_table_destroy(users);
+
+	return (t == DM_SUCCESS) ? (int)copies : DM_EQUERY;
+}
+
 int db_getmailboxname(uint64_t mailbox_idnr, uint64_t user_idnr, char *name)
 {
 	Connection_T c; ResultSet_T r;
@@ -3505,7 +3999,7 @@ int db_get_msgflag(const char *flag_name, uint64_t msg_idnr)
 	return val;
 }
 
-static long long int db_set_msgkeywords(Connection_T c, uint64_t msg_idnr, GList *keywords, int action_type, MessageInfo *msginfo)
+static long long int db_set_msgkeywords(Connection_T c, uint64_t msg_idnr, GList *keywords, int action_type)
 {
 	PreparedStatement_T s;
 	INIT_QUERY;
@@ -3523,13 +4017,9 @@ static long long int db_set_msgkeywords(Connection_T c, uint64_t msg_idnr, GList
 
 		keywords = g_list_first(keywords);
 		while (keywords) {
-			if ((msginfo) && (g_list_find_custom(msginfo->keywords, 
-							(char *)keywords->data, 
-							(GCompareFunc)g_ascii_strcasecmp))) {
-				db_stmt_set_str(s,2,(char *)keywords->data);
-				db_stmt_exec(s);
-				count++;
-			}
+			db_stmt_set_str(s,2,(char *)keywords->data);
+			db_stmt_exec(s);
+			count++;
 
 			if (! g_list_next(keywords)) break;
 			keywords = g_list_next(keywords);
@@ -3547,24 +4037,19 @@ static long long int db_set_msgkeywords(Connection_T c, uint64_t msg_idnr, GList
 
 		keywords = g_list_first(keywords);
 		while (keywords) {
-			if ((! msginfo) || (! g_list_find_custom(msginfo->keywords, 
-							(char *)keywords->data, 
-							(GCompareFunc)g_ascii_strcasecmp))) {
-
-				if (action_type == IMAPFA_ADD) { // avoid duplicate key errors in case of concurrent inserts
-					s = db_stmt_prepare(c, "DELETE FROM %skeywords WHERE message_idnr=? AND keyword=?", DBPFX);
-					db_stmt_set_u64(s, 1, msg_idnr);
-					db_stmt_set_str(s, 2, (char *)keywords->data);
-					db_stmt_exec(s);
-				}
-
-				s = db_stmt_prepare(c, "INSERT %s INTO %skeywords (message_idnr,keyword) VALUES (?, ?)", 
-						ignore, DBPFX);
+			if (action_type == IMAPFA_ADD) { // avoid duplicate key errors in case of concurrent inserts
+				s = db_stmt_prepare(c, "DELETE FROM %skeywords WHERE message_idnr=? AND keyword=?", DBPFX);
 				db_stmt_set_u64(s, 1, msg_idnr);
 				db_stmt_set_str(s, 2, (char *)keywords->data);
 				db_stmt_exec(s);
-				count++;
 			}
+
+			s = db_stmt_prepare(c, "INSERT %s INTO %skeywords (message_idnr,keyword) VALUES (?, ?)", 
+					ignore, DBPFX);
+			db_stmt_set_u64(s, 1, msg_idnr);
+			db_stmt_set_str(s, 2, (char *)keywords->data);
+			db_stmt_exec(s);
+			count++;
 			if (! g_list_next(keywords)) break;
 			keywords = g_list_next(keywords);
 		}
@@ -3593,14 +4078,14 @@ int db_set_msgflag(uint64_t msg_idnr, int *flags, GList *keywords, int action_ty
 		switch (action_type) {
 		case IMAPFA_ADD:
 			if (flags[i]) {
-				if (msginfo) msginfo->flags[i] = 1;
+				if (msginfo) MailboxState_message_setFlag(msginfo, i, TRUE);
 				pos += snprintf(query + pos, DEF_QUERYSIZE - pos - 1, "%s%s=1", seen?",":"", db_flag_desc[i]); 
 				seen++;
 			}
 			break;
 		case IMAPFA_REMOVE:
 			if (flags[i]) {
-				if (msginfo) msginfo->flags[i] = 0;
+				if (msginfo) MailboxState_message_setFlag(msginfo, i, FALSE);
 				pos += snprintf(query + pos, DEF_QUERYSIZE - pos - 1, "%s%s=0", seen?",":"", db_flag_desc[i]); 
 				seen++;
 			}
@@ -3608,10 +4093,10 @@ int db_set_msgflag(uint64_t msg_idnr, int *flags, GList *keywords, int action_ty
 
 		case IMAPFA_REPLACE:
 			if (flags[i]) {
-				if (msginfo) msginfo->flags[i] = 1;
+				if (msginfo) MailboxState_message_setFlag(msginfo, i, TRUE);
 				pos += snprintf(query + pos, DEF_QUERYSIZE - pos - 1, "%s%s=1", seen?",":"", db_flag_desc[i]); 
 			} else if (i != IMAP_FLAG_RECENT) {
-				if (msginfo) msginfo->flags[i] = 0;
+				if (msginfo) MailboxState_message_setFlag(msginfo, i, FALSE);
 				pos += snprintf(query + pos, DEF_QUERYSIZE - pos - 1, "%s%s=0", seen?",":"", db_flag_desc[i]); 
 			}
 			seen++;
@@ -3633,7 +4118,7 @@ int db_set_msgflag(uint64_t msg_idnr, int *flags, GList *keywords, int action_ty
 	/*
 	int mailbox_sync_deleted = config_get_value_default_int("mailbox_sync_deleted", "IMAP", 1); 
 	if (mailbox_sync_deleted==2 && (action_type==IMAPFA_REPLACE || action_type==IMAPFA_ADD)){
-		if (msginfo->flags[IMAP_FLAG_DELETED]==1){
+		if (MailboxState_message_hasFlag(msginfo, IMAP_FLAG_DELETED)){
 			db_set_message_status(msg_idnr,MESSAGE_STATUS_DELETE);
 		}
 	}*/
@@ -3646,7 +4131,7 @@ int db_set_msgflag(uint64_t msg_idnr, int *flags, GList *keywords, int action_ty
 			if (Connection_rowsChanged(c))
 				count = 1;
 		}
-		if (db_set_msgkeywords(c, msg_idnr, keywords, action_type, msginfo))
+		if (db_set_msgkeywords(c, msg_idnr, keywords, action_type))
 			count = 1;
 
 		db_commit_transaction(c);
@@ -4675,6 +5160,8 @@ uint64_t db_mailbox_seq_update(uint64_t mailbox_id, uint64_t message_id)
 	END_TRY;
 	TRACE(TRACE_DEBUG, "mailbox_id [%" PRIu64 "] message_id [%" PRIu64 "] -> seq [%" PRIu64 "]",
 			mailbox_id, message_id, seq);
+	if (seq)
+		dm_notify_publish(mailbox_id, seq);
 	return seq;
 }
 
@@ -4698,8 +5185,25 @@ void db_message_set_seq(uint64_t message_id, uint64_t seq)
 
 int db_move_message(uint64_t message_id, uint64_t mailbox_id)
 {
-	return db_update("UPDATE %smessages SET mailbox_idnr = %" PRIu64 " WHERE message_idnr = %" PRIu64 "",
-		DBPFX, mailbox_id, message_id);
+	Connection_T c; volatile gboolean result = FALSE;
+
+	c = db_con_get();
+	TRY
+		db_begin_transaction(c);
+		db_expunge_log(c, message_id);
+		if (db_exec(c, "UPDATE %smessages SET mailbox_idnr = %" PRIu64 " WHERE message_idnr = %" PRIu64 "",
+					DBPFX, mailbox_id, message_id))
+			result = TRUE;
+		db_commit_transaction(c);
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		db_rollback_transaction(c);
+		result = FALSE;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	return result;
 }
 
 int db_rehash_store(void)
@@ -4737,13 +5241,43 @@ int db_rehash_store(void)
 			uint64_t *id = ids->data;
 
 			db_con_clear(c);
-			s = db_stmt_prepare(c, "SELECT data FROM %smimeparts WHERE id=?", DBPFX);
+			s = db_stmt_prepare(c, "SELECT data, storage, hash, %ssize%s, codec FROM %smimeparts WHERE id=?",
+					db_get_sql(SQL_ESCAPE_COLUMN), db_get_sql(SQL_ESCAPE_COLUMN), DBPFX);
 			db_stmt_set_u64(s,1, *id);
 			r = db_stmt_query(s);
 			db_result_next(r);
-			buf = db_result_get(r, 0);
 			memset(hash, 0, sizeof(hash));
-			dm_get_hash_for_string(buf, hash);
+			if (db_result_get_int(r, 1) == MIMEPART_STORAGE_FILE) {
+				/* the file under the old hash is left for
+				 * the mimepart store check to collect */
+				size_t len = 0;
+				char *data = dm_partstore_get(db_result_get(r, 2), db_result_get_u64(r, 3), &len);
+				if ((! data) || dm_get_hash_for_data(data, len, NULL, hash) ||
+						dm_partstore_put(hash, data, len) != DM_SUCCESS) {
+					TRACE(TRACE_ERR, "unable to rehash mimepart [%" PRIu64 "]", *id);
+					g_free(data);
+					if (! g_list_next(ids)) break;
+					ids = g_list_next(ids);
+					continue;
+				}
+				g_free(data);
+			} else if (db_result_get_int(r, 4) != MIMEPART_CODEC_NONE) {
+				int l = 0;
+				size_t len = 0;
+				const void *blob = db_result_get_blob(r, 0, &l);
+				char *data = dm_mimepart_decode(db_result_get_int(r, 4), blob, l, &len);
+				if ((! data) || dm_get_hash_for_data(data, len, NULL, hash)) {
+					TRACE(TRACE_ERR, "unable to rehash mimepart [%" PRIu64 "]", *id);
+					g_free(data);
+					if (! g_list_next(ids)) break;
+					ids = g_list_next(ids);
+					continue;
+				}
+				g_free(data);
+			} else {
+				buf = db_result_get(r, 0);
+				dm_get_hash_for_string(buf, hash);
+			}
 
 			db_con_clear(c);
 			s = db_stmt_prepare(c, "UPDATE %smimeparts SET hash=? WHERE id=?", DBPFX);
@@ -378,6 +378,16 @@ int db_icheck_physmessages(gboolean cleanup);
 int db_icheck_headernames(gboolean cleanup);
 int db_icheck_headervalues(gboolean cleanup);
 
+/**
+ * \brief check the mimepart store
+ *
+ * db_icheck_partstore lists the mimeparts whose file is missing;
+ * db_icheck_partstore_orphans counts (and with cleanup removes)
+ * files no mimepart refers to.
+ */
+int db_icheck_partstore(GList **lost);
+int db_icheck_partstore_orphans(gboolean cleanup);
+
 /** 
  * \brief check for cached header values
  *
@@ -400,6 +410,13 @@ int db_update_rfcsize(GList *lost);
 int db_icheck_envelope(GList **lost);
 int db_set_envelope(GList *lost);
 
+/**
+ * \brief check for cached BODYSTRUCTURE responses
+ *
+ */
+int db_icheck_bodystructure(GList **lost);
+int db_set_bodystructure(GList *lost);
+
 /**
  * \brief check for empty envelopes
  *
@@ -414,6 +431,22 @@ int db_icheck_empty_envelope(GList **lost);
  */
 int db_set_message_status(uint64_t message_idnr, MessageStatus_T status);
 
+/**
+ * \brief record a message leaving its mailbox in the expunge log
+ * \param c connection, usually inside the transaction that removes it
+ * \param message_idnr
+ * \return TRUE on success
+ */
+gboolean db_expunge_log(Connection_T c, uint64_t message_idnr);
+
+/**
+ * \brief record all messages of a mailbox leaving it in the expunge log
+ * \param c connection, usually inside the transaction that removes them
+ * \param mailbox_idnr
+ * \return TRUE on success
+ */
+gboolean db_expunge_log_mailbox(Connection_T c, uint64_t mailbox_idnr);
+
 /**
  * \brief delete a message 
  * \param message_idnr
@@ -628,6 +661,28 @@ int db_movemsg(uint64_t mailbox_to, uint64_t mailbox_from);
 int db_copymsg(uint64_t msg_idnr, uint64_t mailbox_to,
 	       uint64_t user_idnr, uint64_t * newmsg_idnr);
 
+/** a mailbox for db_copymsg_many */
+typedef struct {
+	uint64_t user_idnr;
+	uint64_t mailbox_idnr;
+	uint64_t message_idnr;	/**< the copy, set on success */
+	int result;		/**< DM_SUCCESS, DM_OVERQUOTA or DM_EQUERY */
+} CopyTarget_T;
+
+/**
+ * \brief copy a message to many mailboxes, for delivery to many users
+ *
+ * the messages rows, keywords, modseqs and quota of all targets are
+ * written in one transaction, with one statement each
+ * \param msg_idnr
+ * \param targets mailboxes and the users to copy for
+ * \param n number of targets
+ * \return 
+ * 		- -1 on failure
+ * 		- the number of copies made otherwise
+ */
+int db_copymsg_many(uint64_t msg_idnr, CopyTarget_T *targets, unsigned n);
+
 /**
  * \brief check if mailbox already holds message with message-id
  * \param mailbox_idnr
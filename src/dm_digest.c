@@ -55,6 +55,32 @@ static void dm_hash(const unsigned char * buf, hashid type, gpointer data)
 	mhash_deinit(td, data);
 }
 
+/* hash len bytes of buf, feeding checksum (if given) in the same pass */
+#define DM_DIGEST_CHUNK 65536
+
+int dm_digest_data(hashid type, const char *buf, size_t len, GChecksum *checksum, char *out)
+{
+	unsigned char h[1024];
+	size_t off, n;
+	MHASH td;
+
+	g_return_val_if_fail(buf != NULL, 1);
+
+	if ((td = mhash_init(type)) == MHASH_FAILED)
+		return 1;
+
+	memset(h,'\0', sizeof(h));
+	for (off = 0; off < len; off += n) {
+		n = MIN(DM_DIGEST_CHUNK, len - off);
+		mhash(td, buf + off, n);
+		if (checksum)
+			g_checksum_update(checksum, (const guchar *)buf + off, n);
+	}
+	mhash_deinit(td, h);
+
+	return dm_digest(h, type, out);
+}
+
 #define DM_HASH(x, t, out) \
 	g_return_val_if_fail(x != NULL, 1); \
 	unsigned char h[1024]; \
@@ -25,6 +25,7 @@
 #define DM_DIGEST_H
 
 int dm_digest(const unsigned char * hash, hashid type, char *);
+int dm_digest_data(hashid type, const char *buf, size_t len, GChecksum *checksum, char *);
 int dm_tiger(const char * const s, char *);
 int dm_sha1(const char * const s, char *);
 int dm_sha256(const char * const s, char *);
@@ -236,6 +236,162 @@ void set_dsn(delivery_status_t *dsn,
 	dsn->detail = qux;
 }
 
+/*
+ * process-wide LRU cache of resolved addresses: the userids, forwards
+ * and DSN an address resolved to, including addresses that don't
+ * exist. Entries expire after resolve_cache_ttl seconds, or
+ * resolve_cache_negative_ttl for unknown addresses. dbmail-users
+ * publishes its changes through notify_directory, on which all entries
+ * are dropped.
+ */
+struct dsncache_entry {
+	char *key;
+	GList *userids;
+	GList *forwards;
+	delivery_status_t dsn;
+	time_t expires;
+};
+
+G_LOCK_DEFINE_STATIC(dsncache);
+static GHashTable *dsncache = NULL; // key -> link in dsncache_lru
+static GQueue dsncache_lru = G_QUEUE_INIT;
+static unsigned dsncache_max = 0;
+static int dsncache_ttl = 0;
+static int dsncache_negative_ttl = 0;
+static uint64_t dsncache_hits = 0;
+static uint64_t dsncache_misses = 0;
+
+static gpointer dsncache_copy_userid(gconstpointer src, gpointer UNUSED data)
+{
+	uint64_t *uid = g_new0(uint64_t, 1);
+	*uid = *(const uint64_t *)src;
+	return uid;
+}
+
+static gpointer dsncache_copy_forward(gconstpointer src, gpointer UNUSED data)
+{
+	return g_strdup((const char *)src);
+}
+
+static void dsncache_entry_free(struct dsncache_entry *e)
+{
+	g_list_free_full(e->userids, g_free);
+	g_list_free_full(e->forwards, g_free);
+	g_free(e->key);
+	g_free(e);
+}
+
+/* call with dsncache locked */
+static gboolean dsncache_init(void)
+{
+	if (! dsncache) {
+		dsncache_max = config_get_value_default_int("resolve_cache_size", "DELIVERY", 10000);
+		dsncache_ttl = config_get_value_default_int("resolve_cache_ttl", "DELIVERY", 300);
+		dsncache_negative_ttl = config_get_value_default_int("resolve_cache_negative_ttl", "DELIVERY", 60);
+		dsncache = g_hash_table_new(g_str_hash, g_str_equal);
+		TRACE(TRACE_DEBUG, "resolve cache size [%u] ttl [%d] negative ttl [%d]",
+				dsncache_max, dsncache_ttl, dsncache_negative_ttl);
+	}
+	return dsncache_max > 0;
+}
+
+/* call with dsncache locked */
+static void dsncache_remove(GList *link)
+{
+	struct dsncache_entry *e = (struct dsncache_entry *)link->data;
+	g_hash_table_remove(dsncache, e->key);
+	g_queue_delete_link(&dsncache_lru, link);
+	dsncache_entry_free(e);
+}
+
+/* fill the delivery from the cache */
+static gboolean dsncache_get(Delivery_T *delivery)
+{
+	GList *link;
+	struct dsncache_entry *e;
+	gboolean found = FALSE;
+
+	G_LOCK(dsncache);
+	if (dsncache_init()) {
+		if ((link = g_hash_table_lookup(dsncache, delivery->address))) {
+			e = (struct dsncache_entry *)link->data;
+			if (e->expires < time(NULL)) {
+				dsncache_remove(link);
+			} else {
+				g_queue_unlink(&dsncache_lru, link);
+				g_queue_push_head_link(&dsncache_lru, link);
+				delivery->userids = g_list_copy_deep(e->userids, dsncache_copy_userid, NULL);
+				delivery->forwards = g_list_copy_deep(e->forwards, dsncache_copy_forward, NULL);
+				delivery->dsn = e->dsn;
+				found = TRUE;
+			}
+		}
+		if (found)
+			dsncache_hits++;
+		else
+			dsncache_misses++;
+		TRACE(TRACE_DEBUG, "resolve cache hits [%" PRIu64 "] misses [%" PRIu64 "]",
+				dsncache_hits, dsncache_misses);
+	}
+	G_UNLOCK(dsncache);
+
+	return found;
+}
+
+/* keep the outcome of a resolved address; temporary failures are
+ * looked up again */
+static void dsncache_put(Delivery_T *delivery)
+{
+	GList *link;
+	struct dsncache_entry *e;
+	int ttl;
+
+	if (delivery->dsn.class == DSN_CLASS_OK)
+		ttl = dsncache_ttl;
+	else if (delivery->dsn.class == DSN_CLASS_FAIL)
+		ttl = dsncache_negative_ttl;
+	else
+		return;
+
+	G_LOCK(dsncache);
+	if (dsncache_init() && ttl > 0) {
+		if ((link = g_hash_table_lookup(dsncache, delivery->address)))
+			dsncache_remove(link);
+
+		e = g_new0(struct dsncache_entry, 1);
+		e->key = g_strdup(delivery->address);
+		e->userids = g_list_copy_deep(delivery->userids, dsncache_copy_userid, NULL);
+		e->forwards = g_list_copy_deep(delivery->forwards, dsncache_copy_forward, NULL);
+		e->dsn = delivery->dsn;
+		e->expires = time(NULL) + ttl;
+		g_queue_push_head(&dsncache_lru, e);
+		g_hash_table_insert(dsncache, e->key, dsncache_lru.head);
+
+		while (g_queue_get_length(&dsncache_lru) > dsncache_max)
+			dsncache_remove(dsncache_lru.tail);
+	}
+	G_UNLOCK(dsncache);
+}
+
+void dsnuser_cache_flush(void)
+{
+	G_LOCK(dsncache);
+	if (dsncache) {
+		while (dsncache_lru.head)
+			dsncache_remove(dsncache_lru.head);
+		TRACE(TRACE_DEBUG, "resolve cache flushed");
+	}
+	G_UNLOCK(dsncache);
+}
+
+void dsnuser_cache_stats(uint64_t *hits, uint64_t *misses)
+{
+	G_LOCK(dsncache);
+	*hits = dsncache_hits;
+	*misses = dsncache_misses;
+	G_UNLOCK(dsncache);
+}
+
 static int address_has_alias(Delivery_T *delivery)
 {
 	int alias_count;
@@ -556,6 +712,14 @@ int dsnuser_resolve(Delivery_T *delivery)
 	/* Ok, we don't have a useridnr, maybe we have an address? */
 	} else if (strlen(delivery->address) > 0) {
 
+		/* Only resolutions starting from empty lists are cached. */
+		gboolean cacheable = (! delivery->userids && ! delivery->forwards);
+
+		if (cacheable && dsncache_get(delivery)) {
+			TRACE(TRACE_INFO, "delivering [%s] as resolved before.", delivery->address);
+			return 0;
+		}
+
 		TRACE(TRACE_INFO, "checking if [%s] is a valid username, alias, or catchall.", delivery->address);
 
 		if (address_has_alias(delivery))  {
@@ -596,6 +760,9 @@ int dsnuser_resolve(Delivery_T *delivery)
 			TRACE(TRACE_INFO, "could not find [%s] at all.", delivery->address);
 		}
 
+		if (cacheable)
+			dsncache_put(delivery);
+
 	/* Neither useridnr nor address.
 	 * Something is wrong upstream. */
 	} else {
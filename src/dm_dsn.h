@@ -113,6 +113,13 @@ int dsnuser_resolve_list(List_T deliveries);
  */
 int dsnuser_resolve(Delivery_T *dsnuser);
 
+/**
+ * \brief Drop all addresses resolved by dsnuser_resolve,
+ * after users, aliases or forwards changed.
+ */
+void dsnuser_cache_flush(void);
+void dsnuser_cache_stats(uint64_t *hits, uint64_t *misses);
+
 /**
  * \brief Loop through the list of delivery addresses
  * and find out what the single worst case scenario was
@@ -0,0 +1,505 @@
+/*
+ Copyright (c) 2020-2026 Alan Hicks, Persistent Objects Ltd support@p-o.co.uk
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either
+ version 2 of the License, or (at your option) any later
+ version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+#include "dbmail.h"
+
+#define THIS_MODULE "fts"
+
+/* postings per INSERT */
+#define FTS_BATCH 512
+/* trigrams of a search string looked up in the index */
+#define FTS_QUERY_MAX 16
+/* physmessages read per query when verifying or indexing */
+#define FTS_READ_BATCH 100
+
+#define T Fts_T
+
+struct T {
+	GHashTable *grams; // trigram -> FTS_* bits
+	gboolean skip; // body of the last header is base64
+};
+
+static volatile int enabled = -1;
+
+gboolean dm_fts_enabled(void)
+{
+	Field_T value;
+
+	if (enabled >= 0)
+		return enabled;
+
+	config_get_value("fts_index", "DBMAIL", value);
+	if (SMATCH(value, "yes")) {
+		if (db_params.db_driver == DM_DRIVER_ORACLE) {
+			TRACE(TRACE_WARNING, "fts_index is not supported on oracle");
+			enabled = 0;
+		} else {
+			enabled = 1;
+		}
+	} else {
+		enabled = 0;
+	}
+
+	return enabled;
+}
+
+#define GRAM(s, i) (((guint)g_ascii_tolower((s)[i]) << 16) | \
+		((guint)g_ascii_tolower((s)[(i)+1]) << 8) | \
+		(guint)g_ascii_tolower((s)[(i)+2]))
+
+/* the data up to the first NUL, as it is retrieved */
+static size_t text_len(const char *data, size_t len)
+{
+	const char *nul;
+	if (data && len && (nul = memchr(data, '\0', len)))
+		return nul - data;
+	return data ? len : 0;
+}
+
+static gboolean header_base64(const char *h, size_t len)
+{
+	const char *name = "content-transfer-encoding:";
+	size_t n = strlen(name), i;
+
+	for (i = 0; i + n < len; i++) {
+		if (i && h[i-1] != '\n')
+			continue;
+		if (g_ascii_strncasecmp(h + i, name, n))
+			continue;
+		i += n;
+		while (i < len && (h[i] == ' ' || h[i] == '\t'))
+			i++;
+		return (len - i >= 6 && g_ascii_strncasecmp(h + i, "base64", 6) == 0);
+	}
+	return FALSE;
+}
+
+/* the searches that see a part, 0 for none. TEXT sees all parts, BODY
+ * all but the message header, like the queries without the index */
+static int part_fields(gboolean *skip, const char *data, size_t len, gboolean is_header, int part_key)
+{
+	if (is_header) {
+		*skip = header_base64(data, len);
+		return part_key > 1 ? (FTS_TEXT|FTS_BODY) : FTS_TEXT;
+	}
+	return *skip ? 0 : (FTS_TEXT|FTS_BODY);
+}
+
+T Fts_new(void)
+{
+	T F = g_new0(struct T, 1);
+	F->grams = g_hash_table_new(g_direct_hash, g_direct_equal);
+	return F;
+}
+
+void Fts_add(T F, const char *data, size_t len, gboolean is_header, int part_key)
+{
+	int fields;
+	size_t i;
+
+	len = text_len(data, len);
+	if (! (fields = part_fields(&F->skip, data, len, is_header, part_key)))
+		return;
+
+	for (i = 0; i + 2 < len; i++) {
+		gpointer key = GUINT_TO_POINTER(GRAM(data, i));
+		int bits = GPOINTER_TO_INT(g_hash_table_lookup(F->grams, key));
+		if ((bits | fields) != bits)
+			g_hash_table_insert(F->grams, key, GINT_TO_POINTER(bits | fields));
+	}
+}
+
+uint64_t Fts_count(T F)
+{
+	return g_hash_table_size(F->grams);
+}
+
+int Fts_store(T F, Connection_T c, uint64_t physid)
+{
+	GHashTableIter iter;
+	gpointer key, value;
+	GString *q = g_string_new("");
+	int n = 0, t = DM_SUCCESS;
+
+	g_hash_table_iter_init(&iter, F->grams);
+	while (t == DM_SUCCESS) {
+		gboolean more = g_hash_table_iter_next(&iter, &key, &value);
+		if (more) {
+			if (! n)
+				g_string_printf(q, "INSERT INTO %sfts_postings (trigram, physmessage_id, fields) VALUES ", DBPFX);
+			g_string_append_printf(q, "%s(%u,%" PRIu64 ",%d)", n ? "," : "",
+					GPOINTER_TO_UINT(key), physid, GPOINTER_TO_INT(value));
+			n++;
+		}
+		if (n && (n == FTS_BATCH || ! more)) {
+			if (! db_exec(c, "%s", q->str))
+				t = DM_EQUERY;
+			n = 0;
+		}
+		if (! more)
+			break;
+	}
+	g_string_free(q, TRUE);
+
+	if (t == DM_SUCCESS && ! db_exec(c, "INSERT INTO %sfts_messages (physmessage_id) VALUES (%" PRIu64 ")", DBPFX, physid))
+		t = DM_EQUERY;
+
+	TRACE(TRACE_DEBUG, "physmessage [%" PRIu64 "] [%u] trigrams", physid, g_hash_table_size(F->grams));
+
+	return t;
+}
+
+void Fts_free(T *F)
+{
+	T f = *F;
+	if (! f)
+		return;
+	g_hash_table_destroy(f->grams);
+	g_free(f);
+	*F = NULL;
+}
+
+/*
+ * read the parts of the physmessages in ids, decoded, in the order
+ * they make up the message
+ */
+typedef void (*PartFunc)(uint64_t physid, const char *data, size_t len, gboolean is_header, int part_key, gpointer userdata);
+
+static int parts_foreach(Connection_T c, GList *ids, PartFunc func, gpointer userdata)
+{
+	ResultSet_T r;
+	GString *set = g_string_new("");
+	const char *esc = db_get_sql(SQL_ESCAPE_COLUMN);
+	char *enc = g_strdup_printf(db_get_sql(SQL_ENCODE_ESCAPE), "p.data");
+	volatile int t = DM_SUCCESS;
+
+	ids = g_list_first(ids);
+	while (ids) {
+		g_string_append_printf(set, "%s%" PRIu64, set->len ? "," : "", *(uint64_t *)ids->data);
+		ids = g_list_next(ids);
+	}
+
+	TRY
+		r = db_query(c, "SELECT l.physmessage_id, l.is_header, l.part_key, "
+				"p.storage, p.hash, p.%ssize%s, p.codec, "
+				"CASE WHEN p.codec = 0 THEN %s END, CASE WHEN p.codec <> 0 THEN p.data END "
+				"FROM %smimeparts p "
+				"JOIN %spartlists l ON p.id = l.part_id "
+				"WHERE l.physmessage_id IN (%s) "
+				"ORDER BY l.physmessage_id, l.part_key, l.part_order ASC, l.part_depth DESC",
+				esc, esc, enc, DBPFX, DBPFX, set->str);
+		if (! r)
+			t = DM_EQUERY;
+		while (db_result_next(r)) {
+			const char *data;
+			char *str = NULL;
+			size_t len = 0;
+			int l = 0;
+
+			if (db_result_get_int(r, 3) == MIMEPART_STORAGE_FILE) {
+				data = str = dm_partstore_get(db_result_get(r, 4), db_result_get_u64(r, 5), &len);
+			} else if (db_result_get_int(r, 6) != MIMEPART_CODEC_NONE) {
+				const void *blob = db_result_get_blob(r, 8, &l);
+				data = str = dm_mimepart_decode(db_result_get_int(r, 6), blob, l, &len);
+			} else {
+				if (! (data = db_result_get_blob(r, 7, &l)))
+					data = "";
+				len = l;
+			}
+			if (! data) {
+				TRACE(TRACE_WARNING, "unable to read a part of physmessage [%" PRIu64 "]",
+						db_result_get_u64(r, 0));
+				continue;
+			}
+			func(db_result_get_u64(r, 0), data, len, db_result_get_bool(r, 1),
+					db_result_get_int(r, 2), userdata);
+			g_free(str);
+		}
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		t = DM_EQUERY;
+	END_TRY;
+
+	g_free(enc);
+	g_string_free(set, TRUE);
+
+	return t;
+}
+
+struct verify {
+	char *needle; // folded
+	size_t needle_len;
+	int wanted; // FTS_TEXT or FTS_BODY
+	uint64_t physid; // message being read
+	gboolean skip;
+	GHashTable *matched; // physids
+};
+
+static void verify_part(uint64_t physid, const char *data, size_t len, gboolean is_header, int part_key, gpointer userdata)
+{
+	struct verify *v = (struct verify *)userdata;
+	int fields;
+	char *s;
+
+	if (physid != v->physid) {
+		v->physid = physid;
+		v->skip = FALSE;
+	}
+	if (g_hash_table_contains(v->matched, &v->physid))
+		return;
+
+	len = text_len(data, len);
+	fields = part_fields(&v->skip, data, len, is_header, part_key);
+	if (! (fields & v->wanted) || len < v->needle_len)
+		return;
+
+	s = g_ascii_strdown(data, len);
+	if (g_strstr_len(s, len, v->needle)) {
+		uint64_t *id = g_new0(uint64_t, 1);
+		*id = physid;
+		g_hash_table_add(v->matched, id);
+	}
+	g_free(s);
+}
+
+/* trigrams of the needle, at most FTS_QUERY_MAX spread over it */
+static GString * needle_grams(const char *needle, int *count)
+{
+	GHashTable *seen = g_hash_table_new(g_direct_hash, g_direct_equal);
+	GString *s = g_string_new("");
+	size_t len = strlen(needle), i, step = 1;
+
+	if (len - 2 > FTS_QUERY_MAX)
+		step = (len - 2 + FTS_QUERY_MAX - 1) / FTS_QUERY_MAX;
+
+	*count = 0;
+	for (i = 0; i + 2 < len; i += step) {
+		guint g = GRAM(needle, i);
+		if (g_hash_table_contains(seen, GUINT_TO_POINTER(g)))
+			continue;
+		g_hash_table_add(seen, GUINT_TO_POINTER(g));
+		g_string_append_printf(s, "%s%u", s->len ? "," : "", g);
+		(*count)++;
+	}
+	g_hash_table_destroy(seen);
+
+	return s;
+}
+
+struct candidate {
+	uint64_t message_idnr;
+	uint64_t physid;
+};
+
+int dm_fts_search(Connection_T c, uint64_t mailbox_id, const char *needle,
+		gboolean body, const char *inset, GList **found)
+{
+	PreparedStatement_T st;
+	ResultSet_T r;
+	GList * volatile candidates = NULL, *l, *batch = NULL;
+	GString *grams;
+	struct verify v;
+	volatile int t = DM_SUCCESS;
+	int count, n = 0;
+
+	if (! dm_fts_enabled() || strlen(needle) < FTS_MIN)
+		return DM_EGENERAL;
+
+	grams = needle_grams(needle, &count);
+
+	TRY
+		st = db_stmt_prepare(c, "SELECT m.message_idnr, m.physmessage_id FROM %smessages m "
+				"JOIN %sfts_postings f ON f.physmessage_id = m.physmessage_id "
+				"WHERE m.mailbox_idnr = ? AND m.status < ? %s "
+				"AND f.trigram IN (%s) %s "
+				"GROUP BY m.message_idnr, m.physmessage_id HAVING COUNT(*) = %d "
+				"UNION "
+				"SELECT m.message_idnr, m.physmessage_id FROM %smessages m "
+				"LEFT JOIN %sfts_messages x ON x.physmessage_id = m.physmessage_id "
+				"WHERE m.mailbox_idnr = ? AND m.status < ? %s "
+				"AND x.physmessage_id IS NULL",
+				DBPFX, DBPFX, inset ? inset : "", grams->str,
+				body ? "AND f.fields > 1" : "", count,
+				DBPFX, DBPFX, inset ? inset : "");
+		db_stmt_set_u64(st, 1, mailbox_id);
+		db_stmt_set_int(st, 2, MESSAGE_STATUS_DELETE);
+		db_stmt_set_u64(st, 3, mailbox_id);
+		db_stmt_set_int(st, 4, MESSAGE_STATUS_DELETE);
+		r = db_stmt_query(st);
+		while (db_result_next(r)) {
+			struct candidate *k = g_new0(struct candidate, 1);
+			k->message_idnr = db_result_get_u64(r, 0);
+			k->physid = db_result_get_u64(r, 1);
+			candidates = g_list_prepend(candidates, k);
+		}
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		t = DM_EQUERY;
+	END_TRY;
+
+	g_string_free(grams, TRUE);
+
+	if (t == DM_EQUERY) {
+		g_list_destroy(candidates);
+		return t;
+	}
+
+	TRACE(TRACE_DEBUG, "[%s] [%u] candidates", needle, g_list_length(candidates));
+
+	/* check the candidates for the string itself */
+	memset(&v, 0, sizeof(v));
+	v.needle = g_ascii_strdown(needle, -1);
+	v.needle_len = strlen(v.needle);
+	v.wanted = body ? FTS_BODY : FTS_TEXT;
+	v.matched = g_hash_table_new_full(g_int64_hash, g_int64_equal, g_free, NULL);
+
+	l = g_list_first(candidates);
+	while (l && t == DM_SUCCESS) {
+		struct candidate *k = (struct candidate *)l->data;
+		batch = g_list_prepend(batch, &k->physid);
+		l = g_list_next(l);
+		if (++n == FTS_READ_BATCH || ! l) {
+			v.physid = 0;
+			t = parts_foreach(c, batch, verify_part, &v);
+			g_list_free(batch);
+			batch = NULL;
+			n = 0;
+		}
+	}
+
+	*found = NULL;
+	l = g_list_first(candidates);
+	while (l && t == DM_SUCCESS) {
+		struct candidate *k = (struct candidate *)l->data;
+		if (g_hash_table_contains(v.matched, &k->physid)) {
+			uint64_t *id = g_new0(uint64_t, 1);
+			*id = k->message_idnr;
+			*found = g_list_prepend(*found, id);
+		}
+		l = g_list_next(l);
+	}
+
+	TRACE(TRACE_DEBUG, "[%s] [%u] found", needle, g_list_length(*found));
+
+	g_hash_table_destroy(v.matched);
+	g_free(v.needle);
+	g_list_destroy(candidates);
+
+	return t;
+}
+
+static void index_part(uint64_t physid, const char *data, size_t len, gboolean is_header, int part_key, gpointer userdata)
+{
+	GHashTable *index = (GHashTable *)userdata;
+	T F;
+
+	if (! (F = g_hash_table_lookup(index, &physid))) {
+		uint64_t *id = g_new0(uint64_t, 1);
+		*id = physid;
+		F = Fts_new();
+		g_hash_table_insert(index, id, F);
+	}
+	Fts_add(F, data, len, is_header, part_key);
+}
+
+static void index_free(gpointer data)
+{
+	T F = (T)data;
+	Fts_free(&F);
+}
+
+int dm_fts_backfill(int limit)
+{
+	Connection_T c; ResultSet_T r;
+	GList * volatile ids = NULL;
+	volatile int t = DM_SUCCESS;
+	int done = 0;
+
+	c = db_con_get();
+	TRY
+		r = db_query(c, "SELECT DISTINCT l.physmessage_id FROM %spartlists l "
+				"LEFT JOIN %sfts_messages x ON x.physmessage_id = l.physmessage_id "
+				"WHERE x.physmessage_id IS NULL "
+				"ORDER BY l.physmessage_id LIMIT %d",
+				DBPFX, DBPFX, limit);
+		while (db_result_next(r)) {
+			uint64_t *id = g_new0(uint64_t, 1);
+			*id = db_result_get_u64(r, 0);
+			ids = g_list_prepend(ids, id);
+		}
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		t = DM_EQUERY;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	if (t == DM_EQUERY) {
+		g_list_destroy(ids);
+		return -1;
+	}
+
+	ids = g_list_reverse(ids);
+
+	while (ids && t == DM_SUCCESS) {
+		GList *batch = ids, *l;
+		GHashTable *index = g_hash_table_new_full(g_int64_hash, g_int64_equal, g_free, index_free);
+		int n = 0;
+
+		while (ids && n < FTS_READ_BATCH) {
+			ids = g_list_next(ids);
+			n++;
+		}
+		if (ids) {
+			ids->prev->next = NULL;
+			ids->prev = NULL;
+		}
+
+		c = db_con_get();
+		TRY
+			db_begin_transaction(c);
+			if ((t = parts_foreach(c, batch, index_part, index)) == DM_SUCCESS) {
+				for (l = batch; l && t == DM_SUCCESS; l = g_list_next(l)) {
+					T F = g_hash_table_lookup(index, l->data);
+					if (F)
+						t = Fts_store(F, c, *(uint64_t *)l->data);
+				}
+			}
+			if (t == DM_SUCCESS) {
+				db_commit_transaction(c);
+				done += n;
+			} else {
+				db_rollback_transaction(c);
+			}
+		CATCH(SQLException)
+			LOG_SQLERROR;
+			db_rollback_transaction(c);
+			t = DM_EQUERY;
+		FINALLY
+			db_con_close(c);
+		END_TRY;
+
+		g_hash_table_destroy(index);
+		g_list_destroy(batch);
+	}
+
+	g_list_destroy(ids);
+
+	return (t == DM_SUCCESS) ? done : -1;
+}
@@ -0,0 +1,67 @@
+/*
+ Copyright (c) 2020-2026 Alan Hicks, Persistent Objects Ltd support@p-o.co.uk
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either
+ version 2 of the License, or (at your option) any later
+ version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+/*
+ * full text index for SEARCH BODY and TEXT
+ *
+ * For every physmessage the index holds the trigrams, sequences of
+ * three bytes folded to lower case, found in its parts. A string can
+ * only occur in a message that has all of its trigrams, so the
+ * messages having them are the candidates, which are then checked for
+ * the string itself. Messages not indexed yet are always candidates.
+ *
+ * Matching is case-insensitive for ASCII. Bodies in base64, mostly
+ * attachments, are neither indexed nor searched.
+ */
+
+#ifndef DM_FTS_H
+#define DM_FTS_H
+
+/* shorter search strings are not looked up in the index */
+#define FTS_MIN 3
+
+/* which searches see a trigram */
+#define FTS_TEXT 1
+#define FTS_BODY 2
+
+#define T Fts_T
+
+typedef struct T *T;
+
+/* collect the trigrams of a message, part by part */
+extern T               Fts_new(void);
+extern void            Fts_add(T, const char *data, size_t len, gboolean is_header, int part_key);
+extern uint64_t        Fts_count(T);
+extern int             Fts_store(T, Connection_T c, uint64_t physid);
+extern void            Fts_free(T *);
+
+#undef T
+
+gboolean dm_fts_enabled(void);
+
+/* message_idnrs in the mailbox with needle in the body or text.
+ * returns DM_EGENERAL if the index can not be used for it */
+int dm_fts_search(Connection_T c, uint64_t mailbox_id, const char *needle,
+		gboolean body, const char *inset, GList **found);
+
+/* index up to limit physmessages not indexed yet; returns the number
+ * indexed or -1 on failure */
+int dm_fts_backfill(int limit);
+
+#endif
@@ -127,6 +127,7 @@ ImapSession * dbmail_imap_session_new(Mempool_T pool)
 	Capa_remove(self->preauth_capa, "SORT");
 	Capa_remove(self->preauth_capa, "QUOTA");
 	Capa_remove(self->preauth_capa, "THREAD=ORDEREDSUBJECT");
+	Capa_remove(self->preauth_capa, "THREAD=REFERENCES");
 	Capa_remove(self->preauth_capa, "UNSELECT");
 	Capa_remove(self->preauth_capa, "IDLE");
 	Capa_remove(self->preauth_capa, "UIDPLUS");
@@ -188,7 +189,91 @@ void dbmail_imap_session_encrypted(ImapSession *self)
 	}
 }
 
-static uint64_t dbmail_imap_session_message_load(ImapSession *self)
+/* messages and bytes read ahead per query during a FETCH */
+#define PREFETCH_BATCHSIZE 32
+#define PREFETCH_BATCHBYTES (16*1024*1024)
+
+/* read the messages following the current one in the fetch set in
+ * a single query */
+static void _message_prefetch(ImapSession *self, gboolean sparse)
+{
+	MailboxState_T M = self->mailbox->mbstate;
+	DbmailMessage *msgs[PREFETCH_BATCHSIZE];
+	uint64_t physids[PREFETCH_BATCHSIZE], uids[PREFETCH_BATCHSIZE];
+	uint64_t msn, bytes = 0;
+	unsigned i, n = 0;
+
+	if (! (self->ids && M))
+		return;
+
+	if (! (msn = MailboxState_getMsnForUid(M, self->msg_idnr)))
+		return;
+	if (! SeqSet_has(self->ids, msn))
+		return;
+	msn--;
+
+	while (n < PREFETCH_BATCHSIZE && bytes < PREFETCH_BATCHBYTES && SeqSet_next(self->ids, &msn)) {
+		uint64_t uid = MailboxState_getUidForMsn(M, msn);
+		MessageInfo *msginfo = g_tree_lookup(MailboxState_getMsginfo(M), &uid);
+		if (! (msginfo && msginfo->phys_id))
+			continue;
+		if (self->prefetched && g_tree_lookup(self->prefetched, &uid))
+			continue;
+		uids[n] = uid;
+		physids[n] = msginfo->phys_id;
+		msgs[n] = dbmail_message_new(self->pool);
+		bytes += msginfo->rfcsize;
+		n++;
+	}
+
+	/* nothing to gain for a single message */
+	if (n < 2) {
+		for (i = 0; i < n; i++)
+			dbmail_message_free(msgs[i]);
+		return;
+	}
+
+	if (! self->prefetched)
+		self->prefetched = g_tree_new_full((GCompareDataFunc)ucmpdata, NULL,
+				(GDestroyNotify)g_free, (GDestroyNotify)dbmail_message_free);
+
+	dbmail_message_retrieve_batch(msgs, physids, n, sparse);
+
+	for (i = 0; i < n; i++) {
+		uint64_t *uid;
+		if (! msgs[i])
+			continue;
+		uid = g_new0(uint64_t, 1);
+		*uid = uids[i];
+		g_tree_replace(self->prefetched, uid, msgs[i]);
+	}
+}
+
+/* take the message for the current uid from the read-ahead */
+static DbmailMessage * _message_prefetched(ImapSession *self, gboolean sparse)
+{
+	DbmailMessage *msg;
+	gpointer key, value;
+
+	if (! self->prefetched)
+		return NULL;
+
+	if (! g_tree_lookup_extended(self->prefetched, &(self->msg_idnr), &key, &value))
+		return NULL;
+
+	g_tree_steal(self->prefetched, key);
+	g_free(key);
+	msg = (DbmailMessage *)value;
+	if (msg->elided && ! sparse) {
+		dbmail_message_free(msg);
+		return NULL;
+	}
+	return msg;
+}
+
+/* with sparse set, the bodies of large parts are only read when a
+ * section containing them is sent */
+static uint64_t dbmail_imap_session_message_load(ImapSession *self, gboolean sparse)
 {
 	TRACE(TRACE_DEBUG, "Call: dbmail_imap_session_message_load");
 	uint64_t *id = NULL;
@@ -223,14 +308,33 @@ static uint64_t dbmail_imap_session_message_load(ImapSession *self)
 			TRACE(TRACE_DEBUG,"id != message->id [%" PRIu64 "] [%" PRIu64 "]", *id, self->message->id);
 			dbmail_message_free(self->message);
 			self->message = NULL;
+		} else if (self->message->elided && ! sparse) {
+			dbmail_message_free(self->message);
+			self->message = NULL;
 		}
 	}
 
 	assert(id);
 
+	if ((! self->message) && self->ids && SeqSet_count(self->ids) > 1) {
+		DbmailMessage *msg;
+		if (! (msg = _message_prefetched(self, sparse))) {
+			_message_prefetch(self, sparse);
+			msg = _message_prefetched(self, sparse);
+		}
+		if (msg && msg->id == *id)
+			self->message = msg;
+		else if (msg)
+			dbmail_message_free(msg);
+	}
+
 	if (! self->message) {
 		DbmailMessage *msg = dbmail_message_new(self->pool);
-		if ((msg = dbmail_message_retrieve(msg, *id)) != NULL)
+		if (sparse)
+			msg = dbmail_message_retrieve_sparse(msg, *id);
+		else
+			msg = dbmail_message_retrieve(msg, *id);
+		if (msg != NULL)
 			self->message = msg;
 	}
 
@@ -304,13 +408,17 @@ void dbmail_imap_session_fetch_free(ImapSession *self, gboolean all)
 		g_tree_destroy(self->envelopes);
 		self->envelopes = NULL;
 	}
-	if (self->ids) {
-		g_tree_destroy(self->ids);
-		self->ids = NULL;
+	if (self->structures) {
+		g_tree_destroy(self->structures);
+		self->structures = NULL;
 	}
-	if (self->ids_list) {
-		g_list_free(g_list_first(self->ids_list));
-		self->ids_list = NULL;
+	if (self->ids)
+		SeqSet_free(&self->ids);
+	if (self->modified)
+		SeqSet_free(&self->modified);
+	if (self->prefetched) {
+		g_tree_destroy(self->prefetched);
+		self->prefetched = NULL;
 	}
 	if (self->fi->bodyfetch) {
 		dbmail_imap_session_bodyfetch_free(self);
@@ -623,7 +731,6 @@ int dbmail_imap_session_fetch_parse_args(ImapSession * self)
 
 		if (! nexttoken || ! MATCH(nexttoken,"[")) {
 			if (ispeek) return -2;	/* error DONE */
-			self->fi->msgparse_needed = 1;
 			self->fi->getMIME_IMB_noextension = 1;	/* just BODY specified */
 		} else {
 			int res = 0;
@@ -673,14 +780,12 @@ int dbmail_imap_session_fetch_parse_args(ImapSession * self)
 		self->fi->getFlags = 1;
 		self->fi->getSize = 1;
 	} else if (MATCH(token,"full")) {
-		self->fi->msgparse_needed=1;
 		self->fi->getInternalDate = 1;
 		self->fi->getEnvelope = 1;
 		self->fi->getMIME_IMB_noextension = 1;
 		self->fi->getFlags = 1;
 		self->fi->getSize = 1;
 	} else if (MATCH(token,"bodystructure")) {
-		self->fi->msgparse_needed=1;
 		self->fi->getMIME_IMB = 1;
 	} else if (MATCH(token,"envelope")) {
 		self->fi->getEnvelope = 1;
@@ -758,6 +863,22 @@ void _send_headers(ImapSession *self, const body_fetch *bodyfetch, gboolean not)
 }
 
 
+/* is the message part of the fetch set */
+static gboolean _fetch_wanted(ImapSession *self, uint64_t uid)
+{
+	uint64_t msn = MailboxState_getMsnForUid(self->mailbox->mbstate, uid);
+	return (msn && SeqSet_has(self->ids, msn));
+}
+
+/* last uid of the prefetch batch starting at the current message */
+static uint64_t _fetch_batch_end(ImapSession *self)
+{
+	MailboxState_T M = self->mailbox->mbstate;
+	uint64_t msn = MailboxState_getMsnForUid(M, self->msg_idnr);
+	uint64_t hi = MailboxState_getUidForMsn(M, SeqSet_advance(self->ids, msn, QUERY_BATCHSIZE));
+	return max(hi, self->msg_idnr);
+}
+
 /* get headers or not */
 static void _fetch_headers(ImapSession *self, body_fetch *bodyfetch, gboolean not)
 {
@@ -766,7 +887,6 @@ static void _fetch_headers(ImapSession *self, body_fetch *bodyfetch, gboolean no
 	gchar *fld2, *val, *old, *new = NULL;
 	uint64_t *mid;
 	uint64_t id;
-	GList *last;
 	GString *fieldorder = NULL;
 	GString *headerIDs = NULL;
 	int k;
@@ -779,7 +899,6 @@ static void _fetch_headers(ImapSession *self, body_fetch *bodyfetch, gboolean no
 		bodyfetch->headers = g_tree_new_full((GCompareDataFunc)ucmpdata,NULL,(GDestroyNotify)uint64_free,(GDestroyNotify)g_free);
 		self->ceiling = 0;
 		self->hi = 0;
-		self->lo = 0;
 	}
 
 	if (! bodyfetch->hdrnames) {
@@ -813,9 +932,7 @@ static void _fetch_headers(ImapSession *self, body_fetch *bodyfetch, gboolean no
 	range = p_string_new(self->pool, "");
 	
 
-	if (! (last = g_list_nth(self->ids_list, self->lo+(uint64_t)QUERY_BATCHSIZE)))
-		last = g_list_last(self->ids_list);
-	self->hi = *(uint64_t *)last->data;
+	self->hi = _fetch_batch_end(self);
 
 	if (self->msg_idnr == self->hi)
 		p_string_printf(range, "= %" PRIu64 "", self->msg_idnr);
@@ -911,7 +1028,7 @@ static void _fetch_headers(ImapSession *self, body_fetch *bodyfetch, gboolean no
 
 			id = db_result_get_u64(r, 0);
 
-			if (! g_tree_lookup(self->ids,&id))
+			if (! _fetch_wanted(self, id))
 				continue;
 
 			fld = db_result_get(r, 1);
@@ -949,7 +1066,6 @@ static void _fetch_headers(ImapSession *self, body_fetch *bodyfetch, gboolean no
 
 	if (t == DM_EQUERY) return;
 	
-	self->lo += QUERY_BATCHSIZE;
 	self->ceiling = self->hi;
 
 	_send_headers(self, bodyfetch, not);
@@ -973,6 +1089,15 @@ static void _imap_send_part(ImapSession *self, GMimeObject *part, body_fetch *bo
 		dbmail_imap_session_buff_printf(self, "] NIL");
 	} else {
 		char *tmp = imap_get_logical_part(part,type);
+		if (self->message->elided) {
+			char *full = dbmail_message_expand(self->message, tmp, TRUE);
+			g_free(tmp);
+			if (! full) {
+				dbmail_imap_session_buff_printf(self, "] NIL");
+				return;
+			}
+			tmp = full;
+		}
 		String_T str = p_string_new(self->pool, tmp);
 		size_t len = p_string_len(str);
 		g_free(tmp);
@@ -1067,12 +1192,10 @@ static void _fetch_envelopes(ImapSession *self)
 	uint64_t *mid;
 	uint64_t id;
 	char range[DEF_FRAGSIZE];
-	GList *last;
 	memset(range,0,sizeof(range));
 
 	if (! self->envelopes) {
 		self->envelopes = g_tree_new_full((GCompareDataFunc)ucmpdata,NULL,(GDestroyNotify)uint64_free,(GDestroyNotify)g_free);
-		self->lo = 0;
 		self->hi = 0;
 	}
 
@@ -1081,11 +1204,7 @@ static void _fetch_envelopes(ImapSession *self)
 		return;
 	}
 
-	TRACE(TRACE_DEBUG,"[%p] lo: %" PRIu64 "", self, self->lo);
-
-	if (! (last = g_list_nth(self->ids_list, self->lo+(uint64_t)QUERY_BATCHSIZE)))
-		last = g_list_last(self->ids_list);
-	self->hi = *(uint64_t *)last->data;
+	self->hi = _fetch_batch_end(self);
 
 	if (self->msg_idnr == self->hi)
 		snprintf(range,DEF_FRAGSIZE-1,"= %" PRIu64 "", self->msg_idnr);
@@ -1105,7 +1224,7 @@ static void _fetch_envelopes(ImapSession *self)
 		while (db_result_next(r)) {
 			id = db_result_get_u64(r, 0);
 			
-			if (! g_tree_lookup(self->ids,&id))
+			if (! _fetch_wanted(self, id))
 				continue;
 			
 			mid = mempool_pop(small_pool, sizeof(uint64_t));
@@ -1122,12 +1241,72 @@ static void _fetch_envelopes(ImapSession *self)
 
 	if (t == DM_EQUERY) return;
 
-	self->lo += QUERY_BATCHSIZE;
-
 	s = g_tree_lookup(self->envelopes, &(self->msg_idnr));
 	dbmail_imap_session_buff_printf(self, "ENVELOPE %s", s?s:"");
 }
 
+/* get cached BODYSTRUCTURE and BODY responses, like the envelopes */
+static char ** _fetch_structures(ImapSession *self)
+{
+	Connection_T c; ResultSet_T r; volatile int t = FALSE;
+	INIT_QUERY;
+	char **s;
+	uint64_t *mid;
+	uint64_t id, hi;
+	char range[DEF_FRAGSIZE];
+	memset(range,0,sizeof(range));
+
+	if (! self->structures) {
+		self->structures = g_tree_new_full((GCompareDataFunc)ucmpdata,NULL,(GDestroyNotify)uint64_free,(GDestroyNotify)g_strfreev);
+	}
+
+	if ((s = g_tree_lookup(self->structures, &(self->msg_idnr))) != NULL)
+		return s;
+
+	hi = _fetch_batch_end(self);
+
+	if (self->msg_idnr >= hi)
+		snprintf(range,DEF_FRAGSIZE-1,"= %" PRIu64 "", self->msg_idnr);
+	else
+		snprintf(range,DEF_FRAGSIZE-1,"BETWEEN %" PRIu64 " AND %" PRIu64 "", self->msg_idnr, hi);
+
+	snprintf(query, DEF_QUERYSIZE-1, "SELECT message_idnr,bodystructure,body "
+			"FROM %senvelope e "
+			"LEFT JOIN %smessages m USING (physmessage_id) "
+			"WHERE m.mailbox_idnr = %" PRIu64 " "
+			"AND message_idnr %s "
+			"AND bodystructure IS NOT NULL AND body IS NOT NULL",
+			DBPFX, DBPFX,  
+			self->mailbox->id, range);
+	c = db_con_get();
+	TRY
+		r = db_query(c, query);
+		while (db_result_next(r)) {
+			id = db_result_get_u64(r, 0);
+			
+			if (! _fetch_wanted(self, id))
+				continue;
+			
+			mid = g_new0(uint64_t, 1);
+			*mid = id;
+
+			s = g_new0(char *, 3);
+			s[0] = g_strdup(db_result_get(r, 1));
+			s[1] = g_strdup(db_result_get(r, 2));
+			g_tree_insert(self->structures,mid,s);
+		}
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		t = DM_EQUERY;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	if (t == DM_EQUERY) return NULL;
+
+	return g_tree_lookup(self->structures, &(self->msg_idnr));
+}
+
 static void _imap_show_body_sections(ImapSession *self) 
 {
 	List_T head;
@@ -1143,15 +1322,38 @@ static void _imap_show_body_sections(ImapSession *self)
 	}
 }
 
+/* only body sections are fetched, which can be served from a message
+ * retrieved without the bodies of large parts */
+static gboolean _fetch_sparse(ImapSession *self)
+{
+	List_T head;
+
+	if (self->fi->getRFC822 || self->fi->getRFC822Peek ||
+			self->fi->getBodyTotal || self->fi->getBodyTotalPeek ||
+			self->fi->getRFC822Header || self->fi->getRFC822Text)
+		return FALSE;
+
+	head = p_list_first(self->fi->bodyfetch);
+	while (head) {
+		body_fetch *bodyfetch = (body_fetch *)p_list_data(head);
+		if (bodyfetch && bodyfetch->itemtype == BFIT_ALL && ! bodyfetch->partspec[0])
+			return FALSE;
+		head = p_list_next(head);
+	}
+
+	return TRUE;
+}
+
 static int _fetch_get_items(ImapSession *self, uint64_t *uid)
 {
 	
 	int result;
 	uint64_t size = 0;
 	gchar *s = NULL;
-	uint64_t *id = uid;
+	uint64_t msn;
 	gboolean reportflags = FALSE;
 	String_T stream = NULL;
+	char **structures = NULL;
 	
 	TRACE(TRACE_DEBUG,"Call: _fetch_get_items");
 	
@@ -1162,9 +1364,9 @@ static int _fetch_get_items(ImapSession *self, uint64_t *uid)
 		return 0;
 	}
 	
-	id = g_tree_lookup(MailboxState_getIds(self->mailbox->mbstate),uid);
+	msn = MailboxState_getMsnForUid(self->mailbox->mbstate, *uid);
 
-	g_return_val_if_fail(id,-1);
+	g_return_val_if_fail(msn,-1);
 
 	if (self->fi->changedsince && (msginfo->seq <= self->fi->changedsince))
 		return 0;
@@ -1173,14 +1375,14 @@ static int _fetch_get_items(ImapSession *self, uint64_t *uid)
 	self->fi->isfirstfetchout = 1;
 
 	if (self->fi->msgparse_needed) {
-		if (! (dbmail_imap_session_message_load(self)))
+		if (! (dbmail_imap_session_message_load(self, _fetch_sparse(self))))
 			return 0;
 
 		stream = self->message->crlf;
 		size = p_string_len(stream);
 	}
 
-	dbmail_imap_session_buff_printf(self, "* %" PRIu64 " FETCH (", *id);
+	dbmail_imap_session_buff_printf(self, "* %" PRIu64 " FETCH (", msn);
 
 	if (self->mailbox->condstore || self->enabled.qresync) {
 		SEND_SPACE;
@@ -1201,9 +1403,7 @@ static int _fetch_get_items(ImapSession *self, uint64_t *uid)
 	if (self->fi->getFlags) {
 		SEND_SPACE;
 
-		GList *sublist = MailboxState_message_flags(self->mailbox->mbstate, msginfo);
-		s = dbmail_imap_plist_as_string(sublist);
-		g_list_free_full(g_steal_pointer (&sublist), g_free);
+		s = MailboxState_message_flags(self->mailbox->mbstate, msginfo);
 		dbmail_imap_session_buff_printf(self,"FLAGS %s",s);
 		g_free(s);
 	}
@@ -1211,9 +1411,25 @@ static int _fetch_get_items(ImapSession *self, uint64_t *uid)
 		SEND_SPACE;
 		dbmail_imap_session_buff_printf(self, "UID %" PRIu64 "", msginfo->uid);
 	}
+	if (self->fi->getMIME_IMB || self->fi->getMIME_IMB_noextension) {
+		/* messages stored before the structures were cached,
+		 * and not yet fixed by dbmail-util, are parsed */
+		if (! (structures = _fetch_structures(self))) {
+			if (! (dbmail_imap_session_message_load(self, FALSE))) {
+				dbmail_imap_session_buff_clear(self);
+				dbmail_imap_session_buff_printf(self, "\r\n* BYE error fetching body structure\r\n");
+				return -1;
+			}
+			stream = self->message->crlf;
+			size = p_string_len(stream);
+		}
+	}
+
 	if (self->fi->getMIME_IMB) {
 		SEND_SPACE;
-		if ((s = imap_get_structure(GMIME_MESSAGE((self->message)->content), 1))==NULL) {
+		if (structures) {
+			s = g_strdup(structures[0]);
+		} else if ((s = imap_get_structure(GMIME_MESSAGE((self->message)->content), 1))==NULL) {
 			dbmail_imap_session_buff_clear(self);
 			dbmail_imap_session_buff_printf(self, "\r\n* BYE error fetching body structure\r\n");
 			return -1;
@@ -1224,7 +1440,9 @@ static int _fetch_get_items(ImapSession *self, uint64_t *uid)
 
 	if (self->fi->getMIME_IMB_noextension) {
 		SEND_SPACE;
-		if ((s = imap_get_structure(GMIME_MESSAGE((self->message)->content), 0))==NULL) {
+		if (structures) {
+			s = g_strdup(structures[1]);
+		} else if ((s = imap_get_structure(GMIME_MESSAGE((self->message)->content), 0))==NULL) {
 			dbmail_imap_session_buff_clear(self);
 			dbmail_imap_session_buff_printf(self, "\r\n* BYE error fetching body\r\n");
 			return -1;
@@ -1303,6 +1521,7 @@ static int _fetch_get_items(ImapSession *self, uint64_t *uid)
 		
 		if (result == 1) {
 			reportflags = TRUE;
+			msginfo = MailboxState_getWritableMsginfo(self->mailbox->mbstate, *uid);
 			result = db_set_msgflag(self->msg_idnr, setSeenSet, NULL, IMAPFA_ADD, 0, msginfo);
 			if (result == -1) {
 				dbmail_imap_session_buff_clear(self);
@@ -1319,15 +1538,12 @@ static int _fetch_get_items(ImapSession *self, uint64_t *uid)
 
 	if (reportflags) {
 		char *t = NULL;
-		GList *sublist = NULL;
 		if (self->use_uid)
 			t = g_strdup_printf("UID %" PRIu64 " ", *uid);
 		
-		sublist = MailboxState_message_flags(self->mailbox->mbstate, msginfo);
-		s = dbmail_imap_plist_as_string(sublist);
-		g_list_destroy(sublist);
+		s = MailboxState_message_flags(self->mailbox->mbstate, msginfo);
 
-		dbmail_imap_session_buff_printf(self,"* %" PRIu64 " FETCH (%sFLAGS %s)\r\n", *id, t?t:"", s);
+		dbmail_imap_session_buff_printf(self,"* %" PRIu64 " FETCH (%sFLAGS %s)\r\n", msn, t?t:"", s);
 		if (t) g_free(t);
 		g_free(s);
 	}
@@ -1335,7 +1551,7 @@ static int _fetch_get_items(ImapSession *self, uint64_t *uid)
 	return 0;
 }
 
-static gboolean _do_fetch(uint64_t *uid, gpointer UNUSED value, ImapSession *self)
+static gboolean _do_fetch(uint64_t *uid, ImapSession *self)
 {
 	/* go fetch the items */
 	if (_fetch_get_items(self,uid) < 0) {
@@ -1351,11 +1567,17 @@ static gboolean _do_fetch(uint64_t *uid, gpointer UNUSED value, ImapSession *sel
 
 int dbmail_imap_session_fetch_get_items(ImapSession *self)
 {
+	uint64_t msn = 0;
+
 	if (! self->ids)
 		TRACE(TRACE_INFO, "[%p] self->ids is NULL", self);
 	else {
 		self->error = FALSE;
-		g_tree_foreach(self->ids, (GTraverseFunc) _do_fetch, self);
+		while (SeqSet_next(self->ids, &msn)) {
+			uint64_t uid = MailboxState_getUidForMsn(self->mailbox->mbstate, msn);
+			if (_do_fetch(&uid, self))
+				break;
+		}
 		dbmail_imap_session_buff_flush(self);
 		if (self->error) return -1;
 	}
@@ -1487,10 +1709,9 @@ static int dbmail_imap_session_prompt(ImapSession * self, char * prompt)
 
 static void notify_fetch(ImapSession *self, MailboxState_T N, uint64_t *uid)
 {
-	uint64_t *msn;
+	uint64_t msn;
 
-	GList *ol = NULL, *nl = NULL;
-	char *oldflags = NULL, *newflags = NULL;
+	char *newflags = NULL;
 	MessageInfo *old = NULL, *new = NULL;
 	MailboxState_T M = self->mailbox->mbstate;
 	gboolean flagschanged = false, modseqchanged = false;
@@ -1500,26 +1721,28 @@ static void notify_fetch(ImapSession *self, MailboxState_T N, uint64_t *uid)
 	if (! (MailboxState_getMsginfo(N) && *uid && (new = g_tree_lookup(MailboxState_getMsginfo(N), uid))))
 		return;
 
-	if (! (msn = g_tree_lookup(MailboxState_getIds(M), uid)))
+	if (! (msn = MailboxState_getMsnForUid(M, *uid)))
 		return;
 
 	MailboxState_merge_recent(N, M);
 
 	// FETCH
-	if ((old = g_tree_lookup(MailboxState_getMsginfo(M), uid)))
-		ol = MailboxState_message_flags(M, old);
-	oldflags = dbmail_imap_plist_as_string(ol);
-
-	nl = MailboxState_message_flags(N, new);
-	newflags = dbmail_imap_plist_as_string(nl);
-
-	g_list_free_full(g_steal_pointer (&ol), g_free);
-	g_list_free_full(g_steal_pointer (&nl), g_free);
+	old = g_tree_lookup(MailboxState_getMsginfo(M), uid);
 
 	if ((!old) || (old->seq < new->seq))
 		modseqchanged = true;
-	if (oldflags && (! MATCH(oldflags, newflags)))
-		flagschanged = true;
+
+	/* only render the flags when they are reported */
+	if (old) {
+		if (! MailboxState_message_flags_equal(M, old, N, new)) {
+			newflags = MailboxState_message_flags(N, new);
+			flagschanged = true;
+		}
+	} else {
+		newflags = MailboxState_message_flags(N, new);
+		if (! MATCH(newflags, "()"))
+			flagschanged = true;
+	}
 
 	if (modseqchanged || flagschanged) {
 		GList *plist = NULL;
@@ -1536,7 +1759,7 @@ static void notify_fetch(ImapSession *self, MailboxState_T N, uint64_t *uid)
 		}
 
 		if (flagschanged) {
-			TRACE(TRACE_DEBUG, "flags [%s] -> [%s]", oldflags, newflags);
+			TRACE(TRACE_DEBUG, "flags -> [%s]", newflags);
 			char *f = g_strdup_printf("FLAGS %s", newflags);
 			plist = g_list_append(plist, f);
 		}
@@ -1544,20 +1767,19 @@ static void notify_fetch(ImapSession *self, MailboxState_T N, uint64_t *uid)
 		response = dbmail_imap_plist_as_string(plist);
 
 		dbmail_imap_session_buff_printf(self, "* %" PRIu64 " FETCH %s\r\n", 
-				*msn, response);
+				msn, response);
 		g_free(response);
 		g_list_free_full(g_steal_pointer (&plist), g_free);
 	}
 
-	if (oldflags) g_free(oldflags);
 	g_free(newflags);
 }
 
 static gboolean notify_expunge(ImapSession *self, uint64_t *uid)
 {
-	uint64_t *msn = NULL, m = 0;
+	uint64_t m = 0;
 
-	if (! (msn = g_tree_lookup(MailboxState_getIds(self->mailbox->mbstate), uid))) {
+	if (! (m = MailboxState_getMsnForUid(self->mailbox->mbstate, *uid))) {
 		TRACE(TRACE_DEBUG,"[%p] can't find uid [%" PRIu64 "]", self, *uid);
 		return TRUE;
 	}
@@ -1568,7 +1790,6 @@ static gboolean notify_expunge(ImapSession *self, uint64_t *uid)
 		case IMAP_COMM_SEARCH:
 			break;
 		default:
-			m = *msn;
 			if (MailboxState_removeUid(self->mailbox->mbstate, *uid) == DM_SUCCESS)
 				dbmail_imap_session_buff_printf(self, "* %" PRIu64 " EXPUNGE\r\n", m);
 			else
@@ -1581,61 +1802,42 @@ static gboolean notify_expunge(ImapSession *self, uint64_t *uid)
 
 static void mailbox_notify_expunge(ImapSession *self, MailboxState_T N)
 {
-	uint64_t *uid, *msn;
+	uint64_t uid, msn;
 	MailboxState_T M;
-	GList *ids;
 	if (! N) return;
 
 	M = self->mailbox->mbstate;
 
-	ids  = g_tree_keys(MailboxState_getIds(M));
-	ids = g_list_reverse(ids);
-
-	// send expunge updates
+	// send expunge updates, highest msn first
 	
-	if (ids) {
-		uid = (uint64_t *)ids->data;
-		GTree * treeM=MailboxState_getIds(M);
-		if (treeM != NULL){
-		    msn = g_tree_lookup(treeM, uid);
-		    if (msn && (*msn > MailboxState_getExists(M))) {
-			    TRACE(TRACE_DEBUG,"exists new [%d] old: [%d]", MailboxState_getExists(N), MailboxState_getExists(M)); 
-			    dbmail_imap_session_buff_printf(self, "* %d EXISTS\r\n", MailboxState_getExists(M));
-		    }
-		}
-	}
-	while (ids) {
-		uid = (uint64_t *)ids->data;
-		MessageInfo *messageInfo=g_tree_lookup(MailboxState_getMsginfo(N), uid);
-		if (messageInfo!=NULL && !g_tree_lookup(MailboxState_getIds(N), uid)) {
-			/* mark message as expunged, it should be ok to be removed from list, see state_load_message */
-			messageInfo->expunged=1;
-			notify_expunge(self, uid);
+	msn = MailboxState_countIds(M);
+	if (msn > MailboxState_getExists(M)) {
+		TRACE(TRACE_DEBUG,"exists new [%d] old: [%d]", MailboxState_getExists(N), MailboxState_getExists(M)); 
+		dbmail_imap_session_buff_printf(self, "* %d EXISTS\r\n", MailboxState_getExists(M));
+	}
+	for (; msn > 0; msn--) {
+		uid = MailboxState_getUidForMsn(M, msn);
+		if (! MailboxState_getMsnForUid(N, uid)) {
+			MessageInfo *messageInfo = MailboxState_getWritableMsginfo(N, uid);
+			/* a new state may not carry the message at all */
+			if (messageInfo)
+				messageInfo->expunged=1;
+			notify_expunge(self, &uid);
 		}
-
-		if (! g_list_next(ids)) break;
-		ids = g_list_next(ids);
 	}
-	ids = g_list_first(ids);
-	g_list_free(ids);
 }
 
 static void mailbox_notify_fetch(ImapSession *self, MailboxState_T N)
 {
-	uint64_t *uid, *id;
-	GList *ids;
+	uint64_t uid, *id, msn;
+	MailboxState_T M = self->mailbox->mbstate;
 	if (! N) return;
 
 	// send fetch updates
-	ids = g_tree_keys(MailboxState_getIds(self->mailbox->mbstate));
-	ids = g_list_first(ids);
-	while (ids) {
-		uid = (uint64_t *)ids->data;
-		notify_fetch(self, N, uid);
-		if (! g_list_next(ids)) break;
-		ids = g_list_next(ids);
+	for (msn = 1; msn <= MailboxState_countIds(M); msn++) {
+		uid = MailboxState_getUidForMsn(M, msn);
+		notify_fetch(self, N, &uid);
 	}
-	g_list_free(g_list_first(ids));
 
 	// switch active mailbox view
 	self->mailbox->mbstate = N;
@@ -1666,7 +1868,7 @@ int dbmail_imap_session_mailbox_status(ImapSession * self, gboolean update)
 	if (self->state != CLIENTSTATE_SELECTED) return FALSE;
 
 	if (update) {
-		unsigned oldseq, newseq;
+		uint64_t oldseq, newseq;
 		uint64_t olduidnext;
 		char *oldflags, *newflags;
 
@@ -1676,32 +1878,14 @@ int dbmail_imap_session_mailbox_status(ImapSession * self, gboolean update)
 		oldexists = MailboxState_getExists(M);
 		olduidnext = MailboxState_getUidnext(M);
 
-                // check the mailbox sequence without a 
-		// full reload
-		N = MailboxState_new(self->pool, 0);
-		MailboxState_setId(N, self->mailbox->id);
-		newseq = MailboxState_getSeq(N);
-		MailboxState_free(&N);
-		N = NULL;
+		// check the mailbox sequence without loading anything
+		newseq = MailboxState_querySeq(self->mailbox->id);
  
-		TRACE(TRACE_DEBUG, "seq: [%u] -> [%u]", oldseq, newseq);
+		TRACE(TRACE_DEBUG, "seq: [%" PRIu64 "] -> [%" PRIu64 "]", oldseq, newseq);
 		if (oldseq != newseq) {
-			int mailbox_update_strategy = config_get_value_default_int("mailbox_update_strategy", "IMAP", 1); 
-			
-			if (mailbox_update_strategy == 1){
-			    TRACE(TRACE_DEBUG, "Strategy reload: 1 (full reload)");
-			    /* do a full reload: re-read flags and counters */
-			    N = MailboxState_new(self->pool, self->mailbox->id);
-			}else{
-			    if (mailbox_update_strategy == 2){    
-					TRACE(TRACE_DEBUG, "Strategy reload: 2 (differential reload)");
-					/* do a diff reload, experimental */
-					N = MailboxState_update(self->pool, M);
-				}else{
-					TRACE(TRACE_DEBUG, "Strategy reload: default (full reload)");
-					/* default strategy is full reload, case 1*/
-					N = MailboxState_new(self->pool, self->mailbox->id);
-			    }
+			if (! (N = MailboxState_refresh(self->pool, M))) {
+				g_free(oldflags);
+				return DM_EQUERY;
 			}
 			
 			unsigned newexists = MailboxState_getExists(N);
@@ -1777,22 +1961,18 @@ MailboxState_T dbmail_imap_session_mbxinfo_lookup(ImapSession *self, uint64_t ma
 		if (! M) {
 			id = mempool_pop(small_pool, sizeof(uint64_t));
 			*id = mailbox_id;
-			M = MailboxState_new(self->pool, mailbox_id);
+			M = MailboxState_view(self->pool, mailbox_id);
 			g_tree_replace(self->mbxinfo, id, M);
 		} else {
-			unsigned newseq = 0, oldseq = 0;
-			MailboxState_T N = NULL;
-			N = MailboxState_new(self->pool, 0);
-			MailboxState_setId(N, mailbox_id);
+			uint64_t newseq = 0, oldseq = 0;
 			oldseq = MailboxState_getSeq(M);
-			newseq = MailboxState_getSeq(N);
+			newseq = MailboxState_querySeq(mailbox_id);
 			oldexists = MailboxState_getExists(M);
-			MailboxState_free(&N);
 			if (oldseq < newseq) {
-				TRACE(TRACE_DEBUG,"oldseq/newseq [%d]/[%d]", oldseq, newseq);
+				TRACE(TRACE_DEBUG,"oldseq/newseq [%" PRIu64 "]/[%" PRIu64 "]", oldseq, newseq);
 				id = mempool_pop(small_pool, sizeof(uint64_t));
 				*id = mailbox_id;
-				M = MailboxState_new(self->pool, mailbox_id);
+				M = MailboxState_view(self->pool, mailbox_id);
 				newexists = MailboxState_getExists(M);
 				MailboxState_setExists(M, max(oldexists, newexists));
 				g_tree_replace(self->mbxinfo, id, M);
@@ -1853,7 +2033,10 @@ static gboolean _do_expunge(uint64_t *id, ImapSession *self)
 		return FALSE;
 	}
 
-	if (! msginfo->flags[IMAP_FLAG_DELETED]) return FALSE;
+	if (! MailboxState_message_hasFlag(msginfo, IMAP_FLAG_DELETED)) return FALSE;
+
+	if (! db_expunge_log(self->c, *id))
+		return TRUE;
 
 	if (db_exec(self->c, "UPDATE %smessages SET status=%d WHERE message_idnr=%" PRIu64 " ", DBPFX, MESSAGE_STATUS_DELETE, *id) == DM_EQUERY)
 		return TRUE;
@@ -1863,42 +2046,42 @@ static gboolean _do_expunge(uint64_t *id, ImapSession *self)
 
 int dbmail_imap_session_mailbox_expunge(ImapSession *self, const char *set, uint64_t *modseq)
 {
-	uint64_t mailbox_size;
+	uint64_t mailbox_size, msn = 0;
 	int i;
-	GList *ids;
-	GTree *uids = NULL;
+	SeqSet_T msns;
 	MailboxState_T M = self->mailbox->mbstate;
 
-	if (! (i = g_tree_nnodes(MailboxState_getIds(M))))
+	if (! (i = MailboxState_countIds(M)))
 		return DM_SUCCESS;
 
 	if (db_get_mailbox_size(self->mailbox->id, 1, &mailbox_size) == DM_EQUERY)
 		return DM_EQUERY;
 
 	if (set) {
-		uids = dbmail_mailbox_get_set(self->mailbox, set, self->use_uid);
-		ids = g_tree_keys(uids);
+		msns = dbmail_mailbox_get_seqset(self->mailbox, set, self->use_uid);
 	} else {
-		ids = g_tree_keys(MailboxState_getIds(M));
+		msns = SeqSet_new();
+		SeqSet_add(msns, 1, i);
 	}
 
-	ids = g_list_reverse(ids);
-
-	if (ids) {
+	if (msns && ! SeqSet_isEmpty(msns)) {
 		self->c = db_con_get();
 		db_begin_transaction(self->c);
-		g_list_foreach(ids, (GFunc) _do_expunge, self);
+		/* walk backwards: expunging a message shifts the msns after it */
+		while (SeqSet_prev(msns, &msn)) {
+			uint64_t uid = MailboxState_getUidForMsn(M, msn);
+			_do_expunge(&uid, self);
+		}
 		db_commit_transaction(self->c);
 		db_con_close(self->c);
 		self->c = NULL;
-		g_list_free(g_list_first(ids));
 	}
 
-	if (uids)
-		g_tree_destroy(uids);
+	if (msns)
+		SeqSet_free(&msns);
 
 	*modseq = 0;
-	if (i > g_tree_nnodes(MailboxState_getIds(M))) {
+	if (i > (int)MailboxState_countIds(M)) {
 		*modseq = db_mailbox_seq_update(self->mailbox->id, 0);
 		if (! dm_quota_user_dec(self->userid, mailbox_size))
 			return DM_EQUERY;
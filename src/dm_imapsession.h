@@ -34,13 +34,13 @@ typedef struct {
 	uint64_t args_idx;
 
 	int loop;              // IDLE loop counter
+	uint64_t idle_id;      // IDLE mailbox registered for change notification
 
 	fetch_items *fi;       // FETCH
 	qresync_args qresync; // SELECT ... (QRESYNC ...)
 	search_order order;    // SORT/SEARCH
 
 	DbmailMailbox *mailbox; // currently selected mailbox
-	uint64_t lo;            // lower boundary for message ids
 	uint64_t hi;            // upper boundary for message ids
 	uint64_t ceiling;       // upper boundary during prefetching
 
@@ -48,12 +48,14 @@ typedef struct {
 
 	uint64_t userid;		/* userID of client in dbase */
 
-	GTree *ids;
+	SeqSet_T ids;		// msns of the current command
 	GList *new_ids; // store new uids after a COPY command
 	GTree *physids;		// cache physmessage_ids for uids 
 	GTree *envelopes;
+	GTree *structures;	// cached BODYSTRUCTURE and BODY
+	GTree *prefetched;	// messages read ahead by FETCH
 	GTree *mbxinfo; 	// cache MailboxState_T 
-	GList *ids_list;
+	SeqSet_T modified;	// STORE UNCHANGEDSINCE failures
 
 	struct cmd_t *cmd; // command structure (wip)
 	gboolean error; // command result
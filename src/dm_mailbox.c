@@ -99,7 +99,7 @@ gboolean dbmail_mailbox_get_uid(DbmailMailbox *self) {
 }
 
 int dbmail_mailbox_open(DbmailMailbox *self) {
-	if ((self->mbstate = MailboxState_new(self->pool, self->id)) == NULL)
+	if ((self->mbstate = MailboxState_view(self->pool, self->id)) == NULL)
 		return DM_EQUERY;
 	return DM_SUCCESS;
 }
@@ -262,139 +262,68 @@ int dbmail_mailbox_dump(DbmailMailbox *self, FILE *file) {
 	return count;
 }
 
-static gboolean _tree_foreach(gpointer key UNUSED, gpointer value, GString * data) {
-	gboolean res = FALSE;
-	uint64_t *id;
-	GList *sublist = g_list_first((GList *) value);
-	GString *t = g_string_new("");
-	int m = g_list_length(sublist);
+/* the SORT and THREAD keys of the mailbox, read up to the messages in
+ * the current state, with the references if threading. The cache is
+ * shared with the other sessions on the mailbox if the state is;
+ * otherwise *owned is set and the caller frees it. */
+static SortCache_T _sortcache(DbmailMailbox *self, gboolean threading, gboolean *owned) {
+	SortCache_T K;
 
-	sublist = g_list_first(sublist);
-	while (sublist) {
-		id = sublist->data;
-		g_string_append_printf(t, "(%" PRIu64 ")", *id);
+	if (!self->mbstate)
+		dbmail_mailbox_open(self);
 
-		if (!g_list_next(sublist))
-			break;
-		sublist = g_list_next(sublist);
+	*owned = FALSE;
+	if (!(K = MailboxState_getSortCache(self->mbstate))) {
+		K = SortCache_new(self->id);
+		*owned = TRUE;
 	}
-	if (m > 1)
-		g_string_append_printf(data, "(%s)", t->str);
-	else
-		g_string_append_printf(data, "%s", t->str);
 
-	g_string_free(t, TRUE);
+	if (threading)
+		SortCache_threading(K);
 
-	return res;
+	if (SortCache_update(K, MailboxState_getExists(self->mbstate)) != DM_SUCCESS) {
+		if (*owned)
+			SortCache_free(&K);
+		return NULL;
+	}
+
+	return K;
 }
 
 char * dbmail_mailbox_orderedsubject(DbmailMailbox *self) {
-	GList *sublist = NULL;
-	volatile uint64_t i = 0, idnr = 0;
-	char *subj;
-	char *res = NULL;
-	uint64_t *id, *msn;
-	GTree *tree;
-	GString *threads;
-	PreparedStatement_T stmt;
-	Connection_T c;
-	ResultSet_T r;
-	volatile int t = FALSE;
+	SortCache_T K;
+	gboolean owned;
+	char *res;
 
-	tree = g_tree_new_full((GCompareDataFunc) dm_strcmpdata, NULL, (GDestroyNotify) g_free, NULL);
-
-	t = FALSE;
-	c = db_con_get();
-	TRY
-	/* thread-roots (ordered) */
-	stmt = db_stmt_prepare(c,
-		"SELECT min(m.message_idnr),v.sortfield "
-		"FROM %smessages m "
-		"LEFT JOIN %sheader h USING (physmessage_id) "
-		"LEFT JOIN %sheadername n ON h.headername_id = n.id "
-		"LEFT JOIN %sheadervalue v ON h.headervalue_id = v.id "
-		"WHERE m.mailbox_idnr=? "
-		"AND n.headername = 'subject' AND m.status < %d "
-		"GROUP BY v.sortfield",
-		DBPFX, DBPFX, DBPFX, DBPFX,
-		MESSAGE_STATUS_DELETE);
-	db_stmt_set_u64(stmt, 1, self->id);
-	r = db_stmt_query(stmt);
-
-	i = 0;
-	while (db_result_next(r)) {
-		i++;
-		idnr = db_result_get_u64(r, 0);
-		if (!g_tree_lookup(self->found, (gconstpointer) & idnr))
-			continue;
-		subj = (char *) db_result_get(r, 1);
-		g_tree_insert(tree, g_strdup(subj), NULL);
-	}
-	CATCH(SQLException)
-	LOG_SQLERROR;
-	t = DM_EQUERY;
-	END_TRY;
+	if (!self->found)
+		return NULL;
 
-	if ((t == DM_EQUERY) || (!i)) {
-		g_tree_destroy(tree);
-		db_con_close(c);
-		return res;
-	}
+	if (!(K = _sortcache(self, FALSE, &owned)))
+		return NULL;
 
-	db_con_clear(c);
+	res = SortCache_orderedsubject(K, self->found, dbmail_mailbox_get_uid(self));
 
-	TRY
-	/* full threads (unordered) */
-	stmt = db_stmt_prepare(c,
-		"SELECT m.message_idnr,v.sortfield "
-		"FROM %smessages m "
-		"LEFT JOIN %sheader h USING (physmessage_id) "
-		"LEFT JOIN %sheadername n ON h.headername_id = n.id "
-		"LEFT JOIN %sheadervalue v ON h.headervalue_id = v.id "
-		"WHERE m.mailbox_idnr = ? "
-		"AND n.headername = 'subject' AND m.status < %d "
-		"ORDER BY v.sortfield, v.datefield",
-		DBPFX, DBPFX, DBPFX, DBPFX,
-		MESSAGE_STATUS_DELETE);
-	db_stmt_set_u64(stmt, 1, self->id);
-	r = db_stmt_query(stmt);
+	if (owned)
+		SortCache_free(&K);
 
-	i = 0;
-	while (db_result_next(r)) {
-		i++;
-		idnr = db_result_get_u64(r, 0);
-		if (!(msn = g_tree_lookup(self->found, (gconstpointer) & idnr)))
-			continue;
-		subj = (char *) db_result_get(r, 1);
+	return res;
+}
 
-		id = g_new0(uint64_t, 1);
-		if (dbmail_mailbox_get_uid(self))
-			*id = idnr;
-		else
-			*id = *msn;
+char * dbmail_mailbox_references(DbmailMailbox *self) {
+	SortCache_T K;
+	gboolean owned;
+	char *res;
 
-		sublist = g_tree_lookup(tree, (gconstpointer) subj);
-		sublist = g_list_append(sublist, id);
-		g_tree_insert(tree, g_strdup(subj), sublist);
-	}
-	CATCH(SQLException)
-	LOG_SQLERROR;
-	t = DM_EQUERY;
-	FINALLY
-	db_con_close(c);
-	END_TRY;
+	if (!self->found)
+		return NULL;
 
-	if ((t == DM_EQUERY) || (!i)) {
-		g_tree_destroy(tree);
-		return res;
-	}
+	if (!(K = _sortcache(self, TRUE, &owned)))
+		return NULL;
 
-	threads = g_string_new("");
-	g_tree_foreach(tree, (GTraverseFunc) _tree_foreach, threads);
-	res = threads->str;
+	res = SortCache_references(K, self->found, dbmail_mailbox_get_uid(self));
 
-	g_string_free(threads, FALSE);
-	g_tree_destroy(tree);
+	if (owned)
+		SortCache_free(&K);
 
 	return res;
 }
@@ -410,7 +339,6 @@ char * dbmail_mailbox_imap_modseq_as_string(DbmailMailbox *self, gboolean uid) {
 	gchar *s = NULL;
 	GList *l = NULL;
 	GTree *msginfo;
-	GTree *msn;
 	uint64_t maxseq = 0;
 
 	if ((self->found == NULL) || g_tree_nnodes(self->found) <= 0) {
@@ -425,19 +353,18 @@ char * dbmail_mailbox_imap_modseq_as_string(DbmailMailbox *self, gboolean uid) {
 	}
 
 	msginfo = MailboxState_getMsginfo(self->mbstate);
-	msn = MailboxState_getMsn(self->mbstate);
 
 	while (l->data) {
 		uint64_t *key = (uint64_t *) l->data;
 		if (self->modseq) {
-			uint64_t *id;
+			uint64_t id;
 			if (uid || dbmail_mailbox_get_uid(self)) {
-				id = key;
+				id = *key;
 			} else {
-				id = g_tree_lookup(msn, key);
+				id = MailboxState_getUidForMsn(self->mbstate, *key);
 			}
 
-			MessageInfo *info = g_tree_lookup(msginfo, id);
+			MessageInfo *info = g_tree_lookup(msginfo, &id);
 			maxseq = max(maxseq, info->seq);
 		}
 		if (!g_list_next(l))
@@ -474,7 +401,6 @@ char * dbmail_mailbox_ids_as_string(
 	gchar *s = NULL;
 	GList *l = NULL;
 	GTree *msginfo;
-	GTree *msn;
 	uint64_t maxseq = 0;
 
 	if ((self->found == NULL) || g_tree_nnodes(self->found) <= 0) {
@@ -490,19 +416,18 @@ char * dbmail_mailbox_ids_as_string(
 	}
 
 	msginfo = MailboxState_getMsginfo(self->mbstate);
-	msn = MailboxState_getMsn(self->mbstate);
 
 	while (l->data) {
 		uint64_t *key = (uint64_t *) l->data;
 		if (self->modseq) {
-			uint64_t *id;
+			uint64_t id;
 			if (uid || dbmail_mailbox_get_uid(self)) {
-				id = key;
+				id = *key;
 			} else {
-				id = g_tree_lookup(msn, key);
+				id = MailboxState_getUidForMsn(self->mbstate, *key);
 			}
 
-			MessageInfo *info = g_tree_lookup(msginfo, id);
+			MessageInfo *info = g_tree_lookup(msginfo, &id);
 			maxseq = max(maxseq, info->seq);
 		}
 		g_string_append_printf(t, "%" PRIu64 "", *key);
@@ -573,20 +498,14 @@ static int append_search(DbmailMailbox *self, search_key *value, gboolean descen
 	return 0;
 }
 
-#define BUFSIZE 255
-
-static void _append_join(char *join, char *table) {
-	char tmp[BUFSIZE + 1];
-	memset(tmp, 0, sizeof (tmp));
-	g_snprintf(tmp, BUFSIZE, "LEFT JOIN %s%s ON m.physmessage_id=%s%s.physmessage_id ", DBPFX, table, DBPFX, table);
-	g_strlcat(join, tmp, MAX_SEARCH_LEN);
-}
-
-static void _append_sort(char *order, char *field, gboolean reverse) {
-	char tmp[BUFSIZE + 1];
-	memset(tmp, 0, sizeof (tmp));
-	g_snprintf(tmp, BUFSIZE, "%s%s,", field, reverse ? " DESC" : "");
-	g_strlcat(order, tmp, MAX_SEARCH_LEN);
+static void _append_sort(search_key *value, int key, gboolean reverse) {
+	int i;
+	for (i = 0; i < SORT_KEYS_MAX - 1; i++) {
+		if (! value->sort[i]) {
+			value->sort[i] = key | (reverse ? SORT_REVERSE : 0);
+			return;
+		}
+	}
 }
 
 static int _handle_sort_args(DbmailMailbox *self, String_T *search_keys, search_key *value, uint64_t *idx) {
@@ -606,30 +525,25 @@ static int _handle_sort_args(DbmailMailbox *self, String_T *search_keys, search_
 	}
 
 	if (MATCH(key, "arrival")) {
-		_append_sort(value->order, "internal_date", reverse);
+		_append_sort(value, SORT_ARRIVAL, reverse);
 		(*idx)++;
 	} else if (MATCH(key, "size")) {
-		_append_sort(value->order, "messagesize", reverse);
+		_append_sort(value, SORT_SIZE, reverse);
 		(*idx)++;
 	} else if (MATCH(key, "from")) {
-		_append_join(value->table, "fromfield");
-		_append_sort(value->order, "fromfield", reverse);
+		_append_sort(value, SORT_FROM, reverse);
 		(*idx)++;
 	} else if (MATCH(key, "subject")) {
-		_append_join(value->table, "subjectfield");
-		_append_sort(value->order, "sortfield", reverse);
+		_append_sort(value, SORT_SUBJECT, reverse);
 		(*idx)++;
 	} else if (MATCH(key, "cc")) {
-		_append_join(value->table, "ccfield");
-		_append_sort(value->order, "ccfield", reverse);
+		_append_sort(value, SORT_CC, reverse);
 		(*idx)++;
 	} else if (MATCH(key, "to")) {
-		_append_join(value->table, "tofield");
-		_append_sort(value->order, "tofield", reverse);
+		_append_sort(value, SORT_TO, reverse);
 		(*idx)++;
 	} else if (MATCH(key, "date")) {
-		_append_join(value->table, "datefield");
-		_append_sort(value->order, "sortfield", reverse);
+		_append_sort(value, SORT_DATE, reverse);
 		(*idx)++;
 	} else if (MATCH(key, "("))
 		(*idx)++;
@@ -1167,13 +1081,9 @@ int dbmail_mailbox_build_imap_search(DbmailMailbox *self, String_T *search_keys,
 
 static gboolean _do_sort(GNode *node, DbmailMailbox *self) {
 	TRACE(TRACE_DEBUG, "Call: _do_sort");
-	GString *q;
-	uint64_t tid, *id;
-	Connection_T c;
-	ResultSet_T r;
-	volatile int t = FALSE;
 	search_key *s = (search_key *) node->data;
-	GTree *z;
+	SortCache_T K;
+	gboolean owned;
 
 	TRACE(TRACE_DEBUG, "type [%d]", s->type);
 
@@ -1181,52 +1091,113 @@ static gboolean _do_sort(GNode *node, DbmailMailbox *self) {
 
 	if (s->searched) return FALSE;
 
-	q = g_string_new("");
-	g_string_printf(q, "SELECT m.message_idnr FROM %smessages m "
-		"LEFT JOIN %sphysmessage p ON m.physmessage_id=p.id "
-		"%s"
-		"WHERE m.mailbox_idnr = %" PRIu64 " AND m.status < %d "
-		"ORDER BY %smessage_idnr", DBPFX, DBPFX, s->table,
-		dbmail_mailbox_get_id(self), MESSAGE_STATUS_DELETE, s->order);
-
 	if (self->sorted) {
 		g_list_destroy(self->sorted);
 		self->sorted = NULL;
 	}
 
-	z = g_tree_new((GCompareFunc) ucmp);
-
-	c = db_con_get();
-	TRY
-	r = db_query(c, q->str);
-	while (db_result_next(r)) {
-		tid = db_result_get_u64(r, 0);
-		if (g_tree_lookup(self->found, &tid) && (!g_tree_lookup(z, &tid))) {
-			id = g_new0(uint64_t, 1);
-			*id = tid;
-			g_tree_insert(z, id, id);
-			self->sorted = g_list_prepend(self->sorted, id);
-		}
-	}
-	CATCH(SQLException)
-	LOG_SQLERROR;
-	t = DM_EQUERY;
-	FINALLY
-	db_con_close(c);
-	g_tree_destroy(z);
-	END_TRY;
+	if (!self->found) return FALSE;
 
-	if (t == DM_EQUERY) return TRUE;
+	if (!(K = _sortcache(self, FALSE, &owned)))
+		return TRUE;
 
-	self->sorted = g_list_reverse(self->sorted);
+	self->sorted = SortCache_sort(K, self->found, s->sort);
 
-	g_string_free(q, TRUE);
+	if (owned)
+		SortCache_free(&K);
 
 	s->searched = TRUE;
 
 	return FALSE;
 }
 
+/* SEARCH BODY and TEXT through the trigram index, if there is one */
+static gboolean mailbox_search_fts(DbmailMailbox *self, Connection_T c, search_key *s, const char *inset, gboolean body)
+{
+	GList *found = NULL, *l;
+	GTree *ids;
+
+	if (! dm_fts_enabled())
+		return FALSE;
+	if (dm_fts_search(c, dbmail_mailbox_get_id(self), s->search, body, inset, &found) != DM_SUCCESS)
+		return FALSE;
+
+	ids = MailboxState_getIds(self->mbstate);
+	l = g_list_first(found);
+	while (l) {
+		uint64_t *k, *v, *w;
+		uint64_t id = *(uint64_t *)l->data;
+		l = g_list_next(l);
+		if (! (w = g_tree_lookup(ids, &id)))
+			continue;
+		k = mempool_pop(small_pool, sizeof (uint64_t));
+		v = mempool_pop(small_pool, sizeof (uint64_t));
+		*k = id;
+		*v = *w;
+		g_tree_insert(s->found, k, v);
+	}
+	TRACE(TRACE_DEBUG, "IST RESULT FTS found %s, found  %d", s->search, g_tree_nnodes(s->found));
+	g_list_destroy(found);
+
+	return TRUE;
+}
+
+/*
+ * compressed mimeparts never match the LIKE in SQL: decode the ones of
+ * the messages not found yet and look for the string in their text
+ */
+static void mailbox_search_compressed(DbmailMailbox *self, Connection_T c, search_key *s, const char *inset, gboolean body)
+{
+	ResultSet_T r; PreparedStatement_T st;
+	GTree *ids;
+	int found = 0;
+
+	if (! strlen(s->search))
+		return;
+
+	db_con_clear(c);
+	st = db_stmt_prepare(c, "SELECT m.message_idnr, k.codec, k.data FROM %smimeparts k "
+		"JOIN %spartlists l ON k.id=l.part_id "
+		"JOIN %smessages m ON m.physmessage_id=l.physmessage_id "
+		"WHERE m.mailbox_idnr = ? AND m.status < ? AND k.codec <> %d "
+		"%s %s "
+		"ORDER BY m.message_idnr",
+		DBPFX, DBPFX, DBPFX, MIMEPART_CODEC_NONE,
+		inset ? inset : "",
+		body ? "AND (l.part_key > 1 OR l.is_header=0)" : "");
+	db_stmt_set_u64(st, 1, dbmail_mailbox_get_id(self));
+	db_stmt_set_int(st, 2, MESSAGE_STATUS_DELETE);
+	r = db_stmt_query(st);
+
+	ids = MailboxState_getIds(self->mbstate);
+	while (db_result_next(r)) {
+		uint64_t *k, *v, *w;
+		uint64_t id = db_result_get_u64(r, 0);
+		const char *data;
+		char *text;
+		int len = 0;
+		size_t outlen = 0;
+
+		if (g_tree_lookup(s->found, &id) || (! (w = g_tree_lookup(ids, &id))))
+			continue;
+
+		data = db_result_get_blob(r, 2, &len);
+		if (! (text = dm_mimepart_decode(db_result_get_int(r, 1), data, len, &outlen)))
+			continue;
+
+		if (g_strstr_len(text, outlen, s->search)) {
+			k = mempool_pop(small_pool, sizeof (uint64_t));
+			v = mempool_pop(small_pool, sizeof (uint64_t));
+			*k = id;
+			*v = *w;
+			g_tree_insert(s->found, k, v);
+			found++;
+		}
+		g_free(text);
+	}
+	TRACE(TRACE_DEBUG, "IST RESULT compressed parts found %s, found  %d", s->search, found);
+}
+
 static GTree * mailbox_search(DbmailMailbox *self, search_key *s) {
 	TRACE(TRACE_DEBUG, "Call: mailbox_search");
 	uint64_t *k, *v, *w;
@@ -1344,6 +1315,10 @@ static GTree * mailbox_search(DbmailMailbox *self, search_key *s) {
 
 		case IST_DATA_TEXT:
 			searchPerformed = 1;
+			if (mailbox_search_fts(self, c, s, (const char *)inset, FALSE)) {
+				sql = 0;
+				break;
+			}
 			TRACE(TRACE_DEBUG, "IST_DATA_TEXT sql");
 			p_string_printf(q, "SELECT DISTINCT m.message_idnr "
 				"FROM %smimeparts k "
@@ -1354,7 +1329,7 @@ static GTree * mailbox_search(DbmailMailbox *self, search_key *s) {
 				"LEFT JOIN %smessages m ON m.physmessage_id=p.id "
 				"WHERE m.mailbox_idnr = ? AND m.status < ? "
 				"%s "
-				"AND (v.headervalue %s ? OR k.data %s ?) "
+				"AND (v.headervalue %s ? OR (k.codec = 0 AND k.data %s ?)) "
 				"ORDER BY m.message_idnr",
 				DBPFX, DBPFX, DBPFX, DBPFX, DBPFX, DBPFX,
 				inset ? inset : "",
@@ -1375,6 +1350,10 @@ static GTree * mailbox_search(DbmailMailbox *self, search_key *s) {
 
 		case IST_DATA_BODY:
 			searchPerformed = 1;
+			if (mailbox_search_fts(self, c, s, (const char *)inset, TRUE)) {
+				sql = 0;
+				break;
+			}
 			TRACE(TRACE_DEBUG, "IST_DATA_BODY sql %s", t->str);
 			g_string_printf(t, db_get_sql(SQL_ENCODE_ESCAPE), "p.data");
 			p_string_printf(q, "SELECT DISTINCT m.message_idnr FROM %smimeparts p "
@@ -1385,6 +1364,7 @@ static GTree * mailbox_search(DbmailMailbox *self, search_key *s) {
 				"WHERE b.mailbox_idnr=? AND m.status < ? "
 				"%s "
 				"AND (l.part_key > 1 OR l.is_header=0) "
+				"AND p.codec = 0 "
 				"AND %s %s ? "
 				"ORDER BY m.message_idnr",
 				DBPFX, DBPFX, DBPFX, DBPFX, DBPFX,
@@ -1612,43 +1592,43 @@ static GTree * mailbox_search(DbmailMailbox *self, search_key *s) {
 
 				int found = 0;
 				switch (IST_MBS_COND) {
-					case 1: found = (int) (msginfo->flags[IMAP_FLAG_ANSWERED] == 1);
+					case 1: found = MailboxState_message_hasFlag(msginfo, IMAP_FLAG_ANSWERED);
 						break;
-					case 2: found = (int) (msginfo->flags[IMAP_FLAG_DELETED] == 1);
+					case 2: found = MailboxState_message_hasFlag(msginfo, IMAP_FLAG_DELETED);
 						break;
-					case 3: found = (int) (msginfo->flags[IMAP_FLAG_FLAGGED] == 1);
+					case 3: found = MailboxState_message_hasFlag(msginfo, IMAP_FLAG_FLAGGED);
 						break;
-					case 4: found = (int) (msginfo->flags[IMAP_FLAG_RECENT] == 1);
+					case 4: found = MailboxState_message_hasFlag(msginfo, IMAP_FLAG_RECENT);
 						break;
-					case 5: found = (int) (msginfo->flags[IMAP_FLAG_SEEN] == 1);
+					case 5: found = MailboxState_message_hasFlag(msginfo, IMAP_FLAG_SEEN);
 						break;
-					case 6: found = (int) (msginfo->flags[IMAP_FLAG_DRAFT] == 1);
+					case 6: found = MailboxState_message_hasFlag(msginfo, IMAP_FLAG_DRAFT);
 						break;
-					case 7: found = (int) (msginfo->flags[IMAP_FLAG_SEEN] == 0 && msginfo->flags[IMAP_FLAG_RECENT] == 1);
+					case 7: found = ! MailboxState_message_hasFlag(msginfo, IMAP_FLAG_SEEN) && MailboxState_message_hasFlag(msginfo, IMAP_FLAG_RECENT);
 						break;
-					case 8: found = (int) (msginfo->flags[IMAP_FLAG_RECENT] == 0);
+					case 8: found = ! MailboxState_message_hasFlag(msginfo, IMAP_FLAG_RECENT);
 						break;
-					case 9: found = (int) (msginfo->flags[IMAP_FLAG_ANSWERED] == 0);
+					case 9: found = ! MailboxState_message_hasFlag(msginfo, IMAP_FLAG_ANSWERED);
 						break;
-					case 10: found = (int) (msginfo->flags[IMAP_FLAG_DELETED] == 0);
+					case 10: found = ! MailboxState_message_hasFlag(msginfo, IMAP_FLAG_DELETED);
 						break;
-					case 11: found = (int) (msginfo->flags[IMAP_FLAG_FLAGGED] == 0);
+					case 11: found = ! MailboxState_message_hasFlag(msginfo, IMAP_FLAG_FLAGGED);
 						break;
-					case 12: found = (int) (msginfo->flags[IMAP_FLAG_SEEN] == 0);
+					case 12: found = ! MailboxState_message_hasFlag(msginfo, IMAP_FLAG_SEEN);
 						break;
-					case 13: found = (int) (msginfo->flags[IMAP_FLAG_DRAFT] == 0);
+					case 13: found = ! MailboxState_message_hasFlag(msginfo, IMAP_FLAG_DRAFT);
 						break;
-					case 14: found = (int) (strcmp(msginfo->internaldate, cond) > 0);
+					case 14: found = strcmp(msginfo->internaldate, cond) > 0;
 						break;
-					case 15: found = (int) (strcmp(msginfo->internaldate, cond) == 0);
+					case 15: found = strcmp(msginfo->internaldate, cond) == 0;
 						break;
-					case 16: found = (int) (strcmp(msginfo->internaldate, cond) < 0);
+					case 16: found = strcmp(msginfo->internaldate, cond) < 0;
 						break;
 						//IST_SIZE_LARGER
-					case 17: found = (int) (msginfo->rfcsize > s->size);
+					case 17: found = msginfo->rfcsize > s->size;
 						break;
 						//IST_SIZE_SMALLER
-					case 18: found = (int) (msginfo->rfcsize < s->size);
+					case 18: found = msginfo->rfcsize < s->size;
 						break;
 
 				}
@@ -1711,6 +1691,9 @@ static GTree * mailbox_search(DbmailMailbox *self, search_key *s) {
 			foundItems++;
 		}
 		TRACE(TRACE_DEBUG, "IST RESULT SQL found %s, found  %d", s->search, foundItems);
+
+		if (s->type == IST_DATA_TEXT || s->type == IST_DATA_BODY)
+			mailbox_search_compressed(self, c, s, (const char *)inset, s->type == IST_DATA_BODY);
 	}
 	if (s->type == IST_UNKEYWORD) {
 		GTree *old = NULL;
@@ -1781,51 +1764,31 @@ static int checkset(const char *s) {
 	return 1;
 }
 
-struct filter_modseq_helper {
+/* drop the messages not changed since self->modseq (CHANGEDSINCE) */
+static SeqSet_T find_modseq(DbmailMailbox *self, SeqSet_T in) {
+	SeqSet_T out;
 	GTree *msginfo;
-	uint64_t modseq;
-	GList *remove;
-};
-
-static int filter_modseq(gpointer key, gpointer UNUSED value, gpointer data) {
-	struct filter_modseq_helper *d = (struct filter_modseq_helper *) data;
-	uint64_t *id;
-
-	id = (uint64_t *) key;
-	MessageInfo *info = g_tree_lookup(d->msginfo, id);
-	if (!info)
-		return TRUE;
+	uint64_t msn = 0;
 
-	if (info->seq <= d->modseq)
-		d->remove = g_list_prepend(d->remove, key);
-	return FALSE;
-}
-
-GTree * find_modseq(DbmailMailbox *self, GTree *in) {
 	if (!self->modseq)
 		return in;
-	GList *remove;
-	struct filter_modseq_helper data;
-	data.msginfo = MailboxState_getMsginfo(self->mbstate);
-	data.modseq = self->modseq;
-	data.remove = NULL;
-
-	g_tree_foreach(in, (GTraverseFunc) filter_modseq, &data);
-	remove = data.remove;
-	while (remove) {
-		uint64_t *key = (uint64_t *) remove->data;
-		g_tree_remove(in, key);
-		if (!g_list_next(remove))
-			break;
-		remove = g_list_next(remove);
+
+	out = SeqSet_new();
+	msginfo = MailboxState_getMsginfo(self->mbstate);
+	while (SeqSet_next(in, &msn)) {
+		uint64_t uid = MailboxState_getUidForMsn(self->mbstate, msn);
+		MessageInfo *info = g_tree_lookup(msginfo, &uid);
+		if (info && info->seq > self->modseq)
+			SeqSet_add(out, msn, msn);
 	}
+	SeqSet_free(&in);
 
-	return in;
+	return out;
 }
 
-GTree * dbmail_mailbox_get_set(DbmailMailbox *self, const char *set, gboolean uid) {
-	GTree *uids;
-	GTree *b;
+/* the messages in an IMAP sequence set, as msns */
+SeqSet_T dbmail_mailbox_get_seqset(DbmailMailbox *self, const char *set, gboolean uid) {
+	SeqSet_T b;
 
 	TRACE(TRACE_DEBUG, "[%s] uid [%d]", set, uid);
 
@@ -1834,18 +1797,34 @@ GTree * dbmail_mailbox_get_set(DbmailMailbox *self, const char *set, gboolean ui
 
 	assert(self && self->mbstate && set);
 
-	uids = MailboxState_getIds(self->mbstate);
-	if ((!uid) && (g_tree_nnodes(uids) == 0))
+	if ((!uid) && (MailboxState_countIds(self->mbstate) == 0))
 		return NULL;
 
 	if (!checkset(set)) // invalid chars
 		return NULL;
 
+	if (! (b = MailboxState_get_seqset(self->mbstate, set, uid)))
+		return NULL;
 
-	b = MailboxState_get_set(self->mbstate, set, uid);
 	return find_modseq(self, b);
 }
 
+/* uid -> msn tree of a set, for the search tree */
+static GTree * _seqset_found(DbmailMailbox *self, SeqSet_T S) {
+	GTree *found;
+	uint64_t msn = 0;
+
+	found = g_tree_new_full((GCompareDataFunc) ucmpdata, NULL, (GDestroyNotify) g_free, (GDestroyNotify) g_free);
+	while (SeqSet_next(S, &msn)) {
+		uint64_t *k = g_new0(uint64_t, 1);
+		uint64_t *v = g_new0(uint64_t, 1);
+		*k = MailboxState_getUidForMsn(self->mbstate, msn);
+		*v = msn;
+		g_tree_insert(found, k, v);
+	}
+	return found;
+}
+
 static gboolean _found_tree_copy(uint64_t *key, uint64_t *val, GTree *tree) {
 	uint64_t *a, *b;
 	a = g_new0(uint64_t, 1);
@@ -1863,16 +1842,19 @@ static gboolean _shallow_tree_copy(uint64_t *key, uint64_t *val, GTree *tree) {
 
 static gboolean _prescan_search(GNode *node, DbmailMailbox *self) {
 	search_key *s = (search_key *) node->data;
+	SeqSet_T set;
+	GTree *found;
+	uint64_t msn = 0;
 
 	if (s->searched) return FALSE;
 
 	switch (s->type) {
 		case IST_SET:
-			if (!(s->found = dbmail_mailbox_get_set(self, (const char *) s->search, 0)))
+			if (!(set = dbmail_mailbox_get_seqset(self, (const char *) s->search, 0)))
 				return TRUE;
 			break;
 		case IST_UIDSET:
-			if (!(s->found = dbmail_mailbox_get_set(self, (const char *) s->search, 1)))
+			if (!(set = dbmail_mailbox_get_seqset(self, (const char *) s->search, 1)))
 				return TRUE;
 			break;
 		default:
@@ -1881,20 +1863,29 @@ static gboolean _prescan_search(GNode *node, DbmailMailbox *self) {
 	}
 	s->searched = TRUE;
 
-	g_tree_merge(self->found, s->found, IST_SUBSEARCH_AND);
+	/* top-level sets narrow down the candidates directly */
+	found = g_tree_new_full((GCompareDataFunc) ucmpdata, NULL, NULL, NULL);
+	while (SeqSet_next(set, &msn)) {
+		uint64_t uid = MailboxState_getUidForMsn(self->mbstate, msn);
+		gpointer key, value;
+		if (g_tree_lookup_extended(self->found, &uid, &key, &value))
+			g_tree_insert(found, key, value);
+	}
+	g_tree_destroy(self->found);
+	self->found = found;
 	s->merged = TRUE;
 
-	TRACE(TRACE_DEBUG, "[%p] depth [%d] type [%d] rows [%d]\n",
-		s, g_node_depth(node), s->type, s->found ? g_tree_nnodes(s->found) : 0);
+	TRACE(TRACE_DEBUG, "[%p] depth [%d] type [%d] rows [%" PRIu64 "]\n",
+		s, g_node_depth(node), s->type, SeqSet_count(set));
 
-	g_tree_destroy(s->found);
-	s->found = NULL;
+	SeqSet_free(&set);
 
 	return FALSE;
 }
 
 static gboolean _do_search(GNode *node, DbmailMailbox *self) {
 	search_key *s = (search_key *) node->data;
+	SeqSet_T set;
 
 	if (s->searched) return FALSE;
 
@@ -1904,12 +1895,11 @@ static gboolean _do_search(GNode *node, DbmailMailbox *self) {
 			break;
 
 		case IST_SET:
-			if (!(s->found = dbmail_mailbox_get_set(self, (const char *) s->search, 0)))
-				return TRUE;
-			break;
 		case IST_UIDSET:
-			if (!(s->found = dbmail_mailbox_get_set(self, (const char *) s->search, 1)))
+			if (!(set = dbmail_mailbox_get_seqset(self, (const char *) s->search, s->type == IST_UIDSET)))
 				return TRUE;
+			s->found = _seqset_found(self, set);
+			SeqSet_free(&set);
 			break;
 
 		case IST_KEYWORD:
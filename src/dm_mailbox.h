@@ -76,9 +76,10 @@ char * dbmail_mailbox_imap_modseq_as_string(DbmailMailbox *self, gboolean uid);
 char * dbmail_mailbox_ids_as_string(DbmailMailbox *self, gboolean uid, const char *sep);
 char * dbmail_mailbox_sorted_as_string(DbmailMailbox *self);
 char * dbmail_mailbox_orderedsubject(DbmailMailbox *self);
+char * dbmail_mailbox_references(DbmailMailbox *self);
 
 int dbmail_mailbox_build_imap_search(DbmailMailbox *self, String_T *search_keys, uint64_t *idx, search_order order);
 
-GTree * dbmail_mailbox_get_set(DbmailMailbox *self, const char *set, gboolean uid);
+SeqSet_T dbmail_mailbox_get_seqset(DbmailMailbox *self, const char *set, gboolean uid);
 
 #endif
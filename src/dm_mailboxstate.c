@@ -39,25 +39,310 @@ extern const char *imap_flag_desc_escaped[];
    
 static void db_getmailbox_seq(T M, Connection_T c);
 static void db_getmailbox_permission(T M, Connection_T c);
-static void state_load_metadata(T M, Connection_T c);
+static void state_load_metadata(T M, Connection_T c, gboolean coldLoad);
 static void MailboxState_setMsginfo(T M, GTree *msginfo);
 /* */
 
-static void MailboxState_uid_msn_new(T M)
+/* drop the GTree views; they point into the index arrays */
+static void MailboxState_views_free(T M)
 {
 	if (M->msn) g_tree_destroy(M->msn);
-	M->msn = g_tree_new_full((GCompareDataFunc)ucmpdata,NULL,NULL,NULL);
+	M->msn = NULL;
 
 	if (M->ids) g_tree_destroy(M->ids);
-	M->ids = g_tree_new_full((GCompareDataFunc)ucmpdata,NULL,NULL,(GDestroyNotify)g_free);
+	M->ids = NULL;
 }
 
-static void MessageInfo_free(MessageInfo *m)
+static void MailboxState_uid_msn_free(T M)
 {
-	g_list_free_full(g_steal_pointer (&m->keywords), g_free);
+	MailboxState_views_free(M);
+
+	if (M->msns) g_array_free(M->msns, TRUE);
+	M->msns = NULL;
+
+	if (M->uids) g_array_free(M->uids, TRUE);
+	M->uids = NULL;
+}
+
+static void MailboxState_uid_msn_new(T M, unsigned size)
+{
+	MailboxState_uid_msn_free(M);
+	M->uids = g_array_sized_new(FALSE, FALSE, sizeof(uint64_t), size);
+}
+
+/* index of the first message with a uid not below 'uid' */
+static unsigned uid_lower_bound(T M, uint64_t uid)
+{
+	const uint64_t *uids = (const uint64_t *)M->uids->data;
+	unsigned lo = 0, hi = M->uids->len;
+
+	while (lo < hi) {
+		unsigned mid = lo + (hi - lo) / 2;
+		if (uids[mid] < uid)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/*
+ * make 'uid' visible or hidden in the msn index without rebuilding
+ * it: the msns of the messages after it shift by one, which only
+ * invalidates the views.
+ */
+static void uid_msn_set(T M, uint64_t uid, gboolean visible)
+{
+	unsigned i = uid_lower_bound(M, uid);
+	gboolean present = (i < M->uids->len && g_array_index(M->uids, uint64_t, i) == uid);
+
+	if (visible == present)
+		return;
+
+	MailboxState_views_free(M);
+
+	if (visible) {
+		g_array_insert_val(M->uids, i, uid);
+		if (M->msns) {
+			uint64_t msn = M->msns->len + 1;
+			g_array_append_val(M->msns, msn);
+		}
+	} else {
+		g_array_remove_index(M->uids, i);
+		if (M->msns)
+			g_array_set_size(M->msns, M->msns->len - 1);
+	}
+}
+
+/*
+ * Keywords are interned per mailbox: the table maps each keyword
+ * (case-insensitive) to a small index, and messages carry a sorted
+ * array of indices instead of their own copies of the strings. The
+ * table is shared by every state derived from the same mailbox, also
+ * across sessions, so indices can be compared directly across updates.
+ * Names are never removed, so a name stays valid while the table lives.
+ */
+struct keyword_table {
+	int refcount;
+	GMutex lock;
+	GPtrArray *names;	// keyword by index
+	GHashTable *index;	// keyword -> index + 1
+};
+
+static guint keyword_hash(gconstpointer key)
+{
+	const char *p = (const char *)key;
+	guint h = 5381;
+	for (; *p; p++)
+		h = (h << 5) + h + (guchar)g_ascii_tolower(*p);
+	return h;
+}
+
+static gboolean keyword_equal(gconstpointer a, gconstpointer b)
+{
+	return g_ascii_strcasecmp((const char *)a, (const char *)b) == 0;
+}
+
+static struct keyword_table * keyword_table_new(void)
+{
+	struct keyword_table *t = g_new0(struct keyword_table, 1);
+	t->refcount = 1;
+	g_mutex_init(&t->lock);
+	t->names = g_ptr_array_new_with_free_func(g_free);
+	t->index = g_hash_table_new(keyword_hash, keyword_equal);
+	return t;
+}
+
+static struct keyword_table * keyword_table_ref(struct keyword_table *t)
+{
+	if (t) g_atomic_int_inc(&t->refcount);
+	return t;
+}
+
+static void keyword_table_unref(struct keyword_table *t)
+{
+	if (! t || ! g_atomic_int_dec_and_test(&t->refcount))
+		return;
+	g_mutex_clear(&t->lock);
+	g_hash_table_destroy(t->index);
+	g_ptr_array_free(t->names, TRUE);
+	g_free(t);
+}
+
+/* index of 'keyword' in the table, or -1 if it was never seen */
+static int keyword_lookup(T M, const char *keyword)
+{
+	gpointer i;
+	if (! M->keywords)
+		return -1;
+	g_mutex_lock(&M->keywords->lock);
+	i = g_hash_table_lookup(M->keywords->index, keyword);
+	g_mutex_unlock(&M->keywords->lock);
+	return GPOINTER_TO_INT(i) - 1;
+}
+
+static const char * keyword_name(T M, guint i)
+{
+	const char *name;
+	g_mutex_lock(&M->keywords->lock);
+	name = (const char *)g_ptr_array_index(M->keywords->names, i);
+	g_mutex_unlock(&M->keywords->lock);
+	return name;
+}
+
+static guint keyword_intern(T M, const char *keyword)
+{
+	gpointer p;
+	char *name;
+	int i;
+
+	if (! M->keywords)
+		M->keywords = keyword_table_new();
+
+	g_mutex_lock(&M->keywords->lock);
+	if ((p = g_hash_table_lookup(M->keywords->index, keyword))) {
+		i = GPOINTER_TO_INT(p) - 1;
+	} else {
+		name = g_strdup(keyword);
+		i = M->keywords->names->len;
+		g_ptr_array_add(M->keywords->names, name);
+		g_hash_table_insert(M->keywords->index, name, GINT_TO_POINTER(i + 1));
+	}
+	g_mutex_unlock(&M->keywords->lock);
+	return (guint)i;
+}
+
+static gboolean keyword_announced(T M, guint i)
+{
+	return M->announced && i < M->announced->len && M->announced->data[i];
+}
+
+static void keyword_announce(T M, guint i)
+{
+	guint len;
+	if (! M->announced)
+		M->announced = g_byte_array_new();
+	if ((len = M->announced->len) <= i) {
+		g_byte_array_set_size(M->announced, i + 1);
+		memset(M->announced->data + len, 0, i + 1 - len);
+	}
+	M->announced->data[i] = 1;
+}
+
+/* position of index 'i' in the message's keywords, or where it belongs */
+static gboolean message_keyword_find(MessageInfo *m, guint i, guint *pos)
+{
+	guint lo = 0, hi = m->keywords ? m->keywords->len : 0;
+
+	while (lo < hi) {
+		guint mid = lo + (hi - lo) / 2;
+		guint v = g_array_index(m->keywords, guint, mid);
+		if (v == i) {
+			*pos = mid;
+			return TRUE;
+		}
+		if (v < i)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	*pos = lo;
+	return FALSE;
+}
+
+static void message_keyword_add(MessageInfo *m, guint i)
+{
+	guint pos;
+	if (message_keyword_find(m, i, &pos))
+		return;
+	if (! m->keywords)
+		m->keywords = g_array_new(FALSE, FALSE, sizeof(guint));
+	g_array_insert_val(m->keywords, pos, i);
+}
+
+static void message_keyword_remove(MessageInfo *m, guint i)
+{
+	guint pos;
+	if (message_keyword_find(m, i, &pos))
+		g_array_remove_index(m->keywords, pos);
+}
+
+/*
+ * A MessageInfo is shared by all states cloned from the one that loaded
+ * it, also across sessions: every msginfo tree holding it counts as a
+ * reference. A state about to change a shared one first puts a private
+ * copy in its own tree (see MailboxState_getWritableMsginfo).
+ */
+MessageInfo * MessageInfo_new(void)
+{
+	MessageInfo *m = g_new0(MessageInfo, 1);
+	m->refcount = 1;
+	return m;
+}
+
+static MessageInfo * MessageInfo_ref(MessageInfo *m)
+{
+	g_atomic_int_inc(&m->refcount);
+	return m;
+}
+
+static void MessageInfo_unref(MessageInfo *m)
+{
+	if (! g_atomic_int_dec_and_test(&m->refcount))
+		return;
+	if (m->keywords)
+		g_array_free(m->keywords, TRUE);
 	g_free(m);
 }
 
+/* the message in the tree, replaced by a private copy if it is shared */
+static MessageInfo * msginfo_writable(GTree *msginfo, uint64_t uid)
+{
+	MessageInfo *info, *copy;
+
+	if (! (info = g_tree_lookup(msginfo, &uid)))
+		return NULL;
+	if (g_atomic_int_get(&info->refcount) == 1)
+		return info;
+
+	copy = g_new(MessageInfo, 1);
+	*copy = *info;
+	copy->refcount = 1;
+	if (info->keywords) {
+		copy->keywords = g_array_sized_new(FALSE, FALSE, sizeof(guint), info->keywords->len);
+		g_array_append_vals(copy->keywords, info->keywords->data, info->keywords->len);
+	}
+	g_tree_replace(msginfo, &copy->uid, copy);
+
+	return copy;
+}
+
+
+/*
+ * drop the messages that left the mailbox since the state was loaded,
+ * as recorded in the expunge log by the paths that remove them
+ */
+static void state_load_expunges(T M, Connection_T c)
+{
+	PreparedStatement_T stmt;
+	ResultSet_T r;
+	uint64_t id;
+	unsigned nrows = 0;
+
+	stmt = db_stmt_prepare(c,
+			"SELECT message_idnr FROM %sexpunges WHERE mailbox_idnr = ? AND seq >= ?",
+			DBPFX);
+	db_stmt_set_u64(stmt, 1, M->id);
+	db_stmt_set_u64(stmt, 2, M->state_seq);
+	r = db_stmt_query(stmt);
+	while (db_result_next(r)) {
+		id = db_result_get_u64(r, 0);
+		if (g_tree_remove(M->msginfo, &id))
+			nrows++;
+	}
+	db_con_clear(c);
+	TRACE(TRACE_DEBUG, "SEQ Expunged [ %u ]", nrows);
+}
 
 static T state_load_messages(T M, Connection_T c, gboolean coldLoad)
 {
@@ -67,7 +352,7 @@ static T state_load_messages(T M, Connection_T c, gboolean coldLoad)
 	uint64_t tempId;
 	MessageInfo *result = NULL;
 	GTree *msginfo;
-	uint64_t *uid, id = 0;
+	uint64_t id = 0;
 	ResultSet_T r;
 	PreparedStatement_T stmt;
 	Field_T frag;
@@ -88,8 +373,10 @@ static T state_load_messages(T M, Connection_T c, gboolean coldLoad)
 	    //msginfo=MailboxState_getMsginfo(M);
 	    
 	    TRACE(TRACE_DEBUG, "SEQ RENEW [ %" PRIu64 " %" PRIu64 " ]",state_seq , seq);
-	    //MailboxState_uid_msn_new(M);
-	    /* use seq to select only changed elements, event this which are deleted*/
+	    state_load_expunges(M, c);
+	    /* use seq to select only changed elements, even those which are
+	     * deleted; the margin covers changes committed while the last
+	     * load read the mailbox seq */
 	    snprintf(filterCondition,64-1,"/*SEQ ReNew*/ AND m.seq >= %" PRIu64 "-1 AND m.status <= %d ", state_seq, MESSAGE_STATUS_DELETE );    
 	}
 	
@@ -126,16 +413,14 @@ static T state_load_messages(T M, Connection_T c, gboolean coldLoad)
 		idsAdded=0;
 		if (coldLoad){
 		    /* new element*/
-		    result = g_new0(MessageInfo,1);
-			uid = g_new0(uint64_t,1); 
-			*uid = id;
+		    result = MessageInfo_new();
 		    idsAdded=1;
 		    result->expunge=0;
 		    result->expunged=0;
 			//TRACE(TRACE_DEBUG, "SEQ CREATED %ld",id);
 		}else{
 		    /* soft renew, so search */
-		    result = g_tree_lookup(msginfo, &id);     
+		    result = msginfo_writable(msginfo, id);
 		    if (result == NULL){
 				/* check deletion */
 				if (db_result_get_int(r, IMAP_NFLAGS + 4)>=MESSAGE_STATUS_DELETE){
@@ -143,20 +428,15 @@ static T state_load_messages(T M, Connection_T c, gboolean coldLoad)
 					continue;
 				}	
 				/* not found so create*/
-				result = g_new0(MessageInfo,1);
-				uid = g_new0(uint64_t,1); 
-				*uid = id;
+				result = MessageInfo_new();
 				idsAdded=1;
 				result->expunge=0;
 				result->expunged=0;
 		    }else{
-				/* initialize uid, result is not null */
-				uid = g_new0(uint64_t,1); 
-				*uid = id;
 				//TRACE(TRACE_DEBUG, "SEQ FOUND %ld",id);
-				/* free all keywords, it will be added later again */
-				g_list_destroy(result->keywords);
-				result->keywords = NULL;
+				/* drop all keywords, they will be added later again */
+				if (result->keywords)
+					g_array_set_size(result->keywords, 0);
 		    }
 		}
 
@@ -168,7 +448,7 @@ static T state_load_messages(T M, Connection_T c, gboolean coldLoad)
 
 		/* flags */
 		for (j = 0; j < IMAP_NFLAGS; j++)
-			result->flags[j] = db_result_get_bool(r,j);
+			MailboxState_message_setFlag(result, j, db_result_get_bool(r,j));
 
 		/* internal date */
 		query_result = db_result_get(r,IMAP_NFLAGS);
@@ -185,42 +465,36 @@ static T state_load_messages(T M, Connection_T c, gboolean coldLoad)
 		result->status = db_result_get_int(r, IMAP_NFLAGS + 4);
 		/* physmessage_id */
 		result->phys_id = db_result_get_int(r, IMAP_NFLAGS + 5);
-		if (result->flags[IMAP_FLAG_DELETED]==1 && result->status < MESSAGE_STATUS_DELETE){
-			TRACE(TRACE_DEBUG, "DESYNC Meessage marked as deleted but not deleted [ %" PRIu64 " ] consider using `mailbox_sync_deleted`", *uid);
+		if (! coldLoad && result->status >= MESSAGE_STATUS_DELETE) {
+			/* gone: the session reports it as the uid lost its msn */
+			g_tree_remove(msginfo, &id);
+			continue;
+		}
+		if (MailboxState_message_hasFlag(result, IMAP_FLAG_DELETED) && result->status < MESSAGE_STATUS_DELETE){
+			TRACE(TRACE_DEBUG, "DESYNC Meessage marked as deleted but not deleted [ %" PRIu64 " ] consider using `mailbox_sync_deleted`", id);
 			if (mailbox_sync_deleted==2  && mailbox_sync_batch_size>0){
 				db_set_message_status(id,MESSAGE_STATUS_DELETE);
 				result->status=MESSAGE_STATUS_DELETE;
 				mailbox_sync_batch_size--;
-				TRACE(TRACE_DEBUG, "DESYNC marked as deleted[ %" PRIu64 " ]", *uid);
+				TRACE(TRACE_DEBUG, "DESYNC marked as deleted[ %" PRIu64 " ]", id);
 			}
 		}
-		if (result->status >= MESSAGE_STATUS_DELETE || result->flags[IMAP_FLAG_DELETED]==1 || result->expunged==1 || result->expunge>=1){
+		if (result->status >= MESSAGE_STATUS_DELETE || MailboxState_message_hasFlag(result, IMAP_FLAG_DELETED) || result->expunged==1 || result->expunge>=1){
 			result->expunge ++;
 			if (result->expunged == 1){
 				//TRACE(TRACE_DEBUG, "SEQ Remove MSG EXPUNGED [ %" PRIu64 " ]", *uid);
 				/* result does not need to be freed, it is freed in tree remove */
-				g_tree_remove(msginfo, uid);
-				g_free(uid);
+				g_tree_remove(msginfo, &id);
 				continue;
 			}else{
 				//TRACE(TRACE_DEBUG, "SEQ Remove MSG EXPUNGING [ %" PRIu64 " expunge flag %d, was expunged %d]", *uid, result->expunge, result->expunged);
 			}
 		}
-		/* add Seen as flag when IMAP_FLAGS_SEEN=1 */
-		if (result->flags[IMAP_FLAG_SEEN]==1){
-			gchar *value = g_strdup("\\Seen");
-			result->keywords = g_list_append(result->keywords, value);
-			/* some strange clients like it this way */
-		}
 		/* cleaning up */
 		if (idsAdded==1){
 			//TRACE(TRACE_DEBUG, "SEQ ADDED %ld",id);
-		    /* it's new */
-			g_tree_insert(msginfo, uid, result);  
-		}else{
-		    /* no need, result was updated */
-			/* free uid, is it always allocated */
-			g_free(uid);
+		    /* it's new, keyed on its own uid */
+			g_tree_insert(msginfo, &result->uid, result);  
 		}
 	}
 	gettimeofday(&after, NULL); 
@@ -260,12 +534,14 @@ static T state_load_messages(T M, Connection_T c, gboolean coldLoad)
 			// TRACE(TRACE_INFO, "Keyword line [%d %s]", nrows, keyword);
 			/* use tempId a temporary store the id of the item in order to avoid unnecessary lookups */
 			if ( tempId!=id || tempId==0 ){
-				result = g_tree_lookup(msginfo, &id);
+				result = coldLoad ? g_tree_lookup(msginfo, &id) : msginfo_writable(msginfo, id);
 				tempId=id;
 			}
-		    if (result && keyword){
-				gchar *keyword2 = g_strdup(keyword);
-				result->keywords = g_list_append(result->keywords, keyword2);
+		    if (result && keyword) {
+				guint k = keyword_intern(M, keyword);
+				message_keyword_add(result, k);
+				if (! coldLoad)
+					keyword_announce(M, k);
 			}
 		}
 	}
@@ -288,7 +564,7 @@ gboolean _compare_data(gconstpointer a, gconstpointer b, gpointer UNUSED data)
 	return strcmp((const char *)a,(const char *)b);
 }
 
-T MailboxState_new(Mempool_T pool, uint64_t id)
+static T state_new(Mempool_T pool, uint64_t id, struct keyword_table *keywords)
 {
 	T M; Connection_T c;
 	volatile int t = DM_SUCCESS;
@@ -307,13 +583,13 @@ T MailboxState_new(Mempool_T pool, uint64_t id)
 
 	M->id = id;
 	M->recent_queue = g_tree_new((GCompareFunc)ucmp);
-	M->keywords     = NULL;
-	M->msginfo		= g_tree_new_full((GCompareDataFunc)ucmpdata, NULL,(GDestroyNotify)g_free,(GDestroyNotify)MessageInfo_free);
+	M->keywords     = keywords ? keyword_table_ref(keywords) : keyword_table_new();
+	M->msginfo		= g_tree_new_full((GCompareDataFunc)ucmpdata, NULL, NULL, (GDestroyNotify)MessageInfo_unref);
 	M->differential_iterations = 0;
 	c = db_con_get();
 	TRY
 		db_begin_transaction(c); // we need read-committed isolation
-		state_load_metadata(M, c);
+		state_load_metadata(M, c, true);
 		state_load_messages(M, c, true);
 		db_commit_transaction(c);
 	CATCH(SQLException)
@@ -332,10 +608,242 @@ T MailboxState_new(Mempool_T pool, uint64_t id)
 	return M;
 }
 
+T MailboxState_new(Mempool_T pool, uint64_t id)
+{
+	return state_new(pool, id, NULL);
+}
+
+/*
+ * Sessions that have the same mailbox selected share one state per
+ * process. The registry keeps the last state loaded for each mailbox,
+ * keyed on its id and valid for the mailbox seq it was loaded at. A
+ * session gets its own copy of that state to keep its msn mapping and
+ * recent and expunge bookkeeping apart; the messages themselves are
+ * shared until a session changes one. The database is only read again
+ * when the mailbox seq moves.
+ */
+struct state_share {
+	uint64_t id;
+	int views;		// session states using this entry
+	GMutex load;		// serializes loading the snapshot
+	T snapshot;		// state at the last seq seen, or NULL
+	SortCache_T sortcache;	// SORT and THREAD keys, created on first use
+};
+
+G_LOCK_DEFINE_STATIC(shares);
+static GHashTable *shares = NULL;
+
+static struct state_share * state_share_acquire(uint64_t id)
+{
+	struct state_share *share;
+
+	G_LOCK(shares);
+	if (! shares)
+		shares = g_hash_table_new((GHashFunc)g_int64_hash, (GEqualFunc)g_int64_equal);
+	if (! (share = g_hash_table_lookup(shares, &id))) {
+		share = g_new0(struct state_share, 1);
+		share->id = id;
+		g_mutex_init(&share->load);
+		g_hash_table_insert(shares, &share->id, share);
+	}
+	share->views++;
+	G_UNLOCK(shares);
+
+	return share;
+}
+
+static void state_share_release(struct state_share *share)
+{
+	T snapshot = NULL;
+
+	G_LOCK(shares);
+	if (--share->views > 0) {
+		G_UNLOCK(shares);
+		return;
+	}
+	g_hash_table_remove(shares, &share->id);
+	G_UNLOCK(shares);
+
+	TRACE(TRACE_DEBUG, "[%" PRIu64 "] drop shared state", share->id);
+	snapshot = share->snapshot;
+	if (snapshot)
+		MailboxState_free(&snapshot);
+	if (share->sortcache)
+		SortCache_free(&share->sortcache);
+	g_mutex_clear(&share->load);
+	g_free(share);
+}
+
+/* the current seq of a mailbox, without loading any state */
+uint64_t MailboxState_querySeq(uint64_t id)
+{
+	Connection_T c; ResultSet_T r; PreparedStatement_T stmt;
+	volatile uint64_t seq = 0;
+
+	c = db_con_get();
+	TRY
+		stmt = db_stmt_prepare(c, "SELECT seq FROM %smailboxes WHERE mailbox_idnr=?", DBPFX);
+		db_stmt_set_u64(stmt, 1, id);
+		r = db_stmt_query(stmt);
+		if (db_result_next(r))
+			seq = db_result_get_u64(r, 0);
+	CATCH(SQLException)
+		LOG_SQLERROR;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	return seq;
+}
+
+static gboolean _clone_msginfo(gpointer UNUSED key, MessageInfo *info, GTree *msginfo)
+{
+	if (info->status >= MESSAGE_STATUS_DELETE)
+		return FALSE;
+
+	g_tree_insert(msginfo, &info->uid, MessageInfo_ref(info));
+	return FALSE;
+}
+
+static gboolean _clone_recent(uint64_t *uid, gpointer UNUSED value, T M)
+{
+	uint64_t *copy = mempool_pop(M->pool, sizeof(uint64_t));
+	*copy = *uid;
+	g_tree_insert(M->recent_queue, copy, copy);
+	return FALSE;
+}
+
+static T state_clone(Mempool_T pool, T S)
+{
+	T M;
+	GTree *msginfo;
+	gboolean freepool = FALSE;
+
+	if (! pool) {
+		pool = mempool_open();
+		freepool = TRUE;
+	}
+
+	M = mempool_pop(pool, sizeof(*M));
+	M->pool = pool;
+	M->freepool = freepool;
+
+	M->id = S->id;
+	M->uidnext = S->uidnext;
+	M->owner_id = S->owner_id;
+	M->seq = S->seq;
+	M->state_seq = S->state_seq;
+	M->no_select = S->no_select;
+	M->no_children = S->no_children;
+	M->no_inferiors = S->no_inferiors;
+	M->recent = S->recent;
+	M->exists = S->exists;
+	M->unseen = S->unseen;
+	M->permission = S->permission;
+	M->is_subscribed = S->is_subscribed;
+	M->is_public = S->is_public;
+	M->is_users = S->is_users;
+	M->is_inbox = S->is_inbox;
+	if (S->name)
+		M->name = p_string_new(pool, p_string_str(S->name));
+
+	M->keywords = keyword_table_ref(S->keywords);
+	if (S->announced) {
+		M->announced = g_byte_array_sized_new(S->announced->len);
+		g_byte_array_append(M->announced, S->announced->data, S->announced->len);
+	}
+
+	M->recent_queue = g_tree_new((GCompareFunc)ucmp);
+	if (S->recent_queue)
+		g_tree_foreach(S->recent_queue, (GTraverseFunc)_clone_recent, M);
+
+	msginfo = g_tree_new_full((GCompareDataFunc)ucmpdata, NULL, NULL, (GDestroyNotify)MessageInfo_unref);
+	if (S->msginfo)
+		g_tree_foreach(S->msginfo, (GTraverseFunc)_clone_msginfo, msginfo);
+	MailboxState_setMsginfo(M, msginfo);
+
+	return M;
+}
+
+static int update_strategy(void)
+{
+	return config_get_value_default_int("mailbox_update_strategy", "IMAP", 2);
+}
+
 /**
- * Update only the mailbox. 
- * @param M
- * @return 
+ * Get a state for a session from the process-wide registry, loading
+ * the mailbox only if no other session has it loaded at its current
+ * seq. Falls back to MailboxState_new when sharing is disabled.
+ */
+T MailboxState_view(Mempool_T pool, uint64_t id)
+{
+	struct state_share *share;
+	uint64_t seq;
+	T M = NULL;
+
+	if (! id || ! config_get_value_default_int("mailbox_state_sharing", "IMAP", 1))
+		return MailboxState_new(pool, id);
+
+	share = state_share_acquire(id);
+	seq = MailboxState_querySeq(id);
+
+	g_mutex_lock(&share->load);
+	if (! (share->snapshot && seq && share->snapshot->seq == seq)) {
+		T S;
+		/* keep the keyword table so indices stay comparable */
+		if (share->snapshot && update_strategy() == 2)
+			S = MailboxState_update(NULL, share->snapshot);
+		else
+			S = state_new(NULL, id, share->snapshot ? share->snapshot->keywords : NULL);
+		if (S) {
+			TRACE(TRACE_DEBUG, "[%" PRIu64 "] load shared state at seq [%" PRIu64 "]", id, S->seq);
+			if (share->snapshot)
+				MailboxState_free(&share->snapshot);
+			share->snapshot = S;
+		}
+	}
+	if (share->snapshot)
+		M = state_clone(pool, share->snapshot);
+	g_mutex_unlock(&share->load);
+
+	if (! M) {
+		state_share_release(share);
+		return NULL;
+	}
+
+	M->share = share;
+	return M;
+}
+
+/**
+ * The sort cache shared by the sessions viewing this mailbox, or NULL
+ * if the state is not shared.
+ */
+SortCache_T MailboxState_getSortCache(T M)
+{
+	SortCache_T K;
+
+	if (! M->share)
+		return NULL;
+
+	g_mutex_lock(&M->share->load);
+	if (! M->share->sortcache)
+		M->share->sortcache = SortCache_new(M->id);
+	K = M->share->sortcache;
+	g_mutex_unlock(&M->share->load);
+
+	return K;
+}
+
+/**
+ * Differential update of a mailbox state: only messages changed since
+ * OldM was loaded are read, and messages removed since then are taken
+ * from the expunge log. OldM is left untouched, so the session can still
+ * compare its messages with the new ones. If the result does not add
+ * up to the mailbox count, a full reload is done instead.
+ * @param pool
+ * @param OldM
+ * @return the new state, or NULL on error
  */
 
 T MailboxState_update(Mempool_T pool, T OldM)
@@ -343,23 +851,23 @@ T MailboxState_update(Mempool_T pool, T OldM)
 	T M; Connection_T c;
 	volatile int t = DM_SUCCESS;
 	gboolean freepool = FALSE;
-	uint64_t id;
+	Mempool_T mpool = pool;
+	GTree *msginfo;
+	uint64_t id = OldM->id;
 	
 	/* differential mode, evaluate max iterations */
 	int mailbox_diffential_max_iterations = config_get_value_default_int("mailbox_update_strategy_2_max_iterations", "IMAP", 300); 
 	if (mailbox_diffential_max_iterations > 0 &&  (int)OldM->differential_iterations >= mailbox_diffential_max_iterations-1 ){
 		TRACE(TRACE_DEBUG, "Strategy differential mode override due to max iterations, see config [IMAP] mailbox_update_strategy_2_max_iterations");
-		return MailboxState_new(pool, OldM->id);
+		return state_new(pool, id, OldM->keywords);
 	} 
 
-	
-	if (! pool) {
-		pool = mempool_open();
+	if (! mpool) {
+		mpool = mempool_open();
 		freepool = TRUE;
 	}
-	id = OldM->id;
-	M = mempool_pop(pool, sizeof(*M));
-	M->pool = pool;
+	M = mempool_pop(mpool, sizeof(*M));
+	M->pool = mpool;
 	M->freepool = freepool;
 
 	if (! id) return M;
@@ -367,14 +875,14 @@ T MailboxState_update(Mempool_T pool, T OldM)
 	M->id = id;
 	M->recent_queue = g_tree_new((GCompareFunc)ucmp);
 
-	if (M->keywords) {
-		g_list_free_full(g_steal_pointer (&M->keywords), g_free);
-		M->keywords    = NULL;
-		//no need, those keywords will be populated at metadata
-		//@todo change this behaviour in state_load_metadata
-		//g_tree_copy_String(M->keywords,OldM->keywords);
+	/* the shared messages keep their keyword indices, so share the
+	 * table; keywords in use stay announced */
+	M->keywords = keyword_table_ref(OldM->keywords);
+	if (OldM->announced) {
+		M->announced = g_byte_array_sized_new(OldM->announced->len);
+		g_byte_array_append(M->announced, OldM->announced->data, OldM->announced->len);
 	}
-	M->msginfo     = g_tree_new_full((GCompareDataFunc)ucmpdata, NULL,(GDestroyNotify)g_free, (GDestroyNotify)MessageInfo_free);
+
 	// increase differential iterations in order to apply mailbox_update_strategy_2_max_iterations
 	M->differential_iterations = OldM->differential_iterations + 1;
 	
@@ -382,20 +890,16 @@ T MailboxState_update(Mempool_T pool, T OldM)
 	M->state_seq = OldM->state_seq;
 	
 	TRACE(TRACE_DEBUG, "Strategy SEQ UPDATE, iterations %d", M->differential_iterations);
-	//M->ids     = g_tree_new_full((GCompareDataFunc)_compare_data,NULL,g_free,NULL);
-	//M->msn     = g_tree_new_full((GCompareDataFunc)_compare_data,NULL,g_free,NULL);
 
-	g_tree_merge(M->msginfo, OldM->msginfo, IST_SUBSEARCH_OR);
+	msginfo = g_tree_new_full((GCompareDataFunc)ucmpdata, NULL, NULL, (GDestroyNotify)MessageInfo_unref);
+	if (OldM->msginfo)
+		g_tree_foreach(OldM->msginfo, (GTraverseFunc)_clone_msginfo, msginfo);
+	M->msginfo = msginfo;
 
-	//MailboxState_remap(M);
-	/* reset the sequence */ 
-	MailboxState_resetSeq(OldM);
-	//uint64_t seq = MailboxState_getSeq(OldM);
-			
 	c = db_con_get();
 	TRY 
 		db_begin_transaction(c); // we need read-committed isolation
-		state_load_metadata(M, c);
+		state_load_metadata(M, c, false);
 		state_load_messages(M, c, false); // do a soft refresh
 		db_commit_transaction(c);
 	CATCH(SQLException)
@@ -409,38 +913,83 @@ T MailboxState_update(Mempool_T pool, T OldM)
 	if (t == DM_EQUERY) {
 		TRACE(TRACE_ERR, "SEQ Error opening mailbox");
 		MailboxState_free(&M);
+		return NULL;
+	}
+
+	if (MailboxState_countIds(M) != M->exists) {
+		TRACE(TRACE_INFO, "[%" PRIu64 "] differential state has [%u] messages, mailbox has [%u]; reloading",
+				id, MailboxState_countIds(M), M->exists);
+		MailboxState_free(&M);
+		return state_new(pool, id, OldM->keywords);
 	}
 
 	return M;
 }
 
-void MailboxState_remap(T M)
+/**
+ * Bring a session state up to date after its mailbox changed, through
+ * the shared registry or by the configured update strategy.
+ * @param pool
+ * @param M the current state of the session
+ * @return the new state, or NULL on error
+ */
+T MailboxState_refresh(Mempool_T pool, T M)
 {
-	GList *ids = NULL;
-	uint64_t *uid, *msn = NULL, rows = 1;
-	MessageInfo *msginfo;
+	if (config_get_value_default_int("mailbox_state_sharing", "IMAP", 1))
+		return MailboxState_view(pool, M->id);
 
-	MailboxState_uid_msn_new(M);
+	if (update_strategy() == 2) {
+		TRACE(TRACE_DEBUG, "Strategy reload: 2 (differential reload)");
+		return MailboxState_update(pool, M);
+	}
 
-	ids = g_tree_keys(M->msginfo);
-	ids = g_list_first(ids);
-	while (ids) {
-		uid = ids->data;
+	TRACE(TRACE_DEBUG, "Strategy reload: 1 (full reload)");
+	return MailboxState_new(pool, M->id);
+}
 
-		msginfo = g_tree_lookup(M->msginfo, uid);
-		if (msginfo->status < MESSAGE_STATUS_DELETE) {
-			msn = g_new0(uint64_t,1);
-			*msn = msginfo->msn = rows++;
+static gboolean _remap(uint64_t UNUSED *uid, MessageInfo *msginfo, T M)
+{
+	if (msginfo->status < MESSAGE_STATUS_DELETE)
+		g_array_append_val(M->uids, msginfo->uid);
+	return FALSE;
+}
 
-			g_tree_insert(M->ids, uid, msn);
-			g_tree_insert(M->msn, msn, uid);
-		}
+/*
+ * rebuild the msn index: the uids of all visible messages in ascending
+ * order, so the msn of a message is its position in the array. The
+ * GTree views returned by MailboxState_getIds and MailboxState_getMsn
+ * are only built when asked for.
+ */
+void MailboxState_remap(T M)
+{
+	MailboxState_uid_msn_new(M, M->msginfo ? g_tree_nnodes(M->msginfo) : 0);
+	if (M->msginfo)
+		g_tree_foreach(M->msginfo, (GTraverseFunc)_remap, M);
+}
 
-		if (! g_list_next(ids)) break;
-		ids = g_list_next(ids);
-	}
+uint64_t MailboxState_getMsnForUid(T M, uint64_t uid)
+{
+	unsigned i;
+
+	if (! M->uids)
+		return 0;
+
+	i = uid_lower_bound(M, uid);
+	if (i < M->uids->len && g_array_index(M->uids, uint64_t, i) == uid)
+		return (uint64_t)i + 1;
+	return 0;
+}
+
+uint64_t MailboxState_getUidForMsn(T M, uint64_t msn)
+{
+	if ((! M->uids) || (! msn) || (msn > M->uids->len))
+		return 0;
+	return g_array_index(M->uids, uint64_t, msn - 1);
+}
 
-	g_list_free(g_list_first(ids));
+unsigned MailboxState_countIds(T M)
+{
+	return M->uids ? M->uids->len : 0;
 }
 	
 GTree * MailboxState_getMsginfo(T M)
@@ -462,20 +1011,34 @@ static void MailboxState_setMsginfo(T M, GTree *msginfo)
 
 void MailboxState_addMsginfo(T M, uint64_t uid, MessageInfo *msginfo)
 {
-	uint64_t *id = g_new0(uint64_t,1);
-	*id = uid;
-	g_tree_insert(M->msginfo, id, msginfo);
-	if (msginfo->flags[IMAP_FLAG_RECENT] == 1) {
+	msginfo->uid = uid;
+	g_tree_replace(M->msginfo, &msginfo->uid, msginfo);
+	if (MailboxState_message_hasFlag(msginfo, IMAP_FLAG_RECENT)) {
 		M->seq--; // force resync
 		M->recent++;
 	}
 	MailboxState_build_recent(M);
-	MailboxState_remap(M);
+	if (M->uids)
+		uid_msn_set(M, uid, msginfo->status < MESSAGE_STATUS_DELETE);
+	else
+		MailboxState_remap(M);
+}
+
+/**
+ * The message to change in this state: a message shared with other
+ * states is replaced by a private copy first.
+ * @return the message, or NULL if the state does not have it
+ */
+MessageInfo * MailboxState_getWritableMsginfo(T M, uint64_t uid)
+{
+	if (! M->msginfo)
+		return NULL;
+	return msginfo_writable(M->msginfo, uid);
 }
 
 int MailboxState_removeUid(T M, uint64_t uid)
 {
-	MessageInfo *msginfo = g_tree_lookup(M->msginfo, &uid);
+	MessageInfo *msginfo = MailboxState_getWritableMsginfo(M, uid);
 	if (! msginfo) {
 		TRACE(TRACE_WARNING,"trying to remove unknown UID [%" PRIu64 "]", uid);
 		return DM_EGENERAL;
@@ -483,18 +1046,55 @@ int MailboxState_removeUid(T M, uint64_t uid)
 	msginfo->status = MESSAGE_STATUS_DELETE;
 	M->exists--;
 
-	MailboxState_remap(M);
+	if (M->uids)
+		uid_msn_set(M, uid, FALSE);
+	else
+		MailboxState_remap(M);
 
 	return DM_SUCCESS;
 }
 
+/* the msn values the views point at; MessageInfo may be shared by
+ * states that number the message differently */
+static uint64_t * msn_values(T M)
+{
+	uint64_t msn;
+
+	if (! M->msns) {
+		M->msns = g_array_sized_new(FALSE, FALSE, sizeof(uint64_t), M->uids->len);
+		for (msn = 1; msn <= M->uids->len; msn++)
+			g_array_append_val(M->msns, msn);
+	}
+	return (uint64_t *)M->msns->data;
+}
+
+/* uid -> msn view on the index */
 GTree * MailboxState_getIds(T M)
 {
+	uint64_t *msns;
+	unsigned i;
+
+	if ((! M->ids) && M->uids) {
+		msns = msn_values(M);
+		M->ids = g_tree_new_full((GCompareDataFunc)ucmpdata,NULL,NULL,NULL);
+		for (i = 0; i < M->uids->len; i++)
+			g_tree_insert(M->ids, &g_array_index(M->uids, uint64_t, i), &msns[i]);
+	}
 	return M->ids;
 }
 
+/* msn -> uid view on the index */
 GTree * MailboxState_getMsn(T M)
 {
+	uint64_t *msns;
+	unsigned i;
+
+	if ((! M->msn) && M->uids) {
+		msns = msn_values(M);
+		M->msn = g_tree_new_full((GCompareDataFunc)ucmpdata,NULL,NULL,NULL);
+		for (i = 0; i < M->uids->len; i++)
+			g_tree_insert(M->msn, &msns[i], &g_array_index(M->uids, uint64_t, i));
+	}
 	return M->msn;
 }
 
@@ -551,7 +1151,7 @@ uint64_t MailboxState_resyncSeq(T M)
 
 unsigned MailboxState_getExists(T M)
 {
-	int real = g_tree_nnodes(M->ids);
+	int real = (int)MailboxState_countIds(M);
 	if (real > (int)M->exists) {
 		TRACE(TRACE_DEBUG, "[%" PRIu64 "] exists [%u] -> [%d]",
 				M->id, M->exists, real);
@@ -639,14 +1239,61 @@ gboolean MailboxState_isPublic(T M)
 
 gboolean MailboxState_hasKeyword(T M, const char *keyword)
 {
-	if (g_list_find_custom(M->keywords, (gpointer)keyword, (GCompareFunc) dm_strcmpdata))
-		return TRUE;
-	return FALSE;
+	int i = keyword_lookup(M, keyword);
+	return (i >= 0 && keyword_announced(M, (guint)i));
 }
 void MailboxState_addKeyword(T M, const char *keyword)
 {
-	char *kw = g_strdup(keyword);
-	M->keywords = g_list_append(M->keywords, kw);
+	keyword_announce(M, keyword_intern(M, keyword));
+}
+
+gboolean MailboxState_message_hasKeyword(T M, MessageInfo *msginfo, const char *keyword)
+{
+	guint pos;
+	int i = keyword_lookup(M, keyword);
+	return (i >= 0 && message_keyword_find(msginfo, (guint)i, &pos));
+}
+
+/*
+ * the keywords of a STORE that actually change the stored set of
+ * the message: the absent ones for ADD, the present ones for REMOVE
+ * and all of them for REPLACE. The list returned shares its data
+ * with 'keywords'.
+ */
+GList * MailboxState_message_keywordChanges(T M, MessageInfo *msginfo, GList *keywords, int action)
+{
+	GList *changes = NULL;
+
+	keywords = g_list_first(keywords);
+	while (keywords) {
+		gboolean present = MailboxState_message_hasKeyword(M, msginfo, (const char *)keywords->data);
+		if ((action == IMAPFA_REPLACE) ||
+				(action == IMAPFA_ADD && ! present) ||
+				(action == IMAPFA_REMOVE && present))
+			changes = g_list_prepend(changes, keywords->data);
+		keywords = g_list_next(keywords);
+	}
+	return g_list_reverse(changes);
+}
+
+/* msginfo as returned by MailboxState_getWritableMsginfo */
+void MailboxState_message_setKeywords(T M, MessageInfo *msginfo, GList *keywords, int action)
+{
+	if (action == IMAPFA_REPLACE && msginfo->keywords)
+		g_array_set_size(msginfo->keywords, 0);
+
+	keywords = g_list_first(keywords);
+	while (keywords) {
+		const char *keyword = (const char *)keywords->data;
+		int i;
+		if (action == IMAPFA_REMOVE) {
+			if ((i = keyword_lookup(M, keyword)) >= 0)
+				message_keyword_remove(msginfo, (guint)i);
+		} else {
+			message_keyword_add(msginfo, keyword_intern(M, keyword));
+		}
+		keywords = g_list_next(keywords);
+	}
 }
 
 void MailboxState_setNoSelect(T M, gboolean no_select)
@@ -678,184 +1325,127 @@ unsigned MailboxState_getUnseen(T M)
 	return M->unseen;
 }
 
-struct filter_range_helper {  
-        gboolean uid;   
-        uint64_t min;      
-        uint64_t max;      
-        GTree *a;       
-};                      
-                        
-static int filter_range(gpointer key, gpointer value, gpointer data)
-{                       
-	uint64_t *k, *v;   
-	struct filter_range_helper *d = (struct filter_range_helper *)data;
-
-	if (*(uint64_t *)key < d->min) return FALSE; // skip
-	if (*(uint64_t *)key > d->max) return TRUE; // done
-
-	k = mempool_pop(small_pool, sizeof(uint64_t));
-	v = mempool_pop(small_pool, sizeof(uint64_t));
-
-	*k = *(uint64_t *)key;
-	*v = *(uint64_t *)value;
-
-	if (d->uid)     
-		g_tree_insert(d->a, k, v);
-	else            
-		g_tree_insert(d->a, v, k);
-
-	return FALSE;   
-}                       
-
-static void find_range(GTree *c, uint64_t l, uint64_t r, GTree *a, gboolean uid)
-{                       
-	struct filter_range_helper data;
-
-	data.uid = uid; 
-	data.min = l;   
-	data.max = r;   
-	data.a = a;     
+/* one id of a sequence set: a number or '*' */
+static gboolean seqset_id(const char **p, uint64_t star, uint64_t *id)
+{
+	char *end = NULL;
 
-	g_tree_foreach(c, (GTraverseFunc)filter_range, &data);
+	if (**p == '*') {
+		(*p)++;
+		*id = star;
+		return TRUE;
+	}
+	if (! g_ascii_isdigit(**p))
+		return FALSE;
+	*id = dm_strtoull(*p, &end, 10);
+	*p = end;
+	if (*id == 0xffffffff) // outlook
+		*id = star;
+	return (*id > 0);
 }
 
-GTree * MailboxState_get_set(MailboxState_T M, const char *set, gboolean uid)
+/*
+ * parse an IMAP sequence set and intersect it with the mailbox. The
+ * result holds the msns of the messages in the set; since uids ascend
+ * with the msn every uid range maps onto a single msn range.
+ *
+ * Returns NULL if the set is invalid. An empty set is valid.
+ */
+SeqSet_T MailboxState_get_seqset(T M, const char *set, gboolean uid)
 {
-	GTree *inset, *a, *b;
-	GList *sets = NULL;
-	GString *t;
-	uint64_t lo = 0, hi = 0;
-	gboolean error = FALSE;
+	SeqSet_T S;
+	const char *p = set;
+	unsigned count = MailboxState_countIds(M);
+	uint64_t star;
 
 	if (uid)
-		inset = MailboxState_getIds(M);
+		star = count ? MailboxState_getUidForMsn(M, count) : 0;
 	else
-		inset = MailboxState_getMsn(M);
+		star = MailboxState_getExists(M);
 
-	a = g_tree_new_full((GCompareDataFunc)ucmpdata,NULL, (GDestroyNotify)uint64_free, (GDestroyNotify)uint64_free);
-	b = g_tree_new_full((GCompareDataFunc)ucmpdata,NULL, (GDestroyNotify)uint64_free, (GDestroyNotify)uint64_free);
+	S = SeqSet_new();
 
-	if (! uid) {
-		lo = 1;
-		hi = MailboxState_getExists(M);
-	} else {
-		GList *ids = g_tree_keys(inset);
-		if (ids) {
-			ids = g_list_last(ids);
-			hi = *((uint64_t *)ids->data);
-			ids = g_list_first(ids);
-			lo = *((uint64_t *)ids->data);
-			g_list_free(g_list_first(ids));
-		}
-	}
+	while (*p && *p != ',') {
+		uint64_t l, r, lo, hi;
 
-	t = g_string_new(set);
-	sets = g_string_split(t, ",");
-	g_string_free(t,TRUE);
+		if (! seqset_id(&p, star, &l))
+			break;
+		r = l;
+		if (*p == ':') {
+			p++;
+			if (! seqset_id(&p, star, &r))
+				break;
+		}
+		if (*p == ',')
+			p++;
+		else if (*p)
+			break;
+
+		if (! count) { // empty box: a placeholder no message maps to
+			SeqSet_add(S, 1, 1);
+			continue;
+		}
 
-	sets = g_list_first(sets);
-	while(sets) {
-		uint64_t l = 0, r = 0;
-		
-		char *rest = (char *)sets->data;
-
-		if (strlen(rest) < 1) break;
-
-		if (g_tree_nnodes(inset) == 0) { // empty box
-			if (rest[0] == '*') {
-				uint64_t *k = mempool_pop(small_pool, sizeof(uint64_t));
-				uint64_t *v = mempool_pop(small_pool, sizeof(uint64_t));
-
-				*k = 1;
-				*v = MailboxState_getUidnext(M);
-
-				g_tree_insert(b, k, v);
-			} else {
-				if (! (l = dm_strtoull(sets->data, &rest, 10))) {
-					error = TRUE;
-					break;
-				}
-				if (rest[0]) {
-					if (rest[0] != ':') {
-						error = TRUE;
-						break;
-					}
-					rest++;
-					if ((rest[0] != '*') && (! dm_strtoull(rest, NULL, 10))) {
-						error = TRUE;
-						break;
-					}
-				}
-				uint64_t *k = mempool_pop(small_pool, sizeof(uint64_t));
-				uint64_t *v = mempool_pop(small_pool, sizeof(uint64_t));
-
-				*k = 1;
-				*v = MailboxState_getUidnext(M);
-
-				g_tree_insert(b, k, v);
-			}
+		lo = min(l, r);
+		hi = max(l, r);
+		if (uid) {
+			lo = uid_lower_bound(M, lo) + 1;
+			hi = uid_lower_bound(M, hi + 1);
 		} else {
-			if (rest[0] == '*') {
-				l = hi;
-				r = l;
-				if (strlen(rest) > 1)
-					rest++;
-			} else {
-				if (! (l = dm_strtoull(sets->data,&rest,10))) {
-					error = TRUE;
-					break;
-				}
-
-				if (l == 0xffffffff) l = hi; // outlook
-
-				if (!uid) l = max(l,lo);
-				r = l;
-			}
-			
-			if (rest[0]==':') {
-				if (strlen(rest)>1) rest++;
-				if (rest[0] == '*') r = hi;
-				else {
-					if (! (r = dm_strtoull(rest,NULL,10))) {
-						error = TRUE;
-						break;
-					}
-
-					if (r == 0xffffffff) r = hi; // outlook
-				}
-				
-				if (!r) break;
-			}
-		
-			if (! (l && r)) break;
-
-			find_range(inset, min(l,r), max(l,r), a, uid);
-
-			if (g_tree_merge(b,a,IST_SUBSEARCH_OR)) {
-				error = TRUE;
-				TRACE(TRACE_ERR, "cannot compare null trees");
-				break;
-			}
+			hi = min(hi, (uint64_t)count);
 		}
+		if (lo && lo <= hi)
+			SeqSet_add(S, lo, hi);
+	}
 
-		if (! g_list_next(sets)) break;
-		sets = g_list_next(sets);
+	if (*p) {
+		TRACE(TRACE_DEBUG, "invalid sequence set [%s] at [%s]", set, p);
+		SeqSet_free(&S);
 	}
 
-	sets = g_list_first(sets);
-	g_list_free_full(g_steal_pointer (&sets), g_free);
+	return S;
+}
+
+GTree * MailboxState_get_set(T M, const char *set, gboolean uid)
+{
+	SeqSet_T S;
+	GTree *b;
+	uint64_t msn = 0;
 
-	if (a) g_tree_destroy(a);
+	if (! (S = MailboxState_get_seqset(M, set, uid)))
+		return NULL;
 
-	if (error) {
-		g_tree_destroy(b);
-		b = NULL;
-		TRACE(TRACE_DEBUG, "return NULL");
+	b = g_tree_new_full((GCompareDataFunc)ucmpdata,NULL, (GDestroyNotify)uint64_free, (GDestroyNotify)uint64_free);
+	while (SeqSet_next(S, &msn)) {
+		uint64_t *k = mempool_pop(small_pool, sizeof(uint64_t));
+		uint64_t *v = mempool_pop(small_pool, sizeof(uint64_t));
+		*k = MailboxState_getUidForMsn(M, msn);
+		*v = msn;
+		g_tree_insert(b, k, v);
 	}
+	SeqSet_free(&S);
 
 	return b;
 }
 
+/* compact uid set for the messages in msns, like "4:7,9" */
+char * MailboxState_uidset(T M, SeqSet_T msns)
+{
+	SeqSet_T S = SeqSet_new();
+	uint64_t msn = 0;
+	char *s;
+
+	while (SeqSet_next(msns, &msn)) {
+		uint64_t uid = MailboxState_getUidForMsn(M, msn);
+		if (uid)
+			SeqSet_add(S, uid, uid);
+	}
+	s = SeqSet_string(S);
+	SeqSet_free(&S);
+
+	return s;
+}
+
 static gboolean _free_recent_queue(gpointer key, gpointer UNUSED value, gpointer data)
 {
 	T M = (T)data;
@@ -868,18 +1458,20 @@ void MailboxState_free(T *M)
 {
 
 	T s = *M;
+	if (s->share)
+		state_share_release(s->share);
+	s->share = NULL;
+
 	if (s->name) 
 		p_string_free(s->name, TRUE);
 
-	if (s->keywords) {
-		g_list_free_full(g_steal_pointer (&s->keywords), g_free);
-	}
+	keyword_table_unref(s->keywords);
+	s->keywords = NULL;
 
-	if (s->msn) g_tree_destroy(s->msn);
-	s->msn = NULL;
+	if (s->announced) g_byte_array_free(s->announced, TRUE);
+	s->announced = NULL;
 
-	if (s->ids) g_tree_destroy(s->ids);		
-	s->ids = NULL;
+	MailboxState_uid_msn_free(s);
 
 	if (s->msginfo) g_tree_destroy(s->msginfo);
 	s->msginfo = NULL;
@@ -898,7 +1490,7 @@ void MailboxState_free(T *M)
 		mempool_close(&pool);
 	}
 
-	s = NULL;
+	*M = NULL;
 }
 
 void db_getmailbox_permission(T M, Connection_T c)
@@ -1118,7 +1710,7 @@ int MailboxState_info(T M)
 	return t;
 }
 
-static void state_load_metadata(T M, Connection_T c)
+static void state_load_metadata(T M, Connection_T c, gboolean coldLoad)
 {
 	uint64_t oldseq;
 
@@ -1131,7 +1723,9 @@ static void state_load_metadata(T M, Connection_T c)
 
 	db_getmailbox_permission(M, c);
 	db_getmailbox_count(M, c);
-	db_getmailbox_keywords(M, c);
+	/* a differential load announces the keywords of changed messages */
+	if (coldLoad)
+		db_getmailbox_keywords(M, c);
 	db_getmailbox_info(M, c);
 
 	TRACE(TRACE_DEBUG, "[%" PRIu64 "] exists [%d] recent [%d]", 
@@ -1165,10 +1759,12 @@ char * MailboxState_flags(T M)
 	GString *string = g_string_new("\\Seen \\Answered \\Deleted \\Flagged \\Draft");
 	assert(M);
 
-	if (M->keywords) {
-		GString *keywords = g_list_join(M->keywords," ");
-		g_string_append_printf(string, " %s", keywords->str);
-		g_string_free(keywords,TRUE);
+	if (M->announced) {
+		guint i;
+		for (i = 0; i < M->announced->len; i++) {
+			if (M->announced->data[i])
+				g_string_append_printf(string, " %s", keyword_name(M, i));
+		}
 	}
 
 	s = string->str;
@@ -1315,7 +1911,7 @@ int MailboxState_getAcl(T M, uint64_t userid, struct ACLMap *map)
 
 static gboolean mailbox_build_recent(uint64_t *uid, MessageInfo *msginfo, T M)
 {
-	if (msginfo->flags[IMAP_FLAG_RECENT]) {
+	if (MailboxState_message_hasFlag(msginfo, IMAP_FLAG_RECENT)) {
 		uint64_t *copy = mempool_pop(M->pool, sizeof(uint64_t));
 		*copy = *uid;
 		g_tree_insert(M->recent_queue, copy, copy);
@@ -1401,11 +1997,18 @@ int MailboxState_flush_recent(T M)
 	return 0;
 }
 
-static gboolean mailbox_clear_recent(uint64_t *uid, MessageInfo *msginfo, T M)
+struct clear_recent {
+	T M;
+	GArray *uids;	// messages with the recent flag set
+};
+
+static gboolean mailbox_clear_recent(uint64_t *uid, MessageInfo *msginfo, struct clear_recent *data)
 {
-	msginfo->flags[IMAP_FLAG_RECENT] = 0;
+	T M = data->M;
 	gpointer value;
 	gpointer orig_key;
+	if (MailboxState_message_hasFlag(msginfo, IMAP_FLAG_RECENT))
+		g_array_append_val(data->uids, *uid);
 	if (g_tree_lookup_extended(M->recent_queue, uid, &orig_key, &value)) {
 		g_tree_remove(M->recent_queue, orig_key);
 		mempool_push(M->pool, orig_key, sizeof(uint64_t));
@@ -1417,36 +2020,117 @@ int MailboxState_clear_recent(T M)
 {
         if (MailboxState_getPermission(M) == IMAPPERM_READWRITE && MailboxState_getMsginfo(M)) {
 		GTree *info = MailboxState_getMsginfo(M);
-		g_tree_foreach(info, (GTraverseFunc)mailbox_clear_recent, M);
+		struct clear_recent data = { M, g_array_new(FALSE, FALSE, sizeof(uint64_t)) };
+		unsigned i;
+
+		g_tree_foreach(info, (GTraverseFunc)mailbox_clear_recent, &data);
+		/* not while walking the tree: changing may replace the message */
+		for (i = 0; i < data.uids->len; i++)
+			MailboxState_message_setFlag(MailboxState_getWritableMsginfo(M, g_array_index(data.uids, uint64_t, i)), IMAP_FLAG_RECENT, FALSE);
+		g_array_free(data.uids, TRUE);
 	}
 
 	return 0;
 }
 
-GList * MailboxState_message_flags(T M, MessageInfo *msginfo)
+gboolean MailboxState_message_hasFlag(const MessageInfo *msginfo, int flag)
+{
+	return (msginfo->flags & (1U << flag)) != 0;
+}
+
+void MailboxState_message_setFlag(MessageInfo *msginfo, int flag, gboolean on)
+{
+	if (on)
+		msginfo->flags |= (1U << flag);
+	else
+		msginfo->flags &= ~(1U << flag);
+}
+
+static gboolean message_recent(T M, MessageInfo *msginfo)
 {
-	GList *t, *sublist = NULL;
-	int j;
 	uint64_t uid = msginfo->uid;
+	if (MailboxState_message_hasFlag(msginfo, IMAP_FLAG_RECENT))
+		return TRUE;
+	return (M->recent_queue && g_tree_lookup(M->recent_queue, &uid));
+}
+
+/* the FLAGS of a message as an IMAP parenthesized list */
+char * MailboxState_message_flags(T M, MessageInfo *msginfo)
+{
+	GString *s = g_string_new("(");
+	guint i;
+	int j;
 
 	for (j = 0; j < IMAP_NFLAGS; j++) {
-		if (msginfo->flags[j])
-			sublist = g_list_append(sublist,g_strdup((gchar *)imap_flag_desc_escaped[j]));
+		if (MailboxState_message_hasFlag(msginfo, j))
+			g_string_append_printf(s, "%s%s", s->len > 1 ? " " : "", imap_flag_desc_escaped[j]);
 	}
-	if ((msginfo->flags[IMAP_FLAG_RECENT] == 0) && g_tree_lookup(M->recent_queue, &uid)) {
+	if ((! MailboxState_message_hasFlag(msginfo, IMAP_FLAG_RECENT)) && message_recent(M, msginfo)) {
 		TRACE(TRACE_DEBUG,"set \\recent flag");
-		sublist = g_list_append(sublist, g_strdup((gchar *)imap_flag_desc_escaped[IMAP_FLAG_RECENT]));
+		g_string_append_printf(s, "%s%s", s->len > 1 ? " " : "", imap_flag_desc_escaped[IMAP_FLAG_RECENT]);
 	}
 
-	t = g_list_first(msginfo->keywords);
-	while (t) {
-		if (MailboxState_hasKeyword(M, t->data))
-			sublist = g_list_append(sublist, g_strdup((gchar *)t->data));
-		if (! g_list_next(t)) break;
-		t = g_list_next(t);
+	for (i = 0; msginfo->keywords && i < msginfo->keywords->len; i++) {
+		guint k = g_array_index(msginfo->keywords, guint, i);
+		if (keyword_announced(M, k))
+			g_string_append_printf(s, "%s%s", s->len > 1 ? " " : "", keyword_name(M, k));
 	}
-	
-	return sublist;
+	g_string_append_c(s, ')');
+
+	return g_string_free(s, FALSE);
+}
+
+static guint message_keyword_next(T M, MessageInfo *msginfo, guint i)
+{
+	while (msginfo->keywords && i < msginfo->keywords->len &&
+			! keyword_announced(M, g_array_index(msginfo->keywords, guint, i)))
+		i++;
+	return i;
+}
+
+/*
+ * compare the FLAGS of message 'a' in state M with those of message
+ * 'b' in state N without rendering them. States sharing a keyword
+ * table compare keyword indices; otherwise the keywords of 'a' are
+ * looked up by name in the table of N.
+ */
+gboolean MailboxState_message_flags_equal(T M, MessageInfo *a, T N, MessageInfo *b)
+{
+	guint i, k, na = 0, nb = 0;
+
+	if ((a->flags ^ b->flags) & ~(1U << IMAP_FLAG_RECENT))
+		return FALSE;
+	if (message_recent(M, a) != message_recent(N, b))
+		return FALSE;
+
+	if (M->keywords == N->keywords) {
+		i = message_keyword_next(M, a, 0);
+		k = message_keyword_next(N, b, 0);
+		while (a->keywords && i < a->keywords->len) {
+			if (! (b->keywords && k < b->keywords->len))
+				return FALSE;
+			if (g_array_index(a->keywords, guint, i) != g_array_index(b->keywords, guint, k))
+				return FALSE;
+			i = message_keyword_next(M, a, i + 1);
+			k = message_keyword_next(N, b, k + 1);
+		}
+		return ! (b->keywords && k < b->keywords->len);
+	}
+
+	for (i = message_keyword_next(N, b, 0); b->keywords && i < b->keywords->len;
+			i = message_keyword_next(N, b, i + 1))
+		nb++;
+
+	for (i = message_keyword_next(M, a, 0); a->keywords && i < a->keywords->len;
+			i = message_keyword_next(M, a, i + 1)) {
+		const char *name = keyword_name(M, g_array_index(a->keywords, guint, i));
+		int n = keyword_lookup(N, name);
+		if (n < 0 || ! keyword_announced(N, (guint)n) || ! message_keyword_find(b, (guint)n, &k))
+			return FALSE;
+		na++;
+	}
+
+	return na == nb;
 }
 
 int MailboxState_merge_recent(T M, T N)
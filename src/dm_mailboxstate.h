@@ -23,6 +23,8 @@
 #define DM_MAILBOXSTATE_H
 
 #include "dbmail.h"
+#include "dm_seqset.h"
+#include "dm_sortcache.h"
 
 #define T MailboxState_T
 
@@ -53,17 +55,25 @@ struct MailboxState_T {
 	gboolean is_inbox;
 	//
 	String_T name;
-	GList *keywords;
+	struct keyword_table *keywords;	// interned keywords, shared with updated states
+	GByteArray *announced;	// keywords in use in the mailbox, by index
 	GTree *msginfo;
-	GTree *ids;
-	GTree *msn;
+	GArray *uids;		// uid of each visible message, by msn - 1
+	GArray *msns;		// 1 .. n, the msn values of both views
+	GTree *ids;		// uid -> msn view, built on demand
+	GTree *msn;		// msn -> uid view, built on demand
 	GTree *recent_queue;
+	struct state_share *share;	// registry entry this state was copied from
 };
 
 typedef struct T *T;
 
 extern T            MailboxState_new(Mempool_T pool, uint64_t id);
+extern T            MailboxState_view(Mempool_T pool, uint64_t id);
 extern T			MailboxState_update(Mempool_T pool, T OldM);
+extern T            MailboxState_refresh(Mempool_T pool, T M);
+extern uint64_t     MailboxState_querySeq(uint64_t id);
+extern SortCache_T  MailboxState_getSortCache(T);
 
 extern int          MailboxState_info(T);
 extern int          MailboxState_count(T);
@@ -75,9 +85,14 @@ extern int          MailboxState_merge_recent(T, T);
 
 extern int          MailboxState_removeUid(T, uint64_t);
 extern void         MailboxState_addMsginfo(T, uint64_t, MessageInfo *);
+extern MessageInfo * MailboxState_getWritableMsginfo(T, uint64_t);
+extern MessageInfo * MessageInfo_new(void);
 extern GTree *      MailboxState_getMsginfo(T);
 extern GTree *      MailboxState_getIds(T);
 extern GTree *      MailboxState_getMsn(T);
+extern uint64_t     MailboxState_getMsnForUid(T, uint64_t);
+extern uint64_t     MailboxState_getUidForMsn(T, uint64_t);
+extern unsigned     MailboxState_countIds(T);
 
 
 extern void         MailboxState_setId(T, uint64_t);
@@ -111,10 +126,18 @@ extern gboolean     MailboxState_isPublic(T);
 
 extern gboolean     MailboxState_hasKeyword(T, const char *);
 extern void         MailboxState_addKeyword(T, const char *);
+extern gboolean     MailboxState_message_hasKeyword(T, MessageInfo *, const char *);
+extern GList *      MailboxState_message_keywordChanges(T, MessageInfo *, GList *, int);
+extern void         MailboxState_message_setKeywords(T, MessageInfo *, GList *, int);
 	
 extern char *       MailboxState_flags(T);
-extern GList *      MailboxState_message_flags(T, MessageInfo *);
+extern char *       MailboxState_message_flags(T, MessageInfo *);
+extern gboolean     MailboxState_message_hasFlag(const MessageInfo *, int);
+extern void         MailboxState_message_setFlag(MessageInfo *, int, gboolean);
+extern gboolean     MailboxState_message_flags_equal(T, MessageInfo *, T, MessageInfo *);
+extern SeqSet_T     MailboxState_get_seqset(T, const char *, gboolean);
 extern GTree *      MailboxState_get_set(T, const char *, gboolean);
+extern char *       MailboxState_uidset(T, SeqSet_T);
 
 extern void         MailboxState_free(T *);
 
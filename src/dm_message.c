@@ -31,31 +31,33 @@ extern DBParam_T db_params;
 #define DBMAIL_TEMPMBOX "INBOX"
 #define THIS_MODULE "message"
 
-static void _header_cache(const char *, const char *, gpointer);
-
-static gboolean _header_insert(uint64_t physmessage_id, uint64_t headername_id, uint64_t headervalue_id);
-static int _header_name_get_id(const DbmailMessage *self, const char *header, uint64_t *id);
-static int _header_value_get_id(const char *value, const char *sortfield, const char *datefield, uint64_t *id);
+static void _header_cache(const DbmailMessage *, GList **, const char *, const char *);
+static int _header_cache_flush(const DbmailMessage *, Connection_T, GList *);
+static void headers_free(GList *);
+static void headername_cache_flush(void);
 
 static DbmailMessage * _retrieve(DbmailMessage *self, const char *query_template);
 static int _message_insert(DbmailMessage *self, 
-		uint64_t user_idnr, 
-		const char *mailbox, 
+		Connection_T c,
+		uint64_t mailbox_idnr, 
 		const char *unique_id); 
+static int _message_cache_headers(const DbmailMessage *self, Connection_T c);
+static void _message_cache_referencesfield(const DbmailMessage *self, Connection_T c);
+static void _message_cache_envelope(const DbmailMessage *self, Connection_T c);
+
+static GMimeContentType *find_type(const char *s);
+static gboolean find_boundary(const char *s, char *boundary);
 
 
 /* general mime utils (missing from gmime?) */
 
-unsigned find_end_of_header(const char *h)
+static unsigned _find_end_of_header(const char *h, size_t l)
 {
 	gchar c, p1 = 0, p2 = 0;
 	unsigned i = 0;
-	size_t l;
 
 	assert(h);
 
-	l  = strlen(h);
-
 	while (h++ && i<l) {
 		i++;
 		c = *h;
@@ -69,244 +71,915 @@ unsigned find_end_of_header(const char *h)
 	return i;
 }
 
-gchar * g_mime_object_get_body(const GMimeObject *object)
+unsigned find_end_of_header(const char *h)
+{
+	assert(h);
+	return _find_end_of_header(h, strlen(h));
+}
+
+/* serialize the object once and copy out the body, returning its length */
+static gchar * _mime_object_get_body(const GMimeObject *object, size_t *len)
 {
-	gchar *s = NULL, *b = NULL;
-        unsigned i;
+	GMimeStream *stream;
+	GByteArray *array;
+	const char *s, *nul;
+	gchar *b;
 	size_t l;
+	unsigned i;
 
 	g_return_val_if_fail(object != NULL, NULL);
 
-	s = g_mime_object_to_string(GMIME_OBJECT(object), NULL);
-	assert(s);
-
-	i = find_end_of_header(s);
-	if (i >= strlen(s)) {
-		g_free(s);
-		return g_strdup("");
+	stream = g_mime_stream_mem_new();
+	g_mime_object_write_to_stream(GMIME_OBJECT(object), NULL, stream);
+	array = g_mime_stream_mem_get_byte_array(GMIME_STREAM_MEM(stream));
+
+	s = (const char *)array->data;
+	l = array->len;
+	/* like the string it used to be */
+	if (l && (nul = memchr(s, '\0', l)))
+		l = nul - s;
+
+	i = l ? _find_end_of_header(s, l) : 0;
+	if (i >= l) {
+		*len = 0;
+		b = g_strdup("");
+	} else {
+		*len = l - i;
+		b = g_malloc(*len + 1);
+		memcpy(b, s + i, *len);
+		b[*len] = '\0';
 	}
 
-	b = s+i;
-	l = strlen(b);
-	memmove(s,b,l);
-	s[l] = '\0';
-	s = g_realloc(s, l+1);
+	g_object_unref(stream);
 
-	return s;
+	return b;
 }
 
-static uint64_t blob_exists(const char *buf, const char *hash)
+gchar * g_mime_object_get_body(const GMimeObject *object)
 {
-	volatile uint64_t id = 0;
-	volatile uint64_t id_old = 0;
-	int message_part_hash=config_get_value_default_int("message_part_hash","DBMAIL",0);
 	size_t l;
+	return _mime_object_get_body(object, &l);
+}
+
+static uint64_t blob_exists(Connection_T c, const char *buf, size_t l, const char *hash)
+{
+	uint64_t id = 0;
+	uint64_t id_old = 0;
+	int message_part_hash=config_get_value_default_int("message_part_hash","DBMAIL",0);
 	assert(buf);
-	TRACE(TRACE_INFO,"mimeparts hash evaluation message_part_hash = %d value size [%lu]",message_part_hash,strlen(buf));
+	TRACE(TRACE_INFO,"mimeparts hash evaluation message_part_hash = %d value size [%lu]",message_part_hash,l);
 	//no hash
 	if (message_part_hash==2)
 		return id;
-	Connection_T c; PreparedStatement_T s; ResultSet_T r;
+	PreparedStatement_T s = NULL; ResultSet_T r;
 	char blob_cmp[DEF_FRAGSIZE];
 	memset(blob_cmp, 0, sizeof(blob_cmp));
 
-	l = strlen(buf);
-	c = db_con_get();
-	TRY
-		if (db_params.db_driver == DM_DRIVER_ORACLE  && l > DM_ORA_MAX_BYTES_LOB_CMP) {
-			db_begin_transaction(c);
-			/** XXX Due to specific Oracle behavior and limitation of
-			 * libzdb methods we can't perform direct comparision lob data
-			 * with some constant more then 4000 chars. So the only way to
-			 * avoid data duplication - insert record and check if it alread
-			 * exists in table. If it exists - rollback the transaction */
-			s = db_stmt_prepare(c, "INSERT INTO %smimeparts (hash, data, %ssize%s) VALUES (?, ?, ?)", 
-				DBPFX, db_get_sql(SQL_ESCAPE_COLUMN), db_get_sql(SQL_ESCAPE_COLUMN));
-			db_stmt_set_str(s, 1, hash);
-			db_stmt_set_blob(s, 2, buf, l);
-			db_stmt_set_int(s, 3, l);
-			db_stmt_exec(s);
-			id = db_get_pk(c, "mimeparts");
-			//for oracle the optimization of message part hash are not implemented
-			switch(message_part_hash){
-			case 0:
-			case 1:
-				s = db_stmt_prepare(c, "SELECT a.id, b.id FROM dbmail_mimeparts a INNER JOIN "
-									"%smimeparts b ON a.hash=b.hash AND DBMS_LOB.COMPARE(a.data, b.data) = 0 "
-									" AND a.id<>b.id AND b.id=?", DBPFX);
+	if (db_params.db_driver == DM_DRIVER_ORACLE  && l > DM_ORA_MAX_BYTES_LOB_CMP) {
+		/** XXX Due to specific Oracle behavior and limitation of
+		 * libzdb methods we can't perform direct comparision lob data
+		 * with some constant more then 4000 chars. So the only way to
+		 * avoid data duplication - insert record and check if it alread
+		 * exists in table. If it exists - delete the new record again,
+		 * since we are running inside the message store transaction */
+		s = db_stmt_prepare(c, "INSERT INTO %smimeparts (hash, data, %ssize%s) VALUES (?, ?, ?)", 
+			DBPFX, db_get_sql(SQL_ESCAPE_COLUMN), db_get_sql(SQL_ESCAPE_COLUMN));
+		db_stmt_set_str(s, 1, hash);
+		db_stmt_set_blob(s, 2, buf, l);
+		db_stmt_set_int(s, 3, l);
+		db_stmt_exec(s);
+		id = db_get_pk(c, "mimeparts");
+		//for oracle the optimization of message part hash are not implemented
+		switch(message_part_hash){
+		case 0:
+		case 1:
+			s = db_stmt_prepare(c, "SELECT a.id, b.id FROM dbmail_mimeparts a INNER JOIN "
+								"%smimeparts b ON a.hash=b.hash AND DBMS_LOB.COMPARE(a.data, b.data) = 0 "
+								" AND a.id<>b.id AND b.id=?", DBPFX);
 
 
-				db_stmt_set_u64(s, 1, id);
-				break;
-			default:
-				TRACE(TRACE_ERR,"unknown message_part_hash = %d value",message_part_hash);
-			}
-			r = db_stmt_query(s);
-			if (db_result_next(r))
-				id_old = db_result_get_u64(r,0);			
-			if (id_old) {
-				//  BLOB already exists - rollback insert
-				id = id_old;
-				db_rollback_transaction(c);
-			} else {
-				db_commit_transaction(c);
-			}
-		} else {
-			switch(message_part_hash){
-			case 0:
-				snprintf(blob_cmp, DEF_FRAGSIZE-1, db_get_sql(SQL_COMPARE_BLOB), "data");
-				s = db_stmt_prepare(c,"SELECT id FROM %smimeparts WHERE hash=? AND %ssize%s=? AND %s limit 1",
-						DBPFX,db_get_sql(SQL_ESCAPE_COLUMN), db_get_sql(SQL_ESCAPE_COLUMN),
-						blob_cmp);
-				db_stmt_set_str(s,1,hash);
-				db_stmt_set_u64(s,2,l);
-				db_stmt_set_blob(s,3,buf,l);
-				break;
-			case 1:
-				s = db_stmt_prepare(c,"SELECT id FROM %smimeparts WHERE hash=? AND %ssize%s=? limit 1",
-						DBPFX,db_get_sql(SQL_ESCAPE_COLUMN), db_get_sql(SQL_ESCAPE_COLUMN)
-					);
-				db_stmt_set_str(s,1,hash);
-				db_stmt_set_u64(s,2,l);
-				break;
-			default:
-				TRACE(TRACE_ERR,"unknown message_part_hash = %d value",message_part_hash);
-			}
-
-			r = db_stmt_query(s);
-			if (db_result_next(r))
-				id = db_result_get_u64(r,0);
+			db_stmt_set_u64(s, 1, id);
+			break;
+		default:
+			TRACE(TRACE_ERR,"unknown message_part_hash = %d value",message_part_hash);
+			return id;
 		}
-	CATCH(SQLException)
-		LOG_SQLERROR;
-		if (db_params.db_driver == DM_DRIVER_ORACLE) 
-			db_rollback_transaction(c);
-	FINALLY
-		db_con_close(c);
-	END_TRY;
+		r = db_stmt_query(s);
+		if (db_result_next(r))
+			id_old = db_result_get_u64(r,0);			
+		if (id_old) {
+			//  BLOB already exists - drop the new copy
+			db_exec(c, "DELETE FROM %smimeparts WHERE id = %" PRIu64 "", DBPFX, id);
+			id = id_old;
+		}
+	} else {
+		switch(message_part_hash){
+		case 0:
+			snprintf(blob_cmp, DEF_FRAGSIZE-1, db_get_sql(SQL_COMPARE_BLOB), "data");
+			s = db_stmt_prepare(c,"SELECT id FROM %smimeparts WHERE hash=? AND %ssize%s=? AND %s limit 1",
+					DBPFX,db_get_sql(SQL_ESCAPE_COLUMN), db_get_sql(SQL_ESCAPE_COLUMN),
+					blob_cmp);
+			db_stmt_set_str(s,1,hash);
+			db_stmt_set_u64(s,2,l);
+			db_stmt_set_blob(s,3,buf,l);
+			break;
+		case 1:
+			s = db_stmt_prepare(c,"SELECT id FROM %smimeparts WHERE hash=? AND %ssize%s=? limit 1",
+					DBPFX,db_get_sql(SQL_ESCAPE_COLUMN), db_get_sql(SQL_ESCAPE_COLUMN)
+				);
+			db_stmt_set_str(s,1,hash);
+			db_stmt_set_u64(s,2,l);
+			break;
+		default:
+			TRACE(TRACE_ERR,"unknown message_part_hash = %d value",message_part_hash);
+			return id;
+		}
+
+		r = db_stmt_query(s);
+		if (db_result_next(r))
+			id = db_result_get_u64(r,0);
+	}
 
 	return id;
 }
 
-static uint64_t blob_insert(const char *buf, const char *hash)
+static uint64_t blob_insert(Connection_T c, const char *buf, size_t l, const char *hash)
 {
-	Connection_T c; PreparedStatement_T s; ResultSet_T r;
-	size_t l;
-	volatile uint64_t id = 0;
+	PreparedStatement_T s; ResultSet_T r;
+	uint64_t id = 0;
 	char *frag = db_returning("id");
 
-	TRACE(TRACE_DEBUG, "final blob store size [%lu] hash %s", strlen(buf),hash);
-
 	assert(buf);
-	l = strlen(buf);
+	TRACE(TRACE_DEBUG, "final blob store size [%lu] hash %s", l, hash);
 
-	c = db_con_get();
-	TRY
-		db_begin_transaction(c);
-		s = db_stmt_prepare(c, "INSERT INTO %smimeparts (hash, data, %ssize%s) VALUES (?, ?, ?) %s",
-				DBPFX, db_get_sql(SQL_ESCAPE_COLUMN), db_get_sql(SQL_ESCAPE_COLUMN), frag);
-		db_stmt_set_str(s, 1, hash);
+	s = db_stmt_prepare(c, "INSERT INTO %smimeparts (hash, data, %ssize%s) VALUES (?, ?, ?) %s",
+			DBPFX, db_get_sql(SQL_ESCAPE_COLUMN), db_get_sql(SQL_ESCAPE_COLUMN), frag);
+	g_free(frag);
+	db_stmt_set_str(s, 1, hash);
 
-		db_stmt_set_blob(s, 2, buf, l);
-		db_stmt_set_int(s, 3, l);
-		if (db_params.db_driver == DM_DRIVER_ORACLE) {
-			db_stmt_exec(s);
-			id = db_get_pk(c, "mimeparts");
-		} else {
-			r = db_stmt_query(s);
-			id = db_insert_result(c,r);
-		}
-		db_commit_transaction(c);
-	CATCH(SQLException)
-		LOG_SQLERROR;
-		db_rollback_transaction(c);
-	FINALLY
-		db_con_close(c);
-	END_TRY;
+	db_stmt_set_blob(s, 2, buf, l);
+	db_stmt_set_int(s, 3, l);
+	if (db_params.db_driver == DM_DRIVER_ORACLE) {
+		db_stmt_exec(s);
+		id = db_get_pk(c, "mimeparts");
+	} else {
+		r = db_stmt_query(s);
+		id = db_insert_result(c,r);
+	}
 
 	TRACE(TRACE_DEBUG,"inserted id [%" PRIu64 "]", id);
-	g_free(frag);
 
 	return id;
 }
 
-static int register_blob(DbmailMessage *m, uint64_t id, gboolean is_header)
+/* a mime part queued by store_blob() until the whole message has been
+ * walked, so the database work can be done in a few batched statements */
+struct mimepart {
+	char *data;
+	size_t size;
+	char *hash;
+	uint64_t id;
+	gboolean is_header;
+	int part_key;
+	int part_depth;
+	int part_order;
+	struct mimepart *same; // earlier part with identical content
+	char *checksum; // content checksum, with message_part_hash = 0
+	char *key; // partcache key
+	gboolean cached; // id was taken from the partcache
+	int storage; // MIMEPART_STORAGE_DB or MIMEPART_STORAGE_FILE
+	gboolean compressible; // not an image, archive or the like
+	char *zdata; // data as stored with codec
+	size_t zsize;
+	int codec;
+	int mime_flags; // PART_* for header parts
+	char boundary[MAX_MIME_BLEN];
+};
+
+/* partlists.mime_flags: what _mime_retrieve would otherwise have to
+ * find out by parsing the header part again */
+#define PART_META 1 // flags and boundary are set
+#define PART_TYPE 2 // has a Content-Type
+#define PART_MESSAGE 4 // message/rfc822
+
+/* maximum number of parts and payload bytes per batched statement */
+#define MIMEPART_BATCH 64
+#define MIMEPART_BATCH_BYTES (4*1024*1024)
+
+/* smaller parts are not worth compressing */
+#define MIMEPART_COMPRESS_MIN 256
+
+static void mimepart_free(struct mimepart *p)
 {
-	Connection_T c; volatile gboolean t = FALSE;
-	c = db_con_get();
+	if (! p) return;
+	g_free(p->data);
+	g_free(p->zdata);
+	g_free(p->hash);
+	g_free(p->checksum);
+	g_free(p->key);
+	g_free(p);
+}
 
-	if (m->part_depth > MAX_MIME_DEPTH) {
-		TRACE(TRACE_WARNING, "MIME part depth exceeds allowed limit. You should recompile "
-				"with CFLAGS+=-DMAX_MIME_DEPTH=<int> where <int> greater than [%d]",
-				m->part_depth);
+static void mimeparts_free(DbmailMessage *m)
+{
+	GList *l = g_list_first(m->mimeparts);
+	while (l) {
+		mimepart_free((struct mimepart *)l->data);
+		l = g_list_next(l);
 	}
+	g_list_free(m->mimeparts);
+	m->mimeparts = NULL;
+}
 
-	TRY
-		db_begin_transaction(c);
-		t = db_exec(c, "INSERT INTO %spartlists (physmessage_id, is_header, part_key, part_depth, part_order, part_id) "
-				"VALUES (%" PRIu64 ",%d,%d,%d,%d,%" PRIu64 ")", DBPFX,
-				dbmail_message_get_physid(m), is_header, m->part_key, m->part_depth, m->part_order, id);	
-		db_commit_transaction(c);
-	CATCH(SQLException)
-		LOG_SQLERROR;
-		db_rollback_transaction(c);
-	FINALLY
-		db_con_close(c);
-	END_TRY;
+/*
+ * process-wide LRU cache of (hash, size) -> mimeparts.id for recently
+ * stored parts, so repeated bodies skip the lookup in the database.
+ *
+ * Entries are dropped again when a store using them fails: the
+ * partlists foreign key rejects ids purged by dbmail-util in another
+ * process. Sqlite and MySQL may hand out a purged id again for other
+ * content, so there the hash and size of cached ids are confirmed with
+ * a primary key lookup. Entries expire after mimepart_cache_ttl
+ * seconds, and dbmail-util publishes the purge through
+ * notify_directory, on which all entries are dropped.
+ */
+struct partcache_entry {
+	char *key;
+	uint64_t id;
+	time_t expires;
+};
 
-	return t;
+G_LOCK_DEFINE_STATIC(partcache);
+static GHashTable *partcache = NULL; // key -> link in partcache_lru
+static GQueue partcache_lru = G_QUEUE_INIT;
+static unsigned partcache_max = 0;
+static int partcache_ttl = 0;
+static uint64_t partcache_hits = 0;
+static uint64_t partcache_misses = 0;
+
+static void partcache_entry_free(struct partcache_entry *e)
+{
+	g_free(e->key);
+	g_free(e);
+}
+
+/* call with partcache locked */
+static gboolean partcache_init(void)
+{
+	if (! partcache) {
+		partcache_max = config_get_value_default_int("mimepart_cache_size", "DBMAIL", 10000);
+		partcache_ttl = config_get_value_default_int("mimepart_cache_ttl", "DBMAIL", 3600);
+		partcache = g_hash_table_new(g_str_hash, g_str_equal);
+		TRACE(TRACE_DEBUG, "mimepart cache size [%u] ttl [%d]", partcache_max, partcache_ttl);
+	}
+	return partcache_max > 0 && partcache_ttl > 0;
+}
+
+static gboolean partcache_enabled(void)
+{
+	gboolean enabled;
+
+	G_LOCK(partcache);
+	enabled = partcache_init();
+	G_UNLOCK(partcache);
+
+	return enabled;
+}
+
+/* call with partcache locked */
+static void partcache_remove(GList *link)
+{
+	struct partcache_entry *e = (struct partcache_entry *)link->data;
+	g_hash_table_remove(partcache, e->key);
+	g_queue_delete_link(&partcache_lru, link);
+	partcache_entry_free(e);
+}
+
+static uint64_t partcache_get(const char *key)
+{
+	GList *link;
+	uint64_t id = 0;
+
+	G_LOCK(partcache);
+	if (partcache_init()) {
+		if ((link = g_hash_table_lookup(partcache, key))) {
+			if (((struct partcache_entry *)link->data)->expires < time(NULL)) {
+				partcache_remove(link);
+			} else {
+				g_queue_unlink(&partcache_lru, link);
+				g_queue_push_head_link(&partcache_lru, link);
+				id = ((struct partcache_entry *)link->data)->id;
+			}
+		}
+		if (id)
+			partcache_hits++;
+		else
+			partcache_misses++;
+	}
+	G_UNLOCK(partcache);
+
+	return id;
+}
+
+static void partcache_put(const char *key, uint64_t id)
+{
+	GList *link;
+	struct partcache_entry *e;
+
+	G_LOCK(partcache);
+	if (partcache_init()) {
+		if ((link = g_hash_table_lookup(partcache, key)))
+			partcache_remove(link);
+
+		e = g_new0(struct partcache_entry, 1);
+		e->key = g_strdup(key);
+		e->id = id;
+		e->expires = time(NULL) + partcache_ttl;
+		g_queue_push_head(&partcache_lru, e);
+		g_hash_table_insert(partcache, e->key, partcache_lru.head);
+
+		while (g_queue_get_length(&partcache_lru) > partcache_max)
+			partcache_remove(partcache_lru.tail);
+	}
+	G_UNLOCK(partcache);
+}
+
+static void partcache_del(const char *key)
+{
+	GList *link;
+
+	G_LOCK(partcache);
+	if (partcache && (link = g_hash_table_lookup(partcache, key)))
+		partcache_remove(link);
+	G_UNLOCK(partcache);
+}
+
+void dm_mimepart_cache_flush(void)
+{
+	G_LOCK(partcache);
+	if (partcache) {
+		while (partcache_lru.head)
+			partcache_remove(partcache_lru.head);
+		TRACE(TRACE_DEBUG, "mimepart cache flushed");
+	}
+	G_UNLOCK(partcache);
+}
+
+void dm_mimepart_cache_stats(uint64_t *hits, uint64_t *misses)
+{
+	G_LOCK(partcache);
+	*hits = partcache_hits;
+	*misses = partcache_misses;
+	G_UNLOCK(partcache);
+}
+
+/* char(n) hash columns may come back blank padded */
+static gboolean mimepart_hash_match(const char *want, const char *got)
+{
+	size_t l = strlen(want);
+	if (strncmp(want, got, l) != 0)
+		return FALSE;
+	while (got[l] == ' ')
+		l++;
+	return got[l] == '\0';
+}
+
+/* with message_part_hash = 0 a matching hash is not enough unless
+ * hash_algorithm is strong: the key then also carries a SHA-256 of the
+ * content */
+static char * partcache_key(const struct mimepart *p)
+{
+	if (p->checksum)
+		return g_strdup_printf("%s:%zu:%s", p->hash, p->size, p->checksum);
+	return g_strdup_printf("%s:%zu", p->hash, p->size);
 }
 
-static uint64_t blob_store(const char *buf)
+/* take the ids of queued parts from the partcache where possible */
+static void partcache_lookup(Connection_T c, GList *todo)
+{
+	GList *l = g_list_first(todo);
+	GString *q = NULL;
+	ResultSet_T r;
+
+	while (l) {
+		struct mimepart *p = (struct mimepart *)l->data;
+		p->key = partcache_key(p);
+		if ((p->id = partcache_get(p->key))) {
+			p->cached = TRUE;
+			if (db_params.db_driver == DM_DRIVER_SQLITE || db_params.db_driver == DM_DRIVER_MYSQL) {
+				if (! q)
+					q = g_string_new("");
+				g_string_append_printf(q, "%s%" PRIu64 "", q->len ? "," : "", p->id);
+			}
+		}
+		l = g_list_next(l);
+	}
+
+	if (! q)
+		return;
+
+	/* ids may have been reused: confirm they still hold the same part */
+	db_con_clear(c);
+	r = db_query(c, "SELECT id, hash, %ssize%s FROM %smimeparts WHERE id IN (%s)",
+			db_get_sql(SQL_ESCAPE_COLUMN), db_get_sql(SQL_ESCAPE_COLUMN), DBPFX, q->str);
+	g_string_free(q, TRUE);
+
+	l = g_list_first(todo);
+	while (l) {
+		((struct mimepart *)l->data)->cached = FALSE;
+		l = g_list_next(l);
+	}
+	while (db_result_next(r)) {
+		uint64_t id = db_result_get_u64(r, 0);
+		const char *hash = db_result_get(r, 1);
+		uint64_t size = db_result_get_u64(r, 2);
+		l = g_list_first(todo);
+		while (l) {
+			struct mimepart *p = (struct mimepart *)l->data;
+			if (p->id == id && p->size == size && mimepart_hash_match(p->hash, hash))
+				p->cached = TRUE;
+			l = g_list_next(l);
+		}
+	}
+	l = g_list_first(todo);
+	while (l) {
+		struct mimepart *p = (struct mimepart *)l->data;
+		if (p->id && ! p->cached) {
+			partcache_del(p->key);
+			p->id = 0;
+		}
+		l = g_list_next(l);
+	}
+}
+
+/* after the store transaction is done: remember the ids of the parts
+ * if it was committed, forget the ones we used if it failed */
+static void partcache_update(DbmailMessage *m, gboolean stored)
+{
+	GList *l = g_list_first(m->mimeparts);
+
+	while (l) {
+		struct mimepart *p = (struct mimepart *)l->data;
+		if (p->key) {
+			if (stored && p->id)
+				partcache_put(p->key, p->id);
+			else if (p->cached)
+				partcache_del(p->key);
+		}
+		l = g_list_next(l);
+	}
+}
+
+static gboolean mimepart_same(const struct mimepart *a, const struct mimepart *b)
+{
+	return ((a->size == b->size) && (strcmp(a->hash, b->hash) == 0) &&
+			(memcmp(a->data, b->data, a->size) == 0));
+}
+
+static gboolean register_blob(Connection_T c, DbmailMessage *m, const struct mimepart *p)
+{
+	return db_exec(c, "INSERT INTO %spartlists (physmessage_id, is_header, part_key, part_depth, part_order, part_id) "
+			"VALUES (%" PRIu64 ",%d,%d,%d,%d,%" PRIu64 ")", DBPFX,
+			dbmail_message_get_physid(m), p->is_header, p->part_key, p->part_depth, p->part_order, p->id);
+}
+
+static uint64_t blob_store(Connection_T c, const char *buf, size_t l, const char *hash)
 {
 	uint64_t id;
-	char hash[FIELDSIZE];
 
 	if (! buf) return 0;
 
-	memset(hash, 0, sizeof(hash));
-	if (dm_get_hash_for_string(buf, hash))
-		return 0;
-
 	// store this message fragment
-	if ((id = blob_exists(buf, (const char *)hash)) != 0) {
+	if ((id = blob_exists(c, buf, l, hash)) != 0) {
 		return id;
 	}
 
-	if ((id = blob_insert(buf, (const char *)hash)) != 0) {
+	if ((id = blob_insert(c, buf, l, hash)) != 0) {
 		return id;
 	}
 	
 	return 0;
 }
 
-static int store_blob(DbmailMessage *m, const char *buf, gboolean is_header)
+/* record content-type details of a header part the way _mime_retrieve
+ * finds them */
+static void mimepart_describe(struct mimepart *p)
 {
-	uint64_t id;
+	GMimeContentType *mimetype;
+
+	p->mime_flags = PART_META;
+	if ((mimetype = find_type(p->data))) {
+		p->mime_flags |= PART_TYPE;
+		if (g_mime_content_type_is_type(mimetype, "message", "rfc822"))
+			p->mime_flags |= PART_MESSAGE;
+		g_object_unref(mimetype);
+	}
+	find_boundary(p->data, p->boundary);
+}
+
+/* queue a part of len bytes; the queue takes ownership of buf */
+static int store_blob(DbmailMessage *m, char *buf, size_t len, gboolean is_header, gboolean compressible)
+{
+	struct mimepart *p;
+	GChecksum *checksum = NULL;
+	char hash[FIELDSIZE];
 
 	if (! buf) return 0;
 
-	TRACE(TRACE_DEBUG, "blob store size [%lu]", strlen(buf));
+	TRACE(TRACE_DEBUG, "blob store size [%lu]", len);
 
 	if (is_header) {
 		m->part_key++;
 		m->part_order=0;
 	}
 
+	if (m->part_depth > MAX_MIME_DEPTH) {
+		TRACE(TRACE_WARNING, "MIME part depth exceeds allowed limit. You should recompile "
+				"with CFLAGS+=-DMAX_MIME_DEPTH=<int> where <int> greater than [%d]",
+				m->part_depth);
+	}
+
 	TRACE(TRACE_DEBUG, "<blob is_header=\"%d\" part_depth=\"%d\" part_key=\"%d\" part_order=\"%d\">\n%s\n</blob>\n",
 			is_header, m->part_depth, m->part_key, m->part_order, buf);
 
-	if (! (id = blob_store(buf)))
-		return DM_EQUERY;
+	/* the partcache needs a checksum next to a weak hash when the
+	 * content itself would otherwise be compared */
+	if (config_get_value_default_int("message_part_hash", "DBMAIL", 0) == 0
+			&& ! dm_get_hash_is_strong() && partcache_enabled())
+		checksum = g_checksum_new(G_CHECKSUM_SHA256);
+
+	memset(hash, 0, sizeof(hash));
+	if (dm_get_hash_for_data(buf, len, checksum, hash)) {
+		if (checksum)
+			g_checksum_free(checksum);
+		g_free(buf);
+		return DM_EQUERY;
+	}
+
+	p = g_new0(struct mimepart, 1);
+	p->hash = g_strdup(hash);
+	p->data = buf;
+	p->size = len;
+	p->is_header = is_header;
+	p->compressible = compressible;
+	if (is_header)
+		mimepart_describe(p);
+	p->part_key = m->part_key;
+	p->part_depth = m->part_depth;
+	p->part_order = m->part_order;
+	if (checksum) {
+		p->checksum = g_strdup(g_checksum_get_string(checksum));
+		g_checksum_free(checksum);
+	}
+
+	m->mimeparts = g_list_prepend(m->mimeparts, p);
+
+	m->part_order++;
+
+	return 0;
+
+}
+
+static int store_string(DbmailMessage *m, const char *s)
+{
+	if (! s) return 0;
+	return store_blob(m, g_strdup(s), strlen(s), 0, TRUE);
+}
+
+/*
+ * resolve the ids of queued parts that are already present in the
+ * mimeparts table with a single multi-hash lookup per batch.
+ *
+ * With 'fresh' set, the lookup follows our own insert: only hash and
+ * size are matched and the newest row wins.
+ */
+static void mimeparts_resolve(Connection_T c, GList *todo, int message_part_hash, gboolean fresh)
+{
+	PreparedStatement_T s; ResultSet_T r;
+	gboolean cmp_data = ((message_part_hash == 0) && (! fresh));
+	const char *esc = db_get_sql(SQL_ESCAPE_COLUMN);
+	GList *batch = g_list_first(todo);
+
+	while (batch) {
+		GList *chunk = batch, *l;
+		GString *q = g_string_new("");
+		int i, n = 0;
+
+		g_string_printf(q, "SELECT id, hash, %ssize%s, storage%s FROM %smimeparts WHERE hash IN (",
+				esc, esc, cmp_data ? ", data, codec" : "", DBPFX);
+		while (batch && n < MIMEPART_BATCH) {
+			g_string_append(q, n ? ",?" : "?");
+			batch = g_list_next(batch);
+			n++;
+		}
+		g_string_append(q, ")");
+		if (fresh)
+			g_string_append(q, " ORDER BY id DESC");
+
+		db_con_clear(c);
+		s = db_stmt_prepare(c, "%s", q->str);
+		g_string_free(q, TRUE);
+
+		for (i = 0, l = chunk; i < n; i++, l = g_list_next(l))
+			db_stmt_set_str(s, i+1, ((struct mimepart *)l->data)->hash);
+
+		r = db_stmt_query(s);
+		while (db_result_next(r)) {
+			uint64_t id = db_result_get_u64(r, 0);
+			const char *hash = db_result_get(r, 1);
+			uint64_t size = db_result_get_u64(r, 2);
+			int storage = db_result_get_int(r, 3);
+			const void *blob = NULL;
+			char *raw = NULL;
+			int len = 0;
+
+			if (cmp_data && storage == MIMEPART_STORAGE_DB) {
+				blob = db_result_get_blob(r, 4, &len);
+				if (db_result_get_int(r, 5) != MIMEPART_CODEC_NONE) {
+					size_t rawlen = 0;
+					if (! (raw = dm_mimepart_decode(db_result_get_int(r, 5), blob, len, &rawlen)))
+						continue;
+					blob = raw;
+					len = rawlen;
+				}
+			}
+
+			for (i = 0, l = chunk; i < n; i++, l = g_list_next(l)) {
+				struct mimepart *p = (struct mimepart *)l->data;
+				if (p->id || (p->size != size) || (! mimepart_hash_match(p->hash, hash)))
+					continue;
+				if (cmp_data && storage == MIMEPART_STORAGE_FILE) {
+					if (! dm_partstore_equals(hash, p->data, p->size))
+						continue;
+				} else if (cmp_data && (((size_t)len != p->size) || (len && memcmp(blob, p->data, p->size)))) {
+					continue;
+				}
+				p->id = id;
+			}
+			g_free(raw);
+		}
+	}
+}
+
+/* insert the unresolved parts using multi-row inserts. Parts kept in
+ * the mimepart store only get a row without data. */
+static void mimeparts_insert(Connection_T c, GList *todo)
+{
+	PreparedStatement_T s;
+	const char *esc = db_get_sql(SQL_ESCAPE_COLUMN);
+	GList *batch = g_list_first(todo);
+
+	while (batch) {
+		GList *chunk = batch, *l;
+		GString *q = g_string_new("");
+		size_t bytes = 0;
+		int i, k, n = 0;
+
+		g_string_printf(q, "INSERT INTO %smimeparts (hash, data, %ssize%s, storage, codec) VALUES ",
+				DBPFX, esc, esc);
+		while (batch && n < MIMEPART_BATCH) {
+			struct mimepart *p = (struct mimepart *)batch->data;
+			size_t stored = p->zdata ? p->zsize : p->size;
+			if (n && (bytes + stored > MIMEPART_BATCH_BYTES))
+				break;
+			if (p->storage == MIMEPART_STORAGE_FILE) {
+				g_string_append_printf(q, "%s(?,'',?,%d,%d)", n ? "," : "",
+						MIMEPART_STORAGE_FILE, MIMEPART_CODEC_NONE);
+			} else {
+				g_string_append_printf(q, "%s(?,?,?,%d,%d)", n ? "," : "",
+						MIMEPART_STORAGE_DB, p->codec);
+				bytes += stored;
+			}
+			batch = g_list_next(batch);
+			n++;
+		}
+
+		db_con_clear(c);
+		s = db_stmt_prepare(c, "%s", q->str);
+		g_string_free(q, TRUE);
+
+		for (i = 0, k = 1, l = chunk; i < n; i++, l = g_list_next(l)) {
+			struct mimepart *p = (struct mimepart *)l->data;
+			db_stmt_set_str(s, k++, p->hash);
+			if (p->storage != MIMEPART_STORAGE_FILE && p->zdata)
+				db_stmt_set_blob(s, k++, p->zdata, p->zsize);
+			else if (p->storage != MIMEPART_STORAGE_FILE)
+				db_stmt_set_blob(s, k++, p->data, p->size);
+			db_stmt_set_u64(s, k++, p->size);
+		}
+		db_stmt_exec(s);
+		TRACE(TRACE_DEBUG, "inserted [%d] mimeparts [%lu] bytes", n, bytes);
+	}
+}
+
+/* register all parts of the message in partlists using multi-row inserts */
+static gboolean mimeparts_register(Connection_T c, DbmailMessage *m)
+{
+	PreparedStatement_T s;
+	GList *batch = g_list_first(m->mimeparts);
+	uint64_t physid = dbmail_message_get_physid(m);
+
+	while (batch) {
+		GList *chunk = batch, *l;
+		GString *q = g_string_new("");
+		int i, k, n = 0;
+
+		g_string_printf(q, "INSERT INTO %spartlists "
+				"(physmessage_id, is_header, part_key, part_depth, part_order, part_id, "
+				"mime_flags, boundary) VALUES ", DBPFX);
+		while (batch && n < MIMEPART_BATCH) {
+			g_string_append(q, n ? ",(?,?,?,?,?,?,?,?)" : "(?,?,?,?,?,?,?,?)");
+			batch = g_list_next(batch);
+			n++;
+		}
+
+		db_con_clear(c);
+		s = db_stmt_prepare(c, "%s", q->str);
+		g_string_free(q, TRUE);
+
+		for (i = 0, k = 1, l = chunk; i < n; i++, l = g_list_next(l)) {
+			struct mimepart *p = (struct mimepart *)l->data;
+			db_stmt_set_u64(s, k++, physid);
+			db_stmt_set_int(s, k++, p->is_header);
+			db_stmt_set_int(s, k++, p->part_key);
+			db_stmt_set_int(s, k++, p->part_depth);
+			db_stmt_set_int(s, k++, p->part_order);
+			db_stmt_set_u64(s, k++, p->id);
+			db_stmt_set_int(s, k++, p->mime_flags);
+			db_stmt_set_str(s, k++, p->boundary);
+		}
+		db_stmt_exec(s);
+	}
+
+	return TRUE;
+}
+
+static gboolean mimepart_compression(void)
+{
+	Field_T value;
+	config_get_value("mimepart_compression", "DBMAIL", value);
+	return (MATCH(value, "gzip"));
+}
+
+/* compress a part for storage, if that saves anything */
+static void mimepart_compress(struct mimepart *p)
+{
+	char *z;
+	size_t zlen = 0;
+
+	if ((! p->compressible) || (p->size < MIMEPART_COMPRESS_MIN))
+		return;
+	if (! (z = dm_deflate(p->data, p->size, &zlen)))
+		return;
+	if (zlen >= p->size) {
+		g_free(z);
+		return;
+	}
+	TRACE(TRACE_DEBUG, "compressed mimepart [%s] from [%zu] to [%zu] bytes", p->hash, p->size, zlen);
+	p->zdata = z;
+	p->zsize = zlen;
+	p->codec = MIMEPART_CODEC_GZIP;
+}
+
+/* decode the data column of a mimepart; the result is NUL terminated */
+char * dm_mimepart_decode(int codec, const char *data, size_t len, size_t *outlen)
+{
+	char *out;
+
+	switch (codec) {
+		case MIMEPART_CODEC_NONE:
+			out = g_new0(char, len + 1);
+			memcpy(out, data, len);
+			*outlen = len;
+			return out;
+		case MIMEPART_CODEC_GZIP:
+			if (! (out = dm_inflate(data, len, outlen)))
+				TRACE(TRACE_ERR, "unable to decompress mimepart");
+			return out;
+		default:
+			TRACE(TRACE_ERR, "unknown mimepart codec [%d]", codec);
+			return NULL;
+	}
+}
+
+/* store all queued parts of the message: resolve duplicates with one
+ * lookup, bulk-insert what is missing and register the partlists.
+ * Runs inside the caller's transaction on connection c. */
+static int mimeparts_store(Connection_T c, DbmailMessage *m)
+{
+	GList *l, *todo = NULL, *missing = NULL;
+	int t = DM_SUCCESS;
+	int message_part_hash = config_get_value_default_int("message_part_hash", "DBMAIL", 0);
+	gboolean compress = mimepart_compression();
+
+	m->mimeparts = g_list_reverse(m->mimeparts);
+
+	if (db_params.db_driver == DM_DRIVER_ORACLE) {
+		/* no multi-row inserts: store one part at a time */
+		l = g_list_first(m->mimeparts);
+		while (l) {
+			struct mimepart *p = (struct mimepart *)l->data;
+			if (! (p->id = blob_store(c, p->data, p->size, p->hash)))
+				return DM_EQUERY;
+			if (! register_blob(c, m, p))
+				return DM_EQUERY;
+			l = g_list_next(l);
+		}
+		return DM_SUCCESS;
+	}
+
+	/* parts repeated within this message are stored only once */
+	l = g_list_first(m->mimeparts);
+	while (l) {
+		struct mimepart *p = (struct mimepart *)l->data;
+		GList *k = g_list_first(todo);
+		while (k) {
+			if (mimepart_same((struct mimepart *)k->data, p)) {
+				p->same = (struct mimepart *)k->data;
+				break;
+			}
+			k = g_list_next(k);
+		}
+		if (! p->same)
+			todo = g_list_prepend(todo, p);
+		l = g_list_next(l);
+	}
+	todo = g_list_reverse(todo);
+
+	TRACE(TRACE_DEBUG, "storing [%u] parts, [%u] distinct", g_list_length(m->mimeparts), g_list_length(todo));
+
+	if (message_part_hash != 2) {
+		GList *lookup = NULL;
+
+		partcache_lookup(c, todo);
+
+		l = g_list_first(todo);
+		while (l) {
+			if (! ((struct mimepart *)l->data)->id)
+				lookup = g_list_prepend(lookup, l->data);
+			l = g_list_next(l);
+		}
+		lookup = g_list_reverse(lookup);
+
+		if (todo) {
+			uint64_t hits, misses;
+			dm_mimepart_cache_stats(&hits, &misses);
+			TRACE(TRACE_DEBUG, "[%u] parts from mimepart cache, hits [%" PRIu64 "] misses [%" PRIu64 "]",
+					g_list_length(todo) - g_list_length(lookup), hits, misses);
+		}
+
+		if (lookup)
+			mimeparts_resolve(c, lookup, message_part_hash, FALSE);
+		g_list_free(lookup);
+	}
 
-	// register this message fragment
-	if (! register_blob(m, id, is_header))
-		return DM_EQUERY;
+	l = g_list_first(todo);
+	while (l) {
+		if (! ((struct mimepart *)l->data)->id)
+			missing = g_list_prepend(missing, l->data);
+		l = g_list_next(l);
+	}
+	missing = g_list_reverse(missing);
+	g_list_free(todo);
+
+	/* large parts go to the mimepart store; if that fails they are
+	 * kept in the database like any other part */
+	l = g_list_first(missing);
+	while (l) {
+		struct mimepart *p = (struct mimepart *)l->data;
+		if (dm_partstore_wants(p->size)) {
+			if (dm_partstore_put(p->hash, p->data, p->size) == DM_SUCCESS)
+				p->storage = MIMEPART_STORAGE_FILE;
+			else
+				TRACE(TRACE_WARNING, "storing mimepart [%s] in the database", p->hash);
+		}
+		if (p->storage == MIMEPART_STORAGE_DB && compress)
+			mimepart_compress(p);
+		l = g_list_next(l);
+	}
 
-	m->part_order++;
+	if (missing) {
+		mimeparts_insert(c, missing);
+		mimeparts_resolve(c, missing, message_part_hash, TRUE);
+		g_list_free(missing);
+	}
 
-	return 0;
+	l = g_list_first(m->mimeparts);
+	while (l) {
+		struct mimepart *p = (struct mimepart *)l->data;
+		if (p->same)
+			p->id = p->same->id;
+		if (! p->id) {
+			TRACE(TRACE_ERR, "unable to resolve mimepart [%s]", p->hash);
+			t = DM_EQUERY;
+		}
+		l = g_list_next(l);
+	}
 
+	if ((t == DM_SUCCESS) && (! mimeparts_register(c, m)))
+		t = DM_EQUERY;
+
+	return t;
 }
 
 static char *find_type_header(const char *s)
@@ -373,166 +1046,364 @@ static gboolean find_boundary(const char *s, char *boundary)
 	return true;
 }
 
-static DbmailMessage * _mime_retrieve(DbmailMessage *self)
-{
-	PreparedStatement_T stmt;
-	Connection_T c;
-       	ResultSet_T r;
+/* bodies larger than this are left out of a sparse retrieval */
+#define MIMEPART_SPARSE_MIN 4096
+
+/* reassembly state of one message in a mimeparts result */
+struct mime_assembly {
+	DbmailMessage *msg;
+	GString *m;
 	char internal_date[SQL_INTERNALDATE_LEN];
+	char boundary[MAX_MIME_BLEN];
+	char blist[MAX_MIME_DEPTH+1][MAX_MIME_BLEN];
+	int depth, row;
+	gboolean got_boundary, prev_boundary, is_header, is_message;
+	gboolean failed;
+	guint32 nonce;
+};
+
+static void mime_assembly_start(struct mime_assembly *a, DbmailMessage *msg)
+{
+	memset(a, 0, sizeof(*a));
+	a->msg = msg;
+	a->is_header = TRUE;
+	a->nonce = g_random_int();
+}
+
+/* append one row of the mimeparts query to the message */
+static void mime_assembly_add(struct mime_assembly *a, ResultSet_T r, gboolean sparse)
+{
+	DbmailMessage *self = a->msg;
+	int l, order, key, flags, prevdepth;
+	gboolean prev_header, prev_is_message;
 	GMimeContentType *mimetype = NULL;
-	volatile int prevdepth, depth = 0, row = 0;
-	volatile int t = FALSE;
-	volatile gboolean got_boundary = FALSE, prev_boundary = FALSE, is_header = TRUE, prev_header;
-	volatile gboolean prev_is_message = FALSE, is_message = FALSE;
-	volatile String_T m = NULL, n = NULL;
-	const void *blob;
-	Field_T frag;
+	const char *data = NULL;
+	char *str = NULL;
+	size_t len = 0;
 
-	assert(dbmail_message_get_physid(self));
-	date2char_str("ph.internal_date", &frag);
-	n = p_string_new(self->pool, "");
-	p_string_printf(n,db_get_sql(SQL_ENCODE_ESCAPE), "data");
+	if (a->failed)
+		return;
 
-	c = db_con_get();
-	TRY
-		char boundary[MAX_MIME_BLEN];
-		char blist[MAX_MIME_DEPTH+1][MAX_MIME_BLEN];
+	prevdepth	= a->depth;
+	prev_header	= a->is_header;
+	prev_is_message	= a->is_message;
+	key		= db_result_get_int(r,0);
+	a->depth	= db_result_get_int(r,1);
+	if (a->depth > MAX_MIME_DEPTH) {
+		TRACE(TRACE_WARNING, "MIME part depth exceeds allowed maximum [%d]",
+				MAX_MIME_DEPTH);
+		return;
+	}
 
-		memset(&boundary, 0, sizeof(boundary));
-		memset(&blist, 0, sizeof(blist));
+	order		= db_result_get_int(r,2);
+	a->is_header	= db_result_get_bool(r,3);
+	if (a->row == 0) {
+		g_strlcpy(a->internal_date, db_result_get(r,4), SQL_INTERNALDATE_LEN-1);
+		/* the reassembled message is about as large
+		 * as the one delivered */
+		a->m = g_string_sized_new(db_result_get_u64(r,11) + 1024);
+	}
 
-		stmt = db_stmt_prepare(c,
-			       	"SELECT l.part_key,l.part_depth,l.part_order,l.is_header,%s,%s "
-				"FROM %smimeparts p "
-				"JOIN %spartlists l ON p.id = l.part_id "
-				"JOIN %sphysmessage ph ON ph.id = l.physmessage_id "
-				"WHERE l.physmessage_id = ? ORDER BY l.part_key, l.part_order ASC, l.part_depth DESC", 
-				frag, p_string_str(n), DBPFX, DBPFX, DBPFX);
-		db_stmt_set_u64(stmt, 1, self->id);
-		r = db_stmt_query(stmt);
-		
-		m = p_string_new(self->pool, "");
+	/* only parts kept outside the data column need a
+	 * buffer of their own */
+	if (sparse && (! a->is_header) && db_result_get_u64(r,7) > MIMEPART_SPARSE_MIN) {
+		uint64_t *id = g_new0(uint64_t, 1);
+		*id = db_result_get_u64(r,12);
+		str = g_strdup_printf("DBMAIL%08xPART%dEND", a->nonce, a->row);
+		len = strlen(str);
+		data = str;
+		if (! self->elided)
+			self->elided = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+		g_hash_table_insert(self->elided, g_strdup(str), id);
+	} else if (db_result_get_int(r,5) == MIMEPART_STORAGE_FILE) {
+		if (! (str = dm_partstore_get(db_result_get(r,6), db_result_get_u64(r,7), &len))) {
+			a->failed = TRUE;
+			return;
+		}
+		data = str;
+	} else if (db_result_get_int(r,8) != MIMEPART_CODEC_NONE) {
+		const void *blob = db_result_get_blob(r,14,&l);
+		if (! (str = dm_mimepart_decode(db_result_get_int(r,8), blob, l, &len))) {
+			a->failed = TRUE;
+			return;
+		}
+		data = str;
+	} else {
+		data = db_result_get_blob(r,13,&l);
+		len = l;
+	}
+	if (data && len) {
+		const char *nul = memchr(data, '\0', len);
+		if (nul)
+			len = nul - data;
+	}
 
-		row = 0;
-		while (db_result_next(r)) {
-			int l;
-			int order;
-			int key;
-
-			prevdepth	= depth;
-			prev_header	= is_header;
-			key		= db_result_get_int(r,0);
-			depth		= db_result_get_int(r,1);
-			if (depth > MAX_MIME_DEPTH) {
-				TRACE(TRACE_WARNING, "MIME part depth exceeds allowed maximum [%d]",
-						MAX_MIME_DEPTH);
-				continue;
-			}
+	flags = a->is_header ? db_result_get_int(r,9) : 0;
 
-			order		= db_result_get_int(r,2);
-			is_header	= db_result_get_bool(r,3);
-			if (row == 0) {
-				memset(internal_date, 0, sizeof(internal_date));
-				g_strlcpy(internal_date, db_result_get(r,4), SQL_INTERNALDATE_LEN-1);
-			}
-			blob		= db_result_get_blob(r,5,&l);
-			char *str = g_new0(char, l + 1);
-			str = strncpy(str, blob, l);
-
-			if (is_header) {
-				prev_boundary = got_boundary;
-				prev_is_message = is_message;
-				if ((mimetype = find_type(str))) {
-					is_message = g_mime_content_type_is_type(mimetype, "message", "rfc822");
-					g_object_unref(mimetype);
-				}
-			}
+	if (a->is_header && ! (flags & PART_META)) {
+		/* stored before mime_flags was introduced */
+		char *h = g_strndup(data ? data : "", len);
+		a->prev_boundary = a->got_boundary;
+		if ((mimetype = find_type(h))) {
+			a->is_message = g_mime_content_type_is_type(mimetype, "message", "rfc822");
+			g_object_unref(mimetype);
+		}
+		a->got_boundary = find_boundary(h, &a->boundary[0]);
+		g_free(h);
+	} else if (a->is_header) {
+		a->prev_boundary = a->got_boundary;
+		if (flags & PART_TYPE)
+			a->is_message = (flags & PART_MESSAGE) ? TRUE : FALSE;
+		a->got_boundary = FALSE;
+		if (*db_result_get(r,10)) {
+			memset(a->boundary, 0, sizeof(a->boundary));
+			g_strlcpy(a->boundary, db_result_get(r,10), MAX_MIME_BLEN);
+			a->got_boundary = TRUE;
+		}
+	} else {
+		a->got_boundary = FALSE;
+	}
 
-			got_boundary = FALSE;
+	if (a->got_boundary) {
+		TRACE(TRACE_DEBUG, "<boundary depth=\"%d\">%s</boundary>\n", a->depth, a->boundary);
+		strncpy(a->blist[a->depth], a->boundary, MAX_MIME_BLEN-1);
+	}
 
-			if (is_header && find_boundary(str, &boundary[0])) {
-				got_boundary = TRUE;
-				TRACE(TRACE_DEBUG, "<boundary depth=\"%d\">%s</boundary>\n", depth, boundary);
-				strncpy(blist[depth], boundary, MAX_MIME_BLEN-1);
-			}
+	while ((prevdepth > 0) && (prevdepth-1 >= a->depth) && a->blist[prevdepth-1][0]) {
+		TRACE(TRACE_DEBUG, "\n--%s at %d -> %d--\n", a->blist[prevdepth-1], prevdepth, prevdepth-1);
+		g_string_append_printf(a->m, "\n--%s--\n", a->blist[prevdepth-1]);
+		memset(a->blist[prevdepth-1], 0, MAX_MIME_BLEN);
+		prevdepth--;
+	}
 
-			while ((prevdepth > 0) && (prevdepth-1 >= depth) && blist[prevdepth-1][0]) {
-				TRACE(TRACE_DEBUG, "\n--%s at %d -> %d--\n", blist[prevdepth-1], prevdepth, prevdepth-1);
-				p_string_append_printf(m, "\n--%s--\n", blist[prevdepth-1]);
-				memset(blist[prevdepth-1], 0, MAX_MIME_BLEN);
-				prevdepth--;
-			}
+	if ((a->depth > 0) && (a->blist[a->depth-1][0]))
+		strncpy(a->boundary, a->blist[a->depth-1], MAX_MIME_BLEN-1);
+
+	if (a->is_header){
+		if (prev_header && a->depth>0 && !prev_is_message) {
+			TRACE(TRACE_DEBUG, "--%s\n", a->boundary);
+			g_string_append_printf(a->m, "--%s\n", a->boundary);
+		}else if (!prev_header || a->prev_boundary) {
+			TRACE(TRACE_DEBUG, "\n--%s\n", a->boundary);
+			g_string_append_printf(a->m, "\n--%s\n", a->boundary);
+		}
+	}
 
-			if ((depth > 0) && (blist[depth-1][0]))
-				strncpy(boundary, blist[depth-1], MAX_MIME_BLEN-1);
+	if (len)
+		g_string_append_len(a->m, data, len);
+	TRACE(TRACE_DEBUG, "<part is_header=\"%d\" depth=\"%d\" key=\"%d\" order=\"%d\">\n%.*s\n</part>\n",
+		a->is_header, a->depth, key, order, (int)len, data ? data : "");
 
-			if (is_header){
-				if (prev_header && depth>0 && !prev_is_message) {
-					TRACE(TRACE_DEBUG, "--%s\n", boundary);
-					p_string_append_printf(m, "--%s\n", boundary);
-				}else if (!prev_header || prev_boundary) {
-					TRACE(TRACE_DEBUG, "\n--%s\n", boundary);
-					p_string_append_printf(m, "\n--%s\n", boundary);
-				}
-			}
+	if (a->is_header)
+		g_string_append_c(a->m, '\n');
 
-			p_string_append_printf(m, "%s", str);
-			TRACE(TRACE_DEBUG, "<part is_header=\"%d\" depth=\"%d\" key=\"%d\" order=\"%d\">\n%s\n</part>\n",
-				is_header, depth, key, order, str);
+	g_free(str);
+	a->row++;
+}
 
-			if (is_header)
-				p_string_append_printf(m,"\n");
-			
-			g_free(str);
-			row++;
+/* parse the reassembled message; NULL if nothing usable was read */
+static DbmailMessage * mime_assembly_finish(struct mime_assembly *a)
+{
+	DbmailMessage *self = a->msg;
+
+	if (a->row == 0 || a->failed) {
+		if (a->m) g_string_free(a->m, TRUE);
+		a->m = NULL;
+		if (self->elided) {
+			g_hash_table_destroy(self->elided);
+			self->elided = NULL;
 		}
+		return NULL;
+	}
 
-		// Add final boundary delimiter line if required
-		if (row > 2 && blist[0][0]) {
-			TRACE(TRACE_DEBUG, "\n--%s-- final\n", blist[0]);
-			p_string_append_printf(m, "\n--%s--\n", blist[0]);
-		}
+	// Add final boundary delimiter line if required
+	if (a->row > 2 && a->blist[0][0]) {
+		TRACE(TRACE_DEBUG, "\n--%s-- final\n", a->blist[0]);
+		g_string_append_printf(a->m, "\n--%s--\n", a->blist[0]);
+	}
+
+	self = dbmail_message_init_with_string(self, a->m->str);
+	dbmail_message_set_internal_date(self, a->internal_date);
+	g_string_free(a->m, TRUE);
+	a->m = NULL;
+
+	return self;
+}
+
+/*
+ * reassemble the messages in msgs, which have their physid set, from
+ * the mimeparts in a single query. Messages that could not be read are
+ * set to NULL in msgs, but not freed.
+ *
+ * Returns the number of messages read.
+ */
+static unsigned _mime_retrieve_list(DbmailMessage **msgs, unsigned n, gboolean sparse)
+{
+	Connection_T c;
+	ResultSet_T r;
+	GString *ids;
+	GHashTable *index;
+	struct mime_assembly *a;
+	char *columns, *enc, *wanted;
+	volatile unsigned count = 0;
+	volatile int current = -1;
+	const char *esc = db_get_sql(SQL_ESCAPE_COLUMN);
+	gboolean *seen;
+	Field_T frag;
+	unsigned i;
+
+	date2char_str("ph.internal_date", &frag);
+
+	/* compressed data is fetched raw in its own column */
+	enc = g_strdup_printf(db_get_sql(SQL_ENCODE_ESCAPE), "data");
+	if (sparse)
+		wanted = g_strdup_printf("(l.is_header = 1 OR p.%ssize%s <= %d)",
+				esc, esc, MIMEPART_SPARSE_MIN);
+	else
+		wanted = g_strdup("1=1");
+	columns = g_strdup_printf("CASE WHEN p.codec = 0 AND %s THEN %s END,"
+			"CASE WHEN p.codec <> 0 AND %s THEN p.data END", wanted, enc, wanted);
+	g_free(enc);
+	g_free(wanted);
+
+	ids = g_string_new("");
+	index = g_hash_table_new(g_int64_hash, g_int64_equal);
+	for (i = 0; i < n; i++) {
+		assert(msgs[i] && msgs[i]->id);
+		g_string_append_printf(ids, "%s%" PRIu64, i ? "," : "", msgs[i]->id);
+		g_hash_table_insert(index, &msgs[i]->id, GUINT_TO_POINTER(i + 1));
+	}
+
+	seen = g_new0(gboolean, n);
+	a = g_new0(struct mime_assembly, 1);
+
+	c = db_con_get();
+	TRY
+		r = db_query(c, "SELECT l.part_key,l.part_depth,l.part_order,l.is_header,%s,"
+				"p.storage,p.hash,p.%ssize%s,p.codec,"
+				"l.mime_flags,l.boundary,ph.messagesize,p.id,%s,"
+				"l.physmessage_id "
+				"FROM %smimeparts p "
+				"JOIN %spartlists l ON p.id = l.part_id "
+				"JOIN %sphysmessage ph ON ph.id = l.physmessage_id "
+				"WHERE l.physmessage_id IN (%s) "
+				"ORDER BY l.physmessage_id, l.part_key, l.part_order ASC, l.part_depth DESC",
+				frag, esc, esc, columns, DBPFX, DBPFX, DBPFX, ids->str);
+
+		while (db_result_next(r)) {
+			uint64_t physid = db_result_get_u64(r, 15);
+			int k = GPOINTER_TO_UINT(g_hash_table_lookup(index, &physid)) - 1;
 
+			if (k < 0)
+				continue;
+			if (k != current) {
+				if (current >= 0) {
+					if ((msgs[current] = mime_assembly_finish(a)))
+						count++;
+				}
+				current = k;
+				seen[k] = TRUE;
+				mime_assembly_start(a, msgs[k]);
+			}
+			mime_assembly_add(a, r, sparse);
+		}
+		if (current >= 0) {
+			if ((msgs[current] = mime_assembly_finish(a)))
+				count++;
+			current = -1;
+		}
 	CATCH(SQLException)
 		LOG_SQLERROR;
-		t = DM_EQUERY;
 	FINALLY
 		db_con_close(c);
 	END_TRY;
 
-	if ((row == 0) || (t == DM_EQUERY)) {
-		if (m) p_string_free(m, TRUE);
-		p_string_free(n, TRUE);
-		return NULL;
+	/* interrupted halfway through a message */
+	if (current >= 0) {
+		a->failed = TRUE;
+		msgs[current] = mime_assembly_finish(a);
 	}
 
-	self = dbmail_message_init_with_string(self,p_string_str(m));
-	dbmail_message_set_internal_date(self, internal_date);
-	p_string_free(m,TRUE);
-	p_string_free(n,TRUE);
-	return self;
+	for (i = 0; i < n; i++) {
+		if (! seen[i])
+			msgs[i] = NULL;
+	}
+
+	g_free(a);
+	g_free(seen);
+	g_free(columns);
+	g_string_free(ids, TRUE);
+	g_hash_table_destroy(index);
+
+	return count;
+}
+
+static DbmailMessage * _mime_retrieve(DbmailMessage *self, gboolean sparse)
+{
+	DbmailMessage *list[1];
+
+	assert(dbmail_message_get_physid(self));
+
+	list[0] = self;
+	if (! _mime_retrieve_list(list, 1, sparse))
+		return NULL;
+
+	return list[0];
 }
 
 static gboolean store_mime_object(GMimeObject *parent, GMimeObject *object, DbmailMessage *m);
 
 static int store_head(GMimeObject *object, DbmailMessage *m)
 {
-	int r;
 	char *head = g_mime_object_get_headers(object, NULL);
-	r = store_blob(m, head, 1);
-	g_free(head);
-	return r;
+	if (! head) return 0;
+	return store_blob(m, head, strlen(head), 1, TRUE);
+}
+
+/* content types that gain nothing from compression */
+static gboolean precompressed(GMimeObject *object)
+{
+	const char *types[] = { "image", "audio", "video", NULL };
+	const char *subtypes[] = { "zip", "gzip", "x-gzip", "x-zip-compressed", "x-7z-compressed",
+		"x-rar-compressed", "vnd.rar", "x-bzip2", "x-xz", "zstd", "x-compress", NULL };
+	GMimeContentType *ct = g_mime_object_get_content_type(object);
+	const char *type, *subtype;
+	int i;
+
+	if (! ct)
+		return FALSE;
+	type = g_mime_content_type_get_media_type(ct);
+	subtype = g_mime_content_type_get_media_subtype(ct);
+
+	for (i = 0; type && types[i]; i++)
+		if (g_ascii_strcasecmp(type, types[i]) == 0)
+			return TRUE;
+
+	if (! (type && subtype && g_ascii_strcasecmp(type, "application") == 0))
+		return FALSE;
+
+	for (i = 0; subtypes[i]; i++)
+		if (g_ascii_strcasecmp(subtype, subtypes[i]) == 0)
+			return TRUE;
+
+	/* office documents are zip archives */
+	if (g_ascii_strncasecmp(subtype, "vnd.openxmlformats", 18) == 0 ||
+			g_ascii_strncasecmp(subtype, "vnd.oasis.opendocument", 22) == 0)
+		return TRUE;
+
+	return FALSE;
 }
 
 static int store_body(GMimeObject *object, DbmailMessage *m)
 {
-	int r;
-	char *text = g_mime_object_get_body(object);
+	size_t len;
+	char *text = _mime_object_get_body(object, &len);
 	if (! text) return 0;
-	if (strlen(text)==0) return 0;
-	r = store_blob(m, text, 0);
-	g_free(text);
-	return r;
+	if (len == 0) {
+		g_free(text);
+		return 0;
+	}
+	return store_blob(m, text, len, 0, ! precompressed(object));
 }
 
 static gboolean store_mime_text(GMimeObject *object, DbmailMessage *m, gboolean skiphead)
@@ -558,7 +1429,7 @@ static gboolean store_mime_multipart(GMimeObject *object, DbmailMessage *m, cons
 	postface = g_mime_multipart_get_epilogue((GMimeMultipart *)object);
 
 	if (g_mime_content_type_is_type(GMIME_CONTENT_TYPE(content_type), "multipart", "*") &&
-			store_blob(m, preface, 0) < 0) return TRUE;
+			store_string(m, preface) < 0) return TRUE;
 
 	if (boundary) {
 		m->part_depth++;
@@ -579,7 +1450,7 @@ static gboolean store_mime_multipart(GMimeObject *object, DbmailMessage *m, cons
 	}
 
 	if (g_mime_content_type_is_type(GMIME_CONTENT_TYPE(content_type), "multipart", "*") &&
-			store_blob(m, postface, 0) < 0) return TRUE;
+			store_string(m, postface) < 0) return TRUE;
 
 
 	return FALSE;
@@ -654,9 +1525,57 @@ gboolean store_mime_object(GMimeObject *parent, GMimeObject *object, DbmailMessa
 }
 
 
+static gboolean _message_store_parts(Connection_T c, DbmailMessage *m)
+{
+	gboolean r;
+
+	mimeparts_free(m);
+	m->part_key = 0;
+	m->part_depth = 0;
+	m->part_order = 0;
+
+	if (! (r = store_mime_object(NULL, (GMimeObject *)m->content, m)))
+		r = (mimeparts_store(c, m) != DM_SUCCESS);
+
+	if (! r && dm_fts_enabled()) {
+		Fts_T F = Fts_new();
+		GList *l = g_list_first(m->mimeparts);
+		while (l) {
+			struct mimepart *p = (struct mimepart *)l->data;
+			Fts_add(F, p->data, p->size, p->is_header, p->part_key);
+			l = g_list_next(l);
+		}
+		r = (Fts_store(F, c, m->id) != DM_SUCCESS);
+		Fts_free(&F);
+	}
+
+	return r;
+}
+
 gboolean dm_message_store(DbmailMessage *m)
 {
-	return store_mime_object(NULL, (GMimeObject *)m->content, m);
+	Connection_T c;
+	volatile gboolean r = TRUE;
+
+	c = db_con_get();
+	TRY
+		db_begin_transaction(c);
+		if (! (r = _message_store_parts(c, m)))
+			db_commit_transaction(c);
+		else
+			db_rollback_transaction(c);
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		db_rollback_transaction(c);
+		r = TRUE;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	partcache_update(m, ! r);
+	mimeparts_free(m);
+
+	return r;
 }
 
 
@@ -704,10 +1623,6 @@ DbmailMessage * dbmail_message_new(Mempool_T pool)
 	/* provide quick case-sensitive header value searches */
 	self->header_value = g_tree_new((GCompareFunc)strcmp);
 	
-	/* internal cache: header_dict[headername.name] = headername.id */
-	self->header_dict = g_hash_table_new_full((GHashFunc)g_str_hash,
-			(GEqualFunc)g_str_equal, (GDestroyNotify)g_free, (GDestroyNotify)g_free);
-	
 	/* set the charset */
 	self->charset = "utf-8";
 
@@ -737,8 +1652,12 @@ void dbmail_message_free(DbmailMessage *self)
 		self->crlf = NULL;
 	}
 
+	mimeparts_free(self);
+
+	if (self->elided)
+		g_hash_table_destroy(self->elided);
+
 	p_string_free(self->envelope_recipient,TRUE);
-	g_hash_table_destroy(self->header_dict);
 	g_tree_destroy(self->header_name);
 	g_tree_destroy(self->header_value);
 	
@@ -1095,7 +2014,7 @@ static DbmailMessage * _retrieve(DbmailMessage *self, const char *query_template
 	
 	store = self;
 
-	if ((self = _mime_retrieve(self)))
+	if ((self = _mime_retrieve(self, FALSE)))
 		return self;
 
 	/* 
@@ -1133,136 +2052,317 @@ static DbmailMessage * _retrieve(DbmailMessage *self, const char *query_template
 	self = dbmail_message_init_with_string(self,m->str);
 	dbmail_message_set_internal_date(self, internal_date);
 
-	if (internal_date) g_free(internal_date);
-	g_string_free(m,TRUE);
+	if (internal_date) g_free(internal_date);
+	g_string_free(m,TRUE);
+
+	return self;
+}
+
+/*
+ *
+ * retrieve the full message
+ *
+ */
+static DbmailMessage * _fetch_full(DbmailMessage *self) 
+{
+	const char *query_template = "SELECT b.messageblk, b.is_header, %s "
+		"FROM %smessageblks b "
+		"JOIN %sphysmessage p ON b.physmessage_id=p.id "
+		"WHERE b.physmessage_id = %" PRIu64 " "
+		"ORDER BY b.messageblk_idnr";
+	return _retrieve(self, query_template);
+}
+
+/* \brief retrieve message
+ * \param empty DbmailMessage
+ * \param physmessage_id
+ * \return filled DbmailMessage
+ */
+DbmailMessage * dbmail_message_retrieve(DbmailMessage *self, uint64_t physid)
+{
+	assert(physid);
+	DbmailMessage *ptr;
+	
+	dbmail_message_set_physid(self, physid);
+	ptr = self;
+	
+	self = _fetch_full(self);
+
+	if ((!self) || (! self->content)) {
+		TRACE(TRACE_ERR, "retrieval failed for physid [%" PRIu64 "]", physid);
+		dbmail_message_free(ptr);
+		return NULL;
+	}
+
+	return self;
+}
+
+/* \brief retrieve a message without the bodies of its large parts
+ * \param empty DbmailMessage
+ * \param physmessage_id
+ * \return filled DbmailMessage
+ *
+ * The bodies are replaced by placeholders, which dbmail_message_expand()
+ * swaps for the stored data. Fetching a single section this way only
+ * reads the parts that are sent.
+ */
+DbmailMessage * dbmail_message_retrieve_sparse(DbmailMessage *self, uint64_t physid)
+{
+	DbmailMessage *ptr;
+
+	assert(physid);
+	dbmail_message_set_physid(self, physid);
+	ptr = self;
+
+	if ((self = _mime_retrieve(self, TRUE)))
+		return self;
+
+	return dbmail_message_retrieve(ptr, physid);
+}
+
+/* \brief retrieve several messages with a single query
+ * \param msgs array of empty DbmailMessages
+ * \param physids their physmessage ids
+ * \param n number of messages
+ * \param sparse as dbmail_message_retrieve_sparse()
+ * \return number of messages retrieved
+ *
+ * Messages that can not be read this way, like those still in the
+ * messageblks table, are freed and set to NULL in msgs; retrieve them
+ * one by one instead.
+ */
+unsigned dbmail_message_retrieve_batch(DbmailMessage **msgs, const uint64_t *physids, unsigned n, gboolean sparse)
+{
+	DbmailMessage **orig;
+	unsigned i, count;
+
+	if (! n)
+		return 0;
+
+	orig = g_new0(DbmailMessage *, n);
+	for (i = 0; i < n; i++) {
+		assert(physids[i]);
+		dbmail_message_set_physid(msgs[i], physids[i]);
+		orig[i] = msgs[i];
+	}
+
+	count = _mime_retrieve_list(msgs, n, sparse);
+
+	for (i = 0; i < n; i++) {
+		if (! msgs[i])
+			dbmail_message_free(orig[i]);
+	}
+	g_free(orig);
+
+	TRACE(TRACE_DEBUG, "retrieved [%u/%u] messages", count, n);
+
+	return count;
+}
+
+static char * mimepart_load(uint64_t id, size_t *len)
+{
+	Connection_T c; PreparedStatement_T s; ResultSet_T r;
+	char * volatile data = NULL;
+	const char *esc = db_get_sql(SQL_ESCAPE_COLUMN);
+	char *enc = g_strdup_printf(db_get_sql(SQL_ENCODE_ESCAPE), "data");
+	size_t l = 0;
+
+	c = db_con_get();
+	TRY
+		s = db_stmt_prepare(c, "SELECT storage, hash, %ssize%s, codec, "
+				"CASE WHEN codec = 0 THEN %s END, CASE WHEN codec <> 0 THEN data END "
+				"FROM %smimeparts WHERE id = ?", esc, esc, enc, DBPFX);
+		db_stmt_set_u64(s, 1, id);
+		r = db_stmt_query(s);
+		if (db_result_next(r)) {
+			int bloblen = 0;
+			const void *blob;
+			if (db_result_get_int(r, 0) == MIMEPART_STORAGE_FILE) {
+				data = dm_partstore_get(db_result_get(r, 1), db_result_get_u64(r, 2), &l);
+			} else if (db_result_get_int(r, 3) != MIMEPART_CODEC_NONE) {
+				blob = db_result_get_blob(r, 5, &bloblen);
+				data = dm_mimepart_decode(db_result_get_int(r, 3), blob, bloblen, &l);
+			} else {
+				blob = db_result_get_blob(r, 4, &bloblen);
+				data = dm_mimepart_decode(MIMEPART_CODEC_NONE, blob, bloblen, &l);
+			}
+		}
+	CATCH(SQLException)
+		LOG_SQLERROR;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	g_free(enc);
 
-	return self;
-}
+	if (data)
+		*len = strlen(data);
 
-/*
- *
- * retrieve the full message
- *
- */
-static DbmailMessage * _fetch_full(DbmailMessage *self) 
-{
-	const char *query_template = "SELECT b.messageblk, b.is_header, %s "
-		"FROM %smessageblks b "
-		"JOIN %sphysmessage p ON b.physmessage_id=p.id "
-		"WHERE b.physmessage_id = %" PRIu64 " "
-		"ORDER BY b.messageblk_idnr";
-	return _retrieve(self, query_template);
+	return data;
 }
 
-/* \brief retrieve message
- * \param empty DbmailMessage
- * \param physmessage_id
- * \return filled DbmailMessage
+/* \brief put the parts left out by dbmail_message_retrieve_sparse()
+ * back into s, a serialized section of the message
+ * \param crlf s is CRLF encoded
+ * \return newly allocated string, or NULL on failure
  */
-DbmailMessage * dbmail_message_retrieve(DbmailMessage *self, uint64_t physid)
+char * dbmail_message_expand(const DbmailMessage *self, const char *s, gboolean crlf)
 {
-	assert(physid);
-	DbmailMessage *ptr;
-	
-	dbmail_message_set_physid(self, physid);
-	ptr = self;
-	
-	self = _fetch_full(self);
+	GHashTableIter iter;
+	gpointer key, value;
+	GString *out;
+
+	if (! self->elided)
+		return g_strdup(s);
+
+	out = g_string_new(s);
+	g_hash_table_iter_init(&iter, self->elided);
+	while (g_hash_table_iter_next(&iter, &key, &value)) {
+		const char *token = (const char *)key;
+		size_t tlen = strlen(token), len = 0, i;
+		char *data, *hit;
+		gssize pos = 0;
+
+		if (! strstr(out->str, token))
+			continue;
+
+		if (! (data = mimepart_load(*(uint64_t *)value, &len))) {
+			TRACE(TRACE_ERR, "unable to load mimepart [%" PRIu64 "]", *(uint64_t *)value);
+			g_string_free(out, TRUE);
+			return NULL;
+		}
 
-	if ((!self) || (! self->content)) {
-		TRACE(TRACE_ERR, "retrieval failed for physid [%" PRIu64 "]", physid);
-		dbmail_message_free(ptr);
-		return NULL;
+		while ((hit = strstr(out->str + pos, token))) {
+			GString *part = g_string_sized_new(len + (len / 32));
+			char prev;
+
+			pos = hit - out->str;
+			prev = pos ? out->str[pos-1] : 0;
+			for (i = 0; i < len; i++) {
+				if (crlf && data[i] == '\n' && prev != '\r')
+					g_string_append_c(part, '\r');
+				g_string_append_c(part, data[i]);
+				prev = data[i];
+			}
+			g_string_erase(out, pos, tlen);
+			g_string_insert_len(out, pos, part->str, part->len);
+			pos += part->len;
+			g_string_free(part, TRUE);
+		}
+		g_free(data);
 	}
 
-	return self;
+	return g_string_free(out, FALSE);
 }
 
 
-/* \brief store a temporary copy of a message.
+/* \brief update the meta-data of a freshly inserted message
  * \param 	filled DbmailMessage
+ * \param 	connection of the running store transaction
  * \return 
  *     - -1 on error
- *     -  1 on success
+ *     -  0 on success
+ *
+ * The temporary copy is owned by the delivery user, whose quota is
+ * not accounted. The recipients are charged by db_copymsg().
  */
-static int _update_message(DbmailMessage *self)
+static int _update_message(DbmailMessage *self, Connection_T c)
 {
 	uint64_t size    = (uint64_t)dbmail_message_get_size(self,FALSE);
 	uint64_t rfcsize = (uint64_t)dbmail_message_get_size(self,TRUE);
 
 	assert(size);
 	assert(rfcsize);
-	if (! db_update("UPDATE %sphysmessage SET messagesize = %" PRIu64 ", rfcsize = %" PRIu64 " WHERE id = %" PRIu64 "", 
+	if (! db_exec(c, "UPDATE %sphysmessage SET messagesize = %" PRIu64 ", rfcsize = %" PRIu64 " WHERE id = %" PRIu64 "", 
 			DBPFX, size, rfcsize, self->id))
 		return DM_EQUERY;
 
-	if (! db_update("UPDATE %smessages SET status = %d WHERE message_idnr = %" PRIu64 "", 
+	if (! db_exec(c, "UPDATE %smessages SET status = %d WHERE message_idnr = %" PRIu64 "", 
 			DBPFX, MESSAGE_STATUS_NEW, self->msg_idnr))
 		return DM_EQUERY;
 
-	if (! dm_quota_user_inc(db_get_useridnr(self->msg_idnr), size))
-		return DM_EQUERY;
-
 	return DM_SUCCESS;
 }
 
-
+/* \brief store a temporary copy of a message.
+ * \param 	filled DbmailMessage
+ * \return 
+ *     - -1 on error
+ *     -  0 on success
+ *
+ * All rows of the message - physmessage, message, mimeparts, partlists,
+ * header cache, references and envelope - are written over a single
+ * connection in a single transaction. A failed attempt is rolled back
+ * as a whole and retried.
+ */
 int dbmail_message_store(DbmailMessage *self)
 {
-	uint64_t user_idnr;
+	uint64_t user_idnr, mailbox_idnr;
 	char unique_id[UID_SIZE];
-	int res = 0, i = 1, retry = 10, delay = 200;
-	int step = 0;
+	int i = 1, retry = 10, delay = 200;
+	volatile int res = DM_EQUERY;
+	Connection_T c;
 	
 	if (! auth_user_exists(DBMAIL_DELIVERY_USERNAME, &user_idnr)) {
 		TRACE(TRACE_ERR, "unable to find user_idnr for user [%s]. Make sure this system user is in the database!", DBMAIL_DELIVERY_USERNAME);
 		return DM_EQUERY;
 	}
 	
+	if (db_find_create_mailbox(DBMAIL_TEMPMBOX, BOX_DEFAULT, user_idnr, &mailbox_idnr) == -1)
+		return DM_EQUERY;
+	
+	if (mailbox_idnr == 0) {
+		TRACE(TRACE_ERR, "mailbox [%s] could not be found!", DBMAIL_TEMPMBOX);
+		return DM_EQUERY;
+	}
+
 	create_unique_id(unique_id, user_idnr);
 
 	while (i++ < retry) {
-		if (step == 0) {
+		c = db_con_get();
+		TRY
+			db_begin_transaction(c);
+			res = DM_EQUERY;
 			/* create a message record */
-			if(_message_insert(self, user_idnr, DBMAIL_TEMPMBOX, unique_id) < 0) {
-				usleep(delay*i);
-				continue;
-			}
-			step++;
-		}
-		if (step == 1) {
-			/* update message meta-data and owner quota */
-			if ((res = _update_message(self) < 0)) {
-				usleep(delay*i);
-				continue;
-			}
-			step++;
-		}
-
-		if (step == 2) {
+			if (_message_insert(self, c, mailbox_idnr, unique_id) < 0)
+				TRACE(TRACE_WARNING, "Failed to insert message");
+			/* update message meta-data */
+			else if (_update_message(self, c) < 0)
+				TRACE(TRACE_WARNING, "Failed to update message");
 			/* store the message mime-parts */
-			if ((res = dm_message_store(self))) {
-				TRACE(TRACE_WARNING,"Failed to store mimeparts");
-				usleep(delay*i);
-				continue;
-			}
-			step++;
-		}
-
-		if (step == 3) {
+			else if (_message_store_parts(c, self))
+				TRACE(TRACE_WARNING, "Failed to store mimeparts");
 			/* store message headers */
-			if ((res = dbmail_message_cache_headers(self)) < 0) {
-				usleep(delay*i);
-				continue;
+			else if (_message_cache_headers(self, c) < 0)
+				TRACE(TRACE_WARNING, "Failed to cache headers");
+			else {
+				_message_cache_envelope(self, c);
+				res = DM_SUCCESS;
 			}
 
-			dbmail_message_cache_envelope(self);
+			if (res == DM_SUCCESS)
+				db_commit_transaction(c);
+			else
+				db_rollback_transaction(c);
+		CATCH(SQLException)
+			LOG_SQLERROR;
+			db_rollback_transaction(c);
+			res = DM_EQUERY;
+		FINALLY
+			db_con_close(c);
+		END_TRY;
+
+		partcache_update(self, res == DM_SUCCESS);
+		mimeparts_free(self);
+		if (res != DM_SUCCESS)
+			headername_cache_flush();
 
-			step++;
-		}
-		
-		/* ready */
-		break;
+		if (res == DM_SUCCESS)
+			break;
+
+		self->id = 0;
+		self->msg_idnr = 0;
+		usleep(delay*i);
 	}
 
 	return res;
@@ -1319,84 +2419,111 @@ static void insert_physmessage(DbmailMessage *self, Connection_T c)
 	}
 }
 
-int _message_insert(DbmailMessage *self, 
-		uint64_t user_idnr, 
-		const char *mailbox, 
+static int _message_insert(DbmailMessage *self, 
+		Connection_T c,
+		uint64_t mailbox_idnr, 
 		const char *unique_id)
 {
-	uint64_t mailboxid;
 	char *frag = NULL;
-	Connection_T c; ResultSet_T r;
-	volatile int t = 0;
+	ResultSet_T r;
 
 	assert(unique_id);
-	assert(mailbox);
-
-	if (db_find_create_mailbox(mailbox, BOX_DEFAULT, user_idnr, &mailboxid) == -1)
-		return -1;
-	
-	if (mailboxid == 0) {
-		TRACE(TRACE_ERR, "mailbox [%s] could not be found!", mailbox);
-		return -1;
-	}
 
 	/* insert a new physmessage entry */
-	
+	insert_physmessage(self, c);
+	if (! dbmail_message_get_physid(self))
+		return DM_EQUERY;
+
 	/* now insert an entry into the messages table */
-	c = db_con_get();
-	TRY
-		db_begin_transaction(c);
-		insert_physmessage(self, c);
+	if (db_params.db_driver == DM_DRIVER_ORACLE) {
+		db_exec(c, "INSERT INTO "
+				"%smessages(mailbox_idnr, physmessage_id, unique_id,"
+				"recent_flag, status) "
+				"VALUES (%" PRIu64 ", %" PRIu64 ", '%s', 1, %d)",
+				DBPFX, mailbox_idnr, dbmail_message_get_physid(self), unique_id,
+				MESSAGE_STATUS_INSERT);
+		self->msg_idnr = db_get_pk(c, "messages");
+	} else {
+		frag = db_returning("message_idnr");
+		r = db_query(c, "INSERT INTO "
+				"%smessages(mailbox_idnr, physmessage_id, unique_id,"
+				"recent_flag, status) "
+				"VALUES (%" PRIu64 ", %" PRIu64 ", '%s', 1, %d) %s",
+				DBPFX, mailbox_idnr, dbmail_message_get_physid(self), unique_id,
+				MESSAGE_STATUS_INSERT, frag);
+		g_free(frag);
+		self->msg_idnr = db_insert_result(c, r);
+	}
+	TRACE(TRACE_DEBUG,"new message_idnr [%" PRIu64 "]", self->msg_idnr);
 
-		if (db_params.db_driver == DM_DRIVER_ORACLE) {
-				db_exec(c, "INSERT INTO "
-						"%smessages(mailbox_idnr, physmessage_id, unique_id,"
-						"recent_flag, status) "
-						"VALUES (%" PRIu64 ", %" PRIu64 ", '%s', 1, %d)",
-						DBPFX, mailboxid, dbmail_message_get_physid(self), unique_id,
-						MESSAGE_STATUS_INSERT);
-				self->msg_idnr = db_get_pk(c, "messages");
-		} else {
-				frag = db_returning("message_idnr");
-				r = db_query(c, "INSERT INTO "
-						"%smessages(mailbox_idnr, physmessage_id, unique_id,"
-						"recent_flag, status) "
-						"VALUES (%" PRIu64 ", %" PRIu64 ", '%s', 1, %d) %s",
-						DBPFX, mailboxid, dbmail_message_get_physid(self), unique_id,
-						MESSAGE_STATUS_INSERT, frag);
-				g_free(frag);
-				self->msg_idnr = db_insert_result(c, r);
-		}
-		TRACE(TRACE_DEBUG,"new message_idnr [%" PRIu64 "]", self->msg_idnr);
-
-		t = DM_SUCCESS;
-		db_commit_transaction(c);
-	CATCH(SQLException)
-		LOG_SQLERROR;
-		db_rollback_transaction(c);
-		t = DM_EQUERY;
-	FINALLY
-		db_con_close(c);
-	END_TRY;
+	if (! self->msg_idnr)
+		return DM_EQUERY;
 
-	return t;
+	return DM_SUCCESS;
 }
 
 #define CACHE_WIDTH 255
 
-void _message_cache_envelope_date(const DbmailMessage *self)
+/* maximum number of rows per batched header cache statement */
+#define HEADER_BATCH 64
+
+/* one header to be cached, collected before anything is written */
+struct header {
+	char *name;		// lower case
+	char *value;
+	char *sortfield;
+	char *datefield;	// NULL if not a date
+	char hash[FIELDSIZE];
+	uint64_t name_id;
+	uint64_t value_id;
+};
+
+/* queue a header for _header_cache_flush, which takes over value */
+static void header_add(GList **headers, const char *name, char *value, const char *sortfield, const char *datefield)
+{
+	struct header *h = g_new0(struct header, 1);
+
+	if (dm_get_hash_for_string(value, h->hash)) {
+		g_free(value);
+		g_free(h);
+		return;
+	}
+
+	h->name = g_ascii_strdown(name, -1);
+	h->value = value;
+	h->sortfield = g_strdup(sortfield);
+	if (datefield && datefield[0])
+		h->datefield = g_strdup(datefield);
+
+	*headers = g_list_prepend(*headers, h);
+}
+
+static void headers_free(GList *headers)
+{
+	GList *l = g_list_first(headers);
+	while (l) {
+		struct header *h = (struct header *)l->data;
+		g_free(h->name);
+		g_free(h->value);
+		g_free(h->sortfield);
+		g_free(h->datefield);
+		g_free(h);
+		l = g_list_next(l);
+	}
+	g_list_free(headers);
+}
+
+static void _message_cache_envelope_date(const DbmailMessage *self, GList **headers)
 {
 	time_t date = self->internal_date;
 	GDateTime* gdate;
 	char *value;
 	char datefield[CACHE_WIDTH];
 	char sortfield[CACHE_WIDTH];
-	uint64_t headervalue_id = 0;
-	uint64_t headername_id = 0;
 
 	gdate = g_date_time_new_from_unix_local(self->internal_date);
 	value = g_mime_utils_header_format_date(gdate);
-	gdate = NULL;
+	g_date_time_unref(gdate);
 
 	memset(sortfield, 0, sizeof(sortfield));
 	strftime(sortfield, CACHE_WIDTH-1, "%Y-%m-%d %H:%M:%S", gmtime(&date));
@@ -1404,17 +2531,10 @@ void _message_cache_envelope_date(const DbmailMessage *self)
 	memset(datefield, 0, sizeof(datefield));
 	strftime(datefield, 20, "%Y-%m-%d", gmtime(&date));
 
-	_header_name_get_id(self, "Date", &headername_id);
-	if (headername_id)
-		_header_value_get_id(value, sortfield, datefield, &headervalue_id);
-
-	g_free(value);
-
-	if (headervalue_id && headername_id)
-		_header_insert(self->id, headername_id, headervalue_id);
+	header_add(headers, "Date", value, sortfield, datefield);
 }
 
-int dbmail_message_cache_headers(const DbmailMessage *self)
+static int _message_cache_headers(const DbmailMessage *self, Connection_T c)
 {
 	assert(self);
 	assert(self->id);
@@ -1422,6 +2542,8 @@ int dbmail_message_cache_headers(const DbmailMessage *self)
 	GMimeContentType *content_type;
 	GMimeContentDisposition *content_disp;
 	const char *header_name, *header_raw_value;
+	GList *cache = NULL;
+	volatile int t = DM_SUCCESS;
 
 	if (! GMIME_IS_MESSAGE(self->content)) {
 		TRACE(TRACE_ERR,"self->content is not a message");
@@ -1442,7 +2564,7 @@ int dbmail_message_cache_headers(const DbmailMessage *self)
 
 		header_name = g_mime_header_get_name (header);
 		header_raw_value = g_mime_header_get_raw_value (header);
-		_header_cache(header_name, header_raw_value, (gpointer)self);
+		_header_cache(self, &cache, header_name, header_raw_value);
 	}
 
 	/*
@@ -1452,13 +2574,13 @@ int dbmail_message_cache_headers(const DbmailMessage *self)
 	part = g_mime_message_get_mime_part(GMIME_MESSAGE(self->content));
 	if ((content_type = g_mime_object_get_content_type(part))) {
 		char *value = g_mime_content_type_get_mime_type(content_type);
-		_header_cache("content-type", (const char *)value, (gpointer)self);
+		_header_cache(self, &cache, "content-type", (const char *)value);
 		g_free(value);
 	}
 
 	if ((content_disp = g_mime_object_get_content_disposition(part))) {
 		char *value = g_mime_content_disposition_encode(content_disp, NULL);
-		_header_cache("content-disposition", (const char *)value, (gpointer)self);
+		_header_cache(self, &cache, "content-disposition", (const char *)value);
 		g_free(value);
 	}
 
@@ -1467,30 +2589,138 @@ int dbmail_message_cache_headers(const DbmailMessage *self)
 	 * 
 	 * */
 	if (! dbmail_message_get_header(self, "Date"))
-		_message_cache_envelope_date(self);
+		_message_cache_envelope_date(self, &cache);
+
+	/* 
+	 * write them using batched statements
+	 *
+	 * */
+	cache = g_list_reverse(cache);
+	TRY
+		_header_cache_flush(self, c, cache);
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		t = DM_EQUERY;
+	FINALLY
+		headers_free(cache);
+	END_TRY;
+
+	if (t == DM_EQUERY)
+		return -1;
 	
 	/* 
 	 * not all messages have a references field or a in-reply-to field 
 	 *
 	 * */
-	dbmail_message_cache_referencesfield(self);
+	_message_cache_referencesfield(self, c);
 
 	return DM_SUCCESS;
 }
 
+int dbmail_message_cache_headers(const DbmailMessage *self)
+{
+	Connection_T c; volatile int t = DM_EQUERY;
+
+	assert(self);
+	assert(self->id);
+
+	c = db_con_get();
+	TRY
+		db_begin_transaction(c);
+		if ((t = _message_cache_headers(self, c)) == DM_SUCCESS)
+			db_commit_transaction(c);
+		else
+			db_rollback_transaction(c);
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		db_rollback_transaction(c);
+		t = DM_EQUERY;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	if (t != DM_SUCCESS)
+		headername_cache_flush();
+
+	return t;
+}
+
 
 
-static int _header_name_get_id(const DbmailMessage *self, const char *header, uint64_t *id)
+/*
+ * process-wide map of lower case headername -> headername.id, loaded
+ * in full on first use. Names are only ever added to it; it is dropped
+ * when a store fails, in case dbmail-util deleted some of them.
+ */
+G_LOCK_DEFINE_STATIC(headernames);
+static GHashTable *headernames = NULL;
+
+static void headername_cache_flush(void)
 {
-	uint64_t *tmp = NULL;
-	gchar *case_header, *safe_header, *frag;
-	Connection_T c; ResultSet_T r; PreparedStatement_T s;
-	Field_T config;
-	volatile gboolean cache_readonly = true;
-	volatile int t = FALSE;
+	G_LOCK(headernames);
+	if (headernames) {
+		g_hash_table_destroy(headernames);
+		headernames = NULL;
+	}
+	G_UNLOCK(headernames);
+}
+
+static void headername_cache_add(GHashTable *names, const char *name, uint64_t id)
+{
+	uint64_t *tmp = g_new0(uint64_t, 1);
+	*tmp = id;
+	g_hash_table_replace(names, g_ascii_strdown(name, -1), tmp);
+}
+
+static void headername_cache_load(int *stmts)
+{
+	Connection_T c; ResultSet_T r;
+	GHashTable *names;
+	volatile int t = DM_SUCCESS;
+
+	G_LOCK(headernames);
+	names = headernames;
+	G_UNLOCK(headernames);
+	if (names)
+		return;
+
+	names = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+
+	c = db_con_get();
+	TRY
+		r = db_query(c, "SELECT id, headername FROM %sheadername", DBPFX);
+		while (db_result_next(r))
+			headername_cache_add(names, db_result_get(r, 1), db_result_get_u64(r, 0));
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		t = DM_EQUERY;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+	(*stmts)++;
+
+	if (t == DM_EQUERY) {
+		g_hash_table_destroy(names);
+		return;
+	}
+
+	TRACE(TRACE_DEBUG, "loaded [%u] headernames", g_hash_table_size(names));
+
+	G_LOCK(headernames);
+	if (! headernames) {
+		headernames = names;
+		names = NULL;
+	}
+	G_UNLOCK(headernames);
 
-	// rfc822 headernames are case-insensitive
-	safe_header = g_ascii_strdown(header,-1);
+	if (names)
+		g_hash_table_destroy(names);
+}
+
+static gboolean headername_cache_readonly(void)
+{
+	Field_T config;
+	gboolean cache_readonly = true;
 
 	config_get_value("header_cache_readonly", "DBMAIL", config);
 	if (strlen(config)) {
@@ -1498,220 +2728,353 @@ static int _header_name_get_id(const DbmailMessage *self, const char *header, ui
 			cache_readonly = false;
 		}
 	}
+	return cache_readonly;
+}
+
+/* return the names from 'headers' that are not in the map yet */
+static GList * headernames_lookup(GList *headers)
+{
+	GList *l, *missing = NULL;
+
+	G_LOCK(headernames);
+	for (l = g_list_first(headers); l; l = g_list_next(l)) {
+		struct header *h = (struct header *)l->data;
+		uint64_t *id = headernames ? g_hash_table_lookup(headernames, h->name) : NULL;
+		if (id)
+			h->name_id = *id;
+		else if (! g_list_find_custom(missing, h->name, (GCompareFunc)strcmp))
+			missing = g_list_prepend(missing, h->name);
+	}
+	G_UNLOCK(headernames);
+
+	return missing;
+}
+
+/*
+ * resolve the headername ids from the map. Names missing from it are
+ * looked up with one query, and inserted unless the headername table
+ * is read-only.
+ */
+static void headernames_resolve(Connection_T c, GList *headers, int *stmts)
+{
+	ResultSet_T r; PreparedStatement_T s;
+	GHashTable *found;
+	GList *missing, *l;
+	GString *q;
+	gchar *case_header, *frag;
+	int i;
+
+	headername_cache_load(stmts);
+
+	if (! (missing = headernames_lookup(headers)))
+		return;
+
+	found = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
 
 	case_header = g_strdup_printf(db_get_sql(SQL_STRCASE),"headername");
-	tmp = g_new0(uint64_t,1);
+	q = g_string_new("");
+	g_string_printf(q, "SELECT id, headername FROM %sheadername WHERE %s IN (", DBPFX, case_header);
+	g_free(case_header);
+	for (i = 0, l = missing; l; l = g_list_next(l), i++)
+		g_string_append(q, i ? ",?" : "?");
+	g_string_append(q, ")");
 
-	c = db_con_get();
+	db_con_clear(c);
+	s = db_stmt_prepare(c, "%s", q->str);
+	g_string_free(q, TRUE);
+	for (i = 0, l = missing; l; l = g_list_next(l), i++)
+		db_stmt_set_str(s, i+1, (const char *)l->data);
+	r = db_stmt_query(s);
+	(*stmts)++;
+	while (db_result_next(r))
+		headername_cache_add(found, db_result_get(r, 1), db_result_get_u64(r, 0));
 
-	TRY
-		db_begin_transaction(c);
-		*tmp = 0;
-		s = db_stmt_prepare(c, "SELECT id FROM %sheadername WHERE %s=?", DBPFX, case_header);
-		db_stmt_set_str(s,1,safe_header);
-		r = db_stmt_query(s);
+	for (l = missing; l; l = g_list_next(l)) {
+		const char *name = (const char *)l->data;
+		uint64_t id = 0;
 
-		if (db_result_next(r)) {
-			*tmp = db_result_get_u64(r,0);
-		} else if (cache_readonly) {
-			*tmp = 0;
-			TRACE(TRACE_DEBUG, "skip: [%s] since headername table is readonly", safe_header);
-		} else {
-			db_con_clear(c);
+		if (g_hash_table_lookup(found, name))
+			continue;
 
-			frag = db_returning("id");
-			s = db_stmt_prepare(c, "INSERT %s INTO %sheadername (headername) VALUES (?) %s",
-					db_get_sql(SQL_IGNORE), DBPFX, frag);
-			g_free(frag);
+		if (headername_cache_readonly()) {
+			TRACE(TRACE_DEBUG, "skip: [%s] since headername table is readonly", name);
+			continue;
+		}
 
-			db_stmt_set_str(s,1,safe_header);
+		db_con_clear(c);
 
-			if (db_params.db_driver == DM_DRIVER_ORACLE) {
-				db_stmt_exec(s);
-				*tmp = db_get_pk(c, "headername");
-			} else {
-				r = db_stmt_query(s);
-				*tmp = db_insert_result(c, r);
-			}
+		frag = db_returning("id");
+		s = db_stmt_prepare(c, "INSERT %s INTO %sheadername (headername) VALUES (?) %s",
+				db_get_sql(SQL_IGNORE), DBPFX, frag);
+		g_free(frag);
+
+		db_stmt_set_str(s,1,name);
+
+		if (db_params.db_driver == DM_DRIVER_ORACLE) {
+			db_stmt_exec(s);
+			id = db_get_pk(c, "headername");
+		} else {
+			r = db_stmt_query(s);
+			id = db_insert_result(c, r);
 		}
-		t = TRUE;
-		db_commit_transaction(c);
+		(*stmts)++;
 
-	CATCH(SQLException)
-		LOG_SQLERROR;
-		db_rollback_transaction(c);
-		t = DM_EQUERY;
-	FINALLY
-		db_con_close(c);
-	END_TRY;
+		TRACE(TRACE_DEBUG,"Adding headername: [%s] [%" PRIu64 "]", name, id);
+		if (id)
+			headername_cache_add(found, name, id);
+	}
+	g_list_free(missing);
 
-	g_free(case_header);
+	for (l = g_list_first(headers); l; l = g_list_next(l)) {
+		struct header *h = (struct header *)l->data;
+		uint64_t *id;
+		if (h->name_id == 0 && (id = g_hash_table_lookup(found, h->name)))
+			h->name_id = *id;
+	}
 
-	if (t == DM_EQUERY) {
-		g_free(safe_header);
-		g_free(tmp);
-		return t;
+	/* a newly inserted name is only shared once this transaction commits,
+	 * but a store that rolls back flushes the map anyway */
+	G_LOCK(headernames);
+	if (headernames) {
+		GHashTableIter iter;
+		gpointer key, value;
+		g_hash_table_iter_init(&iter, found);
+		while (g_hash_table_iter_next(&iter, &key, &value))
+			headername_cache_add(headernames, (const char *)key, *(uint64_t *)value);
 	}
+	G_UNLOCK(headernames);
+
+	g_hash_table_destroy(found);
+}
+
+/*
+ * resolve the ids of headervalues that are already stored, with one
+ * multi-hash lookup per batch. Values are compared here rather than in
+ * SQL, to cover hash collisions.
+ */
+static void headervalues_resolve(Connection_T c, GList *todo, int *stmts)
+{
+	ResultSet_T r; PreparedStatement_T s;
+	GList *batch = g_list_first(todo);
+
+	while (batch) {
+		GList *chunk = batch, *l;
+		GString *q = g_string_new("");
+		int i, n = 0;
+
+		g_string_printf(q, "SELECT id, hash, headervalue FROM %sheadervalue WHERE hash IN (", DBPFX);
+		while (batch && n < HEADER_BATCH) {
+			g_string_append(q, n ? ",?" : "?");
+			batch = g_list_next(batch);
+			n++;
+		}
+		g_string_append(q, ")");
+
+		db_con_clear(c);
+		s = db_stmt_prepare(c, "%s", q->str);
+		g_string_free(q, TRUE);
 
-	*id = *tmp;
-	TRACE(TRACE_DEBUG,"Adding cache: [%s] [%lu]", safe_header, *tmp);
-	g_hash_table_insert(self->header_dict, (gpointer)(safe_header), (gpointer)(tmp));
-	return 1;
+		for (i = 0, l = chunk; i < n; i++, l = g_list_next(l))
+			db_stmt_set_str(s, i+1, ((struct header *)l->data)->hash);
+
+		r = db_stmt_query(s);
+		(*stmts)++;
+		while (db_result_next(r)) {
+			uint64_t id = db_result_get_u64(r, 0);
+			const char *hash = db_result_get(r, 1);
+			const void *blob;
+			int len = 0;
+
+			blob = db_result_get_blob(r, 2, &len);
+
+			for (i = 0, l = chunk; i < n; i++, l = g_list_next(l)) {
+				struct header *h = (struct header *)l->data;
+				if (h->value_id || (! MATCH(h->hash, hash)))
+					continue;
+				if (((size_t)len != strlen(h->value)) || (len && memcmp(blob, h->value, len)))
+					continue;
+				h->value_id = id;
+			}
+		}
+	}
 }
 
-static uint64_t _header_value_exists(Connection_T c, const char *value, const char *hash)
+/* rows per insert statement: Oracle has no multi-row VALUES */
+static int header_insert_batch(void)
 {
-	ResultSet_T r; PreparedStatement_T s;
-	uint64_t id = 0;
-	char blob_cmp[DEF_FRAGSIZE];
-	memset(blob_cmp, 0, sizeof(blob_cmp));
+	if (db_params.db_driver == DM_DRIVER_ORACLE)
+		return 1;
+	return HEADER_BATCH;
+}
 
-	if (db_params.db_driver == DM_DRIVER_ORACLE && strlen(value) > DM_ORA_MAX_BYTES_LOB_CMP) {
-		/** Value greater then DM_ORA_MAX_BYTES_LOB_CMP will cause SQL exception */
-		return 0;
+/* insert the unresolved headervalues using multi-row inserts. The same
+ * value occurring more than once in a message is inserted once. */
+static void headervalues_insert(Connection_T c, GList *todo, int *stmts)
+{
+	PreparedStatement_T s;
+	GList *batch, *unique = NULL, *l, *k;
+	int max = header_insert_batch();
+
+	for (l = g_list_first(todo); l; l = g_list_next(l)) {
+		struct header *h = (struct header *)l->data;
+		gboolean seen = FALSE;
+		for (k = unique; k; k = g_list_next(k)) {
+			struct header *u = (struct header *)k->data;
+			if (MATCH(u->hash, h->hash) && (strcmp(u->value, h->value) == 0)) {
+				seen = TRUE;
+				break;
+			}
+		}
+		if (! seen)
+			unique = g_list_append(unique, h);
 	}
-	db_con_clear(c);
-	snprintf(blob_cmp, DEF_FRAGSIZE-1, db_get_sql(SQL_COMPARE_BLOB), "headervalue");
-
-	s = db_stmt_prepare(c, "SELECT id FROM %sheadervalue WHERE hash=? AND %s", DBPFX, blob_cmp);
-	db_stmt_set_str(s, 1, hash);
-	db_stmt_set_blob(s, 2, value, strlen(value));
 
-	r = db_stmt_query(s);
-	if (db_result_next(r))
-		id = db_result_get_u64(r,0);
+	batch = unique;
+	while (batch) {
+		GList *chunk = batch;
+		GString *q = g_string_new("");
+		int i, j, n = 0;
+
+		g_string_printf(q, "INSERT INTO %sheadervalue (hash, headervalue, sortfield, datefield) VALUES ", DBPFX);
+		while (batch && n < max) {
+			g_string_append(q, n ? ",(?,?,?,?)" : "(?,?,?,?)");
+			batch = g_list_next(batch);
+			n++;
+		}
 
-	return id;
+		db_con_clear(c);
+		s = db_stmt_prepare(c, "%s", q->str);
+		g_string_free(q, TRUE);
 
+		for (i = 0, j = 1, l = chunk; i < n; i++, l = g_list_next(l)) {
+			struct header *h = (struct header *)l->data;
+			db_stmt_set_str(s, j++, h->hash);
+			db_stmt_set_blob(s, j++, h->value, strlen(h->value));
+			db_stmt_set_str(s, j++, h->sortfield);
+			db_stmt_set_str(s, j++, h->datefield);
+		}
+		db_stmt_exec(s);
+		(*stmts)++;
+		TRACE(TRACE_DATABASE, "inserted [%d] headervalues", n);
+	}
+	g_list_free(unique);
 }
 
-static uint64_t _header_value_insert(Connection_T c, const char *value, const char *sortfield, const char *datefield, const char *hash)
+/* insert the header rows that are not present yet */
+static void headers_insert(Connection_T c, uint64_t physid, GList *headers, int *stmts)
 {
 	ResultSet_T r; PreparedStatement_T s;
-	uint64_t id = 0;
-	char *frag;
-	size_t datesize = 0;
-
-	if (datefield)
-		datesize = strlen(datefield);
+	GList *todo = NULL, *batch, *l, *k;
+	int max = header_insert_batch();
 
+	/* rows from an earlier, partial run of dbmail-util -b */
 	db_con_clear(c);
+	s = db_stmt_prepare(c, "SELECT headername_id, headervalue_id FROM %sheader "
+			"WHERE physmessage_id = ?", DBPFX);
+	db_stmt_set_u64(s, 1, physid);
+	r = db_stmt_query(s);
+	(*stmts)++;
+	while (db_result_next(r)) {
+		uint64_t name_id = db_result_get_u64(r, 0);
+		uint64_t value_id = db_result_get_u64(r, 1);
+		for (l = g_list_first(headers); l; l = g_list_next(l)) {
+			struct header *h = (struct header *)l->data;
+			if (h->name_id == name_id && h->value_id == value_id) {
+				TRACE(TRACE_INFO, "Header already inserted: [%" PRIu64 "] [%" PRIu64 "] [%" PRIu64 "]",
+						physid, name_id, value_id);
+				h->value_id = 0;
+			}
+		}
+	}
 
-	frag = db_returning("id");
-	if (datesize)
-		s = db_stmt_prepare(c, "INSERT INTO %sheadervalue (hash, headervalue, sortfield, datefield) VALUES (?,?,?,?) %s", DBPFX, frag);
-	else
-		s = db_stmt_prepare(c, "INSERT INTO %sheadervalue (hash, headervalue, sortfield) VALUES (?,?,?) %s", DBPFX, frag);
-	g_free(frag);
+	for (l = g_list_first(headers); l; l = g_list_next(l)) {
+		struct header *h = (struct header *)l->data;
+		gboolean seen = FALSE;
+		if (! (h->name_id && h->value_id))
+			continue;
+		for (k = todo; k; k = g_list_next(k)) {
+			struct header *u = (struct header *)k->data;
+			if (u->name_id == h->name_id && u->value_id == h->value_id) {
+				seen = TRUE;
+				break;
+			}
+		}
+		if (! seen)
+			todo = g_list_append(todo, h);
+	}
 
-	db_stmt_set_str(s, 1, hash);
-	db_stmt_set_blob(s, 2, value, strlen(value));
-	db_stmt_set_str(s, 3, sortfield);
-	if (datesize)
-		db_stmt_set_str(s, 4, datefield);
+	batch = todo;
+	while (batch) {
+		GList *chunk = batch;
+		GString *q = g_string_new("");
+		int i, j, n = 0;
+
+		g_string_printf(q, "INSERT INTO %sheader (physmessage_id, headername_id, headervalue_id) VALUES ", DBPFX);
+		while (batch && n < max) {
+			g_string_append(q, n ? ",(?,?,?)" : "(?,?,?)");
+			batch = g_list_next(batch);
+			n++;
+		}
 
-	if (db_params.db_driver == DM_DRIVER_ORACLE) {
+		db_con_clear(c);
+		s = db_stmt_prepare(c, "%s", q->str);
+		g_string_free(q, TRUE);
+
+		for (i = 0, j = 1, l = chunk; i < n; i++, l = g_list_next(l)) {
+			struct header *h = (struct header *)l->data;
+			db_stmt_set_u64(s, j++, physid);
+			db_stmt_set_u64(s, j++, h->name_id);
+			db_stmt_set_u64(s, j++, h->value_id);
+		}
 		db_stmt_exec(s);
-		id = db_get_pk(c, "headervalue");
-	} else {
-		r = db_stmt_query(s);
-		id = db_insert_result(c, r);
+		(*stmts)++;
 	}
-	TRACE(TRACE_DATABASE,"new headervalue.id [%" PRIu64 "]", id);
-
-	return id;
+	g_list_free(todo);
 }
 
-static int _header_value_get_id(const char *value, const char *sortfield, const char *datefield, uint64_t *id)
+/*
+ * write the collected headers: resolve all names, then all values,
+ * insert the missing values and finally the header rows, each in as
+ * few statements as possible.
+ */
+static int _header_cache_flush(const DbmailMessage *self, Connection_T c, GList *headers)
 {
-	uint64_t tmp = 0;
-	char hash[FIELDSIZE];
-	memset(hash, 0, sizeof(hash));
-
-	Connection_T c;
-	if (dm_get_hash_for_string(value, hash))
-		return FALSE;
-
-	c = db_con_get();
-	// Test if header already inserted
-	TRY
-		db_begin_transaction(c);
-		if ((tmp = _header_value_exists(c, value, (const char *)hash)) != 0)
-			*id = tmp;
-		else if ((tmp = _header_value_insert(c, value, sortfield, datefield, (const char *)hash)) != 0)
-			*id = tmp;
-		db_commit_transaction(c);
-	CATCH(SQLException)
-		LOG_SQLERROR;
-		db_rollback_transaction(c);
-		*id = 0;
-	FINALLY
-		db_con_close(c);
-	END_TRY;
+	GList *todo = NULL, *l;
+	int stmts = 0;
 
-	return TRUE;
-}
+	if (! headers)
+		return 0;
 
-static gboolean _header_insert(uint64_t physmessage_id, uint64_t headername_id, uint64_t headervalue_id)
-{
+	headernames_resolve(c, headers, &stmts);
 
-	Connection_T c; PreparedStatement_T s; volatile gboolean t = TRUE;
-	ResultSet_T r;
-	volatile uint64_t header_found = 0;
+	for (l = g_list_first(headers); l; l = g_list_next(l)) {
+		struct header *h = (struct header *)l->data;
+		if (h->name_id)
+			todo = g_list_prepend(todo, h);
+	}
+	todo = g_list_reverse(todo);
 
-	TRACE(TRACE_DEBUG, "Inserting header: [%lu] [%lu] [%lu]", physmessage_id, headername_id, headervalue_id);
-	c = db_con_get();
-	db_con_clear(c);
+	headervalues_resolve(c, todo, &stmts);
 
-	// Check if the header exists
-	TRY
-		db_begin_transaction(c);
-		s = db_stmt_prepare(c, "SELECT count(*) "
-			"FROM %sheader "
-			"WHERE physmessage_id = ? "
-			"AND headername_id = ? "
-			"AND headervalue_id = ?", DBPFX);
-		db_stmt_set_u64(s, 1, physmessage_id);
-		db_stmt_set_u64(s, 2, headername_id);
-		db_stmt_set_u64(s, 3, headervalue_id);
-		r = db_stmt_query(s);
-		while (ResultSet_next(r)) {
-			header_found = db_result_get_u64(r, 0);
-		}
-		db_commit_transaction(c);
-	CATCH(SQLException)
-		LOG_SQLWARNING;
-		db_rollback_transaction(c);
-	FINALLY
-		db_con_close(c);
-	END_TRY;
+	for (l = g_list_first(todo); l; ) {
+		GList *next = g_list_next(l);
+		if (((struct header *)l->data)->value_id)
+			todo = g_list_delete_link(todo, l);
+		l = next;
+	}
 
-	// Return if the header exists
-	if (header_found == 1) {
-		TRACE(TRACE_INFO, "Header already inserted: [%lu] [%lu] [%lu]", physmessage_id, headername_id, headervalue_id);
-		return t;
+	if (todo) {
+		headervalues_insert(c, todo, &stmts);
+		headervalues_resolve(c, todo, &stmts);
 	}
+	g_list_free(todo);
 
-	c = db_con_get();
-	db_con_clear(c);
+	headers_insert(c, self->id, headers, &stmts);
 
-	TRY
-		db_begin_transaction(c);
-		s = db_stmt_prepare(c, "INSERT INTO %sheader (physmessage_id, headername_id, headervalue_id) VALUES (?,?,?)", DBPFX);
-		db_stmt_set_u64(s, 1, physmessage_id);
-		db_stmt_set_u64(s, 2, headername_id);
-		db_stmt_set_u64(s, 3, headervalue_id);
-		db_stmt_exec(s);
-		db_commit_transaction(c);
-	CATCH(SQLException)
-		LOG_SQLWARNING;
-		db_rollback_transaction(c);
-		t = FALSE;
-	FINALLY
-		db_con_close(c);
-	END_TRY;
-	
-	return t;
+	TRACE(TRACE_DEBUG, "physmessage [%" PRIu64 "] cached [%u] headers in [%d] statements",
+			self->id, g_list_length(headers), stmts);
+
+	return stmts;
 }
 
 static GString * _header_addresses(InternetAddressList *ialist)
@@ -1768,11 +3131,8 @@ static GString * _header_addresses(InternetAddressList *ialist)
 	return store;
 }
 
-static void _header_cache(const char *header, const char *raw, gpointer user_data)
+static void _header_cache(const DbmailMessage *self, GList **headers, const char *header, const char *raw)
 {
-	uint64_t headername_id = 0;
-	uint64_t headervalue_id;
-	DbmailMessage *self = (DbmailMessage *)user_data;
 	GDateTime *date;
 	gchar* date_fmt;
 	volatile gboolean isaddr = 0, isdate = 0, issubject = 0;
@@ -1791,11 +3151,6 @@ static void _header_cache(const char *header, const char *raw, gpointer user_dat
 
 	TRACE(TRACE_DEBUG,"headername [%s]", header);
 
-	if ((_header_name_get_id(self, header, &headername_id) < 0))
-		return;
-	if (! headername_id)
-		return;
-
 	if (g_ascii_strcasecmp(header,"From")==0)
 		isaddr=1;
 	else if (g_ascii_strcasecmp(header,"To")==0)
@@ -1817,8 +3172,8 @@ static void _header_cache(const char *header, const char *raw, gpointer user_dat
 	value = g_strstrip(value);
 
 	TRACE(TRACE_DEBUG,
-		"headername [%s] id [%lu] raw [%s] value [%s] isaddr [%d] issubject [%d] isdate [%d]",
-		header, headername_id, raw, value, isaddr, issubject, isdate
+		"headername [%s] raw [%s] value [%s] isaddr [%d] issubject [%d] isdate [%d]",
+		header, raw, value, isaddr, issubject, isdate
 	);
 
 	if ((! value) || (strlen(value) == 0)) {
@@ -1890,48 +3245,25 @@ static void _header_cache(const char *header, const char *raw, gpointer user_dat
 	if (sortfield[0] == '\0')
 		g_utf8_strncpy(sortfield, value, CACHE_WIDTH-1);
 
-	/* Fetch header value id if exists, else insert, and return new id */
-	_header_value_get_id(value, sortfield, datefield, &headervalue_id);
-
-	g_free(value);
-
-	/* Insert relation between physmessage, header name and header value */
-	if (headervalue_id)
-		_header_insert(self->id, headername_id, headervalue_id);
-	else
-		TRACE(TRACE_INFO, "error inserting headervalue. skipping.");
-
-	headervalue_id=0;
+	header_add(headers, header, value, sortfield, datefield);
 
 	emaillist=NULL;
 }
 
-static void insert_field_cache(uint64_t physid, const char *field, const char *value)
+static void insert_field_cache(Connection_T c, uint64_t physid, const char *field, const char *value)
 {
-	gchar *clean_value;
-	Connection_T c; PreparedStatement_T s;
+	char clean_value[CACHE_WIDTH+1];
+	PreparedStatement_T s;
 
 	g_return_if_fail(value != NULL);
 
 	/* field values are truncated to 255 bytes */
-	clean_value = g_strndup(value,CACHE_WIDTH);
+	g_strlcpy(clean_value, value, sizeof(clean_value));
 
-	c = db_con_get();
-	TRY
-		db_begin_transaction(c);
-		s = db_stmt_prepare(c,"INSERT INTO %s%sfield (physmessage_id, %sfield) VALUES (?,?)", DBPFX, field, field);
-		db_stmt_set_u64(s, 1, physid);
-		db_stmt_set_str(s, 2, clean_value);
-		db_stmt_exec(s);
-		db_commit_transaction(c);
-	CATCH(SQLException)
-		LOG_SQLERROR;
-		db_rollback_transaction(c);
-		TRACE(TRACE_ERR, "insert %sfield failed [%s]", field, value);
-	FINALLY
-		db_con_close(c);
-	END_TRY;
-	g_free(clean_value);
+	s = db_stmt_prepare(c,"INSERT INTO %s%sfield (physmessage_id, %sfield) VALUES (?,?)", DBPFX, field, field);
+	db_stmt_set_u64(s, 1, physid);
+	db_stmt_set_str(s, 2, clean_value);
+	db_stmt_exec(s);
 }
 
 
@@ -1940,20 +3272,24 @@ static void insert_field_cache(uint64_t physid, const char *field, const char *v
 #define DM_ADDRESS_TYPE_FROM "From"
 #define DM_ADDRESS_TYPE_REPL "Reply-to"
 
-void dbmail_message_cache_referencesfield(const DbmailMessage *self)
+static void _message_cache_referencesfield(const DbmailMessage *self, Connection_T c)
 {
 	GMimeReferences *refs;
 	GTree *tree;
 	const char *referencesfield, *inreplytofield;
-	char *field;
+	GString *field = g_string_new("");
 
 	referencesfield = (char *)dbmail_message_get_header(self,"References");
 	inreplytofield = (char *)dbmail_message_get_header(self,"In-Reply-To");
 
 	// Some clients will put parent in the in-reply-to header only and the grandparents and older in references
-	field = g_strconcat(referencesfield, " ", inreplytofield, NULL);
-	refs = g_mime_references_parse(NULL, field);
-	g_free(field);
+	if (referencesfield && strlen(referencesfield))
+		g_string_append(field, referencesfield);
+	if (inreplytofield && strlen(inreplytofield))
+		g_string_append_printf(field, "%s%s", field->len ? " " : "", inreplytofield);
+
+	refs = field->len ? g_mime_references_parse(NULL, field->str) : NULL;
+	g_string_free(field, TRUE);
 
 	if (! refs) {
 		TRACE(TRACE_DEBUG, "reference_decode failed [%" PRIu64 "]", self->id);
@@ -1970,7 +3306,7 @@ void dbmail_message_cache_referencesfield(const DbmailMessage *self)
 		msgid = g_mime_references_get_message_id (refs, i);
 
 		if (! g_tree_lookup(tree, (gconstpointer) msgid)) {
-			insert_field_cache(self->id, "references", msgid);
+			insert_field_cache(c, self->id, "references", msgid);
 			g_tree_insert(tree, (char *)msgid, (char *)msgid);
 		}
 	}
@@ -1979,31 +3315,99 @@ void dbmail_message_cache_referencesfield(const DbmailMessage *self)
 	g_mime_references_free(refs);
 }
 
-void dbmail_message_cache_envelope(const DbmailMessage *self)
+void dbmail_message_cache_referencesfield(const DbmailMessage *self)
 {
-	char *envelope = NULL;
-	Connection_T c; PreparedStatement_T s;
-
-	envelope = imap_get_envelope(GMIME_MESSAGE(self->content));
+	Connection_T c;
 
 	c = db_con_get();
 	TRY
 		db_begin_transaction(c);
-		s = db_stmt_prepare(c, "INSERT INTO %senvelope (physmessage_id, envelope) VALUES (?,?)", DBPFX);
+		_message_cache_referencesfield(self, c);
+		db_commit_transaction(c);
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		db_rollback_transaction(c);
+		TRACE(TRACE_ERR, "insert referencesfield failed [%" PRIu64 "]", self->id);
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+}
+
+static void _message_cache_envelope(const DbmailMessage *self, Connection_T c)
+{
+	char *envelope = NULL, *bodystructure = NULL, *body = NULL;
+	PreparedStatement_T s;
+
+	envelope = imap_get_envelope(GMIME_MESSAGE(self->content));
+	bodystructure = imap_get_structure(GMIME_MESSAGE(self->content), 1);
+	body = imap_get_structure(GMIME_MESSAGE(self->content), 0);
+
+	TRY
+		s = db_stmt_prepare(c, "INSERT INTO %senvelope (physmessage_id, envelope, bodystructure, body) "
+				"VALUES (?,?,?,?)", DBPFX);
 		db_stmt_set_u64(s, 1, self->id);
 		db_stmt_set_str(s, 2, envelope);
+		db_stmt_set_str(s, 3, bodystructure);
+		db_stmt_set_str(s, 4, body);
 		db_stmt_exec(s);
+	FINALLY
+		g_free(envelope);
+		g_free(bodystructure);
+		g_free(body);
+	END_TRY;
+}
+
+void dbmail_message_cache_envelope(const DbmailMessage *self)
+{
+	Connection_T c;
+
+	c = db_con_get();
+	TRY
+		db_begin_transaction(c);
+		_message_cache_envelope(self, c);
 		db_commit_transaction(c);
 	CATCH(SQLException)
 		LOG_SQLWARNING;
 		db_rollback_transaction(c);
-		TRACE(TRACE_WARNING, "insert envelope failed [%s]", envelope);
+		TRACE(TRACE_WARNING, "insert envelope failed [%" PRIu64 "]", self->id);
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+}
+
+/* fill in the BODYSTRUCTURE and BODY of an existing envelope row */
+void dbmail_message_cache_bodystructure(const DbmailMessage *self)
+{
+	Connection_T c;
+	PreparedStatement_T s;
+	char *bodystructure, *body;
+
+	bodystructure = imap_get_structure(GMIME_MESSAGE(self->content), 1);
+	body = imap_get_structure(GMIME_MESSAGE(self->content), 0);
+	if (! (bodystructure && body)) {
+		TRACE(TRACE_WARNING, "no body structure for [%" PRIu64 "]", self->id);
+		g_free(bodystructure);
+		g_free(body);
+		return;
+	}
+
+	c = db_con_get();
+	TRY
+		s = db_stmt_prepare(c, "UPDATE %senvelope SET bodystructure = ?, body = ? "
+				"WHERE physmessage_id = ?", DBPFX);
+		db_stmt_set_str(s, 1, bodystructure);
+		db_stmt_set_str(s, 2, body);
+		db_stmt_set_u64(s, 3, self->id);
+		db_stmt_exec(s);
+	CATCH(SQLException)
+		LOG_SQLWARNING;
+		TRACE(TRACE_WARNING, "update bodystructure failed [%" PRIu64 "]", self->id);
 	FINALLY
 		db_con_close(c);
 	END_TRY;
 
-	g_free(envelope);
-	envelope = NULL;
+	g_free(bodystructure);
+	g_free(body);
 }
 
 // 
@@ -2270,15 +3674,12 @@ dsn_class_t sort_and_deliver(DbmailMessage *message,
 	return ret;
 }
 
-dsn_class_t sort_deliver_to_mailbox(DbmailMessage *message,
-		uint64_t useridnr, const char *mailbox, mailbox_source source,
-		int *msgflags, GList *keywords)
+/* the mailbox to deliver to: mailbox, or INBOX if the user may not
+ * post to it */
+static dsn_class_t sort_find_mailbox(uint64_t useridnr, const char *mailbox,
+		mailbox_source source, uint64_t *mboxidnr)
 {
-	uint64_t mboxidnr = 0, newmsgidnr = 0;
-	Field_T val;
-	size_t msgsize = (uint64_t)dbmail_message_get_size(message, FALSE);
-
-	if (db_find_create_mailbox(mailbox, source, useridnr, &mboxidnr) != 0) {
+	if (db_find_create_mailbox(mailbox, source, useridnr, mboxidnr) != 0) {
 		TRACE(TRACE_ERR, "mailbox [%s] not found", mailbox);
 		return DSN_CLASS_FAIL;
 	}
@@ -2295,7 +3696,7 @@ dsn_class_t sort_deliver_to_mailbox(DbmailMessage *message,
         
 		// don't load the full mailbox state
 		MailboxState_T S = MailboxState_new(NULL, 0);
-		MailboxState_setId(S, mboxidnr);
+		MailboxState_setId(S, *mboxidnr);
 		permission = acl_has_right(S, useridnr, ACL_RIGHT_POST);
 		MailboxState_free(&S);
 		
@@ -2314,7 +3715,7 @@ dsn_class_t sort_deliver_to_mailbox(DbmailMessage *message,
 				TRACE(TRACE_NOTICE, "already tried to deliver to INBOX");
 				return DSN_CLASS_FAIL;
 			}
-			return sort_deliver_to_mailbox(message, useridnr, "INBOX", BOX_DEFAULT, msgflags, keywords);
+			return sort_find_mailbox(useridnr, "INBOX", BOX_DEFAULT, mboxidnr);
 		case 1:
 			// Has right.
 			TRACE(TRACE_INFO, "user [%" PRIu64 "] has right to deliver mail to [%s]",
@@ -2326,15 +3727,38 @@ dsn_class_t sort_deliver_to_mailbox(DbmailMessage *message,
 		}
 	}
 
-	// if the mailbox already holds this message we're done
+	return DSN_CLASS_OK;
+}
+
+// if the mailbox already holds this message we're done
+static gboolean sort_is_duplicate(DbmailMessage *message, uint64_t mboxidnr)
+{
+	Field_T val;
+
 	GETCONFIGVALUE("suppress_duplicates", "DELIVERY", val);
 	if (strcasecmp(val,"yes") == 0) {
 		const char *messageid = dbmail_message_get_header(message, "message-id");
 		if ( messageid && ((db_mailbox_has_message_id(mboxidnr, messageid)) > 0) ) {
 			TRACE(TRACE_INFO, "suppress_duplicate: [%s]", messageid);
-			return DSN_CLASS_OK;
+			return TRUE;
 		}
 	}
+	return FALSE;
+}
+
+dsn_class_t sort_deliver_to_mailbox(DbmailMessage *message,
+		uint64_t useridnr, const char *mailbox, mailbox_source source,
+		int *msgflags, GList *keywords)
+{
+	uint64_t mboxidnr = 0, newmsgidnr = 0;
+	size_t msgsize = (uint64_t)dbmail_message_get_size(message, FALSE);
+	dsn_class_t ret;
+
+	if ((ret = sort_find_mailbox(useridnr, mailbox, source, &mboxidnr)) != DSN_CLASS_OK)
+		return ret;
+
+	if (sort_is_duplicate(message, mboxidnr))
+		return DSN_CLASS_OK;
 
 	// Ok, we have the ACL right, time to deliver the message.
 	switch (db_copymsg(message->msg_idnr, mboxidnr, useridnr, &newmsgidnr)) {
@@ -2966,6 +4390,137 @@ int send_forward_list(DbmailMessage *message, GList *targets, const char *from)
 }
 
 
+/* a recipient that only gets the implicit keep into INBOX can share a
+ * batched copy; the others are sorted one by one */
+static gboolean sort_batchable(DbmailMessage *message, Delivery_T *delivery,
+		uint64_t useridnr, uint64_t *mboxidnr)
+{
+	Field_T val;
+	char into[1024];
+
+	if (delivery->mailbox || delivery->source == BOX_BRUTEFORCE)
+		return FALSE;
+
+	memset(into,0,sizeof(into));
+	if (get_mailbox_from_filters(message, useridnr, NULL, into, sizeof(into)-1))
+		return FALSE;
+
+	config_get_value("SUBADDRESS", "DELIVERY", val);
+	if (strcasecmp(val, "yes") == 0) {
+		int res;
+		char *subaddress = NULL;
+		size_t sublen, subpos;
+		res = find_bounded((char *)delivery->address, '+', '@', &subaddress, &sublen, &subpos);
+		g_free(subaddress);
+		if (res > 0 && sublen > 0)
+			return FALSE;
+	}
+
+	config_get_value("SIEVE", "DELIVERY", val);
+	if (strcasecmp(val, "yes") == 0 && dm_sievescript_isactive(useridnr))
+		return FALSE;
+
+	if (sort_find_mailbox(useridnr, "INBOX", BOX_DEFAULT, mboxidnr) != DSN_CLASS_OK)
+		return FALSE;
+
+	return (! sort_is_duplicate(message, *mboxidnr));
+}
+
+/* copy the message for a batch of recipients. Those not copied are
+ * left at DSN_CLASS_NONE, to be retried one by one */
+static void sort_deliver_batch(DbmailMessage *message, CopyTarget_T *targets,
+		unsigned *slots, unsigned n, dsn_class_t *results)
+{
+	unsigned i;
+
+	if (! n)
+		return;
+
+	TRACE(TRACE_DEBUG, "copying message [%" PRIu64 "] to [%u] mailboxes", message->msg_idnr, n);
+	db_copymsg_many(message->msg_idnr, targets, n);
+
+	for (i = 0; i < n; i++) {
+		switch (targets[i].result) {
+		case DM_SUCCESS:
+			TRACE(TRACE_NOTICE, "useridnr [%" PRIu64 "] mailbox [%" PRIu64 "] message [%" PRIu64 "] is inserted",
+					targets[i].user_idnr, targets[i].mailbox_idnr, targets[i].message_idnr);
+			results[slots[i]] = DSN_CLASS_OK;
+			break;
+		case DM_OVERQUOTA:
+			TRACE(TRACE_ERR, "error copying message to user [%" PRIu64 "],"
+					"maxmail exceeded", targets[i].user_idnr);
+			results[slots[i]] = DSN_CLASS_QUOTA;
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+/* deliver to the recipients that can share a copy in batches of up to
+ * delivery_batch, before they are walked one by one. Returns the result
+ * per local recipient, in order, or NULL if nothing was batched */
+static dsn_class_t * sort_deliver_batches(DbmailMessage *message, List_T dsnusers)
+{
+	int batch = config_get_value_default_int("delivery_batch", "DELIVERY", 100);
+	unsigned recipients = 0, slot = 0, n = 0;
+	dsn_class_t *results;
+	CopyTarget_T *targets;
+	unsigned *slots;
+	GHashTable *pending;
+	List_T l;
+
+	if (batch < 2)
+		return NULL;
+
+	for (l = p_list_first(dsnusers); l; l = p_list_next(l))
+		recipients += g_list_length(((Delivery_T *)p_list_data(l))->userids);
+
+	if (recipients < 2)
+		return NULL;
+
+	results = g_new0(dsn_class_t, recipients);
+	targets = g_new0(CopyTarget_T, batch);
+	slots = g_new0(unsigned, batch);
+	pending = g_hash_table_new(g_int64_hash, g_int64_equal);
+
+	for (l = p_list_first(dsnusers); l; l = p_list_next(l)) {
+		Delivery_T *delivery = (Delivery_T *)p_list_data(l);
+		GList *userids;
+
+		for (userids = g_list_first(delivery->userids); userids; userids = g_list_next(userids), slot++) {
+			uint64_t useridnr = *(uint64_t *)userids->data;
+			uint64_t mboxidnr = 0;
+
+			if (! sort_batchable(message, delivery, useridnr, &mboxidnr))
+				continue;
+
+			// one copy per mailbox and batch, so duplicates are suppressed
+			if (g_hash_table_lookup(pending, &mboxidnr))
+				continue;
+
+			targets[n].user_idnr = useridnr;
+			targets[n].mailbox_idnr = mboxidnr;
+			targets[n].message_idnr = 0;
+			slots[n] = slot;
+			g_hash_table_insert(pending, &targets[n].mailbox_idnr, &targets[n]);
+
+			if (++n == (unsigned)batch) {
+				sort_deliver_batch(message, targets, slots, n, results);
+				g_hash_table_remove_all(pending);
+				n = 0;
+			}
+		}
+	}
+	sort_deliver_batch(message, targets, slots, n, results);
+
+	g_hash_table_destroy(pending);
+	g_free(targets);
+	g_free(slots);
+
+	return results;
+}
+
 /* Here's the real *meat* of this source file!
  *
  * Function: insert_messages()
@@ -2980,6 +4535,7 @@ int send_forward_list(DbmailMessage *message, GList *targets, const char *from)
  *     - External forwards
  *     - No such user bounces
  *   - Store the local useridnr's
+ *     - Copy the message in batches for users without sorting rules
  *     - Run the message through each user's sorting rules
  *     - Potentially alter the delivery:
  *       - Different mailbox
@@ -3003,6 +4559,8 @@ int insert_messages(DbmailMessage *message, List_T dsnusers)
 	int result=0;
 	Field_T val;
 	gboolean quota_softfail = FALSE;
+	dsn_class_t *batched = NULL;
+	unsigned slot = 0;
 
  	delivery_status_t final_dsn;
 
@@ -3027,6 +4585,8 @@ int insert_messages(DbmailMessage *message, List_T dsnusers)
 	// Code would go here, after we've stored the message 
 	// before we've started delivering it
 
+	batched = sort_deliver_batches(message, dsnusers);
+
 	/* Loop through the users list. */
 	dsnusers = p_list_first(dsnusers);
 	while (dsnusers) {
@@ -3042,9 +4602,17 @@ int insert_messages(DbmailMessage *message, List_T dsnusers)
 		userids = g_list_first(delivery->userids);
 		while (userids) {
 			uint64_t *useridnr = (uint64_t *) userids->data;
+			dsn_class_t ret;
 
-			TRACE(TRACE_DEBUG, "calling sort_and_deliver for useridnr [%" PRIu64 "]", *useridnr);
-			switch (sort_and_deliver(message, delivery->address, *useridnr, delivery->mailbox, delivery->source)) {
+			if (batched && batched[slot] != DSN_CLASS_NONE) {
+				ret = batched[slot];
+			} else {
+				TRACE(TRACE_DEBUG, "calling sort_and_deliver for useridnr [%" PRIu64 "]", *useridnr);
+				ret = sort_and_deliver(message, delivery->address, *useridnr, delivery->mailbox, delivery->source);
+			}
+			slot++;
+
+			switch (ret) {
 			case DSN_CLASS_OK:
 				TRACE(TRACE_INFO, "successful sort_and_deliver for useridnr [%" PRIu64 "]", *useridnr);
 				ok = 1;
@@ -3132,6 +4700,8 @@ int insert_messages(DbmailMessage *message, List_T dsnusers)
 		dsnusers = p_list_next(dsnusers);
 	}
 
+	g_free(batched);
+
 	/* Always delete the temporary message, even if the delivery failed.
 	 * It is the MTA's job to requeue or bounce the message,
 	 * and our job to keep a tidy database ;-) */
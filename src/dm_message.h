@@ -59,7 +59,20 @@ int dbmail_message_store(DbmailMessage *message);
 int dbmail_message_cache_headers(const DbmailMessage *message);
 gboolean dm_message_store(DbmailMessage *m);
 
+/* process-wide (hash, size) -> mimepart id cache */
+void dm_mimepart_cache_flush(void);
+void dm_mimepart_cache_stats(uint64_t *hits, uint64_t *misses);
+
+/* encoding of dbmail_mimeparts.data */
+#define MIMEPART_CODEC_NONE 0
+#define MIMEPART_CODEC_GZIP 1
+
+char * dm_mimepart_decode(int codec, const char *data, size_t len, size_t *outlen);
+
 DbmailMessage * dbmail_message_retrieve(DbmailMessage *self, uint64_t physid);
+DbmailMessage * dbmail_message_retrieve_sparse(DbmailMessage *self, uint64_t physid);
+unsigned dbmail_message_retrieve_batch(DbmailMessage **msgs, const uint64_t *physids, unsigned n, gboolean sparse);
+char * dbmail_message_expand(const DbmailMessage *self, const char *s, gboolean crlf);
 
 /*
  * attribute accessors
@@ -99,6 +112,7 @@ GList * dbmail_message_get_header_repeated(const DbmailMessage *self, const char
 
 void dbmail_message_cache_referencesfield(const DbmailMessage *self);
 void dbmail_message_cache_envelope(const DbmailMessage *self);
+void dbmail_message_cache_bodystructure(const DbmailMessage *self);
 
 /*
  * destructor
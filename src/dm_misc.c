@@ -2376,12 +2376,11 @@ char **base64_decodev(char *str)
 	return ret;
 }
 
-int dm_get_hash_for_string(const char *buf, char *digest)
+static hashid dm_get_hash_type(void)
 {
 	Field_T hash_algorithm;
 	static hashid type;
 	static int initialized=0;
-	int result=0;
 
 	if (! initialized) {
 		if (config_get_value("hash_algorithm", "DBMAIL", hash_algorithm) < 0)
@@ -2406,7 +2405,14 @@ int dm_get_hash_for_string(const char *buf, char *digest)
 		initialized=1;
 	}
 
-	switch(type) {
+	return type;
+}
+
+int dm_get_hash_for_string(const char *buf, char *digest)
+{
+	int result=0;
+
+	switch(dm_get_hash_type()) {
 		case MHASH_MD5:
 			result=dm_md5(buf,digest);
 		break;
@@ -2434,6 +2440,28 @@ int dm_get_hash_for_string(const char *buf, char *digest)
 	return result;
 }
 
+/*
+ * like dm_get_hash_for_string, for len bytes of buf. If checksum is
+ * not NULL, the data is fed to it in the same pass.
+ */
+int dm_get_hash_for_data(const char *buf, size_t len, GChecksum *checksum, char *digest)
+{
+	return dm_digest_data(dm_get_hash_type(), buf, len, checksum, digest);
+}
+
+/* is hash_algorithm at least as strong as SHA-256 */
+gboolean dm_get_hash_is_strong(void)
+{
+	switch (dm_get_hash_type()) {
+		case MHASH_SHA256:
+		case MHASH_SHA512:
+		case MHASH_WHIRLPOOL:
+			return TRUE;
+		default:
+			return FALSE;
+	}
+}
+
 gchar *get_crlf_encoded_opt(const char *in, int dots)
 {
 	char prev = 0, curr = 0, *t, *out;
@@ -2488,6 +2516,47 @@ char * dm_base64_decode(const gchar *s, uint64_t *len)
 	return r;
 }
 
+static char * _gzip_filter(GMimeFilterGZipMode mode, const char *buf, size_t len, size_t *outlen)
+{
+	GMimeStream *stream, *fstream;
+	GMimeFilter *filter;
+	GByteArray *array;
+	char *out;
+
+	stream = g_mime_stream_mem_new();
+	fstream = g_mime_stream_filter_new(stream);
+	filter = g_mime_filter_gzip_new(mode, 6);
+	g_mime_stream_filter_add((GMimeStreamFilter *)fstream, filter);
+	g_object_unref(filter);
+
+	if ((g_mime_stream_write(fstream, buf, len) < 0) || (g_mime_stream_flush(fstream) < 0)) {
+		g_object_unref(fstream);
+		g_object_unref(stream);
+		return NULL;
+	}
+	g_object_unref(fstream);
+
+	array = g_mime_stream_mem_get_byte_array((GMimeStreamMem *)stream);
+	out = g_new0(char, array->len + 1);
+	memcpy(out, array->data, array->len);
+	*outlen = array->len;
+	g_object_unref(stream);
+
+	return out;
+}
+
+/* gzip compress len bytes of buf; returns NULL on failure */
+char * dm_deflate(const char *buf, size_t len, size_t *outlen)
+{
+	return _gzip_filter(GMIME_FILTER_GZIP_MODE_ZIP, buf, len, outlen);
+}
+
+/* reverse dm_deflate; the result is NUL terminated */
+char * dm_inflate(const char *buf, size_t len, size_t *outlen)
+{
+	return _gzip_filter(GMIME_FILTER_GZIP_MODE_UNZIP, buf, len, outlen);
+}
+
 
 uint64_t stridx(const char *s, char c)
 {
@@ -192,9 +192,14 @@ char **base64_decodev(char *in);
 
 /* create a string containing the cryptographic checksum for buf */
 int dm_get_hash_for_string(const char *buf, char *hash);
+int dm_get_hash_for_data(const char *buf, size_t len, GChecksum *checksum, char *hash);
+gboolean dm_get_hash_is_strong(void);
 
 char * dm_base64_decode(const gchar *s, uint64_t *len);
 
+char * dm_deflate(const char *buf, size_t len, size_t *outlen);
+char * dm_inflate(const char *buf, size_t len, size_t *outlen);
+
 uint64_t stridx(const char *s, char c);
 
 #define get_crlf_encoded(string) get_crlf_encoded_opt(string, 0)
@@ -0,0 +1,255 @@
+/*
+ Copyright (c) 2020-2026 Alan Hicks, Persistent Objects Ltd support@p-o.co.uk
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either
+ version 2 of the License, or (at your option) any later
+ version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+#include "dbmail.h"
+
+#define THIS_MODULE "notify"
+
+#define NOTIFY_MSGLEN 64
+
+static char notify_dir[FIELDSIZE];
+static volatile gboolean initialized = FALSE;
+
+/* listener state, only touched from the event loop */
+static int listen_fd = -1;
+static char *listen_path = NULL;
+static struct event *listen_event = NULL;
+static NotifyHandler_T listen_handler = NULL;
+
+/* one socket shared by all publishing threads */
+G_LOCK_DEFINE_STATIC(publish);
+static int publish_fd = -1;
+
+static void notify_init(void)
+{
+	Field_T value;
+
+	if (initialized)
+		return;
+
+	memset(notify_dir, 0, sizeof(notify_dir));
+	config_get_value("notify_directory", "DBMAIL", value);
+	g_strlcpy(notify_dir, value, sizeof(notify_dir));
+	while (strlen(notify_dir) > 1 && notify_dir[strlen(notify_dir)-1] == '/')
+		notify_dir[strlen(notify_dir)-1] = '\0';
+
+	initialized = TRUE;
+}
+
+static gboolean notify_address(struct sockaddr_un *sa, const char *dir, const char *name)
+{
+	memset(sa, 0, sizeof(*sa));
+	sa->sun_family = AF_UNIX;
+	if (snprintf(sa->sun_path, sizeof(sa->sun_path), "%s/%s", dir, name) >= (int)sizeof(sa->sun_path)) {
+		TRACE(TRACE_WARNING, "socket path too long [%s/%s]", dir, name);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+int dm_notify_bind(const char *dir, char **path)
+{
+	struct sockaddr_un sa;
+	char name[32];
+	int fd;
+
+	assert(dir);
+
+	if (g_mkdir_with_parents(dir, 0770)) {
+		int serr = errno;
+		TRACE(TRACE_ERR, "unable to create [%s]: %s", dir, strerror(serr));
+		return -1;
+	}
+
+	snprintf(name, sizeof(name), "%d%s", (int)getpid(), DM_NOTIFY_EXT);
+	if (! notify_address(&sa, dir, name))
+		return -1;
+
+	if ((fd = socket(AF_UNIX, SOCK_DGRAM, 0)) < 0) {
+		int serr = errno;
+		TRACE(TRACE_ERR, "socket failed: %s", strerror(serr));
+		return -1;
+	}
+
+	/* left behind by an earlier process with our pid */
+	unlink(sa.sun_path);
+
+	if (bind(fd, (struct sockaddr *)&sa, sizeof(sa))) {
+		int serr = errno;
+		TRACE(TRACE_ERR, "bind [%s] failed: %s", sa.sun_path, strerror(serr));
+		close(fd);
+		return -1;
+	}
+	chmod(sa.sun_path, 0660);
+	UNBLOCK(fd);
+
+	if (path)
+		*path = g_strdup(sa.sun_path);
+
+	TRACE(TRACE_DEBUG, "listening on [%s]", sa.sun_path);
+
+	return fd;
+}
+
+int dm_notify_send(const char *dir, uint64_t mailbox_id, uint64_t seq)
+{
+	struct sockaddr_un sa;
+	char msg[NOTIFY_MSGLEN];
+	const char *name;
+	GDir *d;
+	int len, sent = 0;
+
+	assert(dir);
+
+	if (! (d = g_dir_open(dir, 0, NULL)))
+		return 0;
+
+	len = snprintf(msg, sizeof(msg), "%" PRIu64 " %" PRIu64, mailbox_id, seq);
+
+	G_LOCK(publish);
+	if (publish_fd < 0) {
+		if ((publish_fd = socket(AF_UNIX, SOCK_DGRAM, 0)) >= 0)
+			UNBLOCK(publish_fd);
+	}
+	while (publish_fd >= 0 && (name = g_dir_read_name(d))) {
+		if (! g_str_has_suffix(name, DM_NOTIFY_EXT))
+			continue;
+		if (! notify_address(&sa, dir, name))
+			continue;
+		if (sendto(publish_fd, msg, len, MSG_DONTWAIT,
+					(struct sockaddr *)&sa, sizeof(sa)) == len) {
+			sent++;
+			continue;
+		}
+		if (errno == ECONNREFUSED) {
+			/* nobody is bound to it anymore */
+			TRACE(TRACE_DEBUG, "remove stale socket [%s]", sa.sun_path);
+			unlink(sa.sun_path);
+		} else {
+			/* listener is backed up; it will poll */
+			int serr = errno;
+			TRACE(TRACE_DEBUG, "sendto [%s] failed: %s", sa.sun_path, strerror(serr));
+		}
+	}
+	G_UNLOCK(publish);
+
+	g_dir_close(d);
+
+	return sent;
+}
+
+gboolean dm_notify_read(int fd, uint64_t *mailbox_id, uint64_t *seq)
+{
+	char msg[NOTIFY_MSGLEN];
+	char *end = NULL;
+	ssize_t len;
+
+	while ((len = recv(fd, msg, sizeof(msg) - 1, MSG_DONTWAIT)) >= 0) {
+		msg[len] = '\0';
+		*mailbox_id = strtoull(msg, &end, 10);
+		if (end && end != msg && *end == ' ') {
+			*seq = strtoull(end + 1, NULL, 10);
+			return TRUE;
+		}
+		TRACE(TRACE_DEBUG, "ignore malformed notification [%s]", msg);
+	}
+	return FALSE;
+}
+
+void dm_notify_publish(uint64_t mailbox_id, uint64_t seq)
+{
+	notify_init();
+	if (! notify_dir[0] || ! mailbox_id)
+		return;
+
+	dm_notify_send(notify_dir, mailbox_id, seq);
+}
+
+void dm_notify_publish_users(void)
+{
+	notify_init();
+	if (! notify_dir[0])
+		return;
+
+	dm_notify_send(notify_dir, DM_NOTIFY_USERS, 0);
+}
+
+void dm_notify_publish_mimeparts(void)
+{
+	notify_init();
+	if (! notify_dir[0])
+		return;
+
+	dm_notify_send(notify_dir, DM_NOTIFY_MIMEPARTS, 0);
+}
+
+static void notify_cb(int fd, short UNUSED what, void UNUSED *arg)
+{
+	uint64_t mailbox_id, seq;
+
+	while (dm_notify_read(fd, &mailbox_id, &seq)) {
+		TRACE(TRACE_DEBUG, "mailbox [%" PRIu64 "] seq [%" PRIu64 "]", mailbox_id, seq);
+		listen_handler(mailbox_id, seq);
+	}
+}
+
+gboolean dm_notify_start(struct event_base *base, NotifyHandler_T handler)
+{
+	assert(base);
+	assert(handler);
+
+	notify_init();
+	if (! notify_dir[0]) {
+		TRACE(TRACE_INFO, "notify_directory not set; change notification disabled");
+		return FALSE;
+	}
+
+	if ((listen_fd = dm_notify_bind(notify_dir, &listen_path)) < 0)
+		return FALSE;
+
+	listen_handler = handler;
+	listen_event = event_new(base, listen_fd, EV_READ|EV_PERSIST, notify_cb, NULL);
+	event_add(listen_event, NULL);
+
+	TRACE(TRACE_NOTICE, "listening for mailbox changes on [%s]", listen_path);
+
+	return TRUE;
+}
+
+gboolean dm_notify_listening(void)
+{
+	return (listen_fd >= 0);
+}
+
+void dm_notify_stop(void)
+{
+	if (listen_event) {
+		event_free(listen_event);
+		listen_event = NULL;
+	}
+	if (listen_fd >= 0) {
+		close(listen_fd);
+		listen_fd = -1;
+	}
+	if (listen_path) {
+		unlink(listen_path);
+		g_free(listen_path);
+		listen_path = NULL;
+	}
+}
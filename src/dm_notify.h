@@ -0,0 +1,65 @@
+/*
+ Copyright (c) 2020-2026 Alan Hicks, Persistent Objects Ltd support@p-o.co.uk
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either
+ version 2 of the License, or (at your option) any later
+ version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+/*
+ * mailbox change notification
+ *
+ * Every process that wants to hear about changes binds a datagram
+ * socket <notify_directory>/<pid>.sock. A change to a mailbox is sent
+ * as "<mailbox_idnr> <seq>" to all sockets in the directory; sockets
+ * of processes that have gone away are removed by the sender.
+ *
+ * Delivery is best effort: a datagram is dropped rather than block the
+ * sender, so listeners keep polling as a fallback.
+ *
+ * Mailbox 0 means users, aliases or forwards changed, mailbox
+ * DM_NOTIFY_MIMEPARTS that dbmail-util deleted mimeparts.
+ */
+
+#ifndef DM_NOTIFY_H
+#define DM_NOTIFY_H
+
+#define DM_NOTIFY_EXT ".sock"
+#define DM_NOTIFY_USERS 0
+#define DM_NOTIFY_MIMEPARTS G_MAXUINT64
+
+typedef void (*NotifyHandler_T)(uint64_t mailbox_id, uint64_t seq);
+
+/* publish a change of mailbox_id to all listeners in notify_directory */
+void dm_notify_publish(uint64_t mailbox_id, uint64_t seq);
+
+/* publish a change of users, aliases or forwards */
+void dm_notify_publish_users(void);
+
+/* publish that mimeparts were deleted */
+void dm_notify_publish_mimeparts(void);
+
+/* listen for changes on the event base; handler is called from the
+ * event loop. Returns FALSE if notification is not configured or the
+ * socket could not be set up */
+gboolean dm_notify_start(struct event_base *base, NotifyHandler_T handler);
+gboolean dm_notify_listening(void);
+void dm_notify_stop(void);
+
+/* transport primitives */
+int dm_notify_bind(const char *dir, char **path);
+int dm_notify_send(const char *dir, uint64_t mailbox_id, uint64_t seq);
+gboolean dm_notify_read(int fd, uint64_t *mailbox_id, uint64_t *seq);
+
+#endif
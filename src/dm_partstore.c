@@ -0,0 +1,304 @@
+/*
+ Copyright (c) 2020-2026 Alan Hicks, Persistent Objects Ltd support@p-o.co.uk
+
+ This program is free software; you can redistribute it and/or 
+ modify it under the terms of the GNU General Public License 
+ as published by the Free Software Foundation; either 
+ version 2 of the License, or (at your option) any later 
+ version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+#include "dbmail.h"
+#include <utime.h>
+
+#define THIS_MODULE "partstore"
+
+static char store_dir[FIELDSIZE];
+static size_t store_threshold = DM_PARTSTORE_THRESHOLD;
+static volatile gboolean initialized = FALSE;
+
+static void partstore_init(void)
+{
+	Field_T value;
+
+	if (initialized)
+		return;
+
+	memset(store_dir, 0, sizeof(store_dir));
+	config_get_value("mimepart_store_dir", "DBMAIL", value);
+	g_strlcpy(store_dir, value, sizeof(store_dir));
+	while (strlen(store_dir) > 1 && store_dir[strlen(store_dir)-1] == '/')
+		store_dir[strlen(store_dir)-1] = '\0';
+
+	store_threshold = config_get_value_default_int("mimepart_store_threshold", "DBMAIL", DM_PARTSTORE_THRESHOLD);
+	if (store_dir[0])
+		TRACE(TRACE_INFO, "storing mimeparts of [%zu] bytes and up in [%s]", store_threshold, store_dir);
+
+	initialized = TRUE;
+}
+
+gboolean dm_partstore_wants(size_t size)
+{
+	partstore_init();
+	if (! store_dir[0])
+		return FALSE;
+	if (db_params.db_driver == DM_DRIVER_ORACLE)
+		return FALSE;
+	return (size > 0 && size >= store_threshold);
+}
+
+char * dm_partstore_path(const char *hash, size_t size)
+{
+	char key[FIELDSIZE];
+	size_t i;
+
+	partstore_init();
+	if (! store_dir[0])
+		return NULL;
+
+	/* hash columns may be blank padded; anything else than hex
+	 * digits would escape the store */
+	for (i = 0; hash[i] && hash[i] != ' ' && i < sizeof(key)-1; i++) {
+		if (! g_ascii_isxdigit(hash[i]))
+			return NULL;
+		key[i] = g_ascii_tolower(hash[i]);
+	}
+	key[i] = '\0';
+
+	if (i < 4)
+		return NULL;
+
+	return g_strdup_printf("%s/%.2s/%.2s/%s.%zu", store_dir, key, key+2, key, size);
+}
+
+static gboolean partstore_compare(const char *path, const char *data, size_t size)
+{
+	GMappedFile *map;
+	GError *err = NULL;
+	gboolean t = FALSE;
+
+	if (! (map = g_mapped_file_new(path, FALSE, &err))) {
+		TRACE(TRACE_ERR, "unable to map [%s]: %s", path, err->message);
+		g_error_free(err);
+		return FALSE;
+	}
+	if ((size_t)g_mapped_file_get_length(map) == size)
+		t = (size == 0 || memcmp(g_mapped_file_get_contents(map), data, size) == 0);
+	g_mapped_file_unref(map);
+
+	return t;
+}
+
+/* 
+ * write a part to the store, unless it is already there.
+ *
+ * returns DM_SUCCESS, DM_EGENERAL if a different part with the same
+ * hash and size is present, or DM_EQUERY on failure
+ */
+int dm_partstore_put(const char *hash, const char *data, size_t size)
+{
+	char *path, *dir, *tmp = NULL;
+	int fd = -1, t = DM_EQUERY;
+	size_t done = 0;
+
+	if (! (path = dm_partstore_path(hash, size)))
+		return DM_EQUERY;
+
+	if (g_file_test(path, G_FILE_TEST_EXISTS)) {
+		if (partstore_compare(path, data, size)) {
+			/* keep the garbage collector away from a
+			 * part that is being referenced again */
+			utime(path, NULL);
+			t = DM_SUCCESS;
+		} else {
+			TRACE(TRACE_WARNING, "[%s] exists with different content", path);
+			t = DM_EGENERAL;
+		}
+		g_free(path);
+		return t;
+	}
+
+	dir = g_path_get_dirname(path);
+	if (g_mkdir_with_parents(dir, 0700) < 0) {
+		TRACE(TRACE_ERR, "unable to create [%s]: %s", dir, strerror(errno));
+		goto done;
+	}
+
+	tmp = g_strdup_printf("%s.XXXXXX", path);
+	if ((fd = g_mkstemp_full(tmp, O_WRONLY, 0600)) < 0) {
+		TRACE(TRACE_ERR, "unable to create [%s]: %s", tmp, strerror(errno));
+		goto done;
+	}
+
+	while (done < size) {
+		ssize_t n = write(fd, data + done, size - done);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			TRACE(TRACE_ERR, "write to [%s] failed: %s", tmp, strerror(errno));
+			goto done;
+		}
+		done += n;
+	}
+
+	if (fsync(fd) < 0) {
+		TRACE(TRACE_ERR, "fsync of [%s] failed: %s", tmp, strerror(errno));
+		goto done;
+	}
+	close(fd);
+	fd = -1;
+
+	/* identical content may have been written concurrently: the
+	 * rename replaces it atomically */
+	if (rename(tmp, path) < 0) {
+		TRACE(TRACE_ERR, "rename [%s] failed: %s", tmp, strerror(errno));
+		goto done;
+	}
+
+	TRACE(TRACE_DEBUG, "stored [%zu] bytes in [%s]", size, path);
+	t = DM_SUCCESS;
+
+done:
+	if (fd >= 0)
+		close(fd);
+	if (tmp && t != DM_SUCCESS)
+		unlink(tmp);
+	g_free(tmp);
+	g_free(dir);
+	g_free(path);
+
+	return t;
+}
+
+char * dm_partstore_get(const char *hash, size_t size, size_t *len)
+{
+	char *path, *buf = NULL;
+	gsize l = 0;
+	GError *err = NULL;
+
+	if (! (path = dm_partstore_path(hash, size))) {
+		TRACE(TRACE_ERR, "no mimepart store for [%s]", hash);
+		return NULL;
+	}
+
+	if (! g_file_get_contents(path, &buf, &l, &err)) {
+		TRACE(TRACE_ERR, "unable to read [%s]: %s", path, err->message);
+		g_error_free(err);
+		g_free(path);
+		return NULL;
+	}
+
+	if (l != size)
+		TRACE(TRACE_WARNING, "[%s] has [%" G_GSIZE_FORMAT "] bytes, expected [%zu]", path, l, size);
+
+	g_free(path);
+	*len = l;
+
+	return buf;
+}
+
+gboolean dm_partstore_equals(const char *hash, const char *data, size_t size)
+{
+	char *path;
+	gboolean t;
+
+	if (! (path = dm_partstore_path(hash, size)))
+		return FALSE;
+	t = partstore_compare(path, data, size);
+	g_free(path);
+
+	return t;
+}
+
+/* the part is present with the expected size */
+gboolean dm_partstore_check(const char *hash, size_t size)
+{
+	char *path;
+	struct stat st;
+	gboolean t = FALSE;
+
+	if (! (path = dm_partstore_path(hash, size)))
+		return FALSE;
+	if (stat(path, &st) == 0 && S_ISREG(st.st_mode) && (size_t)st.st_size == size)
+		t = TRUE;
+	g_free(path);
+
+	return t;
+}
+
+int dm_partstore_remove(const char *hash, size_t size)
+{
+	char *path;
+	int t = DM_SUCCESS;
+
+	if (! (path = dm_partstore_path(hash, size)))
+		return DM_EQUERY;
+	if (unlink(path) < 0 && errno != ENOENT) {
+		TRACE(TRACE_ERR, "unable to remove [%s]: %s", path, strerror(errno));
+		t = DM_EQUERY;
+	}
+	g_free(path);
+
+	return t;
+}
+
+static int partstore_walk_dir(const char *dir, int depth,
+		int (*func)(const char *, const char *, size_t, time_t, void *), void *data)
+{
+	GDir *d;
+	GError *err = NULL;
+	const char *name;
+	int t = DM_SUCCESS;
+
+	if (! (d = g_dir_open(dir, 0, &err))) {
+		TRACE(TRACE_ERR, "unable to open [%s]: %s", dir, err->message);
+		g_error_free(err);
+		return DM_EQUERY;
+	}
+
+	while ((name = g_dir_read_name(d)) && (t == DM_SUCCESS)) {
+		char *path = g_build_filename(dir, name, NULL);
+		struct stat st;
+
+		if (lstat(path, &st) < 0) {
+			g_free(path);
+			continue;
+		}
+
+		if (depth < 2) {
+			if (S_ISDIR(st.st_mode) && strlen(name) == 2)
+				t = partstore_walk_dir(path, depth+1, func, data);
+		} else if (S_ISREG(st.st_mode)) {
+			char **parts = g_strsplit(name, ".", 0);
+			if (g_strv_length(parts) == 2 && strlen(parts[0]) >= 4)
+				t = func(path, parts[0], strtoull(parts[1], NULL, 10), st.st_mtime, data);
+			else
+				t = func(path, NULL, 0, st.st_mtime, data);
+			g_strfreev(parts);
+		}
+		g_free(path);
+	}
+	g_dir_close(d);
+
+	return t;
+}
+
+int dm_partstore_walk(int (*func)(const char *path, const char *hash, size_t size, time_t mtime, void *data), void *data)
+{
+	partstore_init();
+	if (! store_dir[0])
+		return DM_SUCCESS;
+	if (! g_file_test(store_dir, G_FILE_TEST_IS_DIR))
+		return DM_SUCCESS;
+
+	return partstore_walk_dir(store_dir, 0, func, data);
+}
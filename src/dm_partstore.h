@@ -0,0 +1,50 @@
+/*
+ Copyright (c) 2020-2026 Alan Hicks, Persistent Objects Ltd support@p-o.co.uk
+
+ This program is free software; you can redistribute it and/or 
+ modify it under the terms of the GNU General Public License 
+ as published by the Free Software Foundation; either 
+ version 2 of the License, or (at your option) any later 
+ version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+/*
+ * content-addressed filesystem store for large mimeparts
+ *
+ * Parts of at least mimepart_store_threshold bytes are written to
+ * mimepart_store_dir as <dir>/ab/cd/<hash>.<size>; the row in
+ * dbmail_mimeparts then only holds hash and size, with storage set to
+ * MIMEPART_STORAGE_FILE.
+ */
+
+#ifndef DM_PARTSTORE_H
+#define DM_PARTSTORE_H
+
+#define MIMEPART_STORAGE_DB 0
+#define MIMEPART_STORAGE_FILE 1
+
+#define DM_PARTSTORE_THRESHOLD (1024*1024)
+
+gboolean dm_partstore_wants(size_t size);
+char * dm_partstore_path(const char *hash, size_t size);
+
+int dm_partstore_put(const char *hash, const char *data, size_t size);
+char * dm_partstore_get(const char *hash, size_t size, size_t *len);
+gboolean dm_partstore_equals(const char *hash, const char *data, size_t size);
+gboolean dm_partstore_check(const char *hash, size_t size);
+int dm_partstore_remove(const char *hash, size_t size);
+
+/* call func for every file in the store; hash is NULL for files that
+ * are not a part, like left-over temporary files */
+int dm_partstore_walk(int (*func)(const char *path, const char *hash, size_t size, time_t mtime, void *data), void *data);
+
+#endif
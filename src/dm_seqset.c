@@ -0,0 +1,268 @@
+/*
+ Copyright (c) 2020-2026 Alan Hicks, Persistent Objects Ltd support@p-o.co.uk
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either
+ version 2 of the License, or (at your option) any later
+ version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+#include <string.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <assert.h>
+#include <glib.h>
+
+#include "dm_seqset.h"
+
+/*
+ * implements the sequence set as a sorted GArray of ranges
+ */
+
+#define T SeqSet_T
+
+struct range {
+	uint64_t lo;
+	uint64_t hi;
+};
+
+struct T {
+	GArray *ranges;
+	unsigned cursor; // range of the last SeqSet_next
+};
+
+#define RANGE(S, i) (&g_array_index((S)->ranges, struct range, (i)))
+
+/* index of the first range that ends at or after id */
+static unsigned range_lower_bound(T S, uint64_t id)
+{
+	unsigned lo = 0, hi = S->ranges->len;
+
+	while (lo < hi) {
+		unsigned mid = lo + (hi - lo) / 2;
+		if (RANGE(S, mid)->hi < id)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+T SeqSet_new(void)
+{
+	T S = g_new0(struct T, 1);
+	S->ranges = g_array_new(FALSE, FALSE, sizeof(struct range));
+	return S;
+}
+
+void SeqSet_add(T S, uint64_t lo, uint64_t hi)
+{
+	struct range r;
+	unsigned i, j, len;
+
+	assert(S);
+
+	if (lo > hi) {
+		uint64_t t = lo;
+		lo = hi;
+		hi = t;
+	}
+
+	len = S->ranges->len;
+
+	/* sets are mostly built in ascending order */
+	if (len && lo > RANGE(S, len - 1)->hi) {
+		if (lo == RANGE(S, len - 1)->hi + 1)
+			RANGE(S, len - 1)->hi = hi;
+		else {
+			r.lo = lo;
+			r.hi = hi;
+			g_array_append_val(S->ranges, r);
+		}
+		return;
+	}
+
+	/* first range that overlaps or touches [lo, hi] */
+	i = range_lower_bound(S, lo ? lo - 1 : 0);
+
+	r.lo = lo;
+	r.hi = hi;
+	for (j = i; j < len && (hi == UINT64_MAX || RANGE(S, j)->lo <= hi + 1); j++) {
+		r.lo = MIN(r.lo, RANGE(S, j)->lo);
+		r.hi = MAX(r.hi, RANGE(S, j)->hi);
+	}
+
+	if (j == i) {
+		g_array_insert_val(S->ranges, i, r);
+	} else {
+		*RANGE(S, i) = r;
+		if (j > i + 1)
+			g_array_remove_range(S->ranges, i + 1, j - i - 1);
+	}
+	S->cursor = 0;
+}
+
+gboolean SeqSet_has(T S, uint64_t id)
+{
+	unsigned i = range_lower_bound(S, id);
+	return (i < S->ranges->len && RANGE(S, i)->lo <= id);
+}
+
+gboolean SeqSet_isEmpty(T S)
+{
+	return (S->ranges->len == 0);
+}
+
+uint64_t SeqSet_count(T S)
+{
+	uint64_t count = 0;
+	unsigned i;
+
+	for (i = 0; i < S->ranges->len; i++)
+		count += RANGE(S, i)->hi - RANGE(S, i)->lo + 1;
+	return count;
+}
+
+uint64_t SeqSet_first(T S)
+{
+	return S->ranges->len ? RANGE(S, 0)->lo : 0;
+}
+
+uint64_t SeqSet_last(T S)
+{
+	return S->ranges->len ? RANGE(S, S->ranges->len - 1)->hi : 0;
+}
+
+gboolean SeqSet_next(T S, uint64_t *id)
+{
+	uint64_t next = *id + 1;
+	unsigned i = S->cursor;
+
+	if (i < S->ranges->len && RANGE(S, i)->lo <= next && next <= RANGE(S, i)->hi) {
+		*id = next;
+		return TRUE;
+	}
+
+	i = range_lower_bound(S, next);
+	if (i >= S->ranges->len)
+		return FALSE;
+
+	S->cursor = i;
+	*id = MAX(next, RANGE(S, i)->lo);
+	return TRUE;
+}
+
+gboolean SeqSet_prev(T S, uint64_t *id)
+{
+	uint64_t prev;
+	unsigned i;
+
+	if (! S->ranges->len)
+		return FALSE;
+
+	if (*id == 0) {
+		*id = SeqSet_last(S);
+		return TRUE;
+	}
+
+	prev = *id - 1;
+	if (prev == 0)
+		return FALSE;
+
+	i = range_lower_bound(S, prev);
+	if (i < S->ranges->len && RANGE(S, i)->lo <= prev) {
+		*id = prev;
+		return TRUE;
+	}
+	if (i == 0)
+		return FALSE;
+
+	*id = RANGE(S, i - 1)->hi;
+	return TRUE;
+}
+
+uint64_t SeqSet_advance(T S, uint64_t id, uint64_t n)
+{
+	unsigned i = range_lower_bound(S, id);
+	uint64_t cur;
+
+	if (i >= S->ranges->len)
+		return SeqSet_last(S);
+
+	cur = MAX(id, RANGE(S, i)->lo);
+	while (TRUE) {
+		uint64_t room = RANGE(S, i)->hi - cur;
+		if (n <= room)
+			return cur + n;
+		if (i + 1 >= S->ranges->len)
+			return RANGE(S, i)->hi;
+		n -= room + 1;
+		cur = RANGE(S, ++i)->lo;
+	}
+}
+
+void SeqSet_merge(T S, T B)
+{
+	unsigned i;
+
+	for (i = 0; i < B->ranges->len; i++)
+		SeqSet_add(S, RANGE(B, i)->lo, RANGE(B, i)->hi);
+}
+
+T SeqSet_and(T A, T B)
+{
+	T S = SeqSet_new();
+	unsigned i = 0, j = 0;
+
+	while (i < A->ranges->len && j < B->ranges->len) {
+		struct range *a = RANGE(A, i), *b = RANGE(B, j);
+		uint64_t lo = MAX(a->lo, b->lo);
+		uint64_t hi = MIN(a->hi, b->hi);
+
+		if (lo <= hi)
+			SeqSet_add(S, lo, hi);
+
+		if (a->hi < b->hi)
+			i++;
+		else
+			j++;
+	}
+	return S;
+}
+
+char * SeqSet_string(T S)
+{
+	GString *s = g_string_new("");
+	unsigned i;
+
+	for (i = 0; i < S->ranges->len; i++) {
+		struct range *r = RANGE(S, i);
+		if (i)
+			g_string_append_c(s, ',');
+		if (r->lo == r->hi)
+			g_string_append_printf(s, "%" PRIu64, r->lo);
+		else
+			g_string_append_printf(s, "%" PRIu64 ":%" PRIu64, r->lo, r->hi);
+	}
+	return g_string_free(s, FALSE);
+}
+
+void SeqSet_free(T *S)
+{
+	T s = *S;
+	if (! s)
+		return;
+	g_array_free(s->ranges, TRUE);
+	g_free(s);
+	*S = NULL;
+}
@@ -0,0 +1,62 @@
+/*
+ Copyright (c) 2020-2026 Alan Hicks, Persistent Objects Ltd support@p-o.co.uk
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either
+ version 2 of the License, or (at your option) any later
+ version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+/*
+ * ADT interface for sets of message numbers
+ *
+ * the set is kept as an ascending list of disjoint ranges, so 1:*
+ * takes the same space for ten messages as for a million.
+ */
+
+#ifndef DM_SEQSET_H
+#define DM_SEQSET_H
+
+#include <stdint.h>
+#include <glib.h>
+
+#define T SeqSet_T
+
+typedef struct T *T;
+
+extern T               SeqSet_new(void);
+extern void            SeqSet_add(T, uint64_t lo, uint64_t hi);
+extern gboolean        SeqSet_has(T, uint64_t);
+extern gboolean        SeqSet_isEmpty(T);
+extern uint64_t        SeqSet_count(T);
+extern uint64_t        SeqSet_first(T);
+extern uint64_t        SeqSet_last(T);
+
+/* iterate: start with *id = 0; returns FALSE past the end */
+extern gboolean        SeqSet_next(T, uint64_t *id);
+extern gboolean        SeqSet_prev(T, uint64_t *id);
+
+/* the member n places after id, or the last member */
+extern uint64_t        SeqSet_advance(T, uint64_t id, uint64_t n);
+
+extern void            SeqSet_merge(T, T); // a += b
+extern T               SeqSet_and(T, T); // a * b
+
+/* "1:3,5" */
+extern char *          SeqSet_string(T);
+
+extern void            SeqSet_free(T *);
+
+#undef T
+
+#endif
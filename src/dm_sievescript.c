@@ -110,6 +110,54 @@ int dm_sievescript_get(uint64_t user_idnr, char **scriptname)
 	return t;
 }
 
+int dm_sievescript_get_hash(uint64_t user_idnr, char **scriptname, char **hash)
+{
+	Connection_T c; ResultSet_T r; volatile int t = FALSE;
+	assert(scriptname);
+	assert(hash);
+	*scriptname = NULL;
+	*hash = NULL;
+
+	c = db_con_get();
+	TRY
+		r = db_query(c, "SELECT name, hash from %ssievescripts where owner_idnr = %" PRIu64 " and active = 1", DBPFX, user_idnr);
+		if (db_result_next(r)) {
+			*scriptname = g_strdup(db_result_get(r,0));
+			*hash = g_strdup(db_result_get(r,1));
+		}
+
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		t = DM_EQUERY;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	return t;
+}
+
+int dm_sievescript_set_hash(uint64_t user_idnr, const char *scriptname, const char *hash)
+{
+	Connection_T c; PreparedStatement_T s; volatile int t = FALSE;
+	assert(scriptname);
+
+	c = db_con_get();
+	TRY
+		s = db_stmt_prepare(c, "UPDATE %ssievescripts SET hash = ? WHERE owner_idnr = ? AND name = ? AND hash = ''", DBPFX);
+		db_stmt_set_str(s, 1, hash);
+		db_stmt_set_u64(s, 2, user_idnr);
+		db_stmt_set_str(s, 3, scriptname);
+		db_stmt_exec(s);
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		t = DM_EQUERY;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	return t;
+}
+
 int dm_sievescript_list(uint64_t user_idnr, GList **scriptlist)
 {
 	Connection_T c; ResultSet_T r; volatile int t = FALSE;
@@ -188,8 +236,13 @@ int dm_sievescript_rename(uint64_t user_idnr, char *scriptname, char *newname)
 int dm_sievescript_add(uint64_t user_idnr, char *scriptname, char *script)
 {
 	Connection_T c; ResultSet_T r; PreparedStatement_T s; volatile int t = FALSE;
+	char hash[FIELDSIZE];
 	assert(scriptname);
 
+	memset(hash, 0, sizeof(hash));
+	if (dm_get_hash_for_string(script, hash))
+		hash[0] = '\0';
+
 	c = db_con_get();
 	TRY
 		db_begin_transaction(c);
@@ -212,10 +265,11 @@ int dm_sievescript_add(uint64_t user_idnr, char *scriptname, char *script)
 		
 		db_con_clear(c);
 
-		s = db_stmt_prepare(c,"INSERT INTO %ssievescripts (owner_idnr, name, script, active) VALUES (?,?,?,1)", DBPFX);
+		s = db_stmt_prepare(c,"INSERT INTO %ssievescripts (owner_idnr, name, script, active, hash) VALUES (?,?,?,1,?)", DBPFX);
 		db_stmt_set_u64(s, 1, user_idnr);
 		db_stmt_set_str(s, 2, scriptname);
 		db_stmt_set_blob(s, 3, script, strlen(script));
+		db_stmt_set_str(s, 4, hash);
 		db_stmt_exec(s);
 
 		t = db_commit_transaction(c);
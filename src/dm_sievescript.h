@@ -65,6 +65,28 @@ int dm_sievescript_isactive_byname(uint64_t user_idnr, const char *scriptname);
  * \attention caller should free the returned script name
  */
 int dm_sievescript_get(uint64_t user_idnr, char **scriptname);
+/**
+ * \brief get the name and hash of the active sieve script for a user
+ * \param user_idnr user id
+ * \param scriptname pointer to string that will hold the script name
+ * \param hash pointer to string that will hold the hash of the script,
+ * empty for scripts stored before hashes were kept
+ * \return
+ *        - -1 on database failure
+ *        - 0 on success
+ * \attention caller should free the returned script name and hash
+ */
+int dm_sievescript_get_hash(uint64_t user_idnr, char **scriptname, char **hash);
+/**
+ * \brief set the hash of a script stored without one
+ * \param user_idnr user id
+ * \param scriptname name of the script
+ * \param hash hash of the script
+ * \return
+ *        - -1 on database failure
+ *        - 0 on success
+ */
+int dm_sievescript_set_hash(uint64_t user_idnr, const char *scriptname, const char *hash);
 /**
  * \brief get a list of sieve scripts for a user
  * \param user_idnr user id
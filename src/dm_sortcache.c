@@ -0,0 +1,939 @@
+/*
+ Copyright (c) 2020-2026 Alan Hicks, Persistent Objects Ltd support@p-o.co.uk
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either
+ version 2 of the License, or (at your option) any later
+ version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+#include "dbmail.h"
+
+#define THIS_MODULE "sortcache"
+
+#define T SortCache_T
+
+/* messages in the cache that are gone before it is reloaded */
+#define SORTCACHE_SLACK 64
+
+struct T {
+	GMutex lock;
+	uint64_t mailbox_id;
+	uint64_t last;			// highest uid read
+	GArray *uids;			// ascending, one row per message
+	GArray *size;			// rfcsize by row
+	GPtrArray *text[SORT_KEY_LAST];	// other keys by row, in strings
+	gboolean threading;		// also read the keys of THREAD=REFERENCES
+	GPtrArray *msgid;		// message-id by row, in strings
+	GPtrArray *refs;		// references by row, oldest first, space separated
+	GByteArray *reply;		// subject is a reply or forward, by row
+	GStringChunk *strings;
+	GHashTable *absent;		// uids still missing after a reload
+};
+
+static void cache_clear(T K)
+{
+	int i;
+
+	if (K->uids)
+		g_array_free(K->uids, TRUE);
+	if (K->size)
+		g_array_free(K->size, TRUE);
+	for (i = 0; i < SORT_KEY_LAST; i++) {
+		if (K->text[i])
+			g_ptr_array_free(K->text[i], TRUE);
+		K->text[i] = NULL;
+	}
+	if (K->msgid)
+		g_ptr_array_free(K->msgid, TRUE);
+	if (K->refs)
+		g_ptr_array_free(K->refs, TRUE);
+	if (K->reply)
+		g_byte_array_free(K->reply, TRUE);
+	K->msgid = K->refs = NULL;
+	K->reply = NULL;
+	if (K->strings)
+		g_string_chunk_free(K->strings);
+
+	K->uids = g_array_new(FALSE, FALSE, sizeof(uint64_t));
+	K->size = g_array_new(FALSE, FALSE, sizeof(uint64_t));
+	for (i = 0; i < SORT_KEY_LAST; i++) {
+		if (i == SORT_SIZE || i == 0)
+			continue;
+		K->text[i] = g_ptr_array_new();
+	}
+	if (K->threading) {
+		K->msgid = g_ptr_array_new();
+		K->refs = g_ptr_array_new();
+		K->reply = g_byte_array_new();
+	}
+	K->strings = g_string_chunk_new(4096);
+	K->last = 0;
+}
+
+T SortCache_new(uint64_t mailbox_id)
+{
+	T K = g_new0(struct T, 1);
+	g_mutex_init(&K->lock);
+	K->mailbox_id = mailbox_id;
+	K->absent = g_hash_table_new_full(g_int64_hash, g_int64_equal, g_free, NULL);
+	cache_clear(K);
+	return K;
+}
+
+unsigned SortCache_count(T K)
+{
+	return K->uids->len;
+}
+
+void SortCache_threading(T K)
+{
+	g_mutex_lock(&K->lock);
+	if (! K->threading) {
+		K->threading = TRUE;
+		cache_clear(K);
+	}
+	g_mutex_unlock(&K->lock);
+}
+
+#define UID(K, i) g_array_index((K)->uids, uint64_t, (i))
+#define SIZE(K, i) g_array_index((K)->size, uint64_t, (i))
+#define TEXT(K, key, i) ((const char *)g_ptr_array_index((K)->text[(key)], (i)))
+#define MSGID(K, i) ((const char *)g_ptr_array_index((K)->msgid, (i)))
+#define REFS(K, i) ((const char *)g_ptr_array_index((K)->refs, (i)))
+#define REPLY(K, i) ((K)->reply->data[(i)])
+
+/* row of uid, or -1 */
+static int cache_row(T K, uint64_t uid)
+{
+	unsigned lo = 0, hi = K->uids->len;
+
+	while (lo < hi) {
+		unsigned mid = lo + (hi - lo) / 2;
+		if (UID(K, mid) < uid)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo < K->uids->len && UID(K, lo) == uid)
+		return (int)lo;
+	return -1;
+}
+
+static int header_key(const char *name)
+{
+	if (MATCH(name, "subject"))
+		return SORT_SUBJECT;
+	if (MATCH(name, "from"))
+		return SORT_FROM;
+	if (MATCH(name, "to"))
+		return SORT_TO;
+	if (MATCH(name, "cc"))
+		return SORT_CC;
+	if (MATCH(name, "date"))
+		return SORT_DATE;
+	return 0;
+}
+
+/* the id between angle brackets, or the trimmed value */
+static char * msgid_normalize(const char *value)
+{
+	const char *s, *e;
+
+	if ((s = strchr(value, '<')) && (e = strchr(s, '>')))
+		return g_strndup(s + 1, e - s - 1);
+	return g_strstrip(g_strdup(value));
+}
+
+/*
+ * RFC 5256: the subject of a reply or forward has a "re:", "fw:" or
+ * "fwd:" leader, possibly after [blobs], or a "(fwd)" trailer, or is
+ * wrapped in "[fwd: ...]"
+ */
+static gboolean subject_is_reply(const char *subject)
+{
+	const char *s = subject;
+	size_t len;
+
+	while (g_ascii_isspace(*s))
+		s++;
+	if (g_ascii_strncasecmp(s, "[fwd:", 5) == 0)
+		return TRUE;
+
+	len = strlen(s);
+	while (len && g_ascii_isspace(s[len - 1]))
+		len--;
+	if (len >= 5 && g_ascii_strncasecmp(s + len - 5, "(fwd)", 5) == 0)
+		return TRUE;
+
+	while (TRUE) {
+		if (*s == '[') {
+			const char *e = strchr(s, ']');
+			if (! e)
+				return FALSE;
+			s = e + 1;
+		} else if (g_ascii_strncasecmp(s, "re", 2) == 0) {
+			s += 2;
+			break;
+		} else if (g_ascii_strncasecmp(s, "fwd", 3) == 0) {
+			s += 3;
+			break;
+		} else if (g_ascii_strncasecmp(s, "fw", 2) == 0) {
+			s += 2;
+			break;
+		} else {
+			return FALSE;
+		}
+		while (g_ascii_isspace(*s))
+			s++;
+	}
+
+	while (g_ascii_isspace(*s))
+		s++;
+	if (*s == '[') {
+		if (! (s = strchr(s, ']')))
+			return FALSE;
+		s++;
+	}
+	return (*s == ':');
+}
+
+/* read the messages after K->last, up to and including the highest uid
+ * in the mailbox when the first query runs */
+static int cache_load(T K)
+{
+	Connection_T c; ResultSet_T r; PreparedStatement_T st;
+	volatile int t = DM_SUCCESS;
+	unsigned first = K->uids->len, row, i;
+	uint64_t last = K->last;
+	Field_T frag;
+
+	date2char_str("p.internal_date", &frag);
+
+	c = db_con_get();
+	TRY
+		st = db_stmt_prepare(c, "SELECT m.message_idnr, p.rfcsize, %s "
+				"FROM %smessages m "
+				"JOIN %sphysmessage p ON m.physmessage_id = p.id "
+				"WHERE m.mailbox_idnr = ? AND m.status < ? AND m.message_idnr > ? "
+				"ORDER BY m.message_idnr",
+				frag, DBPFX, DBPFX);
+		db_stmt_set_u64(st, 1, K->mailbox_id);
+		db_stmt_set_int(st, 2, MESSAGE_STATUS_DELETE);
+		db_stmt_set_u64(st, 3, K->last);
+		r = db_stmt_query(st);
+		while (db_result_next(r)) {
+			uint64_t uid = db_result_get_u64(r, 0);
+			uint64_t size = db_result_get_u64(r, 1);
+			const char *arrival = db_result_get(r, 2);
+
+			g_array_append_val(K->uids, uid);
+			g_array_append_val(K->size, size);
+			g_ptr_array_add(K->text[SORT_ARRIVAL],
+					g_string_chunk_insert_const(K->strings, arrival ? arrival : ""));
+			for (i = 0; i < SORT_KEY_LAST; i++) {
+				if (K->text[i] && i != SORT_ARRIVAL)
+					g_ptr_array_add(K->text[i], NULL);
+			}
+			if (K->threading) {
+				guint8 no = 0;
+				g_ptr_array_add(K->msgid, NULL);
+				g_ptr_array_add(K->refs, NULL);
+				g_byte_array_append(K->reply, &no, 1);
+			}
+			last = uid;
+		}
+
+		if (K->uids->len > first) {
+			db_con_clear(c);
+			/* the whole subject only to tell replies */
+			st = db_stmt_prepare(c, "SELECT m.message_idnr, n.headername, v.sortfield, %s "
+					"FROM %smessages m "
+					"JOIN %sheader h ON h.physmessage_id = m.physmessage_id "
+					"JOIN %sheadername n ON h.headername_id = n.id "
+					"JOIN %sheadervalue v ON h.headervalue_id = v.id "
+					"WHERE m.mailbox_idnr = ? AND m.status < ? "
+					"AND m.message_idnr > ? AND m.message_idnr <= ? "
+					"AND n.headername IN ('subject','from','to','cc','date'%s) "
+					"ORDER BY m.message_idnr",
+					K->threading ? "CASE WHEN n.headername = 'subject' THEN v.headervalue END" : "NULL",
+					DBPFX, DBPFX, DBPFX, DBPFX,
+					K->threading ? ",'message-id'" : "");
+			db_stmt_set_u64(st, 1, K->mailbox_id);
+			db_stmt_set_int(st, 2, MESSAGE_STATUS_DELETE);
+			db_stmt_set_u64(st, 3, K->last);
+			db_stmt_set_u64(st, 4, last);
+			r = db_stmt_query(st);
+
+			row = first;
+			while (db_result_next(r)) {
+				uint64_t uid = db_result_get_u64(r, 0);
+				const char *value;
+				int key;
+
+				while (row < K->uids->len && UID(K, row) < uid)
+					row++;
+				if (row >= K->uids->len)
+					break;
+				if (UID(K, row) != uid)
+					continue;
+				value = db_result_get(r, 2);
+				if (K->threading && MATCH(db_result_get(r, 1), "message-id")) {
+					if (! MSGID(K, row) && value) {
+						char *id = msgid_normalize(value);
+						g_ptr_array_index(K->msgid, row) =
+							(gpointer)g_string_chunk_insert_const(K->strings, id);
+						g_free(id);
+					}
+					continue;
+				}
+				if (! (key = header_key(db_result_get(r, 1))))
+					continue;
+				/* the first of repeated headers is used */
+				if (TEXT(K, key, row))
+					continue;
+				g_ptr_array_index(K->text[key], row) =
+					(gpointer)g_string_chunk_insert_const(K->strings, value ? value : "");
+				if (K->threading && key == SORT_SUBJECT) {
+					const char *subject = db_result_get(r, 3);
+					REPLY(K, row) = (subject && subject_is_reply(subject));
+				}
+			}
+		}
+
+		if (K->threading && K->uids->len > first) {
+			GString *refs = g_string_new("");
+			uint64_t current = 0;
+
+			db_con_clear(c);
+			st = db_stmt_prepare(c, "SELECT m.message_idnr, r.referencesfield "
+					"FROM %smessages m "
+					"JOIN %sreferencesfield r ON r.physmessage_id = m.physmessage_id "
+					"WHERE m.mailbox_idnr = ? AND m.status < ? "
+					"AND m.message_idnr > ? AND m.message_idnr <= ? "
+					"ORDER BY m.message_idnr, r.id",
+					DBPFX, DBPFX);
+			db_stmt_set_u64(st, 1, K->mailbox_id);
+			db_stmt_set_int(st, 2, MESSAGE_STATUS_DELETE);
+			db_stmt_set_u64(st, 3, K->last);
+			db_stmt_set_u64(st, 4, last);
+			r = db_stmt_query(st);
+
+			while (TRUE) {
+				gboolean more = db_result_next(r);
+				uint64_t uid = more ? db_result_get_u64(r, 0) : 0;
+
+				/* the references of current are complete */
+				if (current && uid != current) {
+					int at = cache_row(K, current);
+					if (at >= (int)first)
+						g_ptr_array_index(K->refs, at) =
+							(gpointer)g_string_chunk_insert(K->strings, refs->str);
+					g_string_truncate(refs, 0);
+				}
+				if (! more)
+					break;
+				current = uid;
+				if (refs->len)
+					g_string_append_c(refs, ' ');
+				g_string_append(refs, db_result_get(r, 1));
+			}
+			g_string_free(refs, TRUE);
+		}
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		t = DM_EQUERY;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	if (t == DM_EQUERY) {
+		/* drop the rows read this time */
+		g_array_set_size(K->uids, first);
+		g_array_set_size(K->size, first);
+		for (i = 0; i < SORT_KEY_LAST; i++) {
+			if (K->text[i])
+				g_ptr_array_set_size(K->text[i], first);
+		}
+		if (K->threading) {
+			g_ptr_array_set_size(K->msgid, first);
+			g_ptr_array_set_size(K->refs, first);
+			g_byte_array_set_size(K->reply, first);
+		}
+		return t;
+	}
+
+	/* missing headers sort as empty strings, a missing date as the
+	 * arrival date */
+	for (row = first; row < K->uids->len; row++) {
+		for (i = 0; i < SORT_KEY_LAST; i++) {
+			if (! K->text[i] || TEXT(K, i, row))
+				continue;
+			g_ptr_array_index(K->text[i], row) = (gpointer)((i == SORT_DATE) ?
+					TEXT(K, SORT_ARRIVAL, row) : g_string_chunk_insert_const(K->strings, ""));
+		}
+		/* messages without a message-id keep NULL */
+		if (K->threading && ! REFS(K, row))
+			g_ptr_array_index(K->refs, row) = (gpointer)g_string_chunk_insert_const(K->strings, "");
+	}
+
+	if (K->uids->len > first)
+		TRACE(TRACE_DEBUG, "mailbox [%" PRIu64 "] read [%u] messages, [%u] cached",
+				K->mailbox_id, K->uids->len - first, K->uids->len);
+
+	K->last = last;
+
+	return DM_SUCCESS;
+}
+
+int SortCache_update(T K, unsigned exists)
+{
+	int t;
+
+	g_mutex_lock(&K->lock);
+	if (K->uids->len > exists + max(exists, SORTCACHE_SLACK)) {
+		TRACE(TRACE_DEBUG, "mailbox [%" PRIu64 "] reload sort cache", K->mailbox_id);
+		cache_clear(K);
+		g_hash_table_remove_all(K->absent);
+	}
+	t = cache_load(K);
+	g_mutex_unlock(&K->lock);
+
+	return t;
+}
+
+/* rows of the uids in found */
+static gboolean _found_row(uint64_t *uid, uint64_t UNUSED *msn, gpointer data)
+{
+	gpointer *args = (gpointer *)data;
+	T K = (T)args[0];
+	GArray *rows = (GArray *)args[1];
+	GList **missing = (GList **)args[2];
+	int row;
+
+	if ((row = cache_row(K, *uid)) < 0) {
+		if (! g_hash_table_contains(K->absent, uid))
+			*missing = g_list_prepend(*missing, uid);
+		return FALSE;
+	}
+	g_array_append_val(rows, row);
+	return FALSE;
+}
+
+/*
+ * A message committed after one with a higher uid was read is not in
+ * the cache, as loads only read uids above the last one. Such a uid in
+ * found reloads the cache. What is still missing then is no longer in
+ * the mailbox and is not looked for again.
+ */
+static GArray * found_rows(T K, GTree *found)
+{
+	GArray *rows = g_array_sized_new(FALSE, FALSE, sizeof(int), g_tree_nnodes(found));
+	GList *missing = NULL, *l;
+	gpointer args[3] = { K, rows, &missing };
+	gboolean loaded;
+
+	g_tree_foreach(found, (GTraverseFunc)_found_row, args);
+	if (! missing)
+		return rows;
+
+	TRACE(TRACE_DEBUG, "mailbox [%" PRIu64 "] [%u] messages not in sort cache, reload",
+			K->mailbox_id, g_list_length(missing));
+	g_list_free(missing);
+	missing = NULL;
+
+	cache_clear(K);
+	loaded = (cache_load(K) == DM_SUCCESS);
+
+	g_array_set_size(rows, 0);
+	g_tree_foreach(found, (GTraverseFunc)_found_row, args);
+	for (l = missing; loaded && l; l = g_list_next(l)) {
+		uint64_t *uid = g_new0(uint64_t, 1);
+		*uid = *(uint64_t *)l->data;
+		TRACE(TRACE_DEBUG, "uid [%" PRIu64 "] not in mailbox [%" PRIu64 "]", *uid, K->mailbox_id);
+		g_hash_table_add(K->absent, uid);
+	}
+	g_list_free(missing);
+
+	return rows;
+}
+
+static int key_cmp(T K, int key, int x, int y)
+{
+	switch (key) {
+		case SORT_SIZE:
+			return (SIZE(K, x) > SIZE(K, y)) - (SIZE(K, x) < SIZE(K, y));
+		case SORT_ARRIVAL:
+		case SORT_DATE:
+			return strcmp(TEXT(K, key, x), TEXT(K, key, y));
+		default:
+			/* i;ascii-casemap */
+			return g_ascii_strcasecmp(TEXT(K, key, x), TEXT(K, key, y));
+	}
+}
+
+struct sort_args {
+	T K;
+	const unsigned char *criteria;
+};
+
+static gint row_cmp(gconstpointer a, gconstpointer b, gpointer data)
+{
+	struct sort_args *s = (struct sort_args *)data;
+	int x = *(const int *)a, y = *(const int *)b;
+	int i, r;
+
+	for (i = 0; i < SORT_KEYS_MAX && s->criteria[i]; i++) {
+		if ((r = key_cmp(s->K, s->criteria[i] & ~SORT_REVERSE, x, y)))
+			return (s->criteria[i] & SORT_REVERSE) ? -r : r;
+	}
+	/* rows are in uid order, so this orders by msn */
+	return (x > y) - (x < y);
+}
+
+GList * SortCache_sort(T K, GTree *found, const unsigned char *criteria)
+{
+	struct sort_args s;
+	GList *sorted = NULL;
+	GArray *rows;
+	int i;
+
+	g_mutex_lock(&K->lock);
+
+	rows = found_rows(K, found);
+	s.K = K;
+	s.criteria = criteria;
+	g_array_sort_with_data(rows, row_cmp, &s);
+
+	for (i = (int)rows->len - 1; i >= 0; i--) {
+		uint64_t *id = g_new0(uint64_t, 1);
+		*id = UID(K, g_array_index(rows, int, i));
+		sorted = g_list_prepend(sorted, id);
+	}
+
+	g_mutex_unlock(&K->lock);
+
+	g_array_free(rows, TRUE);
+
+	return sorted;
+}
+
+/*
+ * threads are trees of containers. A container without a row is a
+ * dummy, standing in for a message that is referenced but not found.
+ * Sibling order does not matter until the trees are sorted.
+ */
+struct container {
+	int row;
+	struct container *parent;
+	struct container *child;	// first child
+	struct container *next;		// next sibling
+};
+
+static struct container * container_new(GPtrArray *all, int row)
+{
+	struct container *c = g_new0(struct container, 1);
+	c->row = row;
+	g_ptr_array_add(all, c);
+	return c;
+}
+
+static void container_link(struct container *parent, struct container *c)
+{
+	c->parent = parent;
+	c->next = parent->child;
+	parent->child = c;
+}
+
+static void container_unlink(struct container *c)
+{
+	struct container **p = &c->parent->child;
+
+	while (*p != c)
+		p = &(*p)->next;
+	*p = c->next;
+	c->parent = NULL;
+	c->next = NULL;
+}
+
+/* a is c or one of its ancestors */
+static gboolean container_above(struct container *a, struct container *c)
+{
+	for (; c; c = c->parent) {
+		if (c == a)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/* the row a container sorts by, for a dummy that of its first child */
+static int container_row(struct container *c)
+{
+	while (c->row < 0 && c->child)
+		c = c->child;
+	return c->row;
+}
+
+static gint container_date_cmp(gconstpointer a, gconstpointer b, gpointer data)
+{
+	T K = (T)data;
+	int x = container_row(*(struct container * const *)a);
+	int y = container_row(*(struct container * const *)b);
+	int r;
+
+	if ((r = key_cmp(K, SORT_DATE, x, y)))
+		return r;
+	return (x > y) - (x < y);
+}
+
+/* sort all siblings below parent by sent date, children first */
+static void container_sort(T K, struct container *parent)
+{
+	GPtrArray *siblings = g_ptr_array_new();
+	struct container *c, **p;
+	unsigned i;
+
+	for (c = parent->child; c; c = c->next) {
+		container_sort(K, c);
+		g_ptr_array_add(siblings, c);
+	}
+	g_ptr_array_sort_with_data(siblings, container_date_cmp, K);
+
+	p = &parent->child;
+	for (i = 0; i < siblings->len; i++) {
+		*p = g_ptr_array_index(siblings, i);
+		p = &(*p)->next;
+	}
+	*p = NULL;
+
+	g_ptr_array_free(siblings, TRUE);
+}
+
+/* the response numbers are uids, or their msns in found */
+static void thread_print(GString *s, T K, struct container *c, GTree *found, gboolean uid)
+{
+	struct container *child;
+
+	if (c->row >= 0) {
+		uint64_t *id = &UID(K, c->row);
+		if (! uid)
+			id = g_tree_lookup(found, id);
+		g_string_append_printf(s, "%" PRIu64, *id);
+	}
+
+	if (! c->child)
+		return;
+
+	if (c->row >= 0)
+		g_string_append_c(s, ' ');
+	if (! c->child->next) {
+		thread_print(s, K, c->child, found, uid);
+		return;
+	}
+	for (child = c->child; child; child = child->next) {
+		g_string_append_c(s, '(');
+		thread_print(s, K, child, found, uid);
+		g_string_append_c(s, ')');
+	}
+}
+
+static char * threads_print(T K, struct container *root, GTree *found, gboolean uid)
+{
+	GString *s = g_string_new("");
+	struct container *c;
+
+	for (c = root->child; c; c = c->next) {
+		g_string_append_c(s, '(');
+		thread_print(s, K, c, found, uid);
+		g_string_append_c(s, ')');
+	}
+	return g_string_free(s, FALSE);
+}
+
+static gint subject_date_cmp(gconstpointer a, gconstpointer b, gpointer data)
+{
+	T K = (T)data;
+	int x = *(const int *)a, y = *(const int *)b;
+	int r;
+
+	if ((r = key_cmp(K, SORT_SUBJECT, x, y)))
+		return r;
+	if ((r = key_cmp(K, SORT_DATE, x, y)))
+		return r;
+	return (x > y) - (x < y);
+}
+
+/*
+ * RFC 5256 ORDEREDSUBJECT: messages with the same base subject form a
+ * thread, in sent date order, each a child of the first. Threads are in
+ * the sent date order of their first message.
+ */
+char * SortCache_orderedsubject(T K, GTree *found, gboolean uid)
+{
+	struct container root, *thread = NULL;
+	GPtrArray *all;
+	GArray *rows;
+	unsigned i;
+	char *s;
+
+	g_mutex_lock(&K->lock);
+
+	rows = found_rows(K, found);
+	if (! rows->len) {
+		g_mutex_unlock(&K->lock);
+		g_array_free(rows, TRUE);
+		return NULL;
+	}
+
+	g_array_sort_with_data(rows, subject_date_cmp, K);
+
+	memset(&root, 0, sizeof(root));
+	root.row = -1;
+	all = g_ptr_array_new_with_free_func(g_free);
+	for (i = 0; i < rows->len; i++) {
+		int row = g_array_index(rows, int, i);
+		struct container *c = container_new(all, row);
+
+		if (thread && ! key_cmp(K, SORT_SUBJECT, thread->row, row)) {
+			container_link(thread, c);
+		} else {
+			container_link(&root, c);
+			thread = c;
+		}
+	}
+
+	container_sort(K, &root);
+	s = threads_print(K, &root, found, uid);
+
+	g_mutex_unlock(&K->lock);
+
+	g_ptr_array_free(all, TRUE);
+	g_array_free(rows, TRUE);
+
+	return s;
+}
+
+/*
+ * RFC 5256 step 4: drop dummies without children and replace the others
+ * by their children, except for a dummy in the root set with more than
+ * one child
+ */
+static void container_prune(struct container *parent, gboolean is_root)
+{
+	struct container **p = &parent->child, *c;
+
+	while ((c = *p)) {
+		struct container *kid, *last = NULL;
+
+		container_prune(c, FALSE);
+
+		if (c->row >= 0 || (c->child && is_root && c->child->next)) {
+			p = &c->next;
+			continue;
+		}
+		if (! c->child) {
+			*p = c->next;
+			continue;
+		}
+		for (kid = c->child; kid; kid = kid->next) {
+			kid->parent = parent;
+			last = kid;
+		}
+		last->next = c->next;
+		*p = c->child;
+		p = &last->next;
+		c->child = NULL;
+	}
+}
+
+/* RFC 5256 step 6: threads in the root set with the same base subject
+ * are merged */
+static void container_group(T K, GPtrArray *all, struct container *root)
+{
+	GHashTable *subjects = g_hash_table_new(g_str_hash, g_str_equal);
+	struct container **p, *c;
+
+	/* a dummy is preferred, then a message that is not a reply */
+	for (c = root->child; c; c = c->next) {
+		const char *subject = TEXT(K, SORT_SUBJECT, container_row(c));
+		struct container *old;
+
+		if (! *subject)
+			continue;
+		old = g_hash_table_lookup(subjects, subject);
+		if (! old || (old->row >= 0 && (c->row < 0 ||
+						(REPLY(K, old->row) && ! REPLY(K, c->row)))))
+			g_hash_table_insert(subjects, (gpointer)subject, c);
+	}
+
+	p = &root->child;
+	while ((c = *p)) {
+		const char *subject = TEXT(K, SORT_SUBJECT, container_row(c));
+		struct container *old, *kid;
+
+		if (! *subject || ! (old = g_hash_table_lookup(subjects, subject)) || old == c) {
+			p = &c->next;
+			continue;
+		}
+
+		*p = c->next;
+		if (old->row < 0 && c->row < 0) {
+			while ((kid = c->child)) {
+				c->child = kid->next;
+				container_link(old, kid);
+			}
+		} else if (old->row < 0 || (REPLY(K, c->row) && ! REPLY(K, old->row))) {
+			container_link(old, c);
+		} else {
+			/* old becomes a dummy above a copy of itself and c */
+			struct container *n = container_new(all, old->row);
+			while ((kid = old->child)) {
+				old->child = kid->next;
+				container_link(n, kid);
+			}
+			old->row = -1;
+			container_link(old, n);
+			container_link(old, c);
+		}
+	}
+
+	g_hash_table_destroy(subjects);
+}
+
+/*
+ * RFC 5256 REFERENCES, the threading algorithm of Jamie Zawinski: a
+ * message is a child of its last reference, each reference a child of
+ * the one before. Messages of the root set with the same base subject
+ * are then grouped.
+ */
+char * SortCache_references(T K, GTree *found, gboolean uid)
+{
+	struct container root, *c;
+	GHashTable *ids;
+	GPtrArray *all;
+	GArray *rows;
+	unsigned i;
+	char *s;
+
+	g_mutex_lock(&K->lock);
+
+	if (! K->threading) {
+		g_mutex_unlock(&K->lock);
+		TRACE(TRACE_ERR, "mailbox [%" PRIu64 "] references not cached", K->mailbox_id);
+		return NULL;
+	}
+
+	rows = found_rows(K, found);
+	if (! rows->len) {
+		g_mutex_unlock(&K->lock);
+		g_array_free(rows, TRUE);
+		return NULL;
+	}
+
+	all = g_ptr_array_new_with_free_func(g_free);
+	ids = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+	for (i = 0; i < rows->len; i++) {
+		int row = g_array_index(rows, int, i);
+		const char *id = MSGID(K, row);
+		struct container *m = NULL, *prev = NULL;
+		char **refs, **ref;
+
+		if (id && *id)
+			m = g_hash_table_lookup(ids, id);
+		/* of messages with the same message-id only the first has it */
+		if (m && m->row >= 0)
+			m = NULL;
+		if (! m) {
+			m = container_new(all, -1);
+			if (id && *id && ! g_hash_table_lookup(ids, id))
+				g_hash_table_insert(ids, g_strdup(id), m);
+		}
+		m->row = row;
+
+		refs = g_strsplit(REFS(K, row), " ", 0);
+		for (ref = refs; *ref; ref++) {
+			struct container *r;
+
+			if (! **ref)
+				continue;
+			if (! (r = g_hash_table_lookup(ids, *ref))) {
+				r = container_new(all, -1);
+				g_hash_table_insert(ids, g_strdup(*ref), r);
+			}
+			/* existing links are kept, and none makes a loop */
+			if (prev && ! r->parent && ! container_above(r, prev))
+				container_link(prev, r);
+			prev = r;
+		}
+		g_strfreev(refs);
+
+		/* a parent that is not the last reference came from a
+		 * truncated references header */
+		if (m->parent && m->parent != prev)
+			container_unlink(m);
+		if (prev && ! m->parent && ! container_above(m, prev))
+			container_link(prev, m);
+	}
+
+	g_hash_table_destroy(ids);
+
+	memset(&root, 0, sizeof(root));
+	root.row = -1;
+	for (i = 0; i < all->len; i++) {
+		c = g_ptr_array_index(all, i);
+		if (! c->parent)
+			container_link(&root, c);
+	}
+
+	container_prune(&root, TRUE);
+	container_sort(K, &root);
+	container_group(K, all, &root);
+	container_sort(K, &root);
+
+	s = threads_print(K, &root, found, uid);
+
+	g_mutex_unlock(&K->lock);
+
+	g_ptr_array_free(all, TRUE);
+	g_array_free(rows, TRUE);
+
+	return s;
+}
+
+void SortCache_free(T *K)
+{
+	T k = *K;
+	int i;
+
+	if (! k)
+		return;
+
+	g_array_free(k->uids, TRUE);
+	g_array_free(k->size, TRUE);
+	for (i = 0; i < SORT_KEY_LAST; i++) {
+		if (k->text[i])
+			g_ptr_array_free(k->text[i], TRUE);
+	}
+	if (k->msgid)
+		g_ptr_array_free(k->msgid, TRUE);
+	if (k->refs)
+		g_ptr_array_free(k->refs, TRUE);
+	if (k->reply)
+		g_byte_array_free(k->reply, TRUE);
+	g_string_chunk_free(k->strings);
+	g_hash_table_destroy(k->absent);
+	g_mutex_clear(&k->lock);
+	g_free(k);
+	*K = NULL;
+}
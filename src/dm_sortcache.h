@@ -0,0 +1,65 @@
+/*
+ Copyright (c) 2020-2026 Alan Hicks, Persistent Objects Ltd support@p-o.co.uk
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either
+ version 2 of the License, or (at your option) any later
+ version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+/*
+ * ADT interface for the SORT and THREAD keys of a mailbox
+ *
+ * the keys are read once per mailbox, one column per SORT criterion,
+ * and only messages added since then are read on later use. SORT and
+ * THREAD are then evaluated without queries. Messages that left the
+ * mailbox stay in the cache until it is reloaded; results only hold
+ * the messages passed in.
+ */
+
+#ifndef DM_SORTCACHE_H
+#define DM_SORTCACHE_H
+
+#include <stdint.h>
+#include <glib.h>
+
+#define T SortCache_T
+
+typedef struct T *T;
+
+extern T               SortCache_new(uint64_t mailbox_id);
+
+/* read the keys of messages added since the last update. exists is
+ * the message count, to notice when the cache holds too many gone */
+extern int             SortCache_update(T, unsigned exists);
+extern unsigned        SortCache_count(T);
+
+/* also cache the message-ids and references, from the next update */
+extern void            SortCache_threading(T);
+
+/* found maps uid -> msn. returns the uids in found, ordered by the
+ * SORT_KEYS in criteria, as a list of newly allocated uint64_t */
+extern GList *         SortCache_sort(T, GTree *found, const unsigned char *criteria);
+
+/* THREAD=ORDEREDSUBJECT response for the messages in found, with uids
+ * or msns; NULL if found has no messages */
+extern char *          SortCache_orderedsubject(T, GTree *found, gboolean uid);
+
+/* THREAD=REFERENCES response, likewise; needs SortCache_threading */
+extern char *          SortCache_references(T, GTree *found, gboolean uid);
+
+extern void            SortCache_free(T *);
+
+#undef T
+
+#endif
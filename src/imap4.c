@@ -37,6 +37,10 @@ extern ServerConfig_T *server_conf;
 extern GAsyncQueue *queue;
 extern struct event_base *evbase;
 
+/* sessions in IDLE by selected mailbox, woken by change notifications */
+G_LOCK_DEFINE_STATIC(idle);
+static GHashTable *idle_sessions = NULL;
+
 const char AcceptedTagChars[] =
     "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789"
     "!@#$%^&-=_`~\\|'\" ;:,.<>/? ";
@@ -169,10 +173,54 @@ void imap_cleanup_deferred(gpointer data)
 }
 
 
+static void imap_idle_register(ImapSession *session)
+{
+	uint64_t *id;
+	GList *sessions;
+
+	if (session->idle_id || ! session->mailbox || ! dm_notify_listening())
+		return;
+
+	session->idle_id = session->mailbox->id;
+	id = g_new0(uint64_t, 1);
+	*id = session->idle_id;
+
+	G_LOCK(idle);
+	if (! idle_sessions)
+		idle_sessions = g_hash_table_new_full(g_int64_hash, g_int64_equal, g_free, NULL);
+	sessions = g_hash_table_lookup(idle_sessions, id);
+	g_hash_table_replace(idle_sessions, id, g_list_prepend(sessions, session));
+	G_UNLOCK(idle);
+}
+
+static void imap_idle_unregister(ImapSession *session)
+{
+	GList *sessions;
+
+	if (! session->idle_id)
+		return;
+
+	G_LOCK(idle);
+	sessions = g_hash_table_lookup(idle_sessions, &session->idle_id);
+	sessions = g_list_remove(sessions, session);
+	if (sessions) {
+		uint64_t *id = g_new0(uint64_t, 1);
+		*id = session->idle_id;
+		g_hash_table_replace(idle_sessions, id, sessions);
+	} else {
+		g_hash_table_remove(idle_sessions, &session->idle_id);
+	}
+	G_UNLOCK(idle);
+
+	session->idle_id = 0;
+}
+
 static void imap_session_bailout(ImapSession *session)
 {
 	TRACE(TRACE_DEBUG,"[%p] state [%d] ci[%p]", session, session->state, session->ci);
 
+	imap_idle_unregister(session);
+
 	if (! dbmail_imap_session_set_state(session, CLIENTSTATE_QUIT_QUEUED)) {
 		assert(session && session->ci);
 		dm_queue_push(imap_cleanup_deferred, session, NULL);
@@ -278,6 +326,8 @@ static void imap_session_reset(ImapSession *session)
 	memset(session->tag, 0, sizeof(session->tag));
 	memset(session->command, 0, sizeof(session->command));
 
+	imap_idle_unregister(session);
+
 	session->use_uid = 0;
 	session->command_type = 0;
 	session->command_state = FALSE;
@@ -381,8 +431,11 @@ void imap_cb_time(void *arg)
 		ci_cork(session->ci);
 		if (! (++session->loop % idle_interval)) {
 			imap_session_printf(session, "* OK Still here\r\n");
+			dbmail_imap_session_mailbox_status(session,TRUE);
+		} else if (! session->idle_id) {
+			// not woken by change notifications, keep polling
+			dbmail_imap_session_mailbox_status(session,TRUE);
 		}
-		dbmail_imap_session_mailbox_status(session,TRUE);
 		dbmail_imap_session_buff_flush(session);
 		ci_uncork(session->ci);
 	} else {
@@ -392,6 +445,43 @@ void imap_cb_time(void *arg)
 	}
 }
 
+/*
+ * change notification callback: wake the sessions idling on the mailbox
+ * and forget the mimeparts dbmail-util may have deleted
+ */
+
+void imap_cb_notify(uint64_t mailbox_id, uint64_t seq)
+{
+	GList *sessions = NULL, *l;
+
+	if (mailbox_id == DM_NOTIFY_USERS)
+		return;
+	if (mailbox_id == DM_NOTIFY_MIMEPARTS) {
+		dm_mimepart_cache_flush();
+		return;
+	}
+
+	G_LOCK(idle);
+	if (idle_sessions)
+		sessions = g_list_copy(g_hash_table_lookup(idle_sessions, &mailbox_id));
+	G_UNLOCK(idle);
+
+	for (l = sessions; l; l = g_list_next(l)) {
+		ImapSession *session = (ImapSession *)l->data;
+		if (session->command_type != IMAP_COMM_IDLE || session->command_state != IDLE)
+			continue;
+		// nothing new for this session
+		if (session->mailbox->mbstate && MailboxState_getSeq(session->mailbox->mbstate) >= seq)
+			continue;
+		TRACE(TRACE_DEBUG, "[%p] mailbox [%" PRIu64 "] seq [%" PRIu64 "]", session, mailbox_id, seq);
+		ci_cork(session->ci);
+		dbmail_imap_session_mailbox_status(session,TRUE);
+		dbmail_imap_session_buff_flush(session);
+		ci_uncork(session->ci);
+	}
+	g_list_free(sessions);
+}
+
 static int checktag(const char *s)
 {
 	int i;
@@ -581,6 +671,8 @@ void imap_handle_input(ImapSession *session)
 			if (result || (session->command_type == IMAP_COMM_IDLE && session->command_state == IDLE)) { 
 				imap_handle_exit(session, result);
 			}
+			if (! result && session->command_type == IMAP_COMM_IDLE && session->command_state == IDLE)
+				imap_idle_register(session);
 			break;
 		}
 
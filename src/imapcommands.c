@@ -333,7 +333,7 @@ int _ic_authenticate(ImapSession *self)
 static gboolean mailbox_first_unseen(gpointer key, gpointer value, gpointer data)
 {
 	MessageInfo *msginfo = (MessageInfo *)value;
-	if (msginfo->flags[IMAP_FLAG_SEEN])
+	if (MailboxState_message_hasFlag(msginfo, IMAP_FLAG_SEEN))
 	       	return FALSE;
 	*(uint64_t *)data = *(uint64_t *)key;
 	return TRUE;
@@ -543,7 +543,7 @@ static int _ic_select_parse_args(ImapSession *self)
 	return 0;
 }
 
-static gboolean _do_fetch_updates(uint64_t *id, gpointer UNUSED value, dm_thread_data *D)
+static gboolean _do_fetch_updates(uint64_t *id, dm_thread_data *D)
 {
 	ImapSession *self = D->session;
 	MessageInfo *msginfo = g_tree_lookup(
@@ -711,12 +711,11 @@ static void _ic_select_enter(dm_thread_data *D)
 	if(self->command_type == IMAP_COMM_SELECT && command_select_allow_unseen == 1){
 		if (MailboxState_getExists(S)) { 
 			/* show msn of first unseen msg (if present) */
-			GTree *uids = MailboxState_getIds(S);
 			GTree *info = MailboxState_getMsginfo(S);
-			uint64_t key = 0, *msn = NULL;
+			uint64_t key = 0, msn = 0;
 			g_tree_foreach(info, (GTraverseFunc)mailbox_first_unseen, &key);
-			if ( (key > 0) && (msn = g_tree_lookup(uids, &key))) {
-				dbmail_imap_session_buff_printf(self, "* OK [UNSEEN %" PRIu64 "] first unseen message\r\n", *msn);
+			if ( (key > 0) && (msn = MailboxState_getMsnForUid(S, key))) {
+				dbmail_imap_session_buff_printf(self, "* OK [UNSEEN %" PRIu64 "] first unseen message\r\n", msn);
 			}
 		}
 	}
@@ -750,12 +749,19 @@ static void _ic_select_enter(dm_thread_data *D)
 		} else {
 			set = "1:*";
 		}
-		changed = dbmail_mailbox_get_set(self->mailbox, set, TRUE);
-		TRACE(TRACE_DEBUG, "messages changed since [%" PRIu64 "] [%u]",
-				self->mailbox->modseq, g_tree_nnodes(changed));
-
-		g_tree_foreach(changed, (GTraverseFunc) _do_fetch_updates, D);
-		g_tree_destroy(changed);
+		changed = dbmail_mailbox_get_seqset(self->mailbox, set, TRUE);
+		if (changed) {
+			uint64_t msn = 0;
+			TRACE(TRACE_DEBUG, "messages changed since [%" PRIu64 "] [%" PRIu64 "]",
+					self->mailbox->modseq, SeqSet_count(changed));
+
+			while (SeqSet_next(changed, &msn)) {
+				uint64_t uid = MailboxState_getUidForMsn(self->mailbox->mbstate, msn);
+				if (_do_fetch_updates(&uid, D))
+					break;
+			}
+			SeqSet_free(&changed);
+		}
 		// done reporting
 		self->use_uid = uid;
 
@@ -947,9 +953,15 @@ void _ic_delete_enter(dm_thread_data *D)
 			c = db_con_get();
 			TRY
 				db_begin_transaction(c);
-				db_exec(c, "UPDATE %smessages SET status=%d WHERE mailbox_idnr = %" PRIu64 "", DBPFX, MESSAGE_STATUS_PURGE, mailbox_idnr);
-				db_exec(c, "UPDATE %smailboxes SET no_select = 1 WHERE mailbox_idnr = %" PRIu64 "", DBPFX, mailbox_idnr);
-				db_commit_transaction(c);
+				/* sessions that have it selected learn from the log */
+				if (db_expunge_log_mailbox(c, mailbox_idnr) &&
+						db_exec(c, "UPDATE %smessages SET status=%d WHERE mailbox_idnr = %" PRIu64 "", DBPFX, MESSAGE_STATUS_PURGE, mailbox_idnr) &&
+						db_exec(c, "UPDATE %smailboxes SET no_select = 1 WHERE mailbox_idnr = %" PRIu64 "", DBPFX, mailbox_idnr)) {
+					db_commit_transaction(c);
+				} else {
+					db_rollback_transaction(c);
+					t = DM_EQUERY;
+				}
 			CATCH(SQLException)
 				LOG_SQLERROR;
 				db_rollback_transaction(c);
@@ -1744,17 +1756,18 @@ void _ic_append_enter(dm_thread_data *D)
 	}
 
 	// MessageInfo
-	info = g_new0(MessageInfo,1);
+	info = MessageInfo_new();
 	info->uid = message_id;
 	info->mailbox_id = mboxid;
 	for (flagcount = 0; flagcount < IMAP_NFLAGS; flagcount++)
-		info->flags[flagcount] = flaglist[flagcount];
-	info->flags[IMAP_FLAG_RECENT] = 1;
+		MailboxState_message_setFlag(info, flagcount, flaglist[flagcount]);
+	MailboxState_message_setFlag(info, IMAP_FLAG_RECENT, TRUE);
 	strncpy(info->internaldate, 
 			internal_date?internal_date:"01-Jan-1970 00:00:01 +0100",
 		       	IMAP_INTERNALDATE_LEN-1);
 	info->rfcsize = strlen(message);
-	info->keywords = keywords;
+	MailboxState_message_setKeywords(M, info, keywords, IMAPFA_ADD);
+	g_list_destroy(keywords);
 
 	MailboxState_addMsginfo(M, message_id, info);
 
@@ -1985,7 +1998,7 @@ static void sorted_search_enter(dm_thread_data *D)
 				s = dbmail_mailbox_orderedsubject(mb);
 			break;
 			case SEARCH_THREAD_REFERENCES:
-				s = NULL; // TODO: unsupported
+				s = dbmail_mailbox_references(mb);
 			break;
 		}
 	} else {
@@ -2026,8 +2039,7 @@ int _ic_thread(ImapSession *self)
 	if (MATCH(p_string_str(self->args[self->args_idx]),"ORDEREDSUBJECT"))
 		return sorted_search(self,SEARCH_THREAD_ORDEREDSUBJECT);
 	if (MATCH(p_string_str(self->args[self->args_idx]),"REFERENCES"))
-		dbmail_imap_session_buff_printf(self, "%s BAD THREAD=REFERENCES not supported\r\n",self->tag);
-		//return sorted_search(self,SEARCH_THREAD_REFERENCES);
+		return sorted_search(self,SEARCH_THREAD_REFERENCES);
 
 	return 1;
 }
@@ -2038,21 +2050,19 @@ int _dm_imapsession_get_ids(ImapSession *self, const char *set)
 	
 	dbmail_mailbox_set_uid(self->mailbox,self->use_uid);
 
-	if (self->ids) {
-		g_tree_destroy(self->ids);
-		self->ids = NULL;
-	}
+	if (self->ids)
+		SeqSet_free(&self->ids);
 
-	self->ids = dbmail_mailbox_get_set(self->mailbox, set, self->use_uid);
+	self->ids = dbmail_mailbox_get_seqset(self->mailbox, set, self->use_uid);
 
-	found = ( self->ids && (g_tree_nnodes(self->ids) > 0) );
+	found = ( self->ids && (! SeqSet_isEmpty(self->ids)) );
 
 	if ( (! self->use_uid) && (! found)) {
 		dbmail_imap_session_buff_printf(self, "%s BAD invalid sequence in msn set [%s]\r\n", self->tag, set);
 		return DM_EGENERAL;
 	}
 	
-	if (self->use_uid && (! self->ids)) { // empty tree IS valid
+	if (self->use_uid && (! self->ids)) { // empty set IS valid
 		dbmail_imap_session_buff_printf(self, "%s BAD invalid sequence in uid set [%s]\r\n", self->tag, set);
 		return DM_EGENERAL;
 	}
@@ -2111,10 +2121,8 @@ static void _ic_fetch_enter(dm_thread_data *D)
 
 	dbmail_imap_session_mailbox_status(self, FALSE);
 
-	if ((result = _dm_imapsession_get_ids(self, p_string_str(self->args[setidx]))) == DM_SUCCESS) {
-		self->ids_list = g_tree_keys(self->ids);
+	if ((result = _dm_imapsession_get_ids(self, p_string_str(self->args[setidx]))) == DM_SUCCESS)
 		result = dbmail_imap_session_fetch_get_items(self);
-	}
 
 	dbmail_imap_session_fetch_free(self, FALSE);
 	dbmail_imap_session_args_free(self, FALSE);
@@ -2147,17 +2155,15 @@ void _fetch_update(ImapSession *self, MessageInfo *msginfo, gboolean showmodseq,
 {
 	gboolean needspace = false;
 
-	uint64_t *msn = g_tree_lookup(MailboxState_getIds(self->mailbox->mbstate), &msginfo->uid);
+	uint64_t msn = MailboxState_getMsnForUid(self->mailbox->mbstate, msginfo->uid);
 
-	dbmail_imap_session_buff_printf(self,"* %" PRIu64 " FETCH (", *msn);
+	dbmail_imap_session_buff_printf(self,"* %" PRIu64 " FETCH (", msn);
 	if (self->use_uid) {
 		dbmail_imap_session_buff_printf(self, "UID %" PRIu64 , msginfo->uid);
 		needspace = true;
 	}
 	if (showflags) {
-		GList *sublist = MailboxState_message_flags(self->mailbox->mbstate, msginfo);
-		char *s = dbmail_imap_plist_as_string(sublist);
-		g_list_free_full(g_steal_pointer (&sublist), g_free);
+		char *s = MailboxState_message_flags(self->mailbox->mbstate, msginfo);
 		if (needspace) dbmail_imap_session_buff_printf(self, " ");
 		dbmail_imap_session_buff_printf(self, "FLAGS %s", s);
 		g_free(s);
@@ -2171,7 +2177,7 @@ void _fetch_update(ImapSession *self, MessageInfo *msginfo, gboolean showmodseq,
 	dbmail_imap_session_buff_printf(self, ")\r\n");
 }
 
-static gboolean _do_store(uint64_t *id, gpointer UNUSED value, dm_thread_data *D)
+static gboolean _do_store(uint64_t *id, dm_thread_data *D)
 {
 	ImapSession *self = D->session;
 	struct cmd_t *cmd = self->cmd;
@@ -2180,15 +2186,18 @@ static gboolean _do_store(uint64_t *id, gpointer UNUSED value, dm_thread_data *D
 	int i;
 	int changed = 0;
 
-	if (self->mailbox && MailboxState_getMsginfo(self->mailbox->mbstate))
-		msginfo = g_tree_lookup(MailboxState_getMsginfo(self->mailbox->mbstate), id);
+	if (self->mailbox && self->mailbox->mbstate)
+		msginfo = MailboxState_getWritableMsginfo(self->mailbox->mbstate, *id);
 
 	if (! msginfo)
 		return TRUE;
 
 
 	if (MailboxState_getPermission(self->mailbox->mbstate) == IMAPPERM_READWRITE) {
-		changed = db_set_msgflag(*id, cmd->flaglist, cmd->keywords, cmd->action, cmd->unchangedsince, msginfo);
+		GList *keywords = MailboxState_message_keywordChanges(self->mailbox->mbstate,
+				msginfo, cmd->keywords, cmd->action);
+		changed = db_set_msgflag(*id, cmd->flaglist, keywords, cmd->action, cmd->unchangedsince, msginfo);
+		g_list_free(keywords);
 		if (changed < 0) {
 			dbmail_imap_session_buff_printf(self, "\r\n* BYE internal dbase error\r\n");
 			D->status = TRUE;
@@ -2197,7 +2206,9 @@ static gboolean _do_store(uint64_t *id, gpointer UNUSED value, dm_thread_data *D
 			db_message_set_seq(*id, cmd->seq);
 			msginfo->seq = cmd->seq;
 		} else {
-			self->ids_list = g_list_prepend(self->ids_list, id);
+			if (! self->modified)
+				self->modified = SeqSet_new();
+			SeqSet_add(self->modified, *id, *id);
 		}
 	}
 
@@ -2210,23 +2221,23 @@ static gboolean _do_store(uint64_t *id, gpointer UNUSED value, dm_thread_data *D
 		switch (cmd->action) {
 			case IMAPFA_ADD:
 				if (cmd->flaglist[i])
-					msginfo->flags[i] = 1;
+					MailboxState_message_setFlag(msginfo, i, TRUE);
 			break;
 			case IMAPFA_REMOVE:
 				if (cmd->flaglist[i]) 
-					msginfo->flags[i] = 0;
+					MailboxState_message_setFlag(msginfo, i, FALSE);
 			break;
 			case IMAPFA_REPLACE:
 				if (cmd->flaglist[i]) 
-					msginfo->flags[i] = 1;
+					MailboxState_message_setFlag(msginfo, i, TRUE);
 				else
-					msginfo->flags[i] = 0;
+					MailboxState_message_setFlag(msginfo, i, FALSE);
 			break;
 		}
 	}
 
 	// Set the user keywords as labels
-	g_list_merge(&(msginfo->keywords), cmd->keywords, cmd->action, (GCompareFunc)g_ascii_strcasecmp);
+	MailboxState_message_setKeywords(self->mailbox->mbstate, msginfo, cmd->keywords, cmd->action);
 
 	// reporting callback
 	if ((! cmd->silent) || changed > 0) {
@@ -2408,9 +2419,14 @@ static void _ic_store_enter(dm_thread_data *D)
 
 	if ((result = _dm_imapsession_get_ids(self, p_string_str(self->args[self->args_idx]))) == DM_SUCCESS) {
 		if (self->ids) {
+			uint64_t msn = 0;
 			uint64_t seq = db_mailbox_seq_update(MailboxState_getId(self->mailbox->mbstate), 0);
 			cmd.seq = seq;
-			g_tree_foreach(self->ids, (GTraverseFunc) _do_store, D);
+			while (SeqSet_next(self->ids, &msn)) {
+				uint64_t uid = MailboxState_getUidForMsn(self->mailbox->mbstate, msn);
+				if (_do_store(&uid, D))
+					break;
+			}
 		}
 	}
 
@@ -2421,15 +2437,14 @@ static void _ic_store_enter(dm_thread_data *D)
 		SESSION_RETURN;
 	}
 
-	if (self->ids_list) {
-		GString *failed_ids = g_list_join_u64(self->ids_list, ",");
+	if (self->modified) {
+		char *failed_ids = SeqSet_string(self->modified);
 		buffer = p_string_new(self->pool, "");
 		//according to RFC7162 section 3.1.3.0 MODIFIED keyword should be used as respnse like 
 		//"... OK [MODIFIED 7,9] ..." not "...OK [MODIFIED [7,9]]..."
-		p_string_printf(buffer, "MODIFIED %s", failed_ids->str);
-		g_string_free(failed_ids, TRUE);
-		g_list_free(g_list_first(self->ids_list));
-		self->ids_list = NULL;
+		p_string_printf(buffer, "MODIFIED %s", failed_ids);
+		g_free(failed_ids);
+		SeqSet_free(&self->modified);
 		SESSION_OK_WITH_RESP_CODE(p_string_str(buffer));
 		p_string_free(buffer, TRUE);
 	} else {
@@ -2452,7 +2467,7 @@ int _ic_store(ImapSession *self)
  * copy a message to another mailbox
  */
 
-static gboolean _do_copy(uint64_t *id, gpointer UNUSED value, ImapSession *self)
+static gboolean _do_copy(uint64_t *id, ImapSession *self)
 {
 	struct cmd_t *cmd = self->cmd;
 	uint64_t newid = 0;
@@ -2501,8 +2516,7 @@ static void _ic_copy_enter(dm_thread_data *D)
 	src = p_string_str(self->args[self->args_idx]);
 	dst = p_string_str(self->args[self->args_idx+1]);
 
-	GList *old_ids;
-	GString *old_ids_buff;
+	char *old_ids;
 	GString *new_ids_buff;
 
 	String_T buffer;
@@ -2531,8 +2545,13 @@ static void _ic_copy_enter(dm_thread_data *D)
 	self->cmd = &cmd;
 	if ((result = _dm_imapsession_get_ids(self, src)) == DM_SUCCESS) {
 		if (self->ids) {
+			uint64_t msn = 0;
 			cmd.seq = db_mailbox_seq_update(destmboxid, 0);
-			g_tree_foreach(self->ids, (GTraverseFunc) _do_copy, self);
+			while (SeqSet_next(self->ids, &msn)) {
+				uint64_t uid = MailboxState_getUidForMsn(self->mailbox->mbstate, msn);
+				if (_do_copy(&uid, self))
+					break;
+			}
 		}
 	}
 	self->cmd = NULL;
@@ -2547,17 +2566,15 @@ static void _ic_copy_enter(dm_thread_data *D)
 
 	self->new_ids = g_list_reverse(self->new_ids);
 
-	old_ids = g_tree_keys(self->ids);
-	old_ids_buff = g_list_join_u64(old_ids,",");
-	g_list_free(g_list_first(old_ids));
+	old_ids = MailboxState_uidset(self->mailbox->mbstate, self->ids);
 
 	new_ids_buff = g_list_join_u64(self->new_ids,",");
 
 	buffer = p_string_new(self->pool, "");
-	p_string_printf(buffer, "COPYUID %" PRIu64 " %s %s", destmboxid, old_ids_buff->str, new_ids_buff->str);
+	p_string_printf(buffer, "COPYUID %" PRIu64 " %s %s", destmboxid, old_ids, new_ids_buff->str);
 
 	g_string_free(new_ids_buff,TRUE);
-	g_string_free(old_ids_buff,TRUE);
+	g_free(old_ids);
 
 	SESSION_OK_WITH_RESP_CODE(p_string_str(buffer));
 	p_string_free(buffer, TRUE);
@@ -28,6 +28,21 @@
 #define MAX_ERRORS 3
 
 extern ServerConfig_T *server_conf;
+extern int selfpipe[2];
+extern pthread_mutex_t selfpipe_lock;
+extern GAsyncQueue *queue;
+
+/* a message being delivered by the worker pool */
+struct delivery {
+	DbmailMessage *msg;
+	List_T rcpt;
+	int result;
+	gint64 start;
+};
+
+/* deliveries in the pool, and the most there have been at once */
+static unsigned deliveries_running = 0;
+static unsigned deliveries_peak = 0;
 
 /* allowed lmtp commands */
 static const char *const commands[] = {
@@ -91,6 +106,10 @@ static void lmtp_handle_input(void *arg)
 	char buffer[MAX_LINESIZE];	/* connection buffer */
 	ClientSession_T *session = (ClientSession_T *)arg;
 	while (TRUE) {
+		/* input waits for the delivery in progress */
+		if (session->command_state)
+			break;
+
 		memset(buffer, 0, sizeof(buffer));
 
 		l = ci_readln(session->ci, buffer);
@@ -109,8 +128,12 @@ static void lmtp_handle_input(void *arg)
 					client_session_bailout(&session);
 					return;
 				}
-				ci_uncork(session->ci);
 				client_session_reset_parser(session);
+				/* the session stays corked until the
+				 * delivery is done */
+				if (session->command_state)
+					return;
+				ci_uncork(session->ci);
 			}
 
 			if (l < 0) {
@@ -178,6 +201,20 @@ int lmtp_handle_connection(client_sock *c)
 	return 0;
 }
 
+/*
+ * change notification callback: forget the recipients resolved
+ * before dbmail-users changed them, and the mimeparts dbmail-util
+ * may have deleted
+ */
+
+void lmtp_cb_notify(uint64_t mailbox_id, uint64_t UNUSED seq)
+{
+	if (mailbox_id == DM_NOTIFY_USERS)
+		dsnuser_cache_flush();
+	else if (mailbox_id == DM_NOTIFY_MIMEPARTS)
+		dm_mimepart_cache_flush();
+}
+
 int lmtp_error(ClientSession_T * session, const char *formatstring, ...)
 {
 	va_list ap, cp;
@@ -282,13 +319,110 @@ int lmtp_tokenizer(ClientSession_T *session, char *buffer)
 	return session->parser_state;
 }
 
+/* the replies to DATA, one per recipient in the order received */
+static void lmtp_data_reply(ClientSession_T *session, List_T rcpt, int result)
+{
+	ClientBase_T *ci = session->ci;
+	const char *class, *subject, *detail;
+
+	if (result == -1) {
+		ci_write(ci, "430 Message not received\r\n");
+		return;
+	}
+
+	rcpt = p_list_first(rcpt);
+	while (rcpt) {
+		Delivery_T * dsnuser = (Delivery_T *)p_list_data(rcpt);
+		dsn_tostring(dsnuser->dsn, &class, &subject, &detail);
+
+		/* Give a simple OK, otherwise a detailed message. */
+		switch (dsnuser->dsn.class) {
+			case DSN_CLASS_OK:
+				ci_write(ci, "%d%d%d Recipient <%s> OK\r\n",
+						dsnuser->dsn.class, dsnuser->dsn.subject, dsnuser->dsn.detail,
+						dsnuser->address);
+				break;
+			default:
+				ci_write(ci, "%d%d%d Recipient <%s> %s %s %s\r\n",
+						dsnuser->dsn.class, dsnuser->dsn.subject, dsnuser->dsn.detail,
+						dsnuser->address, class, subject, detail);
+		}
+
+		if (! p_list_next(rcpt))
+			break;
+		rcpt = p_list_next(rcpt);
+	}
+
+	/* Reset the session after a successful delivery;
+	 * MTA's like Exim prefer to immediately begin the
+	 * next delivery without an RSET or a reconnect. */
+	lmtp_rset(session,TRUE);
+}
+
+/* worker thread: store the message, then hand D back to the main thread */
+static void lmtp_deliver_enter(gpointer data)
+{
+	dm_thread_data *D = (dm_thread_data *)data;
+	struct delivery *d = (struct delivery *)D->data;
+
+	d->result = insert_messages(d->msg, d->rcpt);
+
+	g_async_queue_push(queue, (gpointer)D);
+	PLOCK(selfpipe_lock);
+	if (selfpipe[1] > -1) {
+		if (write(selfpipe[1], "D", 1)) { /* ignore */; }
+	}
+	PUNLOCK(selfpipe_lock);
+}
+
+/* main thread: reply, then read the commands that came in meanwhile */
+static void lmtp_deliver_leave(gpointer data)
+{
+	dm_thread_data *D = (dm_thread_data *)data;
+	ClientSession_T *session = (ClientSession_T *)D->session;
+	struct delivery *d = (struct delivery *)D->data;
+
+	deliveries_running--;
+	TRACE(TRACE_INFO, "[%p] delivered in [%" PRId64 "] ms, running [%u] queued [%u] peak [%u]",
+			session, (g_get_monotonic_time() - d->start) / 1000,
+			deliveries_running, dm_thread_job_queued(), deliveries_peak);
+
+	lmtp_data_reply(session, d->rcpt, d->result);
+	dbmail_message_free(d->msg);
+	g_free(d);
+
+	session->command_state = FALSE;
+	ci_uncork(session->ci);
+	lmtp_handle_input(session);
+}
+
+/* deliver in the worker pool; FALSE if there is none */
+static gboolean lmtp_deliver_async(ClientSession_T *session, DbmailMessage *msg)
+{
+	struct delivery *d = g_new0(struct delivery, 1);
+
+	d->msg = msg;
+	d->rcpt = session->rcpt;
+	d->start = g_get_monotonic_time();
+
+	session->command_state = TRUE;
+	if (! dm_thread_job_push(session, lmtp_deliver_enter, lmtp_deliver_leave, d)) {
+		session->command_state = FALSE;
+		g_free(d);
+		return FALSE;
+	}
+
+	deliveries_running++;
+	deliveries_peak = max(deliveries_peak, deliveries_running);
+
+	return TRUE;
+}
 
 int lmtp(ClientSession_T * session)
 {
 	DbmailMessage *msg;
 	ClientBase_T *ci = session->ci;
 	int helpcmd;
-	const char *class, *subject, *detail;
 	size_t tmplen = 0, tmppos = 0;
 	char *tmpaddr = NULL, *tmpbody = NULL, *arg;
 	int state = 0;
@@ -511,42 +645,14 @@ int lmtp(ClientSession_T * session)
 
 		p_string_truncate(session->rbuff,0);
 
-		if (insert_messages(msg, session->rcpt) == -1) {
-			ci_write(ci, "430 Message not received\r\n");
-			dbmail_message_free(msg);
-			return 1;
-		}
 		/* The DATA command itself it not given a reply except
-		 * that of the status of each of the remaining recipients. */
-
-		/* The replies MUST be in the order received */
-		session->rcpt = p_list_first(session->rcpt);
-		while (session->rcpt) {
-			Delivery_T * dsnuser = (Delivery_T *)p_list_data(session->rcpt);
-			dsn_tostring(dsnuser->dsn, &class, &subject, &detail);
-
-			/* Give a simple OK, otherwise a detailed message. */
-			switch (dsnuser->dsn.class) {
-				case DSN_CLASS_OK:
-					ci_write(ci, "%d%d%d Recipient <%s> OK\r\n",
-							dsnuser->dsn.class, dsnuser->dsn.subject, dsnuser->dsn.detail,
-							dsnuser->address);
-					break;
-				default:
-					ci_write(ci, "%d%d%d Recipient <%s> %s %s %s\r\n",
-							dsnuser->dsn.class, dsnuser->dsn.subject, dsnuser->dsn.detail,
-							dsnuser->address, class, subject, detail);
-			}
+		 * that of the status of each of the remaining recipients,
+		 * sent when the worker pool is done with it. */
+		if (lmtp_deliver_async(session, msg))
+			return 1;
 
-			if (! p_list_next(session->rcpt))
-				break;
-			session->rcpt = p_list_next(session->rcpt);
-		}
+		lmtp_data_reply(session, session->rcpt, insert_messages(msg, session->rcpt));
 		dbmail_message_free(msg);
-		/* Reset the session after a successful delivery;
-		 * MTA's like Exim prefer to immediately begin the
-		 * next delivery without an RSET or a reconnect. */
-		lmtp_rset(session,TRUE);
 		return 1;
 
 	default:
@@ -35,7 +35,7 @@ extern DBParam_T db_params;
 #define DBPFX db_params.pfx
 
 /** list of tables used in dbmail, it is a duplicate found in dm_db.c*/
-#define DB_NTABLES 24
+#define DB_NTABLES 25
 const char *DB_TABLENAMES[DB_NTABLES] = {
 	"acl",
 	"aliases",
@@ -43,6 +43,7 @@ const char *DB_TABLENAMES[DB_NTABLES] = {
 	"auto_notifications",
 	"auto_replies",
 	"envelope",
+	"expunges",
 	"filters",
 	"header",
 	"headername",
@@ -90,7 +91,9 @@ static int do_check_replycache(const char *timespec);
 static int do_vacuum_db(void);
 static int do_rehash(void);
 static int do_migrate(int migrate_limit);
+static int do_fts_index(int limit);
 static int do_check_empty_envelope(void);
+static int do_bodystructure(void);
 
 int do_showhelp(void) {
 	printf("*** dbmail-util ***\n");
@@ -105,7 +108,7 @@ int do_showhelp(void) {
 	"                              --remove-invalid-aliases --test-integrity)\n"
 	"     -c, --clean-database     clean up database (optimize/vacuum)\n"
 	"     -t, --test-integrity     test for message integrity\n"
-	"     -b, --check-body         body/header/envelope cache check\n"
+	"     -b, --check-body         body/header/envelope/bodystructure cache check\n"
 	"     -e, --check-empty-cache  empty envelope cache check\n"
 	"     -p, --purge-deleted      purge messages have the DELETE status set\n"
 	"     -d, --set-deleted        set DELETE status for deleted messages\n"
@@ -120,6 +123,8 @@ int do_showhelp(void) {
 	"                              limit migration to [limit] number of\n"
 	"                              physmessages. Default 10000 per run\n"
 	"     --rehash                 Rebuild hash keys for stored messages\n"
+	"     --fts-index              index stored messages for SEARCH BODY/TEXT,\n"
+	"                              up to --migrate-limit per run\n"
 	"     --erase days             Delete messages older than date in INBOX/Trash \n"
 	"     --move  days             Move messages from INBOX to INBOX/Trash\n"
 	"     --inbox name             Inbox folder to move from, used in conjunction with --move\n"
@@ -146,7 +151,7 @@ int main(int argc, char *argv[])
 	int check_iplog = 0, check_replycache = 0;
 	int check_empty_envelope = 0;
 	char *timespec_iplog = NULL, *timespec_replycache = NULL;
-	int vacuum_db = 0, purge_deleted = 0, set_deleted = 0, dangling_aliases = 0, rehash = 0, move_old = 0, erase_old = 0;
+	int vacuum_db = 0, purge_deleted = 0, set_deleted = 0, dangling_aliases = 0, rehash = 0, fts_index = 0, move_old = 0, erase_old = 0;
 	int show_help = 0;
 	int do_nothing = 1;
 	int is_header = 0;
@@ -165,6 +170,7 @@ int main(int argc, char *argv[])
 		{"migrate-legacy", no_argument, NULL, 'M'},
 		{"migrate-limit", required_argument, 0, 'm'},
 		{"rehash", no_argument, NULL, 0},
+		{"fts-index", no_argument, NULL, 0},
 		{"move", required_argument, NULL, 0},
 		{"erase", required_argument, NULL, 0},
 		{"trash", required_argument, NULL, 0},
@@ -202,6 +208,9 @@ int main(int argc, char *argv[])
 			if (strcmp(long_options[opt_index].name,"rehash")==0)
 				rehash = 1;
 
+			if (strcmp(long_options[opt_index].name,"fts-index")==0)
+				fts_index = 1;
+
 			if (strcmp(long_options[opt_index].name,"move")==0) {
 				move_old = 1;
 				days_move = atoi(optarg);
@@ -390,6 +399,7 @@ int main(int argc, char *argv[])
 	if (vacuum_db) do_vacuum_db();
 	if (rehash) do_rehash();
 	if (migrate) do_migrate(migrate_limit);
+	if (fts_index) do_fts_index(migrate_limit);
 	if (check_empty_envelope) do_check_empty_envelope();
 
 	if (!has_errors && !serious_errors) {
@@ -527,6 +537,15 @@ static int db_deleted_purge(void)
 	return db_update("DELETE FROM %smessages WHERE status=%d", DBPFX, MESSAGE_STATUS_PURGE);
 }
 
+/* drop expunge log entries of messages that are gone from their mailbox */
+static int db_expunges_purge(void)
+{
+	return db_update("DELETE FROM %sexpunges WHERE NOT EXISTS "
+			"(SELECT 1 FROM %smessages m WHERE m.message_idnr = %sexpunges.message_idnr "
+			"AND m.mailbox_idnr = %sexpunges.mailbox_idnr)",
+			DBPFX, DBPFX, DBPFX, DBPFX);
+}
+
 static int db_deleted_count(uint64_t * rows)
 {
 	Connection_T c; ResultSet_T r; volatile int t = FALSE;
@@ -575,6 +594,12 @@ int do_purge_deleted(void)
 		}
 		qprintf("Ok. Messages deleted.\n");
 		TRACE(TRACE_INFO, "Ok. Messages deleted.");
+		if (! db_expunges_purge()) {
+			qprintf ("Failed to clean the expunge log. Please check log.\n");
+			TRACE(TRACE_INFO, "Failed to clean the expunge log. Please check log");
+			serious_errors = 1;
+			return -1;
+		}
 	}
 	return 0;
 }
@@ -738,7 +763,7 @@ int do_check_integrity(void)
 	/* This is what we do:
 	 3. Check for loose physmessages
 	 4. Check for loose partlists
-	 5. Check for loose mimeparts
+	 5. Check for loose mimeparts and the mimepart store
 	 6. Check for loose headernames
 	 7. Check for loose headervalues
 	 */
@@ -814,6 +839,41 @@ int do_check_integrity(void)
 		action, difftime(stop, start));
 	TRACE(TRACE_INFO, "--- %s unconnected mimeparts took %g seconds\n",
 		action, difftime(stop, start));
+
+	start = stop;
+	qprintf("\n%s DBMAIL mimepart store integrity...\n", action);
+	TRACE(TRACE_INFO, "%s DBMAIL mimepart store integrity...", action);
+	if ((count = db_icheck_partstore(&lost)) < 0) {
+		qprintf("Failed. An error occurred. Please check log.\n");
+		serious_errors = 1;
+		return -1;
+	}
+	qprintf("Ok. Found [%ld] mimeparts missing from the store.\n", count);
+	TRACE(TRACE_INFO, "Ok. Found [%ld] mimeparts missing from the store.", count);
+	if (count > 0) {
+		qprintf("Mimeparts missing from the store can not be repaired; restore them from backup.\n");
+		has_errors = 1;
+	}
+	g_list_destroy(lost);
+	lost = NULL;
+
+	if ((count = db_icheck_partstore_orphans(cleanup)) < 0) {
+		qprintf("Failed. An error occurred. Please check log.\n");
+		serious_errors = 1;
+		return -1;
+	}
+	qprintf("Ok. Found [%ld] unreferenced files in the store.\n", count);
+	TRACE(TRACE_INFO, "Ok. Found [%ld] unreferenced files in the store.", count);
+	if (count > 0) {
+		if (cleanup) {
+			qprintf("Ok. Unreferenced files deleted.\n");
+			TRACE(TRACE_INFO, "Ok. Unreferenced files deleted.");
+		}
+	}
+
+	time(&stop);
+	qverbosef("--- %s mimepart store took %g seconds\n",
+		action, difftime(stop, start));
 	/* end part 5 */
 
 	/* part 6 */
@@ -983,6 +1043,54 @@ static int do_envelope(void)
 
 }
 
+static int do_bodystructure(void)
+{
+	time_t start, stop;
+	GList *lost = NULL;
+
+	if (no_to_all) {
+		qprintf("\nChecking DBMAIL for cached bodystructures...\n");
+		TRACE(TRACE_INFO, "Checking DBMAIL for cached bodystructures...");
+	}
+	if (yes_to_all) {
+		qprintf("\nRepairing DBMAIL for cached bodystructures...\n");
+		TRACE(TRACE_INFO, "Repairing DBMAIL for cached bodystructures...");
+	}
+	time(&start);
+
+	if (db_icheck_bodystructure(&lost) < 0) {
+		qprintf("Failed. An error occured. Please check log.\n");
+		TRACE(TRACE_INFO, "Failed. An error occured. Please check log.");
+		serious_errors = 1;
+		return -1;
+	}
+
+	TRACE(TRACE_INFO, "Ok. Found [%d] missing bodystructure values.", g_list_length(lost));
+	qprintf("Ok. Found [%d] missing bodystructure values.\n", g_list_length(lost));
+	if (g_list_length(lost) > 0) {
+		has_errors = 1;
+	}
+
+	if (yes_to_all) {
+		if (db_set_bodystructure(lost) < 0) {
+			qprintf("Error setting the bodystructure cache");
+			TRACE(TRACE_INFO, "Error setting the bodystructure cache");
+			has_errors = 1;
+		}
+	}
+
+	g_list_destroy(lost);
+
+	time(&stop);
+	qverbosef("--- checking bodystructure cache took %g seconds\n",
+	       difftime(stop, start));
+	TRACE(TRACE_INFO, "--- checking bodystructure cache took %g seconds\n",
+	       difftime(stop, start));
+
+	return 0;
+
+}
+
 static int do_check_empty_envelope(void)
 {
 	time_t start, stop;
@@ -1045,6 +1153,10 @@ int do_header_cache(void)
 		serious_errors = 1;
 		return -1;
 	}
+	if (do_bodystructure()) {
+		serious_errors = 1;
+		return -1;
+	}
 	
 	if (no_to_all) {
 		qprintf("\nChecking DBMAIL for cached header values...\n");
@@ -1311,6 +1423,63 @@ int do_migrate(int migrate_limit)
 	return 0;
 }
 
+int do_fts_index(int limit)
+{
+	Connection_T c; ResultSet_T r;
+	volatile int count = 0;
+	int done;
+
+	qprintf ("Index stored messages for SEARCH BODY/TEXT...\n");
+	TRACE(TRACE_INFO, "Index stored messages for SEARCH BODY/TEXT...");
+
+	if (! dm_fts_enabled()) {
+		qprintf ("\tfts_index is not enabled in dbmail.conf, skipped.\n");
+		return 0;
+	}
+
+	c = db_con_get();
+	TRY
+		r = db_query(c, "SELECT COUNT(DISTINCT l.physmessage_id) FROM %spartlists l "
+				"LEFT JOIN %sfts_messages x ON x.physmessage_id = l.physmessage_id "
+				"WHERE x.physmessage_id IS NULL", DBPFX, DBPFX);
+		if (db_result_next(r))
+			count = db_result_get_int(r, 0);
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		count = -1;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	if (count < 0) {
+		qprintf("Failed. Please check the log.\n");
+		serious_errors = 1;
+		return -1;
+	}
+
+	qprintf ("There are %d physmessages not indexed.\n", count);
+	TRACE(TRACE_INFO, "There are %d physmessages not indexed.", count);
+
+	if (! count)
+		return 0;
+
+	if (! yes_to_all) {
+		qprintf ("\tindexing skipped. Use -y option to perform indexing.\n");
+		return 0;
+	}
+
+	if ((done = dm_fts_backfill(limit)) < 0) {
+		qprintf("Failed. Please check the log.\n");
+		serious_errors = 1;
+		return -1;
+	}
+
+	qprintf ("Ok. Indexed %d physmessages.\n", done);
+	TRACE(TRACE_INFO, "Ok. Indexed %d physmessages.", done);
+
+	return 0;
+}
+
 /* Makes a date/time string: YYYY-MM-DD HH:mm:ss
  * based on current time minus timespec
  * timespec contains: <n>h<m>m for a timespan of n hours, m minutes
@@ -118,11 +118,134 @@ static gpointer authldap_once(gpointer UNUSED data)
 	return (gpointer)NULL;
 }
 
+/*
+ * connect backoff
+ *
+ * After a failed connect no new connections are tried before the
+ * backoff of 1, 2, 4 .. LDAP_BACKOFF_MAX seconds has passed. Callers
+ * fail right away meanwhile, instead of sleeping until the server is
+ * back.
+ */
+#define LDAP_BACKOFF_MAX 30
+
+G_LOCK_DEFINE_STATIC(ldap_backoff);
+static unsigned ldap_failures = 0;
+static time_t ldap_retry_at = 0;
+
+static gboolean ldap_backoff_wait(void)
+{
+	gboolean wait;
+	unsigned failures;
+
+	G_LOCK(ldap_backoff);
+	wait = (ldap_retry_at > time(NULL));
+	failures = ldap_failures;
+	G_UNLOCK(ldap_backoff);
+
+	if (wait)
+		TRACE(TRACE_DEBUG, "backing off after [%u] failed connects", failures);
+	return wait;
+}
+
+static void ldap_backoff_update(gboolean connected)
+{
+	G_LOCK(ldap_backoff);
+	if (connected) {
+		ldap_failures = 0;
+		ldap_retry_at = 0;
+	} else {
+		int delay = LDAP_BACKOFF_MAX;
+		if (ldap_failures < 5)
+			delay = MIN(1 << ldap_failures, LDAP_BACKOFF_MAX);
+		ldap_failures++;
+		ldap_retry_at = time(NULL) + delay;
+		TRACE(TRACE_WARNING, "LDAP connect failed [%u] times, retrying in [%d] seconds",
+				ldap_failures, delay);
+	}
+	G_UNLOCK(ldap_backoff);
+}
+
+/*
+ * authldap_open()
+ *
+ * Connect and bind using config credentials
+ * 
+ * returns connection on success, NULL on failure
+ */
+static LDAP * authldap_open(void)
+{
+	int version = 0;
+	LDAP *_ldap_conn = NULL;
+	int ret;
+
+	g_once(&ldap_conn_once, authldap_once, NULL);
+
+	if (ldap_backoff_wait())
+		return NULL;
+
+	switch (_ldap_cfg.version_int) {
+		case 3:
+			version = LDAP_VERSION3;
+			if (strlen(_ldap_cfg.uri)) {
+				TRACE(TRACE_DEBUG, "connecting to ldap server on [%s] version [%d]", _ldap_cfg.uri, _ldap_cfg.version_int);
+				if ((ret = ldap_initialize(&_ldap_conn, _ldap_cfg.uri)) != LDAP_SUCCESS) {
+					TRACE(TRACE_EMERG, "ldap_initialize() failed [%s]", ldap_err2string(ret));
+				}
+			} else {
+				char *uri = g_strdup_printf("ldap://%s:%d", _ldap_cfg.hostname, _ldap_cfg.port_int);
+				TRACE(TRACE_DEBUG, "connecting to ldap server on [%s] version [%d]", uri, _ldap_cfg.version_int);
+				if ((ret = ldap_initialize(&_ldap_conn, uri)) != LDAP_SUCCESS) {
+					TRACE(TRACE_EMERG, "ldap_initialize() failed [%s]", ldap_err2string(ret));
+				}
+				g_free(uri);
+			}
+			break;
+		case 2:
+			version = LDAP_VERSION2; /* fall through... */
+		default:
+			if (!version) {
+				TRACE(TRACE_WARNING, "Unsupported LDAP version [%d] requested."
+						" Default to LDAP version 3.", _ldap_cfg.version_int);
+				version = LDAP_VERSION3;
+			}
+
+			TRACE(TRACE_DEBUG, "connecting to ldap server on [%s] : [%d] version [%d]",
+					_ldap_cfg.hostname, _ldap_cfg.port_int, _ldap_cfg.version_int);
+			_ldap_conn = ldap_init(_ldap_cfg.hostname, _ldap_cfg.port_int);
+			break;
+	}
+
+	if (! _ldap_conn) {
+		ldap_backoff_update(FALSE);
+		return NULL;
+	}
+
+	ldap_set_option(_ldap_conn, LDAP_OPT_PROTOCOL_VERSION, &version);
+
+	/* Turn off referrals */
+	if (strncasecmp(_ldap_cfg.referrals, "no", 2) == 0)
+		ldap_set_option(_ldap_conn, LDAP_OPT_REFERRALS, 0);
+
+	TRACE(TRACE_DEBUG, "binddn [%s]",  _ldap_cfg.bind_dn);
+	if ((ret = ldap_bind_s(_ldap_conn, _ldap_cfg.bind_dn, _ldap_cfg.bind_pw, LDAP_AUTH_SIMPLE))) {
+		TRACE(TRACE_ERR, "ldap_bind_s failed: %s",  ldap_err2string(ret));
+		ldap_unbind_ext(_ldap_conn, NULL, NULL);
+		ldap_backoff_update(FALSE);
+		return NULL;
+	}
+
+	ldap_backoff_update(TRUE);
+	TRACE(TRACE_DEBUG, "connection [%p]", _ldap_conn);
+
+	return _ldap_conn;
+}
+
 /*
  * ldap_con_get()
  *
- * Lookup thread-local ldap connection and bind using config credentials
- * retrying a few times if the server is temporarily unavailable
+ * Lookup thread-local ldap connection, connecting it if needed.
+ * It is used to change the directory and to validate passwords,
+ * which rebinds it; searches use the pool below.
  * 
  * returns connection on success, NULL on failure
  */
@@ -133,34 +256,12 @@ static LDAP * ldap_con_get(void)
 		TRACE(TRACE_DEBUG, "connection [%p]", ld);
 		return ld;
 	}
-	int c = 0;
-	int c_tries = _ldap_cfg.query_timeout_int;
-	int err = -1; // Start wanting success
-	while (err != 0 && c++ < c_tries) {
-		// Loop until success or too many retries
-		TRACE(TRACE_DEBUG, "No connection trying [%d/%d]", c, c_tries);
 
-		err = authldap_connect();
+	if (authldap_connect() == 0)
+		ld = (LDAP *)g_private_get(&ldap_conn_key);
+	else
+		TRACE(TRACE_ERR, "Unable to connect to LDAP");
 
-		switch (err) {
-			case LDAP_SUCCESS:
-				ld = (LDAP *)g_private_get(&ldap_conn_key);
-				TRACE(TRACE_DEBUG, "connection [%p]", ld);
-				break;
-			case LDAP_SERVER_DOWN:
-				TRACE(TRACE_WARNING, "LDAP gone away: %s. Trying to reconnect(%d/%d).", ldap_err2string(err), c, c_tries);
-				sleep(1); // reconnect failed. wait before trying again
-				break;
-			default:
-				TRACE(TRACE_ERR, "LDAP error(%d): %s", err, ldap_err2string(err));
-				sleep(1);
-				break;
-		}
-	}
-	if (! ld) {
-		TRACE(TRACE_ERR, "Unable to connect to LDAP giving up");
-	}
-	TRACE(TRACE_DEBUG, "connection [%p]", ld);
 	return ld;
 }
 
@@ -195,6 +296,8 @@ static int auth_ldap_bind(void)
 	TRACE(TRACE_DEBUG, "binddn [%s]",  _ldap_cfg.bind_dn);
 	
 	LDAP *c = ldap_con_get();
+	if (! c)
+		return -1;
 	if ((err = ldap_bind_s(c, _ldap_cfg.bind_dn, _ldap_cfg.bind_pw, LDAP_AUTH_SIMPLE))) {
 		TRACE(TRACE_ERR, "ldap_bind_s failed: %s",  ldap_err2string(err));
 		return -1;
@@ -212,118 +315,246 @@ static int auth_ldap_bind(void)
  */
 static int authldap_connect(void)
 {
-	int version = 0;
-	LDAP *_ldap_conn = NULL;
-	int ret;
+	LDAP *_ldap_conn;
 
-	g_once(&ldap_conn_once, authldap_once, NULL);
+	if (! (_ldap_conn = authldap_open()))
+		return -1;
 
-	switch (_ldap_cfg.version_int) {
-		case 3:
-			version = LDAP_VERSION3;
-			if (strlen(_ldap_cfg.uri)) {
-				TRACE(TRACE_DEBUG, "connecting to ldap server on [%s] version [%d]", _ldap_cfg.uri, _ldap_cfg.version_int);
-				if ((ret = ldap_initialize(&_ldap_conn, _ldap_cfg.uri) != LDAP_SUCCESS)) {
-					TRACE(TRACE_EMERG, "ldap_initialize() failed %s", strerror(ret));
-				}
-			} else {
-				char *uri = g_strdup_printf("ldap://%s:%d", _ldap_cfg.hostname, _ldap_cfg.port_int);
-				TRACE(TRACE_DEBUG, "connecting to ldap server on [%s] version [%d]", uri, _ldap_cfg.version_int);
-				if ((ret = ldap_initialize(&_ldap_conn, uri)) != LDAP_SUCCESS) {
-					TRACE(TRACE_EMERG, "ldap_initialize() failed [%s]", strerror(ret));
-				}
-				g_free(uri);
-			}
-			break;
-		case 2:
-			version = LDAP_VERSION2; /* fall through... */
-		default:
-			if (!version) {
-				TRACE(TRACE_WARNING, "Unsupported LDAP version [%d] requested."
-						" Default to LDAP version 3.", _ldap_cfg.version_int);
-				version = LDAP_VERSION3;
-			}
+	g_private_replace(&ldap_conn_key, _ldap_conn);
 
-			TRACE(TRACE_DEBUG, "connecting to ldap server on [%s] : [%d] version [%d]",
-					_ldap_cfg.hostname, _ldap_cfg.port_int, _ldap_cfg.version_int);
-			_ldap_conn = ldap_init(_ldap_cfg.hostname, _ldap_cfg.port_int);
-			break;
+	return 0;
+}
+
+/*
+ * search connections, shared by all threads
+ *
+ * A search is sent with ldap_search_ext() on the least busy connection
+ * and only its own message id is waited for, so searches of several
+ * threads are in flight on one connection at the same time. Another
+ * connection, up to pool_size, is only opened when all are busy. The
+ * connections stay bound as bind_dn.
+ *
+ * Without a thread-safe libldap every thread searches on its own
+ * connection instead.
+ */
+#ifdef HAVE_LDAP_THREAD_SAFE
+#define LDAP_POOL_MAX 32
+
+struct ldap_pool_conn {
+	LDAP *ld;
+	unsigned inflight;	// searches using ld
+	gboolean connecting;
+	gboolean broken;	// unbind when the last search is done
+};
+
+G_LOCK_DEFINE_STATIC(ldap_pool);
+static struct ldap_pool_conn ldap_pool[LDAP_POOL_MAX];
+static int ldap_pool_size = 0;
+
+/* returns the connection to search on, or NULL if there is none */
+static LDAP * ldap_pool_get(void)
+{
+	int i, best = -1, idle = -1;
+	LDAP *ld = NULL;
+
+	G_LOCK(ldap_pool);
+	if (! ldap_pool_size) {
+		ldap_pool_size = config_get_value_default_int("pool_size", "LDAP", 4);
+		ldap_pool_size = MAX(1, MIN(ldap_pool_size, LDAP_POOL_MAX));
+		TRACE(TRACE_DEBUG, "ldap pool size [%d]", ldap_pool_size);
+	}
+
+	for (i = 0; i < ldap_pool_size; i++) {
+		struct ldap_pool_conn *p = &ldap_pool[i];
+		if (p->ld && ! p->broken) {
+			if (best < 0 || p->inflight < ldap_pool[best].inflight)
+				best = i;
+		} else if (! p->ld && ! p->connecting && idle < 0) {
+			idle = i;
+		}
 	}
 
-	ldap_set_option(_ldap_conn, LDAP_OPT_PROTOCOL_VERSION, &version);
+	if (idle >= 0 && (best < 0 || ldap_pool[best].inflight > 0)) {
+		ldap_pool[idle].connecting = TRUE;
+		G_UNLOCK(ldap_pool);
 
-	/* Turn off referrals */
-	if (strncasecmp(_ldap_cfg.referrals, "no", 2) == 0)
-		ldap_set_option(_ldap_conn, LDAP_OPT_REFERRALS, 0);
+		ld = authldap_open();
 
-	g_private_replace(&ldap_conn_key, _ldap_conn);
+		G_LOCK(ldap_pool);
+		ldap_pool[idle].connecting = FALSE;
+		if (ld) {
+			ldap_pool[idle].ld = ld;
+			best = idle;
+		} else if (best >= 0 && (! ldap_pool[best].ld || ldap_pool[best].broken)) {
+			best = -1;
+		}
+	}
+
+	ld = NULL;
+	if (best >= 0) {
+		ldap_pool[best].inflight++;
+		ld = ldap_pool[best].ld;
+	}
+	G_UNLOCK(ldap_pool);
+
+	if (! ld)
+		TRACE(TRACE_ERR, "no LDAP connection available");
 
-	return auth_ldap_bind();	
+	return ld;
 }
 
+static void ldap_pool_put(LDAP *ld, gboolean broken)
+{
+	LDAP *gone = NULL;
+	int i;
+
+	G_LOCK(ldap_pool);
+	for (i = 0; i < ldap_pool_size; i++) {
+		struct ldap_pool_conn *p = &ldap_pool[i];
+		if (p->ld != ld)
+			continue;
+		p->inflight--;
+		if (broken)
+			p->broken = TRUE;
+		if (p->broken && ! p->inflight) {
+			gone = p->ld;
+			p->ld = NULL;
+			p->broken = FALSE;
+		}
+		break;
+	}
+	G_UNLOCK(ldap_pool);
+
+	if (gone)
+		ldap_unbind_ext(gone, NULL, NULL);
+}
+#else
+static LDAP * ldap_pool_get(void)
+{
+	return ldap_con_get();
+}
+
+static void ldap_pool_put(LDAP *ld UNUSED, gboolean broken)
+{
+	if (broken)
+		g_private_replace(&ldap_conn_key, NULL);
+}
+#endif
+
 /*
  * authldap_search()
  *
- * Perform an LDAP search
+ * Perform an LDAP search on a pool connection, returning attrs, or all
+ * attributes if NULL. "dn" is always returned. The connection is used
+ * until authldap_search_done().
  * 
  * returns search results on success, NULL on failure
  */
-static LDAPMessage * authldap_search(const gchar *query)
+static LDAPMessage * authldap_search(const gchar *query, const char **attrs, LDAP **ld)
 {
-	LDAPMessage *ldap_res;
-	int _ldap_attrsonly = 0;
-	char **_ldap_attrs = NULL;
-	int err = -1; // Start wanting success
-	int c = 0;
+	LDAPMessage *ldap_res = NULL;
+	struct timeval timeout, *tv = NULL;
+	const char *_ldap_attrs[16] = { NULL };
+	char **search_attrs = NULL;
+	int err, msgid, n = 0, c;
 	char *err_msg = NULL;
-	int c_tries = _ldap_cfg.query_timeout_int;
-	LDAP *_ldap_conn;
 
 	g_return_val_if_fail(query!=NULL, NULL);
 
+	g_once(&ldap_conn_once, authldap_once, NULL);
+
 	TRACE(TRACE_DEBUG, " [%s]", query);
 
-	while (err != 0 && c++ < c_tries) {
-		// Loop until success or too many retries
-		_ldap_conn = ldap_con_get();
+	if (attrs) {
+		for (c = 0; attrs[c] && n < 15; c++) {
+			if (strlen(attrs[c]) && strcasecmp(attrs[c], "dn"))
+				_ldap_attrs[n++] = attrs[c];
+		}
+		if (! n)
+			_ldap_attrs[n++] = LDAP_NO_ATTRS;
+		search_attrs = (char **)_ldap_attrs;
+	}
 
-		// timeout must be NULL as any value times out!
-		err = ldap_search_ext_s(_ldap_conn, _ldap_cfg.base_dn, _ldap_cfg.scope_int,
-			query, _ldap_attrs, _ldap_attrsonly, NULL, NULL, NULL, LDAP_NO_LIMIT, &ldap_res);
+	if (_ldap_cfg.query_timeout_int > 0) {
+		timeout.tv_sec = _ldap_cfg.query_timeout_int;
+		timeout.tv_usec = 0;
+		tv = &timeout;
+	}
+
+	// a connection that went away is replaced once
+	for (c = 1; c <= 2; c++) {
+		if (! (*ld = ldap_pool_get()))
+			break;
+
+		err = ldap_search_ext(*ld, _ldap_cfg.base_dn, _ldap_cfg.scope_int,
+			query, search_attrs, 0, NULL, NULL, NULL, LDAP_NO_LIMIT, &msgid);
+
+		if (err == LDAP_SUCCESS) {
+			switch (ldap_result(*ld, msgid, LDAP_MSG_ALL, tv, &ldap_res)) {
+				case 0:
+					TRACE(TRACE_ERR, "LDAP search timed out after [%d] seconds", _ldap_cfg.query_timeout_int);
+					ldap_abandon_ext(*ld, msgid, NULL, NULL);
+					ldap_pool_put(*ld, FALSE);
+					*ld = NULL;
+					return NULL;
+				case -1:
+					ldap_get_option(*ld, LDAP_OPT_RESULT_CODE, &err);
+					break;
+				default:
+					if (ldap_parse_result(*ld, ldap_res, &err, NULL, NULL, NULL, NULL, 0) != LDAP_SUCCESS)
+						ldap_get_option(*ld, LDAP_OPT_RESULT_CODE, &err);
+					break;
+			}
+		}
 
 		switch (err) {
 			case LDAP_SUCCESS:
 				return ldap_res;
-				break;
 			case LDAP_NO_SUCH_OBJECT:
-				ldap_get_option(_ldap_conn, LDAP_OPT_DIAGNOSTIC_MESSAGE, &err_msg);
 				TRACE(TRACE_ERR,
 					  "LDAP error message (%d): %s. Please check LDAP config.",
 					  err, ldap_err2string(err)
 				);
 				return ldap_res;
-				break;
 			case LDAP_SERVER_DOWN:
-				ldap_get_option(_ldap_conn, LDAP_OPT_DIAGNOSTIC_MESSAGE, &err_msg);
-				TRACE(TRACE_WARNING, "LDAP gone away(%d): %s. Trying again(%d/%d). Error message: %s", err, ldap_err2string(err), c, c_tries, err_msg);
+			case LDAP_CONNECT_ERROR:
+				ldap_get_option(*ld, LDAP_OPT_DIAGNOSTIC_MESSAGE, &err_msg);
+				TRACE(TRACE_WARNING, "LDAP gone away(%d): %s. Trying again(%d/2). Error message: %s", err, ldap_err2string(err), c, err_msg);
 				if (err_msg) {
 					ldap_memfree(err_msg);
 					err_msg = NULL;
 				}
-				break;
+				if (ldap_res)
+					ldap_msgfree(ldap_res);
+				ldap_res = NULL;
+				ldap_pool_put(*ld, TRUE);
+				*ld = NULL;
+				continue;
 			default:
-				TRACE(TRACE_ERR, "LDAP error(%d): %s. Trying again (%d/%d).", err, ldap_err2string(err), c, c_tries);
+				TRACE(TRACE_ERR, "LDAP error(%d): %s.", err, ldap_err2string(err));
 				break;
 		}
-		ldap_msgfree(ldap_res);
-		ldap_unbind_ext(_ldap_conn, NULL, NULL);
-		sleep(1); // Search failed. Wait before trying again.
+		break;
 	}
 
+	if (ldap_res)
+		ldap_msgfree(ldap_res);
+	if (*ld)
+		ldap_pool_put(*ld, FALSE);
+	*ld = NULL;
+
 	TRACE(TRACE_ERR,"unrecoverable error while talking to ldap server");
 	return NULL;
 }
 
+static void authldap_search_done(LDAP *ld, LDAPMessage *ldap_res)
+{
+	if (ldap_res)
+		ldap_msgfree(ldap_res);
+	if (ld)
+		ldap_pool_put(ld, FALSE);
+}
+
 void dm_ldap_freeresult(GList *entlist)
 {
 	GList *fldlist, *attlist;
@@ -421,15 +652,15 @@ static GList * __auth_get_every_match(const char *q, const char **retfields)
 	char **ldap_vals = NULL, *dn;
 	int j = 0, k = 0, m = 0, err;
 	GList *attlist,*fldlist,*entlist;
-	LDAP *_ldap_conn = ldap_con_get();
+	LDAP *_ldap_conn = NULL;
 	
 	attlist = fldlist = entlist = NULL;
 
-	if (! (ldap_res = authldap_search(q))) return NULL;
+	if (! (ldap_res = authldap_search(q, retfields, &_ldap_conn))) return NULL;
 
 	if ((j = ldap_count_entries(_ldap_conn, ldap_res)) < 1) {
 		TRACE(TRACE_DEBUG, "nothing found");
-		if (ldap_res) ldap_msgfree(ldap_res);
+		authldap_search_done(_ldap_conn, ldap_res);
 		return NULL;
 	}
 
@@ -437,7 +668,7 @@ static GList * __auth_get_every_match(const char *q, const char **retfields)
 	if ((ldap_msg = ldap_first_entry(_ldap_conn, ldap_res)) == NULL) {
 		ldap_get_option(_ldap_conn, LDAP_OPT_ERROR_NUMBER, &err);
 		TRACE(TRACE_ERR, "ldap_first_entry failed: [%s]", ldap_err2string(err));
-		if (ldap_res) ldap_msgfree(ldap_res);
+		authldap_search_done(_ldap_conn, ldap_res);
 		return NULL;
 	}
 
@@ -468,7 +699,7 @@ static GList * __auth_get_every_match(const char *q, const char **retfields)
 		ldap_msg = ldap_next_entry(_ldap_conn, ldap_msg);
 	}
 
-	if (ldap_res) ldap_msgfree(ldap_res);
+	authldap_search_done(_ldap_conn, ldap_res);
 
 	return entlist;
 }
@@ -538,12 +769,13 @@ static char * dm_ldap_user_getdn(uint64_t user_idnr)
 	int err;
 	LDAPMessage *ldap_res;
 	LDAPMessage *ldap_msg;
-	LDAP *_ldap_conn = ldap_con_get();
+	LDAP *_ldap_conn = NULL;
+	const char *attrs[] = { "dn", NULL };
 	
 	g_string_printf(t, "(%s=%" PRIu64 ")", _ldap_cfg.field_nid, user_idnr);
 	TRACE(TRACE_DEBUG, "searching with query [%s]", t->str);
 	
-	if (! (ldap_res = authldap_search(t->str))) {
+	if (! (ldap_res = authldap_search(t->str, attrs, &_ldap_conn))) {
 		g_string_free(t,TRUE);
 		return NULL;
 	}
@@ -552,25 +784,25 @@ static char * dm_ldap_user_getdn(uint64_t user_idnr)
 
 	if (ldap_count_entries(_ldap_conn, ldap_res) < 1) {
 		TRACE(TRACE_DEBUG, "no entries found");
-		ldap_msgfree(ldap_res);
+		authldap_search_done(_ldap_conn, ldap_res);
 		return NULL;
 	}
 
 	if (! (ldap_msg = ldap_first_entry(_ldap_conn, ldap_res))) {
 		ldap_get_option(_ldap_conn, LDAP_OPT_ERROR_NUMBER, &err);
 		TRACE(TRACE_ERR, "ldap_first_entry failed: %s", ldap_err2string(err));
-		ldap_msgfree(ldap_res);
+		authldap_search_done(_ldap_conn, ldap_res);
 		return NULL;
 	}
 
 	if (! (dn = ldap_get_dn(_ldap_conn, ldap_msg))) {
 		ldap_get_option(_ldap_conn, LDAP_OPT_ERROR_NUMBER, &err);
 		TRACE(TRACE_ERR, "ldap_get_dn failed: %s", ldap_err2string(err));
-		ldap_msgfree(ldap_res);
+		authldap_search_done(_ldap_conn, ldap_res);
 		return NULL;
 	}
 
-	ldap_msgfree(ldap_res);
+	authldap_search_done(_ldap_conn, ldap_res);
 	return dn;
 }
 
@@ -626,9 +858,9 @@ static char *__auth_get_first_match(const char *q, const char **retfields)
 	char *returnid = NULL, *ldap_dn = NULL;
 	char **ldap_vals = NULL;
 	int k = 0, err;
-	LDAP *_ldap_conn = ldap_con_get();
+	LDAP *_ldap_conn = NULL;
 
-	if (! (ldap_res = authldap_search(q)))
+	if (! (ldap_res = authldap_search(q, retfields, &_ldap_conn)))
 		return NULL;
 
 	if (ldap_count_entries(_ldap_conn, ldap_res) < 1) {
@@ -662,8 +894,7 @@ endfree:
 		ldap_memfree(ldap_dn);
 	if (ldap_vals)
 		ldap_value_free(ldap_vals);
-	if (ldap_res)
-		ldap_msgfree(ldap_res);
+	authldap_search_done(_ldap_conn, ldap_res);
 
 	return returnid;
 }
@@ -912,12 +1143,12 @@ int auth_check_user_ext(const char *userid, GList **userids, GList **fwds, int c
 	TRACE(TRACE_DEBUG, "mail field [%s]", f_mail->str);
 	TRACE(TRACE_DEBUG, "fwd field [%s]", f_fwd->str);
 	const char *fields[] = {
-		f_fwd->str ? f_fwd->str : NULL,
+		f_fwd->str,
+		f_nid->str,
 		NULL
 	};
-	fields[0] = f_fwd->str ? f_fwd->str : NULL;
 	char *attrvalue;
-	GList *entlist, *fldlist, *attlist;
+	GList *entlist, *ent, *fldlist, *attlist;
 
 	if (checks > 20) {
 		TRACE(TRACE_ERR, "too many checks. Possible loop detected.");
@@ -952,69 +1183,35 @@ int auth_check_user_ext(const char *userid, GList **userids, GList **fwds, int c
 
 	TRACE(TRACE_DEBUG, "searching with query [%s], field_nid [%s], checks [%d]", query, f_nid->str, checks);
 
-	// Get forwards
-	TRACE(TRACE_DEBUG, "Getting forwards");
+	// Get forwards and userids in one search
 	entlist = __auth_get_every_match(query, fields);
 	TRACE(TRACE_DEBUG, "field_nid [%s], length [%d]", f_nid->str, g_list_length(entlist));
 
-	entlist = g_list_first(entlist);
-	while (entlist) {
-		TRACE(TRACE_DEBUG, "Forwards [%d] ", g_list_length(entlist));
-		fldlist = g_list_first(entlist->data);
-		while(fldlist) {
-			attlist = g_list_first(fldlist->data);
-			TRACE(TRACE_DEBUG, "attlist [%d] ", g_list_length(attlist));
-			while(attlist) {
-				attrvalue = attlist->data;
-				TRACE(TRACE_DEBUG, "adding [%s] to forwards", attrvalue);
-				*(GList **)fwds = g_list_prepend(*(GList **)fwds, g_strdup(attrvalue));
-				if (!g_list_next(attlist))
-					break;
-				attlist = g_list_next(attlist);
-			}
-			if (!g_list_next(attlist))
-				break;
-			fldlist = g_list_next(fldlist);
-		}
-		if (!g_list_next(entlist))
-			break;
-		entlist = g_list_next(entlist);
-	}
-	dm_ldap_freeresult(entlist);
-
-	// Get userids
-	TRACE(TRACE_DEBUG, "Getting userids");
-	fields[0] = f_nid->str;
+	for (ent = g_list_first(entlist); ent; ent = g_list_next(ent)) {
+		fldlist = g_list_first(ent->data);
+		if (! fldlist)
+			continue;
 
-	entlist = __auth_get_every_match(query, fields);
-	entlist = g_list_first(entlist);
-	TRACE(TRACE_DEBUG, "Get userids: field_nid [%s], qty [%d]", f_nid->str, g_list_length(entlist));
-
-	while (entlist) {
-		fldlist = g_list_first(entlist->data);
-		while(fldlist) {
-			attlist = g_list_first(fldlist->data);
-			TRACE(TRACE_DEBUG, "attlist [%d] ", g_list_length(attlist));
-			while(attlist) {
-				attrvalue = attlist->data;
-				uid = g_new0(uint64_t,1);
-				id = strtoull(attrvalue, &endptr, 10);
-				*uid = id;
-				TRACE(TRACE_DEBUG, "adding [%" PRIu64 "] to userids", *uid);
-				*(GList **)userids = g_list_prepend(*(GList **)userids, uid);
-				++occurences;
+		// forwards
+		for (attlist = g_list_first(fldlist->data); attlist; attlist = g_list_next(attlist)) {
+			attrvalue = attlist->data;
+			TRACE(TRACE_DEBUG, "adding [%s] to forwards", attrvalue);
+			*(GList **)fwds = g_list_prepend(*(GList **)fwds, g_strdup(attrvalue));
+		}
 
-				if (!g_list_next(attlist))
-					break;
-				attlist = g_list_next(attlist);
-			}
-			if (!g_list_next(attlist))
-				break;
-			fldlist = g_list_next(fldlist);
+		if (! (fldlist = g_list_next(fldlist)))
+			continue;
+
+		// userids
+		for (attlist = g_list_first(fldlist->data); attlist; attlist = g_list_next(attlist)) {
+			attrvalue = attlist->data;
+			uid = g_new0(uint64_t,1);
+			id = strtoull(attrvalue, &endptr, 10);
+			*uid = id;
+			TRACE(TRACE_DEBUG, "adding [%" PRIu64 "] to userids", *uid);
+			*(GList **)userids = g_list_prepend(*(GList **)userids, uid);
+			++occurences;
 		}
-		if (!g_list_next(entlist))
-			break;
-		entlist = g_list_next(entlist);
 	}
 
 	g_free(query);
@@ -1143,9 +1340,10 @@ int auth_adduser(const char *username, const char *password,
 
 int auth_delete_user(const char *username)
 {
-	LDAP *_ldap_conn = ldap_con_get();
+	LDAP *_ldap_conn = NULL;
 	LDAPMessage *ldap_res;
 	LDAPMessage *ldap_msg;
+	const char *attrs[] = { "dn", NULL };
 	char *dn;
 	int err;
 	char query[AUTH_QUERY_SIZE];
@@ -1159,12 +1357,12 @@ int auth_delete_user(const char *username)
 
 	snprintf(query, AUTH_QUERY_SIZE-1, "(%s=%s)", _ldap_cfg.field_uid, username);
 
-	if (! (ldap_res = authldap_search(query)))
+	if (! (ldap_res = authldap_search(query, attrs, &_ldap_conn)))
 		return -1;
 	
 	if (ldap_count_entries(_ldap_conn, ldap_res) < 1) {
 		TRACE(TRACE_DEBUG, "no entries found");
-		ldap_msgfree(ldap_res);
+		authldap_search_done(_ldap_conn, ldap_res);
 		return 0;
 	}
 
@@ -1172,26 +1370,28 @@ int auth_delete_user(const char *username)
 	if (ldap_msg == NULL) {
 		ldap_get_option(_ldap_conn, LDAP_OPT_ERROR_NUMBER, &err);
 		TRACE(TRACE_ERR, "ldap_first_entry failed: %s", ldap_err2string(err));
-		ldap_msgfree(ldap_res);
+		authldap_search_done(_ldap_conn, ldap_res);
 		return -1;
 	}
 
 	dn = ldap_get_dn(_ldap_conn, ldap_msg);
+	authldap_search_done(_ldap_conn, ldap_res);
 
 	if (dn) {
 		TRACE(TRACE_DEBUG, "deleting user at dn [%s]", dn);
+		if (! (_ldap_conn = ldap_con_get())) {
+			ldap_memfree(dn);
+			return -1;
+		}
 		err = ldap_delete_s(_ldap_conn, dn);
 		if (err) {
 			TRACE(TRACE_ERR, "could not delete dn: %s", ldap_err2string(err));
 			ldap_memfree(dn);
-			ldap_msgfree(ldap_res);
 			return -1;
 		}
-	} else {
 	}
 
 	ldap_memfree(dn);
-	ldap_msgfree(ldap_res);
 	
 	if (db_user_delete(username)) {
 		TRACE(TRACE_ERR, "sql shadow account deletion failed");
@@ -1356,6 +1556,11 @@ int auth_validate(ClientBase_T *ci, const char *username, const char *password,
 		return 0;
 	}
 
+	if (! _ldap_conn) {
+		ldap_memfree(ldap_dn);
+		return DM_EQUERY;
+	}
+
 	/* now, try to rebind as the given DN using the supplied password */
 	TRACE(TRACE_DEBUG, "rebinding as [%s] to validate password", ldap_dn);
 
@@ -85,6 +85,92 @@ static void sort_sieve_get_config(struct sort_sieve_config *sieve_config)
 	}
 }
 
+/*
+ * process-wide LRU cache of active scripts, keyed by user, script name
+ * and hash. PUTSCRIPT stores the script with a new hash and SETACTIVE
+ * changes the active name, so changes made by dbmail-sievecmd or
+ * timsieved are noticed from the name and hash read on every delivery.
+ */
+struct sievecache_entry {
+	char *key;
+	char *script;
+};
+
+G_LOCK_DEFINE_STATIC(sievecache);
+static GHashTable *sievecache = NULL; // key -> link in sievecache_lru
+static GQueue sievecache_lru = G_QUEUE_INIT;
+static unsigned sievecache_max = 0;
+static uint64_t sievecache_hits = 0;
+static uint64_t sievecache_misses = 0;
+
+static void sievecache_entry_free(struct sievecache_entry *e)
+{
+	g_free(e->key);
+	g_free(e->script);
+	g_free(e);
+}
+
+/* call with sievecache locked */
+static gboolean sievecache_init(void)
+{
+	if (! sievecache) {
+		sievecache_max = config_get_value_default_int("sieve_cache_size", "DELIVERY", 1000);
+		sievecache = g_hash_table_new(g_str_hash, g_str_equal);
+		TRACE(TRACE_DEBUG, "sieve cache size [%u]", sievecache_max);
+	}
+	return sievecache_max > 0;
+}
+
+static char * sievecache_key(uint64_t user_idnr, const char *scriptname, const char *hash)
+{
+	return g_strdup_printf("%" PRIu64 ":%s:%s", user_idnr, scriptname, hash);
+}
+
+/* a copy of the cached script, or NULL */
+static char * sievecache_get(const char *key)
+{
+	GList *link;
+	char *script = NULL;
+
+	G_LOCK(sievecache);
+	if (sievecache_init()) {
+		if ((link = g_hash_table_lookup(sievecache, key))) {
+			g_queue_unlink(&sievecache_lru, link);
+			g_queue_push_head_link(&sievecache_lru, link);
+			script = g_strdup(((struct sievecache_entry *)link->data)->script);
+			sievecache_hits++;
+		} else {
+			sievecache_misses++;
+		}
+		TRACE(TRACE_DEBUG, "sieve cache hits [%" PRIu64 "] misses [%" PRIu64 "]",
+				sievecache_hits, sievecache_misses);
+	}
+	G_UNLOCK(sievecache);
+
+	return script;
+}
+
+static void sievecache_put(const char *key, const char *script)
+{
+	struct sievecache_entry *e;
+
+	G_LOCK(sievecache);
+	if (sievecache_init() && ! g_hash_table_lookup(sievecache, key)) {
+		e = g_new0(struct sievecache_entry, 1);
+		e->key = g_strdup(key);
+		e->script = g_strdup(script);
+		g_queue_push_head(&sievecache_lru, e);
+		g_hash_table_insert(sievecache, e->key, sievecache_lru.head);
+
+		while (g_queue_get_length(&sievecache_lru) > sievecache_max) {
+			e = g_queue_pop_tail(&sievecache_lru);
+			g_hash_table_remove(sievecache, e->key);
+			sievecache_entry_free(e);
+		}
+	}
+	G_UNLOCK(sievecache);
+}
+
 /*
  * Send a vacation message. FIXME: this should provide
  * MIME support, to comply with the Sieve-Vacation spec.
@@ -507,12 +593,15 @@ int sort_getscript(sieve2_context_t *s, void *my)
 		TRACE(TRACE_INFO, "Include requested from [%s] named [%s]", path, name);
 	} else
 	if (!strlen(path) && !strlen(name)) {
-		/* Read the script file given as an argument. */
-		TRACE(TRACE_INFO, "Getting default script named [%s]", m->script);
-		res = dm_sievescript_getbyname(m->user_idnr, m->script, &m->s_buf);
-		if (res != SIEVE2_OK) {
-			TRACE(TRACE_ERR, "sort_getscript: read_file() returns %d\n", res);
-			return SIEVE2_ERROR_FAIL;
+		/* Read the script file given as an argument,
+		 * unless it came from the sieve cache. */
+		if (! m->s_buf) {
+			TRACE(TRACE_INFO, "Getting default script named [%s]", m->script);
+			res = dm_sievescript_getbyname(m->user_idnr, m->script, &m->s_buf);
+			if (res != SIEVE2_OK) {
+				TRACE(TRACE_ERR, "sort_getscript: read_file() returns %d\n", res);
+				return SIEVE2_ERROR_FAIL;
+			}
 		}
 		sieve2_setvalue_string(s, "script", m->s_buf);
 		TRACE(TRACE_INFO, "Script\n%s", m->s_buf);
@@ -727,11 +816,10 @@ static int sort_teardown(sieve2_context_t **s2c,
 	return DM_SUCCESS;
 }
 
-static int sort_startup(sieve2_context_t **s2c,
-		struct sort_context **sc)
+/* a libSieve context with the callbacks for the configured extensions */
+static int sort_alloc(sieve2_context_t **s2c)
 {
 	assert(s2c != NULL);
-	assert(sc != NULL);
 
 	sieve2_context_t *sieve2_context = NULL;
 	struct sort_context *sort_context = NULL;
@@ -785,6 +873,23 @@ static int sort_startup(sieve2_context_t **s2c,
 		}
 	}
 
+	*s2c = sieve2_context;
+
+	return DM_SUCCESS;
+}
+
+static int sort_startup(sieve2_context_t **s2c,
+		struct sort_context **sc)
+{
+	assert(s2c != NULL);
+	assert(sc != NULL);
+
+	sieve2_context_t *sieve2_context = NULL;
+	struct sort_context *sort_context = NULL;
+
+	if (sort_alloc(&sieve2_context) != DM_SUCCESS)
+		return DM_EGENERAL;
+
 	sort_context = g_new0(struct sort_context, 1);
 	if (!sort_context) {
 		sort_teardown(&sieve2_context, &sort_context);
@@ -800,6 +905,33 @@ static int sort_startup(sieve2_context_t **s2c,
 	return DM_SUCCESS;
 }
 
+/* Deliveries in the same thread reuse its libSieve context,
+ * so the callbacks are only set up once. */
+static void sort_context_release(gpointer data)
+{
+	sieve2_context_t *sieve2_context = (sieve2_context_t *)data;
+	int res;
+
+	if ((res = sieve2_free(&sieve2_context)) != SIEVE2_OK)
+		TRACE(TRACE_ERR, "Error [%d] when calling sieve2_free: [%s]",
+			res, sieve2_errstr(res));
+}
+
+static GPrivate sort_context_key = G_PRIVATE_INIT (sort_context_release);
+
+static sieve2_context_t * sort_context_get(void)
+{
+	sieve2_context_t *sieve2_context = g_private_get(&sort_context_key);
+
+	if (! sieve2_context) {
+		if (sort_alloc(&sieve2_context) != DM_SUCCESS)
+			return NULL;
+		g_private_set(&sort_context_key, sieve2_context);
+	}
+
+	return sieve2_context;
+}
+
 /* The caller is responsible for freeing memory here. */
 const char * sort_listextensions(void)
 {
@@ -910,16 +1042,19 @@ SortResult_T *sort_process(uint64_t user_idnr, DbmailMessage *message, const cha
 	struct sort_result *result = NULL;
 	sieve2_context_t *sieve2_context;
 	struct sort_context *sort_context;
+	char *hash = NULL, *key = NULL;
+	gboolean cached = FALSE;
 
 	/* The contents of this function are taken from
 	 * the libSieve distribution, sv_test/example.c,
 	 * and are provided under an "MIT style" license.
 	 * */
 
-	if (sort_startup(&sieve2_context, &sort_context) != DM_SUCCESS) {
+	if (! (sieve2_context = sort_context_get())) {
 		return NULL;
 	}
 
+	sort_context = g_new0(struct sort_context, 1);
 	sort_context->message = message;
 	sort_context->user_idnr = user_idnr;
 	sort_context->result = g_new0(struct sort_result, 1);
@@ -931,7 +1066,7 @@ SortResult_T *sort_process(uint64_t user_idnr, DbmailMessage *message, const cha
 	if (mailbox)
 		sort_context->result->mailbox = mailbox;
 
-	res = dm_sievescript_get(user_idnr, &sort_context->script);
+	res = dm_sievescript_get_hash(user_idnr, &sort_context->script, &hash);
 	if (res != 0) {
 		TRACE(TRACE_ERR, "Error [%d] when calling db_getactive_sievescript", res);
 		exitnull = 1;
@@ -943,11 +1078,20 @@ SortResult_T *sort_process(uint64_t user_idnr, DbmailMessage *message, const cha
 		goto freesieve;
 	}
 
+	/* Scripts stored without a hash are read and then get one. */
+	if (hash && strlen(hash)) {
+		key = sievecache_key(user_idnr, sort_context->script, hash);
+		if ((sort_context->s_buf = sievecache_get(key)))
+			cached = TRUE;
+	}
+
 	res = sieve2_execute(sieve2_context, sort_context);
 	if (res != SIEVE2_OK) {
 		TRACE(TRACE_ERR, "Error [%d] when calling sieve2_execute: [%s]",
 			res, sieve2_errstr(res));
 		exitnull = 1;
+		/* Don't reuse a context libSieve gave up on. */
+		g_private_replace(&sort_context_key, NULL);
 	}
 	if (! sort_context->result->cancelkeep) {
 		TRACE(TRACE_INFO, "No actions taken; message must be kept.");
@@ -955,18 +1099,33 @@ SortResult_T *sort_process(uint64_t user_idnr, DbmailMessage *message, const cha
 
 	/* At this point the callbacks are called from within libSieve. */
 
+	if (! exitnull && ! cached && sort_context->s_buf && ! sort_context->result->error_parse) {
+		if (! key) {
+			char digest[FIELDSIZE];
+			memset(digest, 0, sizeof(digest));
+			if (! dm_get_hash_for_string(sort_context->s_buf, digest)
+					&& dm_sievescript_set_hash(user_idnr, sort_context->script, digest) == DM_SUCCESS)
+				key = sievecache_key(user_idnr, sort_context->script, digest);
+		}
+		if (key)
+			sievecache_put(key, sort_context->s_buf);
+	}
+
 freesieve:
 	if (sort_context->s_buf)
 		g_free(sort_context->s_buf);
 	if (sort_context->script)
 		g_free(sort_context->script);
+	g_free(hash);
+	g_free(key);
 
 	if (exitnull)
 		result = NULL;
 	else
 		result = sort_context->result;
 
-	sort_teardown(&sieve2_context, &sort_context);
+	g_list_destroy(sort_context->freelist);
+	g_free(sort_context);
 
 	return result;
 }
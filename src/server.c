@@ -188,6 +188,52 @@ void dm_thread_data_push(gpointer session, gpointer cb_enter, gpointer cb_leave,
 	if (err) TRACE(TRACE_EMERG,"g_thread_pool_push failed [%s]", err->message);
 }
 
+/*
+ * push a job to the thread pool for a session that is not an
+ * ImapSession. The job hands D back to the main thread through the
+ * queue when done. Returns FALSE if there is no pool to run it.
+ */
+
+gboolean dm_thread_job_push(gpointer session, gpointer cb_enter, gpointer cb_leave, gpointer data)
+{
+	GError *err = NULL;
+	dm_thread_data *D;
+
+	assert(session);
+
+	if (! tpool)
+		return FALSE;
+
+	D = mempool_pop(queue_pool, sizeof(*D));
+	D->magic    = DM_THREAD_DATA_MAGIC;
+	D->status   = 0;
+	D->pool     = queue_pool;
+	D->cb_enter = cb_enter;
+	D->cb_leave = cb_leave;
+	D->session  = session;
+	D->data     = data;
+
+	if (! g_thread_pool_push(tpool, D, &err)) {
+		TRACE(TRACE_EMERG, "g_thread_pool_push failed [%s]", err ? err->message : "");
+		if (err)
+			g_error_free(err);
+		dm_thread_data_free(D);
+		return FALSE;
+	}
+
+	TRACE(TRACE_INFO, "[%p] threads %u/%d queued jobs %u", session,
+			g_thread_pool_get_num_threads(tpool),
+			g_thread_pool_get_max_threads(tpool),
+			g_thread_pool_unprocessed(tpool));
+
+	return TRUE;
+}
+
+guint dm_thread_job_queued(void)
+{
+	return tpool ? g_thread_pool_unprocessed(tpool) : 0;
+}
+
 void dm_thread_data_free(gpointer data)
 {
 	dm_thread_data *D = (dm_thread_data *)data;
@@ -227,6 +273,13 @@ static void dm_thread_dispatch(gpointer data, gpointer user_data)
 	D->cb_enter(D);
 }
 
+/* thread-entry callback for jobs of dm_thread_job_push */
+static void dm_thread_run(gpointer data, gpointer UNUSED user_data)
+{
+	dm_thread_data *D = (dm_thread_data *)data;
+	D->cb_enter(D);
+}
+
 /*
  *
  * basic server setup
@@ -236,14 +289,22 @@ static void dm_thread_dispatch(gpointer data, gpointer user_data)
 static int server_setup(ServerConfig_T *conf)
 {
 	GError *err = NULL;
-	guint tpool_size = db_params.max_db_connections;
+	GFunc dispatch = (GFunc)dm_thread_dispatch;
+	int tpool_size = db_params.max_db_connections;
 
 	server_set_sighandler();
 
 	small_pool = mempool_open();
 
-	if (! MATCH(conf->service_name,"IMAP")) 
+	if (MATCH(conf->service_name,"LMTP")) {
+		/* deliveries run in the pool; none runs them in the main thread */
+		tpool_size = config_get_value_default_int("max_deliveries", "LMTP", tpool_size);
+		if (tpool_size < 1)
+			return 0;
+		dispatch = (GFunc)dm_thread_run;
+	} else if (! MATCH(conf->service_name,"IMAP")) {
 		return 0;
+	}
 
 	// Asynchronous message queue for receiving messages
 	// from worker threads in the main thread. 
@@ -256,7 +317,7 @@ static int server_setup(ServerConfig_T *conf)
 	queue_pool = mempool_open();
 
 	// Create the thread pool
-	if (! (tpool = g_thread_pool_new((GFunc)dm_thread_dispatch,NULL,tpool_size,TRUE,&err)))
+	if (! (tpool = g_thread_pool_new(dispatch,NULL,tpool_size,TRUE,&err)))
 		TRACE(TRACE_DEBUG,"g_thread_pool creation failed [%s]", err->message);
 
 	assert(evbase);
@@ -351,7 +412,7 @@ static int server_start_cli(ServerConfig_T *conf)
 		if (server_setup(conf)) return -1;
 		conf->ClientHandler(c);
 
-		if (MATCH(conf->service_name, "IMAP"))
+		if (MATCH(conf->service_name, "IMAP") || tpool)
 			dm_queue_heartbeat();
 
 		result = server_dispatch();
@@ -584,6 +645,7 @@ static void server_exit(void)
 {
 	disconnect_all();
 	server_close_sockets(server_conf);
+	dm_notify_stop();
 	//event_base_free(evbase);
 
 	pthread_mutex_destroy(&selfpipe_lock);
@@ -909,8 +971,14 @@ int server_run(ServerConfig_T *conf)
 
 	TRACE(TRACE_NOTICE, "starting main service loop for [%s]", conf->service_name);
 
-	if (MATCH(conf->service_name, "IMAP"))
+	if (MATCH(conf->service_name, "IMAP")) {
 		dm_queue_heartbeat();
+		dm_notify_start(evbase, imap_cb_notify);
+	} else if (MATCH(conf->service_name, "LMTP")) {
+		if (tpool)
+			dm_queue_heartbeat();
+		dm_notify_start(evbase, lmtp_cb_notify);
+	}
 #ifdef HAVE_SYSTEMD
 	sd_notify(0, "READY=1");
 #endif
@@ -61,6 +61,8 @@ void dm_queue_heartbeat(void);
 
 void dm_thread_data_push(gpointer session, gpointer cb_enter, gpointer cb_leave, gpointer data);
 void dm_thread_data_sendmessage(gpointer data);
+gboolean dm_thread_job_push(gpointer session, gpointer cb_enter, gpointer cb_leave, gpointer data);
+guint dm_thread_job_queued(void);
 
 void server_showhelp(const char *service, const char *greeting);
 int server_getopt(ServerConfig_T *config, const char *service, int argc, char *argv[]);
@@ -554,6 +554,10 @@ int main(int argc, char *argv[])
 		result = 1;
 	}
 
+	/* Let running daemons forget the recipients they resolved. */
+	if (mode == 'a' || mode == 'd' || mode == 'c' || mode == 'x')
+		dm_notify_publish_users();
+
 	/* Here's where we free memory and quit.
 	 * Be sure that all of these are NULL safe! */
 freeall:
@@ -425,6 +425,66 @@ END_TEST
  * Remove a replycache entry.
  * int db_replycache_unregister(const char *to, const char *from, const char *handle);
  */
+START_TEST(test_db_copymsg_many)
+{
+	DbmailMessage *message;
+	CopyTarget_T targets[3];
+	uint64_t one = 0, two = 0;
+	int i;
+
+	db_createmailbox("testcopymany1", testidnr, &one);
+	db_createmailbox("testcopymany2", testidnr, &two);
+
+	message = dbmail_message_new(NULL);
+	message = dbmail_message_init_with_string(message, simple);
+	dbmail_message_store(message);
+
+	memset(targets, 0, sizeof(targets));
+	targets[0].user_idnr = testidnr;
+	targets[0].mailbox_idnr = one;
+	targets[1].user_idnr = testidnr;
+	targets[1].mailbox_idnr = two;
+	targets[2].user_idnr = testidnr;
+	targets[2].mailbox_idnr = one;
+
+	ck_assert_int_eq(db_copymsg_many(message->msg_idnr, targets, 3), 3);
+	for (i = 0; i < 3; i++) {
+		ck_assert_int_eq(targets[i].result, DM_SUCCESS);
+		ck_assert_uint_gt(targets[i].message_idnr, message->msg_idnr);
+	}
+	ck_assert_uint_ne(targets[0].message_idnr, targets[1].message_idnr);
+	ck_assert_uint_ne(targets[0].message_idnr, targets[2].message_idnr);
+
+	db_delete_message(message->msg_idnr);
+	dbmail_message_free(message);
+}
+END_TEST
+
+START_TEST(test_dm_sievescript_get_hash)
+{
+	char *name = NULL, *hash = NULL, *first;
+
+	ck_assert_int_eq(dm_sievescript_add(testidnr, "testhash", "keep;"), DM_SUCCESS);
+	ck_assert(dm_sievescript_activate(testidnr, "testhash"));
+	ck_assert_int_eq(dm_sievescript_get_hash(testidnr, &name, &hash), DM_SUCCESS);
+	ck_assert_str_eq(name, "testhash");
+	ck_assert_uint_gt(strlen(hash), 0);
+	first = hash;
+	g_free(name);
+
+	// a new upload of the script changes the hash
+	dm_sievescript_add(testidnr, "testhash", "discard;");
+	dm_sievescript_activate(testidnr, "testhash");
+	dm_sievescript_get_hash(testidnr, &name, &hash);
+	ck_assert_str_ne(hash, first);
+	g_free(name);
+	g_free(hash);
+	g_free(first);
+
+	dm_sievescript_delete(testidnr, "testhash");
+}
+END_TEST
+
 START_TEST(test_db_replycache)
 {
 	int result;
@@ -504,6 +564,8 @@ Suite *dbmail_db_suite(void)
 	tcase_add_test(tc_db, test_Connection_executeQuery);
 	tcase_add_test(tc_db, test_db_createmailbox);
 	tcase_add_test(tc_db, test_db_delete_mailbox);
+	tcase_add_test(tc_db, test_db_copymsg_many);
+	tcase_add_test(tc_db, test_dm_sievescript_get_hash);
 	tcase_add_test(tc_db, test_db_replycache);
 	tcase_add_test(tc_db, test_db_mailbox_set_permission);
 	tcase_add_test(tc_db, test_db_mailbox_create_with_parents);
@@ -252,6 +252,48 @@ START_TEST(test_resolve_userpart_catchall)
 }
 END_TEST
 
+START_TEST(test_resolve_cache)
+{
+	uint64_t hits, misses, hits_before;
+	Delivery_T delivery;
+
+	dsnuser_cache_flush();
+
+	dsnuser_init(&delivery);
+	delivery.address = g_strdup(alias);
+	ck_assert_int_eq(dsnuser_resolve(&delivery), 0);
+	ck_assert_int_eq(delivery.dsn.class, DSN_CLASS_OK);
+	dsnuser_free(&delivery);
+	dsnuser_cache_stats(&hits_before, &misses);
+
+	// the second lookup comes from the cache
+	dsnuser_init(&delivery);
+	delivery.address = g_strdup(alias);
+	ck_assert_int_eq(dsnuser_resolve(&delivery), 0);
+	ck_assert_int_eq(delivery.dsn.class, DSN_CLASS_OK);
+	ck_assert_uint_eq(g_list_length(delivery.userids), 1);
+	ck_assert_uint_eq(*(uint64_t *)delivery.userids->data, useridnr);
+	dsnuser_free(&delivery);
+	dsnuser_cache_stats(&hits, &misses);
+	ck_assert_uint_eq(hits, hits_before + 1);
+
+	// and unknown addresses too
+	dsnuser_init(&delivery);
+	delivery.address = g_strdup("nosuchuser@example.invalid");
+	dsnuser_resolve(&delivery);
+	dsnuser_free(&delivery);
+	dsnuser_init(&delivery);
+	delivery.address = g_strdup("nosuchuser@example.invalid");
+	ck_assert_int_eq(dsnuser_resolve(&delivery), 0);
+	ck_assert_int_eq(delivery.dsn.class, DSN_CLASS_FAIL);
+	dsnuser_free(&delivery);
+	dsnuser_cache_stats(&hits, &misses);
+	ck_assert_uint_eq(hits, hits_before + 2);
+
+	dsnuser_cache_flush();
+}
+END_TEST
+
 START_TEST(test_tostring)
 {
 	int res;
@@ -323,6 +365,7 @@ Suite *dbmail_dsn_suite(void)
 	tcase_add_test(tc_dsn, test_resolve_username_mailbox);
 	tcase_add_test(tc_dsn, test_resolve_domain_catchall);
 	tcase_add_test(tc_dsn, test_resolve_userpart_catchall);
+	tcase_add_test(tc_dsn, test_resolve_cache);
 	tcase_add_test(tc_dsn, test_tostring);
 	return s;
 }
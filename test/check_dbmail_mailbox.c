@@ -103,30 +103,6 @@ void tree_dump(GTree *t)
 	TRACE(TRACE_DEBUG,"done");
 }
 
-static gboolean _node_cat(uint64_t *key, uint64_t *value, GString **s)
-{
-	if (! (key && value))
-		return TRUE;
-	
-	g_string_append_printf(*(GString **)s, "[%" PRIu64 ": %" PRIu64 "]\n", *key,*value);
-
-	return FALSE;
-}
-
-char * tree_as_string(GTree *t)
-{
-	char *result;
-	GString *s = g_string_new("");
-	
-	TRACE(TRACE_DEBUG,"start");
-	g_tree_foreach(t,(GTraverseFunc)_node_cat,&s);
-	TRACE(TRACE_DEBUG,"done");
-
-	result = s->str;
-	g_string_free(s,FALSE);
-	return result;
-}
-
 static uint64_t get_mailbox_id(const char *name)
 {
 	uint64_t id, owner;
@@ -509,10 +485,206 @@ START_TEST(test_dbmail_mailbox_orderedsubject)
 
 }
 END_TEST
-START_TEST(test_dbmail_mailbox_get_set)
+START_TEST(test_dbmail_mailbox_sortcache)
+{
+	GList *sorted, *l, *keys;
+	GTree *found, *msginfo;
+	uint64_t prev, first;
+	Connection_T c;
+	unsigned count;
+	unsigned char size[SORT_KEYS_MAX] = { SORT_SIZE, 0 };
+	unsigned char reverse[SORT_KEYS_MAX] = { SORT_SIZE | SORT_REVERSE, SORT_ARRIVAL, 0 };
+	DbmailMailbox *mb = dbmail_mailbox_new(NULL, get_mailbox_id("INBOX"));
+	SortCache_T K = SortCache_new(mb->id);
+	char *res;
+
+	dbmail_mailbox_open(mb);
+	ck_assert_int_eq(SortCache_update(K, MailboxState_getExists(mb->mbstate)), DM_SUCCESS);
+	count = SortCache_count(K);
+	ck_assert_uint_ge(count, 2);
+
+	/* nothing new, nothing read */
+	ck_assert_int_eq(SortCache_update(K, MailboxState_getExists(mb->mbstate)), DM_SUCCESS);
+	ck_assert_uint_eq(SortCache_count(K), count);
+
+	/* new mail is read on the next update */
+	add_message();
+	ck_assert_int_eq(SortCache_update(K, MailboxState_getExists(mb->mbstate) + 1), DM_SUCCESS);
+	ck_assert_uint_eq(SortCache_count(K), count + 1);
+
+	found = MailboxState_getIds(mb->mbstate);
+	msginfo = MailboxState_getMsginfo(mb->mbstate);
+
+	sorted = SortCache_sort(K, found, size);
+	ck_assert_uint_eq(g_list_length(sorted), g_tree_nnodes(found));
+	for (prev = 0, l = sorted; l; l = g_list_next(l)) {
+		MessageInfo *info = g_tree_lookup(msginfo, l->data);
+		ck_assert_uint_ge(info->rfcsize, prev);
+		prev = info->rfcsize;
+	}
+	g_list_destroy(sorted);
+
+	sorted = SortCache_sort(K, found, reverse);
+	ck_assert_uint_eq(g_list_length(sorted), g_tree_nnodes(found));
+	for (prev = UINT64_MAX, l = sorted; l; l = g_list_next(l)) {
+		MessageInfo *info = g_tree_lookup(msginfo, l->data);
+		ck_assert_uint_le(info->rfcsize, prev);
+		prev = info->rfcsize;
+	}
+	g_list_destroy(sorted);
+
+	res = SortCache_orderedsubject(K, found, TRUE);
+	ck_assert_ptr_ne(res, NULL);
+	ck_assert(res[0] == '(');
+	g_free(res);
+
+	SortCache_free(&K);
+	ck_assert_ptr_eq(K, NULL);
+
+	/* a message that shows up below the highest uid read is not lost */
+	keys = g_tree_keys(found);
+	first = *(uint64_t *)keys->data;
+	g_list_free(keys);
+	c = db_con_get();
+	db_exec(c, "UPDATE %smessages SET status = %d WHERE message_idnr = %" PRIu64 "",
+			DBPFX, MESSAGE_STATUS_DELETE, first);
+	K = SortCache_new(mb->id);
+	ck_assert_int_eq(SortCache_update(K, MailboxState_getExists(mb->mbstate)), DM_SUCCESS);
+	ck_assert_uint_eq(SortCache_count(K), count);
+	db_exec(c, "UPDATE %smessages SET status = %d WHERE message_idnr = %" PRIu64 "",
+			DBPFX, MESSAGE_STATUS_NEW, first);
+	db_con_close(c);
+
+	sorted = SortCache_sort(K, found, size);
+	ck_assert_uint_eq(g_list_length(sorted), g_tree_nnodes(found));
+	g_list_destroy(sorted);
+
+	SortCache_free(&K);
+	dbmail_mailbox_free(mb);
+}
+END_TEST
+
+static uint64_t add_thread_message(uint64_t mailbox_id, const char *headers)
+{
+	uint64_t user_idnr, uid = 0;
+	DbmailMessage *message;
+	char *raw = g_strdup_printf("%s\r\n\r\nbody\r\n", headers);
+
+	auth_user_exists("testuser1", &user_idnr);
+	message = dbmail_message_new(NULL);
+	message = dbmail_message_init_with_string(message, raw);
+	dbmail_message_store(message);
+	db_copymsg(message->msg_idnr, mailbox_id, user_idnr, &uid);
+	dbmail_message_free(message);
+	g_free(raw);
+
+	return uid;
+}
+
+START_TEST(test_dbmail_mailbox_search_compressed)
+{
+	const char *body = "this body is stored compressed and has a zebraneedle in it\r\n";
+	uint64_t user_idnr, uid = 0;
+	size_t zlen = 0;
+	char *raw, *z;
+	Connection_T c;
+	PreparedStatement_T st;
+	DbmailMessage *message;
+	String_T *search_keys;
+	size_t size;
+	uint64_t idx = 0;
+	Mempool_T pool = mempool_open();
+	DbmailMailbox *mb = dbmail_mailbox_new(pool, get_mailbox_id("compressed"));
+
+	auth_user_exists("testuser1", &user_idnr);
+	raw = g_strdup_printf("Subject: compressed\r\n\r\n%s", body);
+	message = dbmail_message_new(NULL);
+	message = dbmail_message_init_with_string(message, raw);
+	dbmail_message_store(message);
+	db_copymsg(message->msg_idnr, mb->id, user_idnr, &uid);
+	ck_assert_uint_ne(uid, 0);
+
+	/* store the body as mimepart_compression = gzip would */
+	z = dm_deflate(body, strlen(body), &zlen);
+	ck_assert_ptr_ne(z, NULL);
+	c = db_con_get();
+	st = db_stmt_prepare(c, "UPDATE %smimeparts SET data = ?, codec = %d WHERE id IN "
+			"(SELECT part_id FROM %spartlists WHERE physmessage_id = ? AND is_header = 0)",
+			DBPFX, MIMEPART_CODEC_GZIP, DBPFX);
+	db_stmt_set_blob(st, 1, z, zlen);
+	db_stmt_set_u64(st, 2, message->id);
+	ck_assert(db_stmt_exec(st));
+	db_con_close(c);
+	g_free(z);
+
+	search_keys = _build_search_keys(pool, "BODY zebraneedle", &size);
+	dbmail_mailbox_build_imap_search(mb, search_keys, &idx, 0);
+	dbmail_mailbox_search(mb);
+	ck_assert_int_eq(g_tree_nnodes(mb->found), 1);
+	mempool_push(pool, search_keys, size);
+	dbmail_mailbox_free(mb);
+
+	idx = 0;
+	mb = dbmail_mailbox_new(pool, get_mailbox_id("compressed"));
+	search_keys = _build_search_keys(pool, "TEXT zebraneedle", &size);
+	dbmail_mailbox_build_imap_search(mb, search_keys, &idx, 0);
+	dbmail_mailbox_search(mb);
+	ck_assert_int_eq(g_tree_nnodes(mb->found), 1);
+	mempool_push(pool, search_keys, size);
+
+	db_delete_mailbox(mb->id, 0, 0);
+	dbmail_mailbox_free(mb);
+	dbmail_message_free(message);
+	g_free(raw);
+	mempool_close(&pool);
+}
+END_TEST
+
+START_TEST(test_dbmail_mailbox_references)
+{
+	uint64_t a, b, c, d;
+	DbmailMailbox *mb = dbmail_mailbox_new(NULL, get_mailbox_id("threads"));
+	SortCache_T K = SortCache_new(mb->id);
+	char *res, *expect;
+
+	a = add_thread_message(mb->id, "Message-ID: <a@test>\r\n"
+			"Subject: thread\r\n"
+			"Date: Mon, 1 Jun 2020 10:00:00 +0000");
+	b = add_thread_message(mb->id, "Message-ID: <b@test>\r\n"
+			"References: <a@test>\r\n"
+			"Subject: Re: thread\r\n"
+			"Date: Tue, 2 Jun 2020 10:00:00 +0000");
+	c = add_thread_message(mb->id, "Message-ID: <c@test>\r\n"
+			"In-Reply-To: <gone@test>\r\n"
+			"Subject: other\r\n"
+			"Date: Wed, 3 Jun 2020 10:00:00 +0000");
+	d = add_thread_message(mb->id, "Message-ID: <d@test>\r\n"
+			"In-Reply-To: <gone@test>\r\n"
+			"Subject: Re: other\r\n"
+			"Date: Thu, 4 Jun 2020 10:00:00 +0000");
+
+	dbmail_mailbox_open(mb);
+	SortCache_threading(K);
+	ck_assert_int_eq(SortCache_update(K, MailboxState_getExists(mb->mbstate)), DM_SUCCESS);
+
+	/* c and d are replies to a message not in the mailbox */
+	expect = g_strdup_printf("(%" PRIu64 " %" PRIu64 ")((%" PRIu64 ")(%" PRIu64 "))", a, b, c, d);
+	res = SortCache_references(K, MailboxState_getIds(mb->mbstate), TRUE);
+	ck_assert_str_eq(res, expect);
+	g_free(res);
+	g_free(expect);
+
+	SortCache_free(&K);
+	db_delete_mailbox(mb->id, 0, 0);
+	dbmail_mailbox_free(mb);
+}
+END_TEST
+
+START_TEST(test_dbmail_mailbox_get_seqset)
 {
-	guint c, d, r;
-	GTree *set;
+	uint64_t c, d;
+	int r;
+	SeqSet_T set;
 	DbmailMailbox *mb = dbmail_mailbox_new(NULL, get_mailbox_id("INBOX"));
 	dbmail_mailbox_set_uid(mb,TRUE);
 	r = dbmail_mailbox_open(mb);
@@ -520,73 +692,71 @@ START_TEST(test_dbmail_mailbox_get_set)
 	fail_unless(r == DM_SUCCESS, "dbmail_mailbox_open failed");
 
 	// basic tests;
-	set = dbmail_mailbox_get_set(mb, "1:*", 0);
-	fail_unless(set != NULL,"dbmail_mailbox_get_set failed");
-	c = g_tree_nnodes(set);
-	fail_unless(c>1,"dbmail_mailbox_get_set failed [%d]", c);
-	g_tree_destroy(set);
-
-	set = dbmail_mailbox_get_set(mb,"*:1",0);
-	fail_unless(set != NULL,"dbmail_mailbox_get_set failed");
-	d = g_tree_nnodes(set);
-	fail_unless(c==d,"dbmail_mailbox_get_set failed [%d != %d]", c, d);
-	g_tree_destroy(set);
-
-	set = dbmail_mailbox_get_set(mb,"1,*",0);
-	fail_unless(set != NULL,"dbmail_mailbox_get_set failed");
-	d = g_tree_nnodes(set);
-	fail_unless(d==2,"mailbox_get_set failed [%d != 2]", d);
-	g_tree_destroy(set);
-	
-	set = dbmail_mailbox_get_set(mb,"*,1",0);
-	fail_unless(set != NULL,"dbmail_mailbox_get_set failed");
-	d = g_tree_nnodes(set);
-	fail_unless(d==2,"mailbox_get_set failed");
-	g_tree_destroy(set);
-	
-	set = dbmail_mailbox_get_set(mb,"1",0);
-	fail_unless(set != NULL,"dbmail_mailbox_get_set failed");
-	d = g_tree_nnodes(set);
-	fail_unless(d==1,"mailbox_get_set failed");
-	g_tree_destroy(set);
-
-	set = dbmail_mailbox_get_set(mb,"-1:1",0);
+	set = dbmail_mailbox_get_seqset(mb, "1:*", 0);
+	fail_unless(set != NULL,"dbmail_mailbox_get_seqset failed");
+	c = SeqSet_count(set);
+	fail_unless(c>1,"dbmail_mailbox_get_seqset failed [%" PRIu64 "]", c);
+	fail_unless(SeqSet_first(set) == 1);
+	fail_unless(SeqSet_last(set) == c);
+	SeqSet_free(&set);
+
+	set = dbmail_mailbox_get_seqset(mb,"*:1",0);
+	fail_unless(set != NULL,"dbmail_mailbox_get_seqset failed");
+	d = SeqSet_count(set);
+	fail_unless(c==d,"dbmail_mailbox_get_seqset failed [%" PRIu64 " != %" PRIu64 "]", c, d);
+	SeqSet_free(&set);
+
+	set = dbmail_mailbox_get_seqset(mb,"1,*",0);
+	fail_unless(set != NULL,"dbmail_mailbox_get_seqset failed");
+	d = SeqSet_count(set);
+	fail_unless(d==2,"mailbox_get_seqset failed [%" PRIu64 " != 2]", d);
+	SeqSet_free(&set);
+	
+	set = dbmail_mailbox_get_seqset(mb,"*,1",0);
+	fail_unless(set != NULL,"dbmail_mailbox_get_seqset failed");
+	d = SeqSet_count(set);
+	fail_unless(d==2,"mailbox_get_seqset failed");
+	SeqSet_free(&set);
+	
+	set = dbmail_mailbox_get_seqset(mb,"1",0);
+	fail_unless(set != NULL,"dbmail_mailbox_get_seqset failed");
+	d = SeqSet_count(set);
+	fail_unless(d==1,"mailbox_get_seqset failed");
+	SeqSet_free(&set);
+
+	set = dbmail_mailbox_get_seqset(mb,"-1:1",0);
 	fail_unless(set == NULL);
-	g_tree_destroy(set);
 
-	set = dbmail_mailbox_get_set(mb, "999999998:999999999", 0);
-	fail_unless(set != NULL,"dbmail_mailbox_get_set failed");
-	c = g_tree_nnodes(set);
-	fail_unless(c==0, "dbmail_mailbox_get_set failed [%d]", c);
-	g_tree_destroy(set);
+	set = dbmail_mailbox_get_seqset(mb, "999999998:999999999", 0);
+	fail_unless(set != NULL,"dbmail_mailbox_get_seqset failed");
+	fail_unless(SeqSet_isEmpty(set), "dbmail_mailbox_get_seqset failed");
+	SeqSet_free(&set);
 	
 	// UID sets
 	char *s, *t;
 
-	set = dbmail_mailbox_get_set(mb, "0", 1);
+	set = dbmail_mailbox_get_seqset(mb, "0", 1);
 	fail_unless(set == NULL);
-	g_tree_destroy(set);
-
-	set = dbmail_mailbox_get_set(mb, "1:*", 1);
-	fail_unless(set != NULL,"dbmail_mailbox_get_set failed");
-	s = tree_as_string(set);
-	c = g_tree_nnodes(set);
-	fail_unless(c>1,"dbmail_mailbox_get_set failed");
-	g_tree_destroy(set);
-
-	set = dbmail_mailbox_get_set(mb, "1:*", 0);
-	fail_unless(set != NULL,"dbmail_mailbox_get_set failed");
-	t = tree_as_string(set);
+
+	set = dbmail_mailbox_get_seqset(mb, "1:*", 1);
+	fail_unless(set != NULL,"dbmail_mailbox_get_seqset failed");
+	s = MailboxState_uidset(mb->mbstate, set);
+	d = SeqSet_count(set);
+	fail_unless(c==d,"dbmail_mailbox_get_seqset failed");
+	SeqSet_free(&set);
+
+	set = dbmail_mailbox_get_seqset(mb, "1:*", 0);
+	fail_unless(set != NULL,"dbmail_mailbox_get_seqset failed");
+	t = MailboxState_uidset(mb->mbstate, set);
 	fail_unless(strncmp(s,t,1024)==0,"mismatch between <1:*> and <UID 1:*>\n%s\n%s", s,t);
-	g_tree_destroy(set);
+	SeqSet_free(&set);
 	g_free(s);
 	g_free(t);
 	
-	set = dbmail_mailbox_get_set(mb, "999999998:999999999", 1);
-	fail_unless(set != NULL,"dbmail_mailbox_get_set failed");
-	c = g_tree_nnodes(set);
-	fail_unless(c==0, "dbmail_mailbox_get_set failed [%d]", c);
-	g_tree_destroy(set);
+	set = dbmail_mailbox_get_seqset(mb, "999999998:999999999", 1);
+	fail_unless(set != NULL,"dbmail_mailbox_get_seqset failed");
+	fail_unless(SeqSet_isEmpty(set), "dbmail_mailbox_get_seqset failed");
+	SeqSet_free(&set);
 	
 	dbmail_mailbox_free(mb);
 
@@ -594,49 +764,43 @@ START_TEST(test_dbmail_mailbox_get_set)
 	mb = dbmail_mailbox_new(NULL, empty_box);
 	dbmail_mailbox_open(mb);
 
-	set = dbmail_mailbox_get_set(mb, "1:*", 0);
-	fail_unless(set == NULL,"dbmail_mailbox_get_set failed");
-	g_tree_destroy(set);
+	set = dbmail_mailbox_get_seqset(mb, "1:*", 0);
+	fail_unless(set == NULL,"dbmail_mailbox_get_seqset failed");
 	
-	set = dbmail_mailbox_get_set(mb, "*", 0);
-	fail_unless(set == NULL,"dbmail_mailbox_get_set failed");
-	g_tree_destroy(set);
+	set = dbmail_mailbox_get_seqset(mb, "*", 0);
+	fail_unless(set == NULL,"dbmail_mailbox_get_seqset failed");
 
-	set = dbmail_mailbox_get_set(mb, "1", 0);
-	fail_unless(set == NULL,"dbmail_mailbox_get_set failed");
-	g_tree_destroy(set);
+	set = dbmail_mailbox_get_seqset(mb, "1", 0);
+	fail_unless(set == NULL,"dbmail_mailbox_get_seqset failed");
 
-	set = dbmail_mailbox_get_set(mb, "1:*", 1);
+	set = dbmail_mailbox_get_seqset(mb, "1:*", 1);
 	fail_unless(set != NULL);
-	d = g_tree_nnodes(set);
-	fail_unless(d==1, "expected 1, got %d", d);
-	g_tree_destroy(set);
+	d = SeqSet_count(set);
+	fail_unless(d==1, "expected 1, got %" PRIu64 "", d);
+	SeqSet_free(&set);
 
-	set = dbmail_mailbox_get_set(mb, "*:1", 1);
+	set = dbmail_mailbox_get_seqset(mb, "*:1", 1);
 	fail_unless(set != NULL);
-	d = g_tree_nnodes(set);
-	fail_unless(d==1, "expected 1, got %d", d);
-	g_tree_destroy(set);
+	d = SeqSet_count(set);
+	fail_unless(d==1, "expected 1, got %" PRIu64 "", d);
+	SeqSet_free(&set);
 
-	set = dbmail_mailbox_get_set(mb, "1234567", 1);
-	fail_unless(set != NULL,"dbmail_mailbox_get_set failed");
-	g_tree_destroy(set);
+	set = dbmail_mailbox_get_seqset(mb, "1234567", 1);
+	fail_unless(set != NULL,"dbmail_mailbox_get_seqset failed");
+	SeqSet_free(&set);
 
-	set = dbmail_mailbox_get_set(mb, "1:1", 1);
-	fail_unless(set != NULL,"dbmail_mailbox_get_set failed");
-	g_tree_destroy(set);
+	set = dbmail_mailbox_get_seqset(mb, "1:1", 1);
+	fail_unless(set != NULL,"dbmail_mailbox_get_seqset failed");
+	SeqSet_free(&set);
 
-	set = dbmail_mailbox_get_set(mb, "1:a*", 1);
-	fail_unless(set == NULL,"dbmail_mailbox_get_set failed");
-	g_tree_destroy(set);
+	set = dbmail_mailbox_get_seqset(mb, "1:a*", 1);
+	fail_unless(set == NULL,"dbmail_mailbox_get_seqset failed");
 	
-	set = dbmail_mailbox_get_set(mb, "a:*", 1);
-	fail_unless(set == NULL,"dbmail_mailbox_get_set failed");
-	g_tree_destroy(set);
+	set = dbmail_mailbox_get_seqset(mb, "a:*", 1);
+	fail_unless(set == NULL,"dbmail_mailbox_get_seqset failed");
 
-	set = dbmail_mailbox_get_set(mb, "*:a", 1);
-	fail_unless(set == NULL,"dbmail_mailbox_get_set failed");
-	g_tree_destroy(set);
+	set = dbmail_mailbox_get_seqset(mb, "*:a", 1);
+	fail_unless(set == NULL,"dbmail_mailbox_get_seqset failed");
 
 	dbmail_mailbox_free(mb);
 }
@@ -645,13 +809,11 @@ END_TEST
 /* A UID less than the minimum existing UID must return an empty set,
  * not clamp to the minimum existing UID.
  * Per RFC 3501 §6.4, non-existent UIDs must be silently ignored. */
-START_TEST(test_dbmail_mailbox_get_set_nonexistent_uid)
+START_TEST(test_dbmail_mailbox_get_seqset_nonexistent_uid)
 {
-	GTree *all, *set;
-	GList *keys;
+	SeqSet_T all, set;
 	uint64_t min_uid;
 	char set_str[32];
-	guint c;
 	int r;
 
 	DbmailMailbox *mb = dbmail_mailbox_new(NULL, get_mailbox_id("INBOX"));
@@ -661,13 +823,11 @@ START_TEST(test_dbmail_mailbox_get_set_nonexistent_uid)
 
 	/* Collect all UIDs; require at least 2 so one can be removed
 	 * while a non-empty mailbox remains for the assertion. */
-	all = dbmail_mailbox_get_set(mb, "1:*", 1);
-	fail_unless(all != NULL && g_tree_nnodes(all) >= 2,
+	all = dbmail_mailbox_get_seqset(mb, "1:*", 1);
+	fail_unless(all != NULL && SeqSet_count(all) >= 2,
 		"precondition: INBOX must have at least 2 messages");
-	keys = g_tree_keys(all);
-	min_uid = *(uint64_t *)g_list_first(keys)->data;
-	g_list_free(keys);
-	g_tree_destroy(all);
+	min_uid = MailboxState_getUidForMsn(mb->mbstate, SeqSet_first(all));
+	SeqSet_free(&all);
 	dbmail_mailbox_free(mb);
 
 	/* Remove the message with the minimum UID to open a gap below
@@ -682,13 +842,12 @@ START_TEST(test_dbmail_mailbox_get_set_nonexistent_uid)
 
 	/* Request the now-absent UID: RFC 3501 §6.4 requires an empty result. */
 	snprintf(set_str, sizeof(set_str), "%" PRIu64, min_uid);
-	set = dbmail_mailbox_get_set(mb, set_str, 1);
-	fail_unless(set != NULL, "dbmail_mailbox_get_set failed");
-	c = g_tree_nnodes(set);
-	fail_unless(c == 0,
-		"deleted UID %" PRIu64 " should match 0 messages, got %d",
-		min_uid, c);
-	g_tree_destroy(set);
+	set = dbmail_mailbox_get_seqset(mb, set_str, 1);
+	fail_unless(set != NULL, "dbmail_mailbox_get_seqset failed");
+	fail_unless(SeqSet_isEmpty(set),
+		"deleted UID %" PRIu64 " should match 0 messages, got %" PRIu64,
+		min_uid, SeqSet_count(set));
+	SeqSet_free(&set);
 
 	dbmail_mailbox_free(mb);
 }
@@ -701,8 +860,8 @@ Suite *dbmail_mailbox_suite(void)
 	TCase *tc_mailbox = tcase_create("Mailbox");
 	suite_add_tcase(s, tc_mailbox);
 	tcase_add_checked_fixture(tc_mailbox, setup, teardown);
-	tcase_add_test(tc_mailbox, test_dbmail_mailbox_get_set);
-	tcase_add_test(tc_mailbox, test_dbmail_mailbox_get_set_nonexistent_uid);
+	tcase_add_test(tc_mailbox, test_dbmail_mailbox_get_seqset);
+	tcase_add_test(tc_mailbox, test_dbmail_mailbox_get_seqset_nonexistent_uid);
 	tcase_add_test(tc_mailbox, test_dbmail_mailbox_new);
 	tcase_add_test(tc_mailbox, test_dbmail_mailbox_free);
 	tcase_add_test(tc_mailbox, test_dbmail_mailbox_dump);
@@ -714,7 +873,10 @@ Suite *dbmail_mailbox_suite(void)
 	tcase_add_test(tc_mailbox, test_dbmail_mailbox_search4);
 	tcase_add_test(tc_mailbox, test_dbmail_mailbox_search_parsed_1);
 	tcase_add_test(tc_mailbox, test_dbmail_mailbox_search_parsed_2);
+	tcase_add_test(tc_mailbox, test_dbmail_mailbox_search_compressed);
 	tcase_add_test(tc_mailbox, test_dbmail_mailbox_orderedsubject);
+	tcase_add_test(tc_mailbox, test_dbmail_mailbox_sortcache);
+	tcase_add_test(tc_mailbox, test_dbmail_mailbox_references);
 
 	return s;
 }
@@ -140,6 +140,380 @@ START_TEST(test_metadata)
 }
 END_TEST
 
+START_TEST(test_seqset)
+{
+	SeqSet_T S, B, A;
+	uint64_t id;
+	char *s;
+
+	S = SeqSet_new();
+	ck_assert(SeqSet_isEmpty(S));
+	SeqSet_add(S, 1, 3);
+	SeqSet_add(S, 7, 9);
+	SeqSet_add(S, 4, 4); // touches 1:3
+	SeqSet_add(S, 12, 11); // reversed
+	ck_assert_uint_eq (SeqSet_count(S), 9);
+	ck_assert_uint_eq (SeqSet_first(S), 1);
+	ck_assert_uint_eq (SeqSet_last(S), 12);
+	ck_assert(SeqSet_has(S, 4));
+	ck_assert(! SeqSet_has(S, 5));
+	ck_assert(! SeqSet_has(S, 10));
+
+	s = SeqSet_string(S);
+	ck_assert_str_eq (s, "1:4,7:9,11:12");
+	g_free(s);
+
+	/* bridge the gaps */
+	SeqSet_add(S, 5, 10);
+	s = SeqSet_string(S);
+	ck_assert_str_eq (s, "1:12");
+	g_free(s);
+	SeqSet_free(&S);
+	ck_assert(S == NULL);
+
+	S = SeqSet_new();
+	SeqSet_add(S, 2, 3);
+	SeqSet_add(S, 6, 6);
+	SeqSet_add(S, 9, 10);
+
+	id = 0;
+	ck_assert(SeqSet_next(S, &id)); ck_assert_uint_eq (id, 2);
+	ck_assert(SeqSet_next(S, &id)); ck_assert_uint_eq (id, 3);
+	ck_assert(SeqSet_next(S, &id)); ck_assert_uint_eq (id, 6);
+	ck_assert(SeqSet_next(S, &id)); ck_assert_uint_eq (id, 9);
+	ck_assert(SeqSet_next(S, &id)); ck_assert_uint_eq (id, 10);
+	ck_assert(! SeqSet_next(S, &id));
+
+	id = 0;
+	ck_assert(SeqSet_prev(S, &id)); ck_assert_uint_eq (id, 10);
+	ck_assert(SeqSet_prev(S, &id)); ck_assert_uint_eq (id, 9);
+	ck_assert(SeqSet_prev(S, &id)); ck_assert_uint_eq (id, 6);
+	ck_assert(SeqSet_prev(S, &id)); ck_assert_uint_eq (id, 3);
+	ck_assert(SeqSet_prev(S, &id)); ck_assert_uint_eq (id, 2);
+	ck_assert(! SeqSet_prev(S, &id));
+
+	ck_assert_uint_eq (SeqSet_advance(S, 2, 2), 6);
+	ck_assert_uint_eq (SeqSet_advance(S, 3, 2), 9);
+	ck_assert_uint_eq (SeqSet_advance(S, 2, 100), 10);
+
+	B = SeqSet_new();
+	SeqSet_add(B, 3, 9);
+	A = SeqSet_and(S, B);
+	s = SeqSet_string(A);
+	ck_assert_str_eq (s, "3,6,9");
+	g_free(s);
+
+	SeqSet_merge(A, S);
+	ck_assert_uint_eq (SeqSet_count(A), 5);
+
+	SeqSet_free(&A);
+	SeqSet_free(&B);
+	SeqSet_free(&S);
+}
+END_TEST
+
+START_TEST(test_msn_index)
+{
+	MailboxState_T M;
+	GTree *set;
+	SeqSet_T S;
+	char *s;
+	uint64_t msn, uid, first, last;
+	int i;
+
+	testboxid = get_mailbox_id("mailboxstate2", "msnindex");
+	for (i = 0; i < 3; i++)
+		insert_message();
+
+	M = MailboxState_new(NULL, testboxid);
+	ck_assert_uint_eq (MailboxState_countIds(M), 3);
+
+	/* uids ascend with the msn, and map back to it */
+	first = MailboxState_getUidForMsn(M, 1);
+	last = MailboxState_getUidForMsn(M, 3);
+	ck_assert_uint_gt (first, 0);
+	for (msn = 1; msn <= 3; msn++) {
+		uid = MailboxState_getUidForMsn(M, msn);
+		ck_assert_uint_eq (MailboxState_getMsnForUid(M, uid), msn);
+		ck_assert_uint_eq (*(uint64_t *)g_tree_lookup(MailboxState_getIds(M), &uid), msn);
+		ck_assert_uint_eq (*(uint64_t *)g_tree_lookup(MailboxState_getMsn(M), &msn), uid);
+	}
+	ck_assert_uint_eq (MailboxState_getUidForMsn(M, 0), 0);
+	ck_assert_uint_eq (MailboxState_getUidForMsn(M, 4), 0);
+	ck_assert_uint_eq (MailboxState_getMsnForUid(M, last + 1), 0);
+
+	/* sets map uid -> msn */
+	set = MailboxState_get_set(M, "2:*", FALSE);
+	ck_assert_int_eq (g_tree_nnodes(set), 2);
+	ck_assert_uint_eq (*(uint64_t *)g_tree_lookup(set, &last), 3);
+	g_tree_destroy(set);
+
+	set = MailboxState_get_set(M, "*", TRUE);
+	ck_assert_int_eq (g_tree_nnodes(set), 1);
+	ck_assert_uint_eq (*(uint64_t *)g_tree_lookup(set, &last), 3);
+	g_tree_destroy(set);
+
+	/* uid ranges become msn ranges */
+	S = MailboxState_get_seqset(M, "1:*", TRUE);
+	s = SeqSet_string(S);
+	ck_assert_str_eq (s, "1:3");
+	g_free(s);
+	SeqSet_free(&S);
+
+	S = MailboxState_get_seqset(M, "2,5:9", FALSE);
+	s = SeqSet_string(S);
+	ck_assert_str_eq (s, "2");
+	g_free(s);
+	s = MailboxState_uidset(M, S);
+	ck_assert_uint_eq (strtoull(s, NULL, 10), MailboxState_getUidForMsn(M, 2));
+	g_free(s);
+	SeqSet_free(&S);
+
+	ck_assert(MailboxState_get_seqset(M, "1:x", FALSE) == NULL);
+
+	/* removed messages leave the index, and the views follow */
+	ck_assert_int_eq (MailboxState_removeUid(M, first), DM_SUCCESS);
+	ck_assert_uint_eq (MailboxState_countIds(M), 2);
+	ck_assert_uint_eq (MailboxState_getMsnForUid(M, first), 0);
+	ck_assert_uint_eq (MailboxState_getMsnForUid(M, last), 2);
+	ck_assert_ptr_eq (g_tree_lookup(MailboxState_getIds(M), &first), NULL);
+	ck_assert_uint_eq (*(uint64_t *)g_tree_lookup(MailboxState_getIds(M), &last), 2);
+	msn = 2;
+	ck_assert_uint_eq (*(uint64_t *)g_tree_lookup(MailboxState_getMsn(M), &msn), last);
+	msn = 3;
+	ck_assert_ptr_eq (g_tree_lookup(MailboxState_getMsn(M), &msn), NULL);
+
+	MailboxState_free(&M);
+}
+END_TEST
+
+START_TEST(test_keywords)
+{
+	MailboxState_T M, N;
+	MessageInfo *a, *b;
+	GList *keywords = NULL, *changes;
+	uint64_t uid;
+	char *s;
+
+	testboxid = get_mailbox_id("mailboxstate2", "keywords");
+	insert_message();
+
+	M = MailboxState_new(NULL, testboxid);
+	uid = MailboxState_getUidForMsn(M, 1);
+	a = g_tree_lookup(MailboxState_getMsginfo(M), &uid);
+	ck_assert_ptr_ne (a, NULL);
+
+	keywords = g_list_append(keywords, "$Label1");
+	keywords = g_list_append(keywords, "$label2");
+	MailboxState_addKeyword(M, "$Label1");
+	MailboxState_addKeyword(M, "$Label2");
+	MailboxState_message_setKeywords(M, a, keywords, IMAPFA_ADD);
+
+	/* interned case-insensitively, rendered in table order */
+	ck_assert (MailboxState_message_hasKeyword(M, a, "$LABEL2"));
+	s = MailboxState_message_flags(M, a);
+	ck_assert_str_eq (s, "($Label1 $Label2)");
+	g_free(s);
+	s = MailboxState_flags(M);
+	ck_assert_str_eq (s, "\\Seen \\Answered \\Deleted \\Flagged \\Draft $Label1 $Label2");
+	g_free(s);
+
+	/* only the keywords that change the message are written */
+	changes = MailboxState_message_keywordChanges(M, a, keywords, IMAPFA_ADD);
+	ck_assert_ptr_eq (changes, NULL);
+	changes = MailboxState_message_keywordChanges(M, a, keywords, IMAPFA_REMOVE);
+	ck_assert_int_eq (g_list_length(changes), 2);
+	g_list_free(changes);
+
+	/* flags compare without rendering, within and across tables */
+	N = MailboxState_new(NULL, testboxid);
+	b = g_tree_lookup(MailboxState_getMsginfo(N), &uid);
+	ck_assert (! MailboxState_message_flags_equal(M, a, N, b));
+	MailboxState_addKeyword(N, "$label2");
+	MailboxState_addKeyword(N, "$label1");
+	MailboxState_message_setKeywords(N, b, keywords, IMAPFA_REPLACE);
+	ck_assert (MailboxState_message_flags_equal(M, a, N, b));
+	MailboxState_message_setFlag(b, IMAP_FLAG_FLAGGED, TRUE);
+	ck_assert (! MailboxState_message_flags_equal(M, a, N, b));
+	MailboxState_free(&N);
+
+	N = MailboxState_update(NULL, M);
+	b = MailboxState_getWritableMsginfo(N, uid);
+	ck_assert_ptr_ne (b, NULL);
+	ck_assert_ptr_ne (a, b);
+	MailboxState_addKeyword(N, "$Label1");
+	MailboxState_addKeyword(N, "$Label2");
+	MailboxState_message_setKeywords(N, b, keywords, IMAPFA_ADD);
+	ck_assert (MailboxState_message_hasKeyword(N, b, "$label1"));
+	MailboxState_message_setKeywords(N, b, g_list_last(keywords), IMAPFA_REMOVE);
+	ck_assert (! MailboxState_message_hasKeyword(N, b, "$label2"));
+	s = MailboxState_message_flags(N, b);
+	ck_assert_str_eq (s, "($Label1)");
+	g_free(s);
+	ck_assert (MailboxState_message_hasKeyword(M, a, "$label2"));
+
+	g_list_free(keywords);
+	MailboxState_free(&M);
+	MailboxState_free(&N);
+}
+END_TEST
+
+START_TEST(test_shared_view)
+{
+	MailboxState_T M, N, P;
+	MessageInfo *a, *b;
+	uint64_t uid;
+
+	testboxid = get_mailbox_id("mailboxstate2", "sharedview");
+	insert_message();
+	insert_message();
+
+	M = MailboxState_view(NULL, testboxid);
+	N = MailboxState_view(NULL, testboxid);
+	ck_assert_ptr_ne (M, NULL);
+	ck_assert_ptr_ne (N, NULL);
+	ck_assert_ptr_eq (M->share, N->share);
+	ck_assert_ptr_eq (M->keywords, N->keywords);
+	ck_assert_uint_eq (MailboxState_getSeq(M), MailboxState_getSeq(N));
+	ck_assert_uint_eq (MailboxState_countIds(M), 2);
+	ck_assert_uint_eq (MailboxState_countIds(N), 2);
+
+	/* the sessions share the messages until one changes them */
+	uid = MailboxState_getUidForMsn(M, 1);
+	a = g_tree_lookup(MailboxState_getMsginfo(M), &uid);
+	b = g_tree_lookup(MailboxState_getMsginfo(N), &uid);
+	ck_assert_ptr_eq (a, b);
+	a = MailboxState_getWritableMsginfo(M, uid);
+	ck_assert_ptr_ne (a, b);
+	ck_assert_ptr_eq (a, g_tree_lookup(MailboxState_getMsginfo(M), &uid));
+	ck_assert_ptr_eq (a, MailboxState_getWritableMsginfo(M, uid));
+	MailboxState_message_setFlag(a, IMAP_FLAG_FLAGGED, TRUE);
+	MailboxState_message_setFlag(a, IMAP_FLAG_DRAFT, TRUE);
+	MailboxState_message_setFlag(a, IMAP_FLAG_DRAFT, FALSE);
+	ck_assert (MailboxState_message_hasFlag(a, IMAP_FLAG_FLAGGED));
+	ck_assert (! MailboxState_message_hasFlag(a, IMAP_FLAG_DRAFT));
+	ck_assert_int_eq (MailboxState_message_hasFlag(b, IMAP_FLAG_FLAGGED), 0);
+	ck_assert_int_eq (MailboxState_removeUid(M, uid), DM_SUCCESS);
+	ck_assert_uint_eq (MailboxState_countIds(N), 2);
+	ck_assert_uint_eq (MailboxState_getMsnForUid(N, uid), 1);
+	ck_assert_uint_eq (*(uint64_t *)g_tree_lookup(MailboxState_getIds(N), &uid), 1);
+
+	/* a change of the mailbox seq loads the mailbox again */
+	insert_message();
+	P = MailboxState_view(NULL, testboxid);
+	ck_assert_ptr_eq (P->share, N->share);
+	ck_assert_uint_eq (MailboxState_countIds(P), 3);
+	ck_assert_uint_gt (MailboxState_getSeq(P), MailboxState_getSeq(N));
+
+	MailboxState_free(&M);
+	MailboxState_free(&N);
+	MailboxState_free(&P);
+	ck_assert_ptr_eq (P, NULL);
+}
+END_TEST
+
+START_TEST(test_differential)
+{
+	MailboxState_T M, N, F;
+	MessageInfo *a, *b;
+	GList *keywords = NULL;
+	int flags[IMAP_NFLAGS];
+	uint64_t uid, msn;
+	char *s, *t;
+
+	testboxid = get_mailbox_id("mailboxstate2", "differential");
+	insert_message();
+	insert_message();
+	insert_message();
+
+	M = MailboxState_new(NULL, testboxid);
+	ck_assert_uint_eq (MailboxState_countIds(M), 3);
+
+	/* change a message, expunge another and deliver a new one */
+	memset(flags, 0, sizeof(flags));
+	flags[IMAP_FLAG_FLAGGED] = 1;
+	keywords = g_list_append(keywords, "$Test");
+	uid = MailboxState_getUidForMsn(M, 1);
+	db_set_msgflag(uid, flags, keywords, IMAPFA_ADD, 0, NULL);
+	db_mailbox_seq_update(testboxid, uid);
+
+	uid = MailboxState_getUidForMsn(M, 2);
+	ck_assert (db_set_message_status(uid, MESSAGE_STATUS_DELETE));
+	db_mailbox_seq_update(testboxid, 0);
+
+	insert_message();
+
+	/* the differential update matches a full load */
+	N = MailboxState_update(NULL, M);
+	F = MailboxState_new(NULL, testboxid);
+	ck_assert_ptr_ne (N, NULL);
+	ck_assert_uint_eq (MailboxState_countIds(N), 3);
+	ck_assert_uint_eq (MailboxState_countIds(N), MailboxState_countIds(F));
+	ck_assert_uint_eq (MailboxState_getExists(N), MailboxState_getExists(F));
+	ck_assert_uint_eq (MailboxState_getMsnForUid(N, uid), 0);
+	for (msn = 1; msn <= MailboxState_countIds(F); msn++) {
+		uid = MailboxState_getUidForMsn(F, msn);
+		ck_assert_uint_eq (MailboxState_getUidForMsn(N, msn), uid);
+		a = g_tree_lookup(MailboxState_getMsginfo(N), &uid);
+		b = g_tree_lookup(MailboxState_getMsginfo(F), &uid);
+		ck_assert_ptr_ne (a, NULL);
+		s = MailboxState_message_flags(N, a);
+		t = MailboxState_message_flags(F, b);
+		ck_assert_str_eq (s, t);
+		g_free(s);
+		g_free(t);
+	}
+	s = MailboxState_flags(N);
+	t = MailboxState_flags(F);
+	ck_assert_str_eq (s, t);
+	g_free(s);
+	g_free(t);
+
+	/* the old state is left alone */
+	ck_assert_uint_eq (MailboxState_countIds(M), 3);
+	uid = MailboxState_getUidForMsn(M, 1);
+	a = g_tree_lookup(MailboxState_getMsginfo(M), &uid);
+	ck_assert_int_eq (MailboxState_message_hasFlag(a, IMAP_FLAG_FLAGGED), 0);
+
+	g_list_free(keywords);
+	MailboxState_free(&M);
+	MailboxState_free(&N);
+	MailboxState_free(&F);
+}
+END_TEST
+
+START_TEST(test_emptied)
+{
+	MailboxState_T M, N;
+	Connection_T c; ResultSet_T r;
+	int logged = 0;
+
+	testboxid = get_mailbox_id("mailboxstate2", "emptied");
+	insert_message();
+	insert_message();
+
+	M = MailboxState_new(NULL, testboxid);
+	ck_assert_uint_eq (MailboxState_countIds(M), 2);
+
+	/* emptying the mailbox leaves its messages in the expunge log */
+	ck_assert_int_eq (db_delete_mailbox(testboxid, 1, 0), DM_SUCCESS);
+	c = db_con_get();
+	r = db_query(c, "SELECT COUNT(*) FROM dbmail_expunges WHERE mailbox_idnr = %" PRIu64 "", testboxid);
+	if (db_result_next(r))
+		logged = db_result_get_int(r, 0);
+	db_con_close(c);
+	ck_assert_int_eq (logged, 2);
+
+	ck_assert_uint_gt (MailboxState_querySeq(testboxid), MailboxState_getSeq(M));
+	N = MailboxState_update(NULL, M);
+	ck_assert_ptr_ne (N, NULL);
+	ck_assert_uint_eq (MailboxState_countIds(N), 0);
+
+	MailboxState_free(&M);
+	MailboxState_free(&N);
+}
+END_TEST
+
 static void mailboxstate_destroy(MailboxState_T M)
 {
 	MailboxState_free(&M);
@@ -181,6 +555,12 @@ Suite *dbmail_common_suite(void)
 	tcase_add_test(tc_state, test_createdestroy);
 	tcase_add_test(tc_state, test_metadata);
 	tcase_add_test(tc_state, test_mbxinfo);
+	tcase_add_test(tc_state, test_seqset);
+	tcase_add_test(tc_state, test_msn_index);
+	tcase_add_test(tc_state, test_keywords);
+	tcase_add_test(tc_state, test_shared_view);
+	tcase_add_test(tc_state, test_differential);
+	tcase_add_test(tc_state, test_emptied);
 
 	return s;
 }
@@ -40,6 +40,8 @@ extern char configFile[PATH_MAX];
 extern char *multipart_message;
 extern char *multipart_message_part;
 extern char *raw_lmtp_data;
+extern DBParam_T db_params;
+#define DBPFX db_params.pfx
 
 
 /*
@@ -510,6 +512,279 @@ START_TEST(test_dbmail_message_store2)
 END_TEST
 
 
+START_TEST(test_dbmail_message_store_dedup)
+{
+	DbmailMessage *m;
+	Connection_T c; ResultSet_T r;
+	uint64_t physid, part_id = 0;
+	int rows = 0;
+	char *t, *e;
+	const char *attachment = "Content-Type: application/octet-stream\n"
+		"Content-Transfer-Encoding: base64\n"
+		"\n"
+		"ZGJtYWlsIGJhdGNoZWQgbWltZXBhcnQgZGVkdXBsaWNhdGlvbiB0ZXN0Cg==\n";
+	char *message = g_strdup_printf("From: nobody@example.org\n"
+		"To: nobody@example.org\n"
+		"Subject: repeated attachment\n"
+		"MIME-Version: 1.0\n"
+		"Content-Type: multipart/mixed; boundary=\"dedup\"\n"
+		"\n"
+		"--dedup\n%s\n--dedup\n%s\n--dedup\n%s\n--dedup--\n",
+		attachment, attachment, attachment);
+
+	m = message_init(message);
+	e = dbmail_message_to_string(m);
+	dbmail_message_store(m);
+	physid = dbmail_message_get_physid(m);
+	fail_unless(physid != 0, "dbmail_message_store failed");
+
+	/* the three identical bodies share a single mimepart */
+	c = db_con_get();
+	r = db_query(c, "SELECT DISTINCT part_id FROM dbmail_partlists "
+			"WHERE physmessage_id = %" PRIu64 " AND is_header = 0 AND part_depth = 1",
+			physid);
+	while (db_result_next(r)) {
+		part_id = db_result_get_u64(r, 0);
+		rows++;
+	}
+	db_con_close(c);
+	fail_unless(rows == 1, "repeated mimepart stored [%d] times", rows);
+	fail_unless(part_id != 0, "repeated mimepart not registered");
+
+	t = store_and_retrieve(m);
+	ck_assert_str_eq(e, t);
+
+	g_free(message);
+	g_free(e);
+	g_free(t);
+}
+END_TEST
+
+START_TEST(test_dbmail_message_store_complete)
+{
+	DbmailMessage *m;
+	Connection_T c; ResultSet_T r;
+	uint64_t physid;
+	const char *tables[] = { "envelope", "header", "partlists", "referencesfield", NULL };
+	int i;
+
+	m = message_init(multipart_message);
+	fail_unless(dbmail_message_store(m) == DM_SUCCESS, "dbmail_message_store failed");
+	physid = dbmail_message_get_physid(m);
+	fail_unless(physid != 0, "dbmail_message_store failed");
+
+	/* every part of the message is in place once the store returns */
+	c = db_con_get();
+	r = db_query(c, "SELECT status FROM dbmail_messages WHERE physmessage_id = %" PRIu64 "", physid);
+	fail_unless(db_result_next(r), "message row missing");
+	fail_unless(db_result_get_int(r, 0) == MESSAGE_STATUS_NEW, "message status not updated");
+	for (i = 0; tables[i]; i++) {
+		r = db_query(c, "SELECT 1 FROM dbmail_%s WHERE physmessage_id = %" PRIu64 "", tables[i], physid);
+		fail_unless(db_result_next(r), "no rows in [%s] for stored message", tables[i]);
+	}
+	db_con_close(c);
+
+	dbmail_message_free(m);
+}
+END_TEST
+
+START_TEST(test_dbmail_message_cache_bodystructure)
+{
+	DbmailMessage *m, *r2;
+	Connection_T c; ResultSet_T r;
+	uint64_t physid;
+	char *bs, *b;
+
+	m = message_init(multipart_message);
+	dbmail_message_store(m);
+	physid = dbmail_message_get_physid(m);
+	fail_unless(physid != 0, "dbmail_message_store failed");
+
+	r2 = dbmail_message_retrieve(dbmail_message_new(NULL), physid);
+	bs = imap_get_structure(GMIME_MESSAGE(r2->content), 1);
+	b = imap_get_structure(GMIME_MESSAGE(r2->content), 0);
+
+	/* the cached responses match those of the retrieved message */
+	c = db_con_get();
+	r = db_query(c, "SELECT bodystructure, body FROM dbmail_envelope WHERE physmessage_id = %" PRIu64 "", physid);
+	fail_unless(db_result_next(r), "envelope row missing");
+	ck_assert_str_eq(bs, db_result_get(r, 0));
+	ck_assert_str_eq(b, db_result_get(r, 1));
+	db_con_close(c);
+
+	g_free(bs);
+	g_free(b);
+	dbmail_message_free(m);
+	dbmail_message_free(r2);
+}
+END_TEST
+
+START_TEST(test_dm_mimepart_cache)
+{
+	DbmailMessage *m;
+	uint64_t hits, misses, hits2, misses2;
+	char *e, *t;
+
+	dm_mimepart_cache_flush();
+
+	m = message_init(multipart_message);
+	dbmail_message_store(m);
+	dbmail_message_free(m);
+	dm_mimepart_cache_stats(&hits, &misses);
+
+	/* the second copy finds all its parts in the cache */
+	m = message_init(multipart_message);
+	e = dbmail_message_to_string(m);
+	t = store_and_retrieve(m);
+	dm_mimepart_cache_stats(&hits2, &misses2);
+	fail_unless(hits2 > hits, "no mimepart cache hits [%" PRIu64 "]", hits2);
+	fail_unless(misses2 == misses, "unexpected mimepart cache misses");
+	ck_assert_str_eq(e, t);
+	g_free(e);
+	g_free(t);
+
+	dm_mimepart_cache_flush();
+}
+END_TEST
+
+START_TEST(test_dbmail_message_retrieve_sparse)
+{
+	DbmailMessage *m, *full, *sparse;
+	GString *msg = g_string_new("");
+	uint64_t physid;
+	const char *sections[] = { "1", "2", NULL };
+	int i;
+
+	g_string_append(msg, "From: nobody@example.org\n"
+			"Subject: sparse\n"
+			"MIME-Version: 1.0\n"
+			"Content-type: multipart/mixed; boundary=boundary\n"
+			"\n"
+			"--boundary\n"
+			"Content-type: text/plain\n"
+			"\n"
+			"small part\n"
+			"\n"
+			"--boundary\n"
+			"Content-type: text/plain; name=large\n"
+			"\n");
+	for (i = 0; i < 500; i++)
+		g_string_append(msg, "a line in a part that is too large to read up front\n");
+	g_string_append(msg, "\n--boundary--\n");
+
+	m = message_init(msg->str);
+	dbmail_message_store(m);
+	physid = dbmail_message_get_physid(m);
+	fail_unless(physid > 0, "dbmail_message_store failed");
+
+	full = dbmail_message_retrieve(dbmail_message_new(NULL), physid);
+	sparse = dbmail_message_retrieve_sparse(dbmail_message_new(NULL), physid);
+	fail_unless(full && sparse, "retrieval failed");
+	fail_unless(sparse->elided != NULL, "no parts left out");
+
+	for (i = 0; sections[i]; i++) {
+		GMimeObject *a = imap_get_partspec(full->content, sections[i]);
+		GMimeObject *b = imap_get_partspec(sparse->content, sections[i]);
+		char *expect = imap_get_logical_part(a, NULL);
+		char *part = imap_get_logical_part(b, NULL);
+		char *result = dbmail_message_expand(sparse, part, TRUE);
+		ck_assert_str_eq(expect, result);
+		g_free(expect);
+		g_free(part);
+		g_free(result);
+	}
+
+	dbmail_message_free(m);
+	dbmail_message_free(full);
+	dbmail_message_free(sparse);
+	g_string_free(msg, TRUE);
+}
+END_TEST
+
+START_TEST(test_dbmail_message_retrieve_batch)
+{
+	const char *sources[] = { multipart_message, simple, multipart_alternative, rfc822 };
+	DbmailMessage *msgs[5];
+	uint64_t physids[5];
+	unsigned i, n = 4;
+
+	for (i = 0; i < n; i++) {
+		DbmailMessage *m = message_init(sources[i]);
+		dbmail_message_store(m);
+		physids[i] = dbmail_message_get_physid(m);
+		fail_unless(physids[i] > 0, "dbmail_message_store failed");
+		dbmail_message_free(m);
+	}
+	/* a physid without parts */
+	physids[n++] = physids[3] + 1000000;
+
+	for (i = 0; i < n; i++)
+		msgs[i] = dbmail_message_new(NULL);
+
+	ck_assert_uint_eq(dbmail_message_retrieve_batch(msgs, physids, n, FALSE), 4);
+	fail_unless(msgs[4] == NULL, "message without parts retrieved");
+
+	/* every message matches the one read on its own */
+	for (i = 0; i < 4; i++) {
+		DbmailMessage *single = dbmail_message_retrieve(dbmail_message_new(NULL), physids[i]);
+		char *a, *b;
+		fail_unless(msgs[i] && msgs[i]->content, "batch retrieval failed [%u]", i);
+		ck_assert_uint_eq(msgs[i]->id, physids[i]);
+		a = dbmail_message_to_string(single);
+		b = dbmail_message_to_string(msgs[i]);
+		ck_assert_str_eq(a, b);
+		g_free(a);
+		g_free(b);
+		dbmail_message_free(single);
+		dbmail_message_free(msgs[i]);
+	}
+}
+END_TEST
+
+START_TEST(test_dm_mimepart_cache_reused)
+{
+	DbmailMessage *m;
+	Connection_T c; ResultSet_T r;
+	uint64_t physid;
+	int rows = 0;
+	char *e, *t;
+
+	if (db_params.db_driver != DM_DRIVER_SQLITE)
+		return;
+
+	dm_mimepart_cache_flush();
+
+	m = message_init(multipart_message);
+	dbmail_message_store(m);
+	physid = dbmail_message_get_physid(m);
+	dbmail_message_free(m);
+
+	/* the cached ids now hold other content */
+	c = db_con_get();
+	db_exec(c, "UPDATE dbmail_mimeparts SET hash = 'reused' WHERE id IN "
+			"(SELECT part_id FROM dbmail_partlists WHERE physmessage_id = %" PRIu64 ")", physid);
+	db_con_close(c);
+
+	m = message_init(multipart_message);
+	e = dbmail_message_to_string(m);
+	t = store_and_retrieve(m);
+	ck_assert_str_eq(e, t);
+
+	c = db_con_get();
+	r = db_query(c, "SELECT COUNT(*) FROM dbmail_mimeparts WHERE hash = 'reused' AND id IN "
+			"(SELECT part_id FROM dbmail_partlists WHERE physmessage_id > %" PRIu64 ")", physid);
+	if (db_result_next(r))
+		rows = db_result_get_int(r, 0);
+	db_con_close(c);
+	fail_unless(rows == 0, "[%d] parts stored on reused ids", rows);
+
+	g_free(e);
+	g_free(t);
+
+	dm_mimepart_cache_flush();
+}
+END_TEST
+
 //DbmailMessage * dbmail_message_retrieve(DbmailMessage *self, uint64_t physid, int filter);
 START_TEST(test_dbmail_message_retrieve)
 {
@@ -821,6 +1096,40 @@ START_TEST(test_dbmail_message_cache_headers)
 }
 END_TEST
 
+START_TEST(test_dbmail_message_cache_headers_shared)
+{
+	DbmailMessage *m;
+	Connection_T c; ResultSet_T r;
+	uint64_t physid[2];
+	int i, rows[2];
+
+	for (i = 0; i < 2; i++) {
+		m = message_init(multipart_message);
+		fail_unless(dbmail_message_store(m) == DM_SUCCESS, "dbmail_message_store failed");
+		physid[i] = dbmail_message_get_physid(m);
+		dbmail_message_free(m);
+	}
+
+	/* the second copy gets the same header rows, using the same values */
+	c = db_con_get();
+	for (i = 0; i < 2; i++) {
+		r = db_query(c, "SELECT COUNT(*) FROM dbmail_header WHERE physmessage_id = %" PRIu64 "", physid[i]);
+		fail_unless(db_result_next(r));
+		rows[i] = db_result_get_int(r, 0);
+	}
+	fail_unless(rows[0] > 0, "no headers cached");
+	fail_unless(rows[0] == rows[1], "header rows differ [%d] [%d]", rows[0], rows[1]);
+
+	r = db_query(c, "SELECT COUNT(*) FROM dbmail_header a JOIN dbmail_header b "
+			"ON a.headername_id = b.headername_id AND a.headervalue_id = b.headervalue_id "
+			"WHERE a.physmessage_id = %" PRIu64 " AND b.physmessage_id = %" PRIu64 "",
+			physid[0], physid[1]);
+	fail_unless(db_result_next(r));
+	fail_unless(db_result_get_int(r, 0) == rows[0], "headervalues not shared");
+	db_con_close(c);
+}
+END_TEST
+
 START_TEST(test_dbmail_message_get_header_addresses)
 {
 	GList * result;
@@ -986,8 +1295,6 @@ START_TEST(test_db_get_message_lines)
 END_TEST
 
 /* Fetching subject from database */
-extern DBParam_T db_params;
-#define DBPFX db_params.pfx
 
 int test_db_get_subject(uint64_t physid, char **subject)
 {
@@ -1070,7 +1377,14 @@ Suite *dbmail_message_suite(void)
 	tcase_add_test(tc_message, test_g_mime_object_get_body);
 	tcase_add_test(tc_message, test_dbmail_message_store);
 	tcase_add_test(tc_message, test_dbmail_message_store2);
+	tcase_add_test(tc_message, test_dbmail_message_store_dedup);
+	tcase_add_test(tc_message, test_dbmail_message_store_complete);
+	tcase_add_test(tc_message, test_dbmail_message_cache_bodystructure);
+	tcase_add_test(tc_message, test_dm_mimepart_cache);
+	tcase_add_test(tc_message, test_dm_mimepart_cache_reused);
 	tcase_add_test(tc_message, test_dbmail_message_retrieve);
+	tcase_add_test(tc_message, test_dbmail_message_retrieve_sparse);
+	tcase_add_test(tc_message, test_dbmail_message_retrieve_batch);
 	tcase_add_test(tc_message, test_dbmail_message_init_with_string);
 	tcase_add_test(tc_message, test_dbmail_message_to_string);
 	tcase_add_test(tc_message, test_dbmail_message_hdrs_to_string);
@@ -1078,6 +1392,7 @@ Suite *dbmail_message_suite(void)
 	tcase_add_test(tc_message, test_dbmail_message_set_header);
 	tcase_add_test(tc_message, test_dbmail_message_get_header);
 	tcase_add_test(tc_message, test_dbmail_message_cache_headers);
+	tcase_add_test(tc_message, test_dbmail_message_cache_headers_shared);
 	tcase_add_test(tc_message, test_dbmail_message_free);
 	tcase_add_test(tc_message, test_dbmail_message_encoded);
 	tcase_add_test(tc_message, test_dbmail_message_8bit);
@@ -459,6 +459,71 @@ START_TEST(test_whirlpool)
 }
 END_TEST
 
+START_TEST(test_dm_digest_data)
+{
+	char hash[FIELDSIZE], expect[FIELDSIZE];
+	GString *data = g_string_new("");
+	GChecksum *checksum;
+	int i;
+
+	/* longer than a single digest chunk */
+	for (i = 0; i < 20000; i++)
+		g_string_append(data, "abcdefg\n");
+
+	memset(hash,0,sizeof(hash));
+	memset(expect,0,sizeof(expect));
+	checksum = g_checksum_new(G_CHECKSUM_SHA256);
+	dm_digest_data(MHASH_SHA1, data->str, data->len, checksum, hash);
+	dm_sha1(data->str, expect);
+	fail_unless(SMATCH(hash, expect), "dm_digest_data failed [%s] != [%s]", hash, expect);
+
+	memset(expect,0,sizeof(expect));
+	dm_sha256(data->str, expect);
+	fail_unless(SMATCH(g_checksum_get_string(checksum), expect), "checksum failed");
+	g_checksum_free(checksum);
+
+	/* only len bytes are hashed */
+	memset(hash,0,sizeof(hash));
+	dm_digest_data(MHASH_SHA1, "abcdef", 3, NULL, hash);
+	fail_unless(SMATCH(hash, "a9993e364706816aba3e25717850c26c9cd0d89d"), "dm_digest_data failed [%s]", hash);
+
+	g_string_free(data, TRUE);
+}
+END_TEST
+
+START_TEST(test_dm_deflate)
+{
+	GString *data = g_string_new("");
+	char *z, *r;
+	size_t zlen = 0, rlen = 0;
+	int i;
+
+	for (i = 0; i < 1000; i++)
+		g_string_append(data, "Subject: compress me\r\n");
+
+	z = dm_deflate(data->str, data->len, &zlen);
+	fail_unless(z != NULL, "dm_deflate failed");
+	fail_unless(zlen < data->len, "dm_deflate did not compress [%zu]", zlen);
+
+	r = dm_inflate(z, zlen, &rlen);
+	fail_unless(r != NULL, "dm_inflate failed");
+	fail_unless(rlen == data->len, "dm_inflate length [%zu] != [%zu]", rlen, data->len);
+	fail_unless(memcmp(r, data->str, rlen) == 0, "dm_inflate content mismatch");
+	g_free(r);
+
+	r = dm_mimepart_decode(MIMEPART_CODEC_GZIP, z, zlen, &rlen);
+	fail_unless(r && SMATCH(r, data->str), "dm_mimepart_decode failed");
+	g_free(r);
+
+	r = dm_mimepart_decode(MIMEPART_CODEC_NONE, "abcdef", 3, &rlen);
+	fail_unless(rlen == 3 && SMATCH(r, "abc"), "dm_mimepart_decode failed");
+	g_free(r);
+
+	g_free(z);
+	g_string_free(data, TRUE);
+}
+END_TEST
+
 START_TEST(test_get_crlf_encoded_opt1)
 {
 	char *in[] = {
@@ -565,6 +630,82 @@ START_TEST(test_date_sql2imap)
 }
 END_TEST
 
+START_TEST(test_dm_notify)
+{
+	char *dir, *path = NULL;
+	uint64_t id = 0, seq = 0;
+	int fd;
+
+	dir = g_dir_make_tmp("dbmail-notify-XXXXXX", NULL);
+	ck_assert_ptr_ne(dir, NULL);
+
+	/* nobody listening */
+	ck_assert_int_eq(dm_notify_send(dir, 1, 2), 0);
+
+	fd = dm_notify_bind(dir, &path);
+	ck_assert_int_ge(fd, 0);
+	ck_assert(g_file_test(path, G_FILE_TEST_EXISTS));
+	ck_assert(! dm_notify_read(fd, &id, &seq));
+
+	ck_assert_int_eq(dm_notify_send(dir, 42, 7), 1);
+	ck_assert_int_eq(dm_notify_send(dir, 43, 8), 1);
+	ck_assert(dm_notify_read(fd, &id, &seq));
+	ck_assert_uint_eq(id, 42);
+	ck_assert_uint_eq(seq, 7);
+	ck_assert(dm_notify_read(fd, &id, &seq));
+	ck_assert_uint_eq(id, 43);
+	ck_assert_uint_eq(seq, 8);
+	ck_assert(! dm_notify_read(fd, &id, &seq));
+
+	/* the socket of a listener that went away is cleaned up */
+	close(fd);
+	ck_assert_int_eq(dm_notify_send(dir, 42, 9), 0);
+	ck_assert(! g_file_test(path, G_FILE_TEST_EXISTS));
+
+	g_free(path);
+	rmdir(dir);
+	g_free(dir);
+}
+END_TEST
+
+START_TEST(test_fts)
+{
+	const char *h1 = "Subject: Hello\r\nContent-Type: multipart/mixed\r\n\r\n";
+	const char *b1 = "hello HELLO";
+	const char *h2 = "Content-Type: application/pdf\r\n"
+		"Content-Transfer-Encoding: base64\r\n\r\n";
+	const char *b2 = "JVBERi0xLjQKJcfsj6IKNSAwIG9iago8PC9MZW5ndGgg";
+	Fts_T F = Fts_new();
+
+	/* no trigrams in short data */
+	Fts_add(F, "ab", 2, FALSE, 2);
+	ck_assert_uint_eq(Fts_count(F), 0);
+
+	/* folded to lower case */
+	Fts_add(F, b1, strlen(b1), FALSE, 2);
+	ck_assert_uint_eq(Fts_count(F), 6);
+	Fts_free(&F);
+	ck_assert_ptr_eq(F, NULL);
+
+	/* data after a NUL is not indexed */
+	F = Fts_new();
+	Fts_add(F, "abc\0def", 7, FALSE, 2);
+	ck_assert_uint_eq(Fts_count(F), 1);
+	Fts_free(&F);
+
+	/* base64 bodies are skipped, but not the body after them */
+	F = Fts_new();
+	Fts_add(F, h2, strlen(h2), TRUE, 2);
+	uint64_t n = Fts_count(F);
+	Fts_add(F, b2, strlen(b2), FALSE, 2);
+	ck_assert_uint_eq(Fts_count(F), n);
+	Fts_add(F, h1, strlen(h1), TRUE, 3);
+	Fts_add(F, "zzzz", 4, FALSE, 3);
+	ck_assert_uint_gt(Fts_count(F), n);
+	Fts_free(&F);
+}
+END_TEST
+
 
 Suite *dbmail_misc_suite(void)
 {
@@ -590,10 +731,14 @@ Suite *dbmail_misc_suite(void)
 	tcase_add_test(tc_misc, test_whirlpool);
 	tcase_add_test(tc_misc, test_md5);
 	tcase_add_test(tc_misc, test_tiger);
+	tcase_add_test(tc_misc, test_dm_digest_data);
+	tcase_add_test(tc_misc, test_dm_deflate);
 	tcase_add_test(tc_misc, test_get_crlf_encoded_opt1);
 	tcase_add_test(tc_misc, test_get_crlf_encoded_opt2);
 	tcase_add_test(tc_misc, test_date_imap2sql);
 	tcase_add_test(tc_misc, test_date_sql2imap);
+	tcase_add_test(tc_misc, test_dm_notify);
+	tcase_add_test(tc_misc, test_fts);
 
 	return s;
 }